@@ -7,6 +7,9 @@ function BFL_groupwise_reg3D(SBJ_CELL, DATA_DIR, Output_dir, params)
 % * Output_dir: the directory where the results will be written. 
 %   There are three sets of results: 
 %      (i) warp files, which are .mat files with names like [Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat']
+%      holding the velocity field v of the subject as a packed
+%      velocitytransform ('transform', see velocitytransform), or as
+%      log_def_x/y/z when velocitytransform is not compiled
 %      (ii) warped subjects: these are warped subject images (resampled on
 %      to the template grid) -- the names are as follows: [OUTPUT_DIR '/'
 %      SBJ_CELL{1,i} Sbj_filename_postfix_out]
@@ -37,6 +40,11 @@ function BFL_groupwise_reg3D(SBJ_CELL, DATA_DIR, Output_dir, params)
 %   warped/resampled subjects
 %   initial_template_sbj_name = name of subject who will serve as initial
 %   template guess
+%   warp_storage_levels : times the velocity fields of the warp files are
+%   decimated (storage_levels of velocitytransform; default 0). Each level
+%   makes the files 8 times smaller; the warps then differ by about 0.07
+%   voxel (1 level) or 0.27 voxel (2 levels) from those of the full fields,
+%   for fields of a few voxels (see itkVelocityTransformStorageTest).
 
 
 %=========================================================================
@@ -100,6 +108,13 @@ if (~isfield(params, 'verbose'))
     params.verbose = 0;
 end
 
+if (~isfield(params, 'warp_storage_levels'))
+    
+    warp_storage_levels = 0;
+else
+    warp_storage_levels = params.warp_storage_levels;
+end
+
 if (~isfield(params, 'renormalize_warps_flag'))
     
     renormalize_warps_flag = 1;
@@ -214,11 +229,9 @@ for iter = 1:num_outer_iter
     
     load([Output_dir '/Template' num2str(iter-1) '.mat']);
     for i = 1:NumSbj
+        warp_file = [Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat'];
         if (iter ~= 1)
-            load([Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat']);
-            options.log_def_x = log_def_x;
-            options.log_def_y = log_def_y;
-            options.log_def_z = log_def_z;
+            [options.log_def_x, options.log_def_y, options.log_def_z] = load_warp_aux(warp_file);
         end
         if (params.verbose)
             display(['Registering subj : ' SBJ_CELL{1,i}]);
@@ -237,8 +250,7 @@ for iter = 1:num_outer_iter
             [log_def_x, log_def_y, log_def_z] = AffineMat2VelocityField3D_aux(affineMat, size(vol1.vol));
         end
         
-        save([Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat'], ...
-            'log_def_x', 'log_def_y', 'log_def_z');
+        save_warp_aux(warp_file, log_def_x, log_def_y, log_def_z, warp_storage_levels);
         clear log_def_x log_def_y log_def_z stats wm
     end
     
@@ -246,7 +258,7 @@ for iter = 1:num_outer_iter
         if (params.verbose)
             display('Renormalizing warps...');
         end
-        renormalize_warps(SBJ_CELL, Output_dir, CurTemplateWarpName);
+        renormalize_warps(SBJ_CELL, Output_dir, CurTemplateWarpName, warp_storage_levels);
     end
     if (params.verbose)
             display('Updating template...');
@@ -263,11 +275,8 @@ output_template.vol = template_vol;
 MRIwrite(output_template, [OUTPUT_DIR '/TemplateSbj.nii']);
 
 for i = 1:NumSbj
-    load([Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat']);
-   
     vol1 = MRIread([DATA_DIR '/' SBJ_CELL{1,i}]);
-    [def_x, def_y, def_z] = velocityfieldexp(-log_def_x, -log_def_y, -log_def_z);
-    vol1.vol = warpimage(single(vol1.vol), def_x, def_y,def_z);
+    vol1.vol = warp_to_template_aux([Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat'], vol1.vol);
     vol1.vol(isnan(vol1.vol)) = 0;
     temp_cnt = sum([SBJ_CELL{1,i} Sbj_filename_postfix_out] == '/');
     
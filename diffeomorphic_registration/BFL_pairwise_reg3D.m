@@ -36,6 +36,49 @@ function [log_def_x, log_def_y, log_def_z, stats, warped_mov_im, backwarped_fix_
 %   of the warp). 
 %   *verbose = <scalar, 0 or nonzero> if nonzero, will display some
 %   results. (default: 0)
+%   *sdm_mode = <string> 'recompute' recomputes the label SDMs of the
+%   warped images at every iteration, 'warp' computes them once per level
+%   and resamples them through the current warp (faster, predictable
+%   cost). (default: 'recompute')
+%   *sdm_band = <scalar> if positive, the label SDMs are only computed
+%   within this many voxels of the label boundaries and clamped beyond.
+%   Within the band the SDMs, and the forces, are the same as without it.
+%   (default: 0, i.e. everywhere)
+%   *sdm_frame = <scalar, integer> margin in voxels kept around the
+%   bounding box of the labels when computing the SDMs without a band.
+%   (default: 5)
+%   *num_threads = <scalar, integer> number of threads used to evaluate
+%   the demons forces, 0 uses the ITK default. The result does not depend
+%   on it. (default: 0)
+%   *vectorize = <scalar, 0 or nonzero> if nonzero, the demons forces of
+%   3D images are evaluated with SIMD instructions when the CPU has them.
+%   The result does not depend on it. (default: 1)
+%   *fused_iteration = <scalar, 0 or nonzero> if nonzero, each iteration
+%   is done by a single call to the demonsiteration mex function instead
+%   of one call per step. It follows the step-by-step path within the
+%   tolerances of Testing/itkDemonsIterationEngineTest.cpp. (default: 0)
+%   *demons_session = <scalar, 0 or nonzero> if nonzero, the fused
+%   iterations run in a demons_session that keeps the images, buffers and
+%   SDMs between iterations. (default: 0)
+%   *fused_metrics = <scalar, 0 or nonzero> if nonzero, the statistics of
+%   an iteration outside demons_session/demonsiteration are computed by a
+%   single call to registrationmetrics. (default: 0)
+%   *exp_recompute_interval = <scalar> in a demons_session, exp(v) and
+%   exp(-v) are updated from the previous iteration with the exponential
+%   of the last update, and recomputed from v every exp_recompute_interval
+%   iterations (0: never). (default: 1, always recomputed)
+%   *profile_log = <string> file to which the force and iteration mex
+%   functions append, one JSON line per call, the time spent in each of
+%   their phases and counters such as the voxels processed and the SDM
+%   passes. (default: none)
+%   *sdm_pyramid = <string> the label images of the coarser levels keep
+%   every other voxel of the finer ones. 'label' computes the SDMs of each
+%   level on its own label images, 'smooth' computes them on the
+%   full-resolution label images and brings them down to the level with a
+%   Gaussian of sdm_pyramid_sigma voxels before each decimation (needs
+%   sdm_mode 'warp' and the force mex functions). (default: 'label')
+%   *sdm_pyramid_sigma = <scalar> standard deviation of that Gaussian, in
+%   voxels of the finer level. (default: 1)
 
 
 % output:
@@ -139,6 +182,21 @@ if (~isfield(options, 'min_level'))
     options.min_level = 1;
 end
 
+if ~isfield(options, 'sdm_pyramid')
+    options.sdm_pyramid = 'label';
+end
+if ~any(strcmpi(options.sdm_pyramid, {'label', 'smooth'}))
+    error('Option sdm_pyramid must be ''label'' or ''smooth''.');
+end
+smooth_sdm_pyramid = strcmpi(options.sdm_pyramid, 'smooth');
+if smooth_sdm_pyramid && ~(isfield(options, 'sdm_mode') && strcmpi(options.sdm_mode, 'warp'))
+    error('Option sdm_pyramid ''smooth'' needs sdm_mode ''warp''.');
+end
+
+% the pyramids are built natively when registrationpyramid is compiled
+use_pyramid_mex = (exist('registrationpyramid','file') == 3) && ...
+    isfloat(fix_im) && isfloat(mov_im);
+
 numOfLevels = options.num_multires;
 
 pyramid1 = cell(numOfLevels, 1);
@@ -151,6 +209,11 @@ pyramid2{1,1} = mov_im;
 
 
 
+if use_pyramid_mex
+    % label images are only decimated, never smoothed
+    pyramid1 = registrationpyramid('image', fix_im, numOfLevels);
+    pyramid2 = registrationpyramid('image', mov_im, numOfLevels);
+else
 for level = 2:1:numOfLevels
 
 
@@ -207,6 +270,7 @@ for level = 2:1:numOfLevels
 
 
 end
+end
 
 
 
@@ -257,6 +321,13 @@ pyramid_log_def_y{1} = options.log_def_y;
 pyramid_log_def_z{1} = options.log_def_z;
 
 
+if use_pyramid_mex && isfloat(options.log_def_x)
+    for level = 2:1:numOfLevels
+        [pyramid_log_def_x{level,1}, pyramid_log_def_y{level,1}, pyramid_log_def_z{level,1}] = ...
+            registrationpyramid('downsample_field', pyramid_log_def_x{level-1,1}, ...
+            pyramid_log_def_y{level-1,1}, pyramid_log_def_z{level-1,1});
+    end
+else
 for level = 2:1:numOfLevels
 
 
@@ -331,6 +402,7 @@ for level = 2:1:numOfLevels
     pyramid_log_def_z{level,1} = pyramid_log_def_z{level,1}/2;
    
 end
+end
 
 options.log_def_x = double(pyramid_log_def_x{numOfLevels,1});
 options.log_def_y = double(pyramid_log_def_y{numOfLevels,1});
@@ -340,6 +412,12 @@ clear pyramid_log_def_x pyramid_log_def_y pyramid_log_def_z
 
 stats = cell(numOfLevels,1);
 
+% single arrays are read by the force mex functions without a copy
+if smooth_sdm_pyramid
+    sdm_fixed_reference = single(fix_im);
+    sdm_moving_reference = single(mov_im);
+end
+
 for level = numOfLevels: -1: 1
 
     if (level < options.min_level)
@@ -348,13 +426,30 @@ for level = numOfLevels: -1: 1
         options.numiter = options.numiter_cell{level};
     end
     
+    % the SDMs of the coarser levels come from the full-resolution ones
+    if smooth_sdm_pyramid && level > 1
+        options.sdm_fixed_reference = sdm_fixed_reference;
+        options.sdm_moving_reference = sdm_moving_reference;
+    elseif isfield(options, 'sdm_fixed_reference')
+        options = rmfield(options, {'sdm_fixed_reference', 'sdm_moving_reference'});
+    end
+
     [log_def_x, log_def_y, log_def_z, stats{level,1}, warped_mov_im, backwarped_fix_im] = ...
-        invconstdemonsreg3d_aux(double(pyramid1{level,1}), double(pyramid2{level,1}), options);
+        invconstdemonsreg3d_aux(pyramid1{level,1}, pyramid2{level,1}, options);
     
     if (level ~= 1)
-        options.log_def_x = double(upscale(log_def_x, size(pyramid1{level - 1,1})));
-        options.log_def_y = double(upscale(log_def_y, size(pyramid1{level - 1,1})));
-        options.log_def_z = double(upscale(log_def_z, size(pyramid1{level - 1,1})));
+        if use_pyramid_mex
+            [up_x, up_y, up_z] = registrationpyramid('upsample_field', ...
+                log_def_x, log_def_y, log_def_z, size(pyramid1{level - 1,1}));
+            options.log_def_x = double(up_x);
+            options.log_def_y = double(up_y);
+            options.log_def_z = double(up_z);
+            clear up_x up_y up_z
+        else
+            options.log_def_x = double(upscale(log_def_x, size(pyramid1{level - 1,1})));
+            options.log_def_y = double(upscale(log_def_y, size(pyramid1{level - 1,1})));
+            options.log_def_z = double(upscale(log_def_z, size(pyramid1{level - 1,1})));
+        end
     end
     display(['Finished registration at pyramid level: ' num2str(level)]);
     
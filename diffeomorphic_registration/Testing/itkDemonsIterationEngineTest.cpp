@@ -0,0 +1,339 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkDemonsIterationEngineTest.cpp
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+// Checks DemonsIterationEngine, behind the demonsiteration and
+// demons_session MEX functions and the registrationmetrics statistics,
+// against the step-by-step path of invconstdemonsreg3d_aux.m: exp(v) and
+// exp(-v) by velocityfieldexp, the force by invcondemonsforces, the MSE by
+// warplabelimage, the harmonic energy by deffieldharmonicenergy and the
+// negative Jacobian ratio from the determinants of velocityfieldexp. Both
+// paths run several iterations from the same velocity field, one engine
+// kept between them as in a session, and must agree within:
+//
+//   velocity field            1e-4 voxel (largest component difference)
+//   MSE, back MSE             1e-6 relative
+//   harmonic energies         1e-5 relative
+//   negative Jacobian ratios  1e-3 absolute
+
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkDemonsIterationEngine.h"
+#include "itkESMInvConDemonsRegistrationFunction.h"
+#include "itkDemonsUpdateCalculator.h"
+#include "itkJointFieldExponentiator.h"
+#include "itkWarpImageFilter.h"
+#include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkWarpHarmonicEnergyCalculator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+namespace {
+
+typedef itk::Image<float, 3>                                    ImageType;
+typedef itk::Vector<float, 3>                                   VectorPixelType;
+typedef itk::Image<VectorPixelType, 3>                          DeformationFieldType;
+typedef itk::DemonsIterationEngine
+  <ImageType, DeformationFieldType>                             EngineType;
+typedef itk::ESMInvConDemonsRegistrationFunction
+  <ImageType, ImageType, DeformationFieldType>                  FunctionType;
+typedef itk::DemonsUpdateCalculator
+  <FunctionType, DeformationFieldType>                          UpdateCalculatorType;
+typedef itk::JointFieldExponentiator<DeformationFieldType>      ExponentiatorType;
+typedef itk::WarpImageFilter
+  <ImageType, ImageType, DeformationFieldType>                  WarperType;
+typedef itk::NearestNeighborInterpolateImageFunction
+  <ImageType, double>                                           InterpolatorType;
+typedef itk::WarpHarmonicEnergyCalculator<DeformationFieldType> HarmonicEnergyCalculatorType;
+
+const unsigned int numberOfIterations = 5;
+const double regWeight = 100.0;
+
+const double fieldTolerance = 1e-4;
+const double mseTolerance = 1e-6;
+const double energyTolerance = 1e-5;
+const double jacobianTolerance = 1e-3;
+
+struct StatisticsType
+  {
+  double m_MSE;
+  double m_BackMSE;
+  double m_HarmonicEnergy;
+  double m_BackHarmonicEnergy;
+  double m_NegativeJacobianRatio;
+  double m_BackNegativeJacobianRatio;
+  };
+
+// A ball and a slab, the ball shifted in the moving image
+ImageType::Pointer MakeLabels( double shift )
+{
+  ImageType::SizeType size;
+  size[0] = 34;
+  size[1] = 30;
+  size[2] = 26;
+  ImageType::RegionType region;
+  region.SetSize( size );
+
+  ImageType::Pointer labels = ImageType::New();
+  labels->SetRegions( region );
+  labels->Allocate();
+
+  float * buffer = labels->GetBufferPointer();
+  for( long z = 0; z < static_cast<long>( size[2] ); z++ )
+    {
+    for( long y = 0; y < static_cast<long>( size[1] ); y++ )
+      {
+      for( long x = 0; x < static_cast<long>( size[0] ); x++ )
+        {
+        float label = 0.0f;
+        const double dx = x - 15.0 - shift, dy = y - 15.0, dz = z - 13.0;
+        if( dx * dx + dy * dy + dz * dz <= 8.0 * 8.0 )
+          {
+          label = 3.0f;
+          }
+        if( x >= 27 && x < 30 && y > 4 && y < 25 )
+          {
+          label = 10.0f;
+          }
+        buffer[ x + size[0] * ( y + size[1] * z ) ] = label;
+        }
+      }
+    }
+  return labels;
+}
+
+DeformationFieldType::Pointer MakeField( const ImageType * image )
+{
+  DeformationFieldType::Pointer field = DeformationFieldType::New();
+  field->SetRegions( image->GetLargestPossibleRegion() );
+  field->Allocate();
+  VectorPixelType zero;
+  zero.Fill( 0.0f );
+  field->FillBuffer( zero );
+  return field;
+}
+
+// v += u, as invconstdemonsreg3d_aux.m does after each iteration
+void AddUpdate( DeformationFieldType * velocity, const DeformationFieldType * update )
+{
+  VectorPixelType * v = velocity->GetBufferPointer();
+  const VectorPixelType * u = update->GetBufferPointer();
+  const unsigned long n = velocity->GetBufferedRegion().GetNumberOfPixels();
+  for( unsigned long i = 0; i < n; i++ )
+    {
+    v[i] += u[i];
+    }
+}
+
+double MaximumDifference( const DeformationFieldType * a, const DeformationFieldType * b )
+{
+  const VectorPixelType * p = a->GetBufferPointer();
+  const VectorPixelType * q = b->GetBufferPointer();
+  const unsigned long n = a->GetBufferedRegion().GetNumberOfPixels();
+  double maximum = 0.0;
+  for( unsigned long i = 0; i < n; i++ )
+    {
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      maximum = std::max( maximum, std::fabs( static_cast<double>( p[i][d] ) - q[i][d] ) );
+      }
+    }
+  return maximum;
+}
+
+double MaximumNorm( const DeformationFieldType * a )
+{
+  const VectorPixelType * p = a->GetBufferPointer();
+  const unsigned long n = a->GetBufferedRegion().GetNumberOfPixels();
+  double maximum = 0.0;
+  for( unsigned long i = 0; i < n; i++ )
+    {
+    maximum = std::max( maximum, static_cast<double>( p[i].GetNorm() ) );
+    }
+  return maximum;
+}
+
+// warplabelimage, then the mean of the squared differences over the voxels
+// that are not NaN
+double WarpedMSE( const ImageType * image, const DeformationFieldType * field,
+                  const ImageType * target )
+{
+  WarperType::Pointer warper = WarperType::New();
+  warper->SetInterpolator( InterpolatorType::New() );
+  warper->SetInput( image );
+  warper->SetOutputSpacing( image->GetSpacing() );
+  warper->SetOutputOrigin( image->GetOrigin() );
+  warper->SetDeformationField( field );
+  warper->SetEdgePaddingValue( std::numeric_limits<float>::quiet_NaN() );
+  warper->UpdateLargestPossibleRegion();
+
+  const float * warped = warper->GetOutput()->GetBufferPointer();
+  const float * reference = target->GetBufferPointer();
+  const unsigned long n = target->GetBufferedRegion().GetNumberOfPixels();
+  double sum = 0.0;
+  unsigned long count = 0;
+  for( unsigned long i = 0; i < n; i++ )
+    {
+    if( warped[i] == warped[i] )
+      {
+      const double difference = static_cast<double>( warped[i] ) - reference[i];
+      sum += difference * difference;
+      count++;
+      }
+    }
+  return count > 0 ? sum / count : 0.0;
+}
+
+double HarmonicEnergy( const DeformationFieldType * field )
+{
+  HarmonicEnergyCalculatorType::Pointer calculator = HarmonicEnergyCalculatorType::New();
+  calculator->SetImage( field );
+  calculator->Compute();
+  return calculator->GetHarmonicEnergy();
+}
+
+double NegativeRatio( const ImageType * jacobian )
+{
+  const float * p = jacobian->GetBufferPointer();
+  const unsigned long n = jacobian->GetBufferedRegion().GetNumberOfPixels();
+  unsigned long count = 0;
+  for( unsigned long i = 0; i < n; i++ )
+    {
+    if( p[i] <= 0.0f )
+      {
+      count++;
+      }
+    }
+  return static_cast<double>( count ) / n;
+}
+
+// One iteration of invconstdemonsreg3d_aux.m without the fused options:
+// the update of v goes to update, the statistics of exp(v) to statistics
+void ReferenceIteration( const ImageType * fixed, const ImageType * moving,
+                         const DeformationFieldType * velocity,
+                         DeformationFieldType * update, StatisticsType & statistics )
+{
+  // velocityfieldexp with the jacobian option
+  ExponentiatorType::Pointer exponentiator = ExponentiatorType::New();
+  exponentiator->SetVelocityField( velocity );
+  exponentiator->SetComputeInverse( true );
+  exponentiator->SetComputeJacobianDeterminant( true );
+  exponentiator->Compute();
+  DeformationFieldType::Pointer field = exponentiator->GetDeformationField();
+  DeformationFieldType::Pointer inverseField = exponentiator->GetInverseDeformationField();
+  ImageType::Pointer jacobian = exponentiator->GetJacobianDeterminant();
+  ImageType::Pointer inverseJacobian = exponentiator->GetInverseJacobianDeterminant();
+
+  // invcondemonsforces, weighted by the Jacobian of exp(-v)
+  FunctionType::Pointer function = FunctionType::New();
+  function->SetUseGradientType( FunctionType::Symmetric );
+  function->SetDeformationField( field );
+  function->SetInvDeformationField( inverseField );
+  function->SetFixedImage( fixed );
+  function->SetMovingImage( moving );
+  function->SetRegWeight( regWeight );
+  function->SetUseJacobian( true );
+  function->SetJacobianDetImage( inverseJacobian );
+  function->InitializeIteration();
+
+  UpdateCalculatorType::Pointer calculator = UpdateCalculatorType::New();
+  calculator->SetDemonsFunction( function );
+  calculator->SetDeformationField( field );
+  calculator->SetUpdateField( update );
+  calculator->Compute();
+
+  statistics.m_MSE = WarpedMSE( moving, field, fixed );
+  statistics.m_BackMSE = WarpedMSE( fixed, inverseField, moving );
+  statistics.m_HarmonicEnergy = HarmonicEnergy( field );
+  statistics.m_BackHarmonicEnergy = HarmonicEnergy( inverseField );
+  statistics.m_NegativeJacobianRatio = NegativeRatio( jacobian );
+  statistics.m_BackNegativeJacobianRatio = NegativeRatio( inverseJacobian );
+}
+
+bool Close( const char * name, unsigned int iteration, double value, double expected,
+            double tolerance, bool relative )
+{
+  const double scale = relative ? std::max( std::fabs( expected ), 1e-12 ) : 1.0;
+  if( std::fabs( value - expected ) <= tolerance * scale )
+    {
+    return true;
+    }
+  std::cerr << "Iteration " << iteration << ": " << name << " is " << value
+            << ", the reference path gives " << expected << std::endl;
+  return false;
+}
+
+} // end namespace
+
+int main( int, char *[] )
+{
+  ImageType::Pointer fixed = MakeLabels( 0.0 );
+  ImageType::Pointer moving = MakeLabels( 2.0 );
+
+  DeformationFieldType::Pointer engineVelocity = MakeField( fixed );
+  DeformationFieldType::Pointer referenceVelocity = MakeField( fixed );
+  DeformationFieldType::Pointer referenceUpdate = MakeField( fixed );
+
+  // one engine for all the iterations, as in a demons_session
+  EngineType::Pointer engine = EngineType::New();
+  engine->SetFixedImage( fixed );
+  engine->SetMovingImage( moving );
+  engine->SetVelocityField( engineVelocity );
+  engine->SetInverseConsistent( true );
+  engine->SetRegWeight( regWeight );
+
+  for( unsigned int i = 0; i < numberOfIterations; i++ )
+    {
+    engine->Iterate();
+
+    StatisticsType expected;
+    ReferenceIteration( fixed, moving, referenceVelocity, referenceUpdate, expected );
+
+    if( MaximumNorm( referenceUpdate ) == 0.0 )
+      {
+      std::cerr << "Iteration " << i << ": the reference update is zero" << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    AddUpdate( engineVelocity, engine->GetUpdateField() );
+    AddUpdate( referenceVelocity, referenceUpdate );
+
+    const double difference = MaximumDifference( engineVelocity, referenceVelocity );
+    if( difference > fieldTolerance )
+      {
+      std::cerr << "Iteration " << i << ": the velocity fields differ by "
+                << difference << " voxel" << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    if( !Close( "MSE", i, engine->GetMSE(), expected.m_MSE, mseTolerance, true )
+        || !Close( "backMSE", i, engine->GetBackMSE(), expected.m_BackMSE, mseTolerance, true )
+        || !Close( "harmoEner", i, engine->GetHarmonicEnergy(),
+                   expected.m_HarmonicEnergy, energyTolerance, true )
+        || !Close( "backharmoEner", i, engine->GetBackHarmonicEnergy(),
+                   expected.m_BackHarmonicEnergy, energyTolerance, true )
+        || !Close( "negJacRatio", i, engine->GetNegativeJacobianRatio(),
+                   expected.m_NegativeJacobianRatio, jacobianTolerance, false )
+        || !Close( "backnegJacRatio", i, engine->GetBackNegativeJacobianRatio(),
+                   expected.m_BackNegativeJacobianRatio, jacobianTolerance, false ) )
+      {
+      return EXIT_FAILURE;
+      }
+    }
+
+  std::cout << "DemonsIterationEngine matches the step-by-step path over "
+            << numberOfIterations << " iterations" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,307 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkESMInvConDemonsRowKernelTest.cpp
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+// Compares ComputeUpdateRow of ESMInvConDemonsRegistrationFunction, with
+// the AVX and the SSE4.1 row kernels, to the scalar ComputeUpdate, bit for
+// bit: updates and metric sums. The SDM buffers are random rows holding
+// outside sentinels (NumericTraits::max()), flat patches giving singular
+// Hessians (with a zero regularisation weight) and matching intensities
+// masked by the threshold, with zero Jacobians in places.
+//
+// The scalar code must not be built with contracted multiply-adds (e.g.
+// -march with FMA in GNU mode), or it only agrees to float rounding.
+
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkConstNeighborhoodIterator.h"
+#include "itkNumericTraits.h"
+#include "itkESMInvConDemonsRegistrationFunction.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+typedef itk::Image<float, 3>                                    ImageType;
+typedef itk::Vector<float, 3>                                   VectorPixelType;
+typedef itk::Image<VectorPixelType, 3>                          DeformationFieldType;
+typedef itk::ESMInvConDemonsRegistrationFunction
+  <ImageType, ImageType, DeformationFieldType>                  FunctionType;
+typedef FunctionType::PixelType                                 UpdateType;
+typedef itk::ConstNeighborhoodIterator<DeformationFieldType>    NeighborhoodIteratorType;
+
+// Odd along x, so that the kernels leave tails to the scalar code
+const unsigned long imageSize[3] = { 29, 9, 7 };
+
+// Deterministic generator, the same on every platform
+class Random
+{
+public:
+  Random( unsigned long seed ) : m_State( seed ) {}
+  double Uniform()
+    {
+    m_State = ( m_State * 1103515245ul + 12345ul ) & 0x7ffffffful;
+    return static_cast<double>( m_State ) / 2147483648.0;
+    }
+private:
+  unsigned long m_State;
+};
+
+ImageType::Pointer MakeImage( float value )
+{
+  ImageType::RegionType region;
+  ImageType::SizeType size;
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    size[d] = imageSize[d];
+    }
+  region.SetSize( size );
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+  image->FillBuffer( value );
+  return image;
+}
+
+DeformationFieldType::Pointer MakeField()
+{
+  DeformationFieldType::Pointer field = DeformationFieldType::New();
+  field->SetRegions( MakeImage( 0.0f )->GetLargestPossibleRegion() );
+  field->Allocate();
+  VectorPixelType zero;
+  zero.Fill( 0.0f );
+  field->FillBuffer( zero );
+  return field;
+}
+
+// Overwrite an SDM the function reads with random values. The warped SDMs
+// get outside sentinels and flat 5x3x3 patches, whose centres have zero
+// gradients, hence singular Hessians without regularisation. The unwarped
+// ones get scattered voxels of the patch value, where the intensities
+// match and the update is masked by the threshold.
+void FillSDM( const ImageType * sdm, Random & random, bool warped )
+{
+  const float patchValue = 100.0f;
+  float * buffer = const_cast<ImageType *>( sdm )->GetBufferPointer();
+  const unsigned long numberOfPixels = sdm->GetBufferedRegion().GetNumberOfPixels();
+  for( unsigned long i = 0; i < numberOfPixels; i++ )
+    {
+    const unsigned long x = i % imageSize[0];
+    const unsigned long y = ( i / imageSize[0] ) % imageSize[1];
+    const unsigned long z = i / ( imageSize[0] * imageSize[1] );
+    const bool patch = ( x / 5 + y / 3 + z / 3 ) % 3 == 0;
+    const double u = random.Uniform();
+    if( warped && patch )
+      {
+      buffer[i] = patchValue;
+      }
+    else if( warped && u < 0.04 )
+      {
+      buffer[i] = itk::NumericTraits<float>::max();
+      }
+    else if( !warped && u < 0.25 )
+      {
+      buffer[i] = patchValue;
+      }
+    else
+      {
+      buffer[i] = static_cast<float>( 255.0 * random.Uniform() );
+      }
+    }
+}
+
+// Set the images, run InitializeIteration and replace the SDMs it computed
+// by random ones, the same for a given seed
+void Initialize( FunctionType * function, unsigned long seed )
+{
+  function->InitializeIteration();
+
+  Random random( seed );
+  FillSDM( function->GetFixedSDMImage(), random, true );
+  FillSDM( function->GetMovingSDMImage(), random, true );
+  FillSDM( function->GetorignalFixedSDMImage(), random, false );
+  FillSDM( function->GetorignalMovingSDMImage(), random, false );
+}
+
+struct Result
+{
+  std::vector<UpdateType>   m_Updates;
+  double                    m_Metric;
+  double                    m_RMSChange;
+  unsigned long             m_NumberOfPixelsProcessed;
+};
+
+// All the updates, row by row, one voxel at a time or by rows. Rows cover
+// the whole x extent, and a part of it starting inside the image.
+Result Compute( FunctionType * function, DeformationFieldType * field,
+                unsigned long seed, bool byRows )
+{
+  Initialize( function, seed );
+
+  NeighborhoodIteratorType::RadiusType radius;
+  radius.Fill( 1 );
+  NeighborhoodIteratorType it( radius, field, field->GetLargestPossibleRegion() );
+
+  Result result;
+  void * globalData = function->GetGlobalDataPointer();
+  const long starts[2] = { 0, 3 };
+  const long lengths[2] = { static_cast<long>( imageSize[0] ), 11 };
+  for( unsigned int r = 0; r < 2; r++ )
+    {
+    for( long z = 0; z < static_cast<long>( imageSize[2] ); z++ )
+      {
+      for( long y = 0; y < static_cast<long>( imageSize[1] ); y++ )
+        {
+        FunctionType::IndexType index;
+        index[0] = starts[r];
+        index[1] = y;
+        index[2] = z;
+        std::vector<UpdateType> row( lengths[r] );
+        if( byRows )
+          {
+          function->ComputeUpdateRow( index, lengths[r], &row[0], globalData );
+          }
+        else
+          {
+          for( long x = 0; x < lengths[r]; x++ )
+            {
+            index[0] = starts[r] + x;
+            it.SetLocation( index );
+            row[x] = function->ComputeUpdate( it, globalData );
+            }
+          }
+        result.m_Updates.insert( result.m_Updates.end(), row.begin(), row.end() );
+        }
+      }
+    }
+  function->ReleaseGlobalDataPointer( globalData );
+
+  result.m_Metric = function->GetMetric();
+  result.m_RMSChange = function->GetRMSChange();
+  result.m_NumberOfPixelsProcessed = function->GetNumberOfPixelsProcessed();
+  return result;
+}
+
+bool SameBits( const Result & a, const Result & b )
+{
+  if( a.m_Updates.size() != b.m_Updates.size()
+      || a.m_NumberOfPixelsProcessed != b.m_NumberOfPixelsProcessed
+      || std::memcmp( &a.m_Metric, &b.m_Metric, sizeof( double ) ) != 0
+      || std::memcmp( &a.m_RMSChange, &b.m_RMSChange, sizeof( double ) ) != 0 )
+    {
+    std::cerr << "Metrics differ: " << a.m_Metric << " " << a.m_RMSChange << " "
+              << a.m_NumberOfPixelsProcessed << " vs " << b.m_Metric << " "
+              << b.m_RMSChange << " " << b.m_NumberOfPixelsProcessed << std::endl;
+    return false;
+    }
+  unsigned long numberOfFailures = 0;
+  for( unsigned long i = 0; i < a.m_Updates.size(); i++ )
+    {
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      const float u = a.m_Updates[i][d];
+      const float v = b.m_Updates[i][d];
+      if( std::memcmp( &u, &v, sizeof( float ) ) != 0 )
+        {
+        if( numberOfFailures < 10 )
+          {
+          std::cerr << "Update " << i << "[" << d << "]: " << u << " vs " << v << std::endl;
+          }
+        ++numberOfFailures;
+        }
+      }
+    }
+  return numberOfFailures == 0;
+}
+
+} // end namespace
+
+int main( int, char *[] )
+{
+  using itk::ESMInvConDemonsDetail::RowKernelInstructionSet;
+  using itk::ESMInvConDemonsDetail::GetRowKernelInstructionSet;
+
+  // labels only matter to InitializeIteration, whose SDMs are replaced
+  ImageType::Pointer fixedImage = MakeImage( 1.0f );
+  ImageType::Pointer movingImage = MakeImage( 1.0f );
+  DeformationFieldType::Pointer field = MakeField();
+  DeformationFieldType::Pointer inverseField = MakeField();
+
+  // Jacobians and weights, zero in places
+  ImageType::Pointer jacobian = MakeImage( 1.0f );
+  ImageType::Pointer weight = MakeImage( 1.0f );
+  Random random( 7 );
+  float * jacobianBuffer = jacobian->GetBufferPointer();
+  float * weightBuffer = weight->GetBufferPointer();
+  const unsigned long numberOfPixels = jacobian->GetBufferedRegion().GetNumberOfPixels();
+  for( unsigned long i = 0; i < numberOfPixels; i++ )
+    {
+    jacobianBuffer[i] = ( random.Uniform() < 0.2 ) ? 0.0f
+      : static_cast<float>( 0.5 + random.Uniform() );
+    weightBuffer[i] = static_cast<float>( random.Uniform() );
+    }
+
+  const RowKernelInstructionSet instructionSets[2] =
+    { itk::ESMInvConDemonsDetail::AVXInstructions,
+      itk::ESMInvConDemonsDetail::SSE41Instructions };
+  const char * names[2] = { "AVX", "SSE4.1" };
+  // the zero regularisation weight makes the flat patches singular
+  const double regWeights[2] = { 0.0, 0.1 };
+
+  unsigned int numberOfChecks = 0;
+  for( unsigned int w = 0; w < 2; w++ )
+    {
+    FunctionType::Pointer function = FunctionType::New();
+    function->SetFixedImage( fixedImage );
+    function->SetMovingImage( movingImage );
+    function->SetDeformationField( field );
+    function->SetInvDeformationField( inverseField );
+    function->SetUseJacobian( true );
+    function->SetJacobianDetImage( jacobian );
+    function->SetUseFwWeight( w == 1 );
+    function->SetFwWeightImage( weight );
+    function->SetRegWeight( regWeights[w] );
+    function->SetIntensityDifferenceThreshold( 2.0 );
+
+    const unsigned long seed = 1000 + w;
+    function->SetUseVectorizedUpdate( false );
+    const Result scalar = Compute( function, field, seed, false );
+    if( !SameBits( scalar, Compute( function, field, seed, true ) ) )
+      {
+      std::cerr << "Scalar rows differ from ComputeUpdate" << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    function->SetUseVectorizedUpdate( true );
+    for( unsigned int s = 0; s < 2; s++ )
+      {
+      if( GetRowKernelInstructionSet() < instructionSets[s] )
+        {
+        std::cout << names[s] << " is not available, skipped" << std::endl;
+        continue;
+        }
+      function->SetRowKernelInstructionSet( instructionSets[s] );
+      if( !SameBits( scalar, Compute( function, field, seed, true ) ) )
+        {
+        std::cerr << names[s] << " rows differ from ComputeUpdate (regularisation "
+                  << regWeights[w] << ")" << std::endl;
+        return EXIT_FAILURE;
+        }
+      ++numberOfChecks;
+      }
+    }
+
+  std::cout << numberOfChecks << " kernel runs match ComputeUpdate" << std::endl;
+  return EXIT_SUCCESS;
+}
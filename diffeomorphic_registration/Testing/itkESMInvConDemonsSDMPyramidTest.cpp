@@ -0,0 +1,237 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkESMInvConDemonsSDMPyramidTest.cpp
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+// Checks the SDM reference images of ESMInvConDemonsRegistrationFunction:
+// on a coarse level, the SDMs of the unwarped label images must be the SDMs
+// of the full-resolution labels brought down by RegistrationPyramid in
+// SmoothMode, bit for bit, kept between iterations and shared through the
+// SDM cache. References are rejected outside the WarpSDM mode and when
+// they are not finer than the level.
+
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkESMInvConDemonsRegistrationFunction.h"
+#include "itkMultiLabelDistanceMapImageFilter.h"
+#include "itkRegistrationPyramid.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+typedef itk::Image<float, 3>                                    ImageType;
+typedef itk::Vector<float, 3>                                   VectorPixelType;
+typedef itk::Image<VectorPixelType, 3>                          DeformationFieldType;
+typedef itk::ESMInvConDemonsRegistrationFunction
+  <ImageType, ImageType, DeformationFieldType>                  FunctionType;
+typedef itk::RegistrationPyramid<ImageType>                     PyramidType;
+typedef itk::MultiLabelDistanceMapImageFilter
+  <ImageType, ImageType>                                        DistanceMapFilterType;
+
+const unsigned int numberOfDecimations = 2;
+
+// A ball and a slab, the ball shifted in the moving image
+ImageType::Pointer MakeLabels( double shift )
+{
+  ImageType::SizeType size;
+  size[0] = 41;
+  size[1] = 36;
+  size[2] = 30;
+  ImageType::RegionType region;
+  region.SetSize( size );
+
+  ImageType::Pointer labels = ImageType::New();
+  labels->SetRegions( region );
+  labels->Allocate();
+
+  float * buffer = labels->GetBufferPointer();
+  for( long z = 0; z < static_cast<long>( size[2] ); z++ )
+    {
+    for( long y = 0; y < static_cast<long>( size[1] ); y++ )
+      {
+      for( long x = 0; x < static_cast<long>( size[0] ); x++ )
+        {
+        float label = 0.0f;
+        const double dx = x - 18.0 - shift, dy = y - 17.0, dz = z - 15.0;
+        if( dx * dx + dy * dy + dz * dz <= 10.0 * 10.0 )
+          {
+          label = 3.0f;
+          }
+        if( x >= 32 && x < 35 && y > 4 && y < 30 )
+          {
+          label = 10.0f;
+          }
+        buffer[ x + size[0] * ( y + size[1] * z ) ] = label;
+        }
+      }
+    }
+  return labels;
+}
+
+ImageType::Pointer Decimate( const ImageType * labels )
+{
+  PyramidType::Pointer pyramid = PyramidType::New();
+  ImageType::Pointer level = pyramid->DownsampleImage( labels, PyramidType::LabelMode );
+  for( unsigned int l = 1; l < numberOfDecimations; l++ )
+    {
+    level = pyramid->DownsampleImage( level, PyramidType::LabelMode );
+    }
+  return level;
+}
+
+// SDM of the full-resolution labels, smoothed down to the level
+ImageType::Pointer ExpectedSDM( const ImageType * labels, double sigma )
+{
+  DistanceMapFilterType::Pointer filter = DistanceMapFilterType::New();
+  filter->SetInput( labels );
+  filter->SetBandWidth( 0.0 );
+  filter->SetFrameWidth( 5 );
+  filter->Update();
+  ImageType::Pointer sdm = filter->GetOutput();
+  sdm->DisconnectPipeline();
+
+  PyramidType::Pointer pyramid = PyramidType::New();
+  pyramid->SetSmoothingSigma( sigma );
+  for( unsigned int l = 0; l < numberOfDecimations; l++ )
+    {
+    sdm = pyramid->DownsampleImage( sdm, PyramidType::SmoothMode );
+    }
+  return sdm;
+}
+
+DeformationFieldType::Pointer MakeField( const ImageType * image )
+{
+  DeformationFieldType::Pointer field = DeformationFieldType::New();
+  field->SetRegions( image->GetLargestPossibleRegion() );
+  field->Allocate();
+  VectorPixelType zero;
+  zero.Fill( 0.0f );
+  field->FillBuffer( zero );
+  return field;
+}
+
+bool SameBits( const ImageType * a, const ImageType * b )
+{
+  if( a->GetBufferedRegion() != b->GetBufferedRegion() )
+    {
+    std::cerr << "Regions differ" << std::endl;
+    return false;
+    }
+  return std::memcmp( a->GetBufferPointer(), b->GetBufferPointer(),
+    a->GetBufferedRegion().GetNumberOfPixels() * sizeof( float ) ) == 0;
+}
+
+// InitializeIteration is expected to throw
+bool Throws( FunctionType * function )
+{
+  try
+    {
+    function->InitializeIteration();
+    }
+  catch( itk::ExceptionObject & )
+    {
+    return true;
+    }
+  return false;
+}
+
+} // end namespace
+
+int main( int, char *[] )
+{
+  const double sigma = 1.0;
+
+  ImageType::Pointer fixedFull = MakeLabels( 0.0 );
+  ImageType::Pointer movingFull = MakeLabels( 2.0 );
+  ImageType::Pointer fixedLevel = Decimate( fixedFull );
+  ImageType::Pointer movingLevel = Decimate( movingFull );
+  DeformationFieldType::Pointer field = MakeField( fixedLevel );
+  DeformationFieldType::Pointer inverseField = MakeField( fixedLevel );
+
+  FunctionType::SDMCachePointer cache = FunctionType::SDMCacheType::New();
+
+  FunctionType::Pointer function = FunctionType::New();
+  function->SetFixedImage( fixedLevel );
+  function->SetMovingImage( movingLevel );
+  function->SetDeformationField( field );
+  function->SetInvDeformationField( inverseField );
+  function->SetSDMCache( cache );
+  function->SetSDMMode( FunctionType::WarpSDM );
+  function->SetSDMPyramidSigma( sigma );
+  function->SetFixedSDMReferenceImage( fixedFull );
+  function->SetMovingSDMReferenceImage( movingFull );
+  function->InitializeIteration();
+
+  const ImageType * fixedSDM = function->GetorignalFixedSDMImage();
+  const ImageType * movingSDM = function->GetorignalMovingSDMImage();
+  if( !SameBits( fixedSDM, ExpectedSDM( fixedFull, sigma ) )
+      || !SameBits( movingSDM, ExpectedSDM( movingFull, sigma ) ) )
+    {
+    std::cerr << "The SDMs of the level are not the smoothed full-resolution ones" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // the next iteration of the level keeps them
+  function->InitializeIteration();
+  if( function->GetorignalFixedSDMImage() != fixedSDM
+      || function->GetorignalMovingSDMImage() != movingSDM )
+    {
+    std::cerr << "The SDMs of the level were recomputed" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // a new function, e.g. of the next MEX call, finds them in the cache
+  FunctionType::Pointer next = FunctionType::New();
+  next->SetFixedImage( fixedLevel );
+  next->SetMovingImage( movingLevel );
+  next->SetDeformationField( field );
+  next->SetInvDeformationField( inverseField );
+  next->SetSDMCache( cache );
+  next->SetSDMMode( FunctionType::WarpSDM );
+  next->SetSDMPyramidSigma( sigma );
+  next->SetFixedSDMReferenceImage( fixedFull );
+  next->SetMovingSDMReferenceImage( movingFull );
+  next->InitializeIteration();
+  if( next->GetorignalFixedSDMImage() != fixedSDM
+      || next->GetorignalMovingSDMImage() != movingSDM )
+    {
+    std::cerr << "The SDMs of the level were not shared by the cache" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // the warped SDMs would not come from the references
+  next->SetSDMMode( FunctionType::RecomputeSDM );
+  if( !Throws( next ) )
+    {
+    std::cerr << "References were accepted in the RecomputeSDM mode" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // a reference coarser than the level
+  FunctionType::Pointer coarse = FunctionType::New();
+  coarse->SetFixedImage( fixedFull );
+  coarse->SetMovingImage( movingFull );
+  coarse->SetDeformationField( MakeField( fixedFull ) );
+  coarse->SetInvDeformationField( MakeField( fixedFull ) );
+  coarse->SetSDMMode( FunctionType::WarpSDM );
+  coarse->SetFixedSDMReferenceImage( fixedLevel );
+  coarse->SetMovingSDMReferenceImage( movingLevel );
+  if( !Throws( coarse ) )
+    {
+    std::cerr << "A reference coarser than the level was accepted" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "The SDM pyramid matches the smoothed full-resolution SDMs" << std::endl;
+  return EXIT_SUCCESS;
+}
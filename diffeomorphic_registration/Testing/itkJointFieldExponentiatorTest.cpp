@@ -0,0 +1,226 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkJointFieldExponentiatorTest.cpp
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+// Checks the drift of the incremental mode of JointFieldExponentiator, the
+// check_drift option of velocityfieldexp: a smooth velocity field receives
+// small updates, each followed by an incremental Compute(), and exp(v) and
+// exp(-v) are compared with a full exponentiation of the same v. Without
+// recomputation the per-voxel error norm must stay within maximumDrift
+// (largest) and meanDrift (mean) over all the updates. With a
+// RecomputeInterval, every such Compute() must be a full one that gives
+// the full exponentiation again and clears the accumulated drift.
+
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkJointFieldExponentiator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+
+typedef itk::Vector<float, 3>                                   VectorPixelType;
+typedef itk::Image<VectorPixelType, 3>                          DeformationFieldType;
+typedef itk::JointFieldExponentiator<DeformationFieldType>      ExponentiatorType;
+
+const unsigned int numberOfUpdates = 8;
+const unsigned int recomputeInterval = 3;
+
+// in voxels, for a velocity field of up to 1.5 voxel and updates of 0.1:
+// the drift grows to about 0.07 (mean 0.003) over the 8 updates
+const double maximumDrift = 0.1;
+const double meanDrift = 0.005;
+
+struct DriftType
+  {
+  double m_Maximum;
+  double m_Mean;
+  };
+
+// Smooth field of the given amplitude (in voxels) and phase. It vanishes
+// at the border: the composition takes the fields as zero outside the
+// image, so a field leaving it would make exp(v - u) o exp(u) differ from
+// exp(v) by more than the drift of the increments.
+DeformationFieldType::Pointer MakeField( double amplitude, double phase )
+{
+  DeformationFieldType::SizeType size;
+  size[0] = 32;
+  size[1] = 28;
+  size[2] = 24;
+  DeformationFieldType::RegionType region;
+  region.SetSize( size );
+
+  DeformationFieldType::Pointer field = DeformationFieldType::New();
+  field->SetRegions( region );
+  field->Allocate();
+
+  const double pi = 3.14159265358979;
+  VectorPixelType * buffer = field->GetBufferPointer();
+  for( long z = 0; z < static_cast<long>( size[2] ); z++ )
+    {
+    for( long y = 0; y < static_cast<long>( size[1] ); y++ )
+      {
+      for( long x = 0; x < static_cast<long>( size[0] ); x++ )
+        {
+        const double a = 2.0 * pi * x / size[0] + phase;
+        const double b = 2.0 * pi * y / size[1] + 2.0 * phase;
+        const double c = 2.0 * pi * z / size[2] + 3.0 * phase;
+        const double window = amplitude
+          * std::sin( pi * x / ( size[0] - 1 ) ) * std::sin( pi * x / ( size[0] - 1 ) )
+          * std::sin( pi * y / ( size[1] - 1 ) ) * std::sin( pi * y / ( size[1] - 1 ) )
+          * std::sin( pi * z / ( size[2] - 1 ) ) * std::sin( pi * z / ( size[2] - 1 ) );
+        VectorPixelType & v = buffer[ x + size[0] * ( y + size[1] * z ) ];
+        v[0] = static_cast<float>( window * std::sin( b ) * std::cos( c ) );
+        v[1] = static_cast<float>( window * std::sin( c ) * std::cos( a ) );
+        v[2] = static_cast<float>( window * std::sin( a ) * std::cos( b ) );
+        }
+      }
+    }
+  return field;
+}
+
+void AddUpdate( DeformationFieldType * velocity, const DeformationFieldType * update )
+{
+  VectorPixelType * v = velocity->GetBufferPointer();
+  const VectorPixelType * u = update->GetBufferPointer();
+  const unsigned long n = velocity->GetBufferedRegion().GetNumberOfPixels();
+  for( unsigned long i = 0; i < n; i++ )
+    {
+    v[i] += u[i];
+    }
+}
+
+// Per-voxel error norm of a field against the exact one, as check_drift
+DriftType Drift( const DeformationFieldType * approximate, const DeformationFieldType * exact )
+{
+  const VectorPixelType * p = approximate->GetBufferPointer();
+  const VectorPixelType * q = exact->GetBufferPointer();
+  const unsigned long n = exact->GetBufferedRegion().GetNumberOfPixels();
+  DriftType drift;
+  drift.m_Maximum = 0.0;
+  drift.m_Mean = 0.0;
+  for( unsigned long i = 0; i < n; i++ )
+    {
+    const double error = ( p[i] - q[i] ).GetNorm();
+    drift.m_Maximum = std::max( drift.m_Maximum, error );
+    drift.m_Mean += error;
+    }
+  drift.m_Mean /= n;
+  return drift;
+}
+
+// Larger drift of exp(v) and exp(-v) against a full exponentiation of v
+DriftType DriftFromFull( ExponentiatorType * exponentiator, const DeformationFieldType * velocity )
+{
+  ExponentiatorType::Pointer full = ExponentiatorType::New();
+  full->SetVelocityField( velocity );
+  full->SetComputeInverse( true );
+  full->Compute();
+
+  const DriftType forward = Drift( exponentiator->GetDeformationField(), full->GetDeformationField() );
+  const DriftType backward = Drift( exponentiator->GetInverseDeformationField(),
+                                    full->GetInverseDeformationField() );
+  DriftType drift;
+  drift.m_Maximum = std::max( forward.m_Maximum, backward.m_Maximum );
+  drift.m_Mean = std::max( forward.m_Mean, backward.m_Mean );
+  return drift;
+}
+
+} // end namespace
+
+int main( int, char *[] )
+{
+  DeformationFieldType::Pointer velocity = MakeField( 1.5, 0.0 );
+
+  // incremental only, the drift accumulates over all the updates
+  ExponentiatorType::Pointer exponentiator = ExponentiatorType::New();
+  exponentiator->SetVelocityField( velocity );
+  exponentiator->SetComputeInverse( true );
+  exponentiator->SetRecomputeInterval( 0 );
+  exponentiator->Compute();
+
+  DriftType last;
+  last.m_Maximum = 0.0;
+  last.m_Mean = 0.0;
+  for( unsigned int k = 0; k < numberOfUpdates; k++ )
+    {
+    DeformationFieldType::Pointer update = MakeField( 0.1, 0.4 * ( k + 1 ) );
+    AddUpdate( velocity, update );
+    exponentiator->SetUpdateField( update );
+    exponentiator->Compute();
+    if( !exponentiator->GetIncremental() )
+      {
+      std::cerr << "Update " << k << " was not incremental" << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    last = DriftFromFull( exponentiator, velocity );
+    if( last.m_Maximum > maximumDrift || last.m_Mean > meanDrift )
+      {
+      std::cerr << "Update " << k << ": drift of " << last.m_Maximum << " voxel (mean "
+                << last.m_Mean << "), above " << maximumDrift << " (" << meanDrift << ")"
+                << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  if( last.m_Maximum == 0.0 )
+    {
+    std::cerr << "The incremental results are the full ones" << std::endl;
+    return EXIT_FAILURE;
+    }
+  std::cout << "Drift after " << numberOfUpdates << " updates: " << last.m_Maximum
+            << " voxel (mean " << last.m_Mean << ")" << std::endl;
+
+  // with recomputation, the same sequence of updates
+  velocity = MakeField( 1.5, 0.0 );
+  exponentiator = ExponentiatorType::New();
+  exponentiator->SetVelocityField( velocity );
+  exponentiator->SetComputeInverse( true );
+  exponentiator->SetRecomputeInterval( recomputeInterval );
+  exponentiator->Compute();
+
+  for( unsigned int k = 0; k < numberOfUpdates; k++ )
+    {
+    DeformationFieldType::Pointer update = MakeField( 0.1, 0.4 * ( k + 1 ) );
+    AddUpdate( velocity, update );
+    exponentiator->SetUpdateField( update );
+    exponentiator->Compute();
+
+    const bool recomputed = ( k + 1 ) % recomputeInterval == 0;
+    if( exponentiator->GetIncremental() == recomputed )
+      {
+      std::cerr << "Update " << k << ( recomputed ? " was not" : " was" )
+                << " recomputed, with an interval of " << recomputeInterval << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    const DriftType drift = DriftFromFull( exponentiator, velocity );
+    if( recomputed && drift.m_Maximum != 0.0 )
+      {
+      std::cerr << "Update " << k << ": the recomputation left a drift of "
+                << drift.m_Maximum << " voxel" << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( drift.m_Maximum > maximumDrift || drift.m_Mean > meanDrift )
+      {
+      std::cerr << "Update " << k << ": drift of " << drift.m_Maximum << " voxel (mean "
+                << drift.m_Mean << ") with recomputation" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  std::cout << "The incremental exponentials stay within " << maximumDrift
+            << " voxel of the full ones" << std::endl;
+  return EXIT_SUCCESS;
+}
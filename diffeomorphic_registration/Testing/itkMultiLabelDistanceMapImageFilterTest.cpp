@@ -0,0 +1,186 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkMultiLabelDistanceMapImageFilterTest.cpp
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+// Compares the narrow-band MultiLabelDistanceMapImageFilter to the full
+// transform: the maxima, i.e. the normalisation, must be the same, the
+// normalised outputs within the band must be the same bit for bit, and the
+// voxels beyond the band must hold the normalised band.
+
+#include "itkImage.h"
+#include "itkMultiLabelDistanceMapImageFilter.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+typedef itk::Image<unsigned short, 3>                           LabelImageType;
+typedef itk::Image<float, 3>                                    OutputImageType;
+typedef itk::MultiLabelDistanceMapImageFilter
+  <LabelImageType, OutputImageType>                             FilterType;
+
+const float eps = 0.0001f;
+
+// Labels: a ball thicker than the band, a slab thinner than it, a small
+// box touching the image border, and scattered single voxels
+LabelImageType::Pointer MakeLabels()
+{
+  LabelImageType::SizeType size;
+  size[0] = 48;
+  size[1] = 40;
+  size[2] = 36;
+  LabelImageType::RegionType region;
+  region.SetSize( size );
+
+  LabelImageType::Pointer labels = LabelImageType::New();
+  labels->SetRegions( region );
+  labels->Allocate();
+  labels->FillBuffer( 0 );
+
+  unsigned short * buffer = labels->GetBufferPointer();
+  unsigned long random = 12345;
+  for( long z = 0; z < static_cast<long>( size[2] ); z++ )
+    {
+    for( long y = 0; y < static_cast<long>( size[1] ); y++ )
+      {
+      for( long x = 0; x < static_cast<long>( size[0] ); x++ )
+        {
+        unsigned short label = 0;
+        const double dx = x - 20.0, dy = y - 20.0, dz = z - 18.0;
+        if( dx * dx + dy * dy + dz * dz <= 12.0 * 12.0 )
+          {
+          label = 3;
+          }
+        if( x >= 36 && x < 38 && y > 4 && y < 34 )
+          {
+          label = 10;
+          }
+        if( x < 6 && y < 5 && z < 7 )
+          {
+          label = 200;
+          }
+        random = random * 1103515245ul + 12345ul;
+        if( ( random >> 16 ) % 97 == 0 )
+          {
+          label = 7;
+          }
+        buffer[ x + size[0] * ( y + size[1] * z ) ] = label;
+        }
+      }
+    }
+  return labels;
+}
+
+FilterType::Pointer Run( LabelImageType * labels, double bandWidth )
+{
+  FilterType::Pointer filter = FilterType::New();
+  filter->SetInput( labels );
+  filter->SetBandWidth( bandWidth );
+  filter->Update();
+  return filter;
+}
+
+} // end namespace
+
+int main( int, char *[] )
+{
+  const double bandWidth = 4.0;
+  const float band = static_cast<float>( bandWidth * bandWidth );
+
+  LabelImageType::Pointer labels = MakeLabels();
+  FilterType::Pointer full = Run( labels, 0.0 );
+  FilterType::Pointer banded = Run( labels, bandWidth );
+
+  const FilterType::LabelArrayType & labelArray = full->GetLabels();
+  if( labelArray != banded->GetLabels() || labelArray.size() != 4 )
+    {
+    std::cerr << "Label tables differ" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const std::vector<float> & fullMaxima = full->GetMaximumDistances();
+  const std::vector<float> & bandMaxima = banded->GetMaximumDistances();
+  bool thickLabel = false;
+  for( unsigned int l = 0; l < labelArray.size(); l++ )
+    {
+    if( bandMaxima[l] != fullMaxima[l] )
+      {
+      std::cerr << "Label " << labelArray[l] << ": maximum " << bandMaxima[l]
+                << " with the band, " << fullMaxima[l] << " without" << std::endl;
+      return EXIT_FAILURE;
+      }
+    thickLabel = thickLabel || fullMaxima[l] > band;
+    }
+  if( !thickLabel )
+    {
+    std::cerr << "No label is thicker than the band" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const unsigned short * labelBuffer = labels->GetBufferPointer();
+  const float * fullBuffer = full->GetOutput()->GetBufferPointer();
+  const float * bandBuffer = banded->GetOutput()->GetBufferPointer();
+  const unsigned long numberOfPixels =
+    labels->GetBufferedRegion().GetNumberOfPixels();
+  unsigned long numberOfFailures = 0;
+  unsigned long numberOfClamped = 0;
+  for( unsigned long i = 0; i < numberOfPixels; i++ )
+    {
+    if( labelBuffer[i] == 0 )
+      {
+      if( fullBuffer[i] != 0.0f || bandBuffer[i] != 0.0f )
+        {
+        ++numberOfFailures;
+        }
+      continue;
+      }
+    const unsigned int l = std::lower_bound( labelArray.begin(), labelArray.end(),
+      static_cast<unsigned int>( labelBuffer[i] ) ) - labelArray.begin();
+
+    // squared distance back from the normalised output, the same
+    // normalisation giving the band beyond it
+    const float diff = fullMaxima[l] + eps;
+    const float fullDistance = fullBuffer[i] / 255.0f * diff;
+    float expected = fullBuffer[i];
+    if( fullDistance > band + 0.5f )
+      {
+      expected = band / diff;
+      expected = expected * 255;
+      ++numberOfClamped;
+      }
+    if( bandBuffer[i] != expected )
+      {
+      if( numberOfFailures < 10 )
+        {
+        std::cerr << "Voxel " << i << " of label " << labelBuffer[i]
+                  << ": " << bandBuffer[i] << " with the band, "
+                  << fullBuffer[i] << " without" << std::endl;
+        }
+      ++numberOfFailures;
+      }
+    }
+  if( numberOfClamped == 0 )
+    {
+    std::cerr << "No voxel lies beyond the band" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  if( numberOfFailures > 0 )
+    {
+    std::cerr << numberOfFailures << " voxels differ" << std::endl;
+    return EXIT_FAILURE;
+    }
+  std::cout << "Band and full distance maps agree, the band only clamps" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,285 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkWarpFieldFileTest.cpp
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+// Checks the .bflwarp container of WarpFieldFile, raw and with block
+// compression: a field of odd size, whose last block is partial, must
+// read back bit for bit with its geometry, and a range of pixels crossing
+// block boundaries must read back on its own, in float and in double. A
+// byte changed in a block and a file cut short must both throw. The files
+// are written to the current directory.
+
+#include "itkWarpFieldFile.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+typedef itk::WarpFieldFile<3>         WarpFieldFileType;
+
+// 8 KB blocks, 2048 pixels of a component
+const unsigned long blockSize = 8192;
+const unsigned long pageSize = 4096;
+
+// The components: a smooth one on a coarse grid, which deflates, an
+// irregular one, which stays raw, and a constant one
+void MakeComponents( const WarpFieldFileType::SizeType & size,
+                     std::vector<float> components[3] )
+{
+  const unsigned long n = size[0] * size[1] * size[2];
+  unsigned int state = 12345;
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    components[d].resize( n );
+    }
+  for( unsigned long i = 0; i < n; i++ )
+    {
+    const unsigned long x = i % size[0];
+    const unsigned long y = ( i / size[0] ) % size[1];
+    components[0][i] = static_cast<float>( ( x * y ) % 64 ) / 64.0f - 0.5f;
+    state = state * 1103515245u + 12345u;
+    components[1][i] = static_cast<float>( state >> 8 ) / 16777216.0f * 6.0f - 3.0f;
+    components[2][i] = -1.25f;
+    }
+}
+
+WarpFieldFileType::Pointer Write( const char * fileName,
+                                  WarpFieldFileType::CompressionType compression,
+                                  const WarpFieldFileType::SizeType & size,
+                                  const std::vector<float> components[3] )
+{
+  WarpFieldFileType::SpacingType spacing;
+  spacing[0] = 1.0;
+  spacing[1] = 1.5;
+  spacing[2] = 2.0;
+  WarpFieldFileType::PointType origin;
+  origin[0] = -10.0;
+  origin[1] = 0.5;
+  origin[2] = 3.0;
+
+  WarpFieldFileType::Pointer writer = WarpFieldFileType::New();
+  writer->SetFileName( fileName );
+  writer->SetSize( size );
+  writer->SetSpacing( spacing );
+  writer->SetOrigin( origin );
+  writer->SetCompression( compression );
+  writer->SetBlockSize( blockSize );
+  const float * const pointers[3] =
+    { &components[0][0], &components[1][0], &components[2][0] };
+  writer->Write( pointers );
+  return writer;
+}
+
+bool SameBits( const std::vector<float> & a, const float * b, unsigned long first, unsigned long count )
+{
+  return std::memcmp( &a[first], b, count * sizeof( float ) ) == 0;
+}
+
+long FileLength( const char * fileName )
+{
+  std::ifstream file( fileName, std::ios::in | std::ios::binary | std::ios::ate );
+  return static_cast<long>( file.tellg() );
+}
+
+// Flip the bits of one byte of the file
+void CorruptByte( const char * fileName, long offset )
+{
+  std::fstream file( fileName, std::ios::in | std::ios::out | std::ios::binary );
+  file.seekg( offset );
+  char byte = 0;
+  file.read( &byte, 1 );
+  byte = static_cast<char>( ~byte );
+  file.seekp( offset );
+  file.write( &byte, 1 );
+}
+
+// Copy of the file without its last page
+void Truncate( const char * fileName, const char * truncatedName )
+{
+  const long length = FileLength( fileName ) - static_cast<long>( pageSize );
+  std::vector<char> bytes( length );
+  std::ifstream input( fileName, std::ios::in | std::ios::binary );
+  input.read( &bytes[0], length );
+  std::ofstream output( truncatedName, std::ios::out | std::ios::binary | std::ios::trunc );
+  output.write( &bytes[0], length );
+}
+
+// Open() and a read of the whole field are expected to throw
+bool ReadThrows( const char * fileName, unsigned long numberOfPixels )
+{
+  std::vector<float> values[3];
+  float * outputs[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    values[d].resize( numberOfPixels );
+    outputs[d] = &values[d][0];
+    }
+  try
+    {
+    WarpFieldFileType::Pointer reader = WarpFieldFileType::New();
+    reader->SetFileName( fileName );
+    reader->Open();
+    reader->ReadComponents( 0, numberOfPixels, outputs );
+    }
+  catch( itk::ExceptionObject & )
+    {
+    return true;
+    }
+  return false;
+}
+
+bool TestCompression( WarpFieldFileType::CompressionType compression, const char * fileName )
+{
+  const char * name = ( compression == WarpFieldFileType::BlockCompression ) ? "compressed" : "raw";
+
+  // 9801 pixels, 4.8 blocks per component
+  WarpFieldFileType::SizeType size;
+  size[0] = 27;
+  size[1] = 11;
+  size[2] = 33;
+  const unsigned long n = size[0] * size[1] * size[2];
+  std::vector<float> components[3];
+  MakeComponents( size, components );
+  WarpFieldFileType::Pointer writer = Write( fileName, compression, size, components );
+
+  WarpFieldFileType::Pointer reader = WarpFieldFileType::New();
+  reader->SetFileName( fileName );
+  reader->Open();
+  if( reader->GetSize() != size || reader->GetSpacing() != writer->GetSpacing()
+      || reader->GetOrigin() != writer->GetOrigin() || reader->GetCompression() != compression )
+    {
+    std::cerr << "The geometry of the " << name << " file differs" << std::endl;
+    return false;
+    }
+
+  // the whole field
+  std::vector<float> values[3];
+  float * outputs[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    values[d].assign( n, 0.0f );
+    outputs[d] = &values[d][0];
+    }
+  reader->ReadComponents( 0, n, outputs );
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    if( !SameBits( components[d], outputs[d], 0, n ) )
+      {
+      std::cerr << "Component " << d << " of the " << name << " file differs" << std::endl;
+      return false;
+      }
+    }
+
+  // the mapping, raw files only
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    const float * mapped = reader->GetMappedComponent( d );
+    if( compression == WarpFieldFileType::BlockCompression ? mapped != NULL
+        : ( mapped == NULL || !SameBits( components[d], mapped, 0, n ) ) )
+      {
+      std::cerr << "Mapped component " << d << " of the " << name << " file is wrong" << std::endl;
+      return false;
+      }
+    }
+
+  // pixels [1500, 6600) from the middle of block 0 to that of block 3, and
+  // the partial last block with the one before
+  const unsigned long ranges[2][2] = { { 1500, 5100 }, { 7000, n - 7000 } };
+  for( unsigned int r = 0; r < 2; r++ )
+    {
+    const unsigned long first = ranges[r][0];
+    const unsigned long count = ranges[r][1];
+    std::vector<float> subFloat[3];
+    std::vector<double> subDouble[3];
+    float * floatOutputs[3];
+    double * doubleOutputs[3];
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      subFloat[d].assign( count, 0.0f );
+      subDouble[d].assign( count, 0.0 );
+      floatOutputs[d] = &subFloat[d][0];
+      doubleOutputs[d] = &subDouble[d][0];
+      }
+    reader->ReadComponents( first, count, floatOutputs );
+    reader->ReadComponents( first, count, doubleOutputs );
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      bool same = SameBits( components[d], floatOutputs[d], first, count );
+      for( unsigned long i = 0; i < count && same; i++ )
+        {
+        same = ( subDouble[d][i] == static_cast<double>( components[d][first + i] ) );
+        }
+      if( !same )
+        {
+        std::cerr << "Pixels [" << first << ", " << first + count << ") of component " << d
+                  << " of the " << name << " file differ" << std::endl;
+        return false;
+        }
+      }
+    }
+  reader->Close();
+
+  // a raw file holds at least its header page and all the values
+  if( compression == WarpFieldFileType::BlockCompression
+      && FileLength( fileName ) >= static_cast<long>( pageSize + 3 * ( n * sizeof( float ) ) ) )
+    {
+    std::cerr << "No block was compressed" << std::endl;
+    return false;
+    }
+
+  // a file cut short
+  std::string truncatedName( fileName );
+  truncatedName += ".truncated";
+  Truncate( fileName, truncatedName.c_str() );
+  if( !ReadThrows( truncatedName.c_str(), n ) )
+    {
+    std::cerr << "The truncated " << name << " file was read" << std::endl;
+    return false;
+    }
+
+  // a byte of the first block, which follows the header page and the
+  // block table (one page)
+  CorruptByte( fileName, 2 * pageSize + 10 );
+  if( !ReadThrows( fileName, n ) )
+    {
+    std::cerr << "The corrupted " << name << " file was read" << std::endl;
+    return false;
+    }
+
+  return true;
+}
+
+} // end namespace
+
+int main( int, char *[] )
+{
+  try
+    {
+    if( !TestCompression( WarpFieldFileType::NoCompression, "itkWarpFieldFileTestRaw.bflwarp" )
+        || !TestCompression( WarpFieldFileType::BlockCompression,
+                             "itkWarpFieldFileTestCompressed.bflwarp" ) )
+      {
+      return EXIT_FAILURE;
+      }
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cerr << err << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Warp field files read back bit for bit and reject damaged files" << std::endl;
+  return EXIT_SUCCESS;
+}
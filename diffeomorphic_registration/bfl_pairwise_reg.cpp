@@ -0,0 +1,634 @@
+#include "itkDemonsIterationEngine.h"
+#include "itkJointFieldExponentiator.h"
+#include "itkRegistrationPyramid.h"
+
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkWarpImageFilter.h"
+
+#include "vnl/vnl_det.h"
+#include "vnl/vnl_inverse.h"
+#include "vnl/vnl_matrix_fixed.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// bfl_pairwise_reg [options] fixed moving log_field warped
+//
+// BFL_pairwise_reg3D without MATLAB: registers the moving label volume to
+// the fixed one with the multi-resolution inverse consistent SDM demons,
+// and writes the velocity (log) field and the moving volume warped by its
+// exponential (nearest neighbour, 0 outside). The volumes are read and
+// written through ITK, so any format with a registered ImageIO works
+// (NIfTI out of the box; MGZ needs an ITK built with an MGH ImageIO).
+//
+// As in MATLAB, the registration works in voxel units on the voxel grid:
+// the log field holds displacements in voxels of the fixed volume, along
+// its axes, and takes the spacing, origin and direction of the fixed
+// volume only as metadata.
+//
+// Each level runs the iterations of invconstdemonsreg3d_aux, in a
+// DemonsIterationEngine as demons_session does, and stops as it does: after
+// three iterations in a row without an MSE decrease, the field of lowest
+// MSE is kept.
+//
+// Options, with the names and defaults of BFL_pairwise_reg3D:
+//   --num_multires N            levels of the pyramid (4)
+//   --numiter N                 iterations per level (150)
+//   --numiter_levels n1,n2,...  iterations per level, finest first
+//   --min_level L               no iterations on the levels finer than L (1)
+//   --reg_weight W              step size, higher is smaller (50)
+//   --affine FILE               initial affine transform: the 4x4 matrix
+//                               affineMat, row by row, acting on the
+//                               1-based voxel coordinates of the file's
+//                               axes (MRIread swaps the first two axes, so
+//                               a matrix estimated in MATLAB on MRIread
+//                               volumes needs its first two rows and
+//                               columns swapped)
+//   --invcon_flag 0|1           inverse consistent force (1)
+//   --fw_weight 0|1             Jacobian weighting without it (0)
+//   --sdm_mode recompute|warp   see invcondemonsforces (recompute)
+//   --sdm_band B                SDM band width in voxels (0: everywhere)
+//   --sdm_frame F               margin around the labels (5)
+//   --vectorize 0|1             SIMD force kernel when available (1)
+//   --exp_recompute_interval N  see demons_session (1)
+//   --sdm_pyramid label|smooth  SDMs of the coarser levels computed on
+//                               their decimated labels, or on the
+//                               full-resolution labels and Gaussian-
+//                               smoothed down, with --sdm_mode warp (label)
+//   --sdm_pyramid_sigma S       standard deviation of that Gaussian, in
+//                               voxels of the finer level (1)
+//   --num_threads N             threads, 0 for the ITK default (0)
+//   --verbose 0|1               print the MSE of each iteration (0)
+
+const unsigned int Dimension = 3;
+
+typedef float PixelType;
+typedef itk::Image< PixelType, Dimension >           ImageType;
+
+typedef float                                        VectorComponentType;
+typedef itk::Vector<VectorComponentType, Dimension>  VectorPixelType;
+typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
+
+typedef itk::DemonsIterationEngine
+   <ImageType,DeformationFieldType>                  DemonsIterationEngineType;
+typedef DemonsIterationEngineType::DemonsFunctionType DemonsRegistrationFunctionType;
+typedef itk::RegistrationPyramid
+   <ImageType,DeformationFieldType>                  PyramidType;
+typedef itk::JointFieldExponentiator
+   <DeformationFieldType>                            FieldExponentiatorType;
+
+typedef vnl_matrix_fixed<double, 4, 4>               AffineMatrixType;
+
+// Options given on the command line, by name
+class OptionTable
+{
+public:
+   void Set(const std::string & name, const std::string & value)
+   {
+      m_Values[name] = value;
+   }
+
+   bool Has(const std::string & name) const
+   {
+      return m_Values.find(name) != m_Values.end();
+   }
+
+   std::string GetString(const std::string & name, const std::string & defaultValue) const
+   {
+      std::map<std::string, std::string>::const_iterator it = m_Values.find(name);
+      return it == m_Values.end() ? defaultValue : it->second;
+   }
+
+   double GetScalar(const std::string & name, double defaultValue) const
+   {
+      std::map<std::string, std::string>::const_iterator it = m_Values.find(name);
+      if ( it == m_Values.end() )
+      {
+         return defaultValue;
+      }
+      std::istringstream stream(it->second);
+      double value;
+      if ( !(stream >> value) || !stream.eof() )
+      {
+         throw std::runtime_error("Option --" + name + " must be numeric.");
+      }
+      return value;
+   }
+
+   unsigned int GetCount(const std::string & name, unsigned int defaultValue) const
+   {
+      const double value = this->GetScalar(name, defaultValue);
+      if ( value < 0 || value != std::floor(value) )
+      {
+         throw std::runtime_error("Option --" + name + " must be a non-negative integer.");
+      }
+      return static_cast<unsigned int>( value );
+   }
+
+private:
+   std::map<std::string, std::string> m_Values;
+};
+
+void PrintUsage(const char * program)
+{
+   std::cerr << "Usage: " << program << " [options] fixed moving log_field warped" << std::endl
+             << "Options (see the source for details):" << std::endl
+             << "  --num_multires N  --numiter N  --numiter_levels n1,n2,...  --min_level L" << std::endl
+             << "  --reg_weight W  --affine FILE  --invcon_flag 0|1  --fw_weight 0|1" << std::endl
+             << "  --sdm_mode recompute|warp  --sdm_band B  --sdm_frame F  --vectorize 0|1" << std::endl
+             << "  --exp_recompute_interval N  --sdm_pyramid label|smooth  --sdm_pyramid_sigma S" << std::endl
+             << "  --num_threads N  --verbose 0|1" << std::endl;
+}
+
+// Read a volume, its geometry reset to the voxel grid the registration
+// works on
+ImageType::Pointer ReadVolume(const std::string & filename)
+{
+   typedef itk::ImageFileReader<ImageType> ReaderType;
+   ReaderType::Pointer reader = ReaderType::New();
+   reader->SetFileName( filename );
+   reader->Update();
+
+   ImageType::Pointer image = reader->GetOutput();
+   image->DisconnectPipeline();
+   return image;
+}
+
+void SetVoxelGeometry(itk::ImageBase<Dimension> * image)
+{
+   ImageType::SpacingType    spacing;
+   ImageType::PointType      origin;
+   ImageType::DirectionType  direction;
+   spacing.Fill( 1.0 );
+   origin.Fill( 0.0 );
+   direction.SetIdentity();
+
+   ImageType::RegionType region = image->GetLargestPossibleRegion();
+   region.SetIndex( ImageType::IndexType() );
+   image->SetRegions( region );
+   image->SetSpacing( spacing );
+   image->SetOrigin( origin );
+   image->SetDirection( direction );
+}
+
+// Square root of a matrix by the Denman-Beavers iteration
+AffineMatrixType MatrixSquareRoot(const AffineMatrixType & matrix)
+{
+   AffineMatrixType y = matrix;
+   AffineMatrixType z;
+   z.set_identity();
+   for (unsigned int i=0; i<100; i++)
+   {
+      const AffineMatrixType nexty = 0.5 * ( y + vnl_inverse(z) );
+      const AffineMatrixType nextz = 0.5 * ( z + vnl_inverse(y) );
+      const double change = ( nexty - y ).frobenius_norm();
+      y = nexty;
+      z = nextz;
+      if ( change <= 1e-14 * y.frobenius_norm() )
+      {
+         break;
+      }
+   }
+   return y;
+}
+
+// Principal logarithm of a matrix by inverse scaling and squaring, as
+// logm: square roots until it is close to the identity, then the series
+// of log(I + X)
+AffineMatrixType MatrixLogarithm(const AffineMatrixType & matrix)
+{
+   AffineMatrixType identity;
+   identity.set_identity();
+
+   AffineMatrixType root = matrix;
+   unsigned int numberOfRoots = 0;
+   while ( ( root - identity ).frobenius_norm() > 0.25 )
+   {
+      if ( ++numberOfRoots > 40 )
+      {
+         throw std::runtime_error("The affine matrix has no real logarithm.");
+      }
+      root = MatrixSquareRoot( root );
+   }
+
+   const AffineMatrixType x = root - identity;
+   AffineMatrixType power = x;
+   AffineMatrixType logarithm = x;
+   for (unsigned int n=2; n<100 && power.frobenius_norm() > 1e-17; n++)
+   {
+      power = power * x;
+      logarithm += ( ( n % 2 ) ? 1.0 : -1.0 ) / n * power;
+   }
+   return std::ldexp( 1.0, static_cast<int>( numberOfRoots ) ) * logarithm;
+}
+
+// Velocity field of an affine transform on a grid of the given size, as
+// AffineMat2VelocityField3D_aux: the matrix acts on 1-based voxel
+// coordinates, about the centre size/2
+DeformationFieldType::Pointer AffineVelocityField(const AffineMatrixType & affine,
+                                                  const ImageType::SizeType & size)
+{
+   // rotation about the centre c: t - M c + c
+   AffineMatrixType transform = affine;
+   for (unsigned int i=0; i<Dimension; i++)
+   {
+      double shift = 0.0;
+      for (unsigned int j=0; j<Dimension; j++)
+      {
+         shift += affine(i,j) * 0.5 * size[j];
+      }
+      transform(i,3) = affine(i,3) - shift + 0.5 * size[i];
+   }
+   for (unsigned int j=0; j<3; j++)
+   {
+      transform(3,j) = 0.0;
+   }
+   transform(3,3) = 1.0;
+   vnl_matrix_fixed<double, 3, 3> linear;
+   for (unsigned int i=0; i<3; i++)
+   {
+      for (unsigned int j=0; j<3; j++)
+      {
+         linear(i,j) = transform(i,j);
+      }
+   }
+   if ( vnl_det( linear ) <= 0.0 )
+   {
+      throw std::runtime_error("The affine matrix must preserve the orientation.");
+   }
+
+   const AffineMatrixType logarithm = MatrixLogarithm( transform );
+
+   DeformationFieldType::Pointer field = DeformationFieldType::New();
+   ImageType::RegionType region;
+   region.SetSize( size );
+   field->SetRegions( region );
+   field->Allocate();
+
+   itk::ImageRegionIteratorWithIndex<DeformationFieldType> it( field, region );
+   for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+   {
+      VectorPixelType value;
+      for (unsigned int i=0; i<Dimension; i++)
+      {
+         double component = logarithm(i,3);
+         for (unsigned int j=0; j<Dimension; j++)
+         {
+            component += logarithm(i,j) * ( it.GetIndex()[j] + 1.0 );
+         }
+         value[i] = static_cast<VectorComponentType>( component );
+      }
+      it.Set( value );
+   }
+   return field;
+}
+
+AffineMatrixType ReadAffineMatrix(const std::string & filename)
+{
+   std::ifstream file( filename.c_str() );
+   if ( !file )
+   {
+      throw std::runtime_error("Cannot open the affine matrix " + filename + ".");
+   }
+   AffineMatrixType affine;
+   for (unsigned int i=0; i<4; i++)
+   {
+      for (unsigned int j=0; j<4; j++)
+      {
+         if ( !(file >> affine(i,j)) )
+         {
+            throw std::runtime_error("The affine matrix " + filename + " must hold 4x4 numbers.");
+         }
+      }
+   }
+   return affine;
+}
+
+// The iterations of invconstdemonsreg3d_aux on one level. The velocity
+// field is accumulated in double, as the MATLAB arrays are. The reference
+// images, when not NULL, are the full-resolution labels the SDMs of the
+// level are smoothed down from.
+DeformationFieldType::Pointer RegisterLevel(const ImageType * fixed,
+                                            const ImageType * moving,
+                                            const ImageType * fixedReference,
+                                            const ImageType * movingReference,
+                                            const DeformationFieldType * initial,
+                                            unsigned int numberOfIterations,
+                                            const OptionTable & options)
+{
+   const unsigned long numPix = fixed->GetLargestPossibleRegion().GetNumberOfPixels();
+   std::vector<double> velocity( Dimension * numPix );
+   for (unsigned long n=0; n<numPix; n++)
+   {
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         velocity[Dimension*n + d] = initial->GetBufferPointer()[n][d];
+      }
+   }
+   std::vector<double> bestVelocity( velocity );
+
+   DeformationFieldType::Pointer field = DeformationFieldType::New();
+   field->CopyInformation( fixed );
+   field->SetRegions( fixed->GetLargestPossibleRegion() );
+   field->Allocate();
+
+   DemonsIterationEngineType::Pointer engine = DemonsIterationEngineType::New();
+   engine->SetFixedImage( fixed );
+   engine->SetMovingImage( moving );
+   engine->SetVelocityField( field );
+   engine->SetInverseConsistent( options.GetScalar("invcon_flag", 1.0) != 0 );
+   engine->SetUseFwWeight( options.GetScalar("fw_weight", 0.0) != 0 );
+   engine->SetRegWeight( options.GetScalar("reg_weight", 50.0) );
+   engine->SetNumberOfThreads( options.GetCount("num_threads", 0) );
+   engine->SetExpRecomputeInterval( options.GetCount("exp_recompute_interval", 1) );
+
+   DemonsRegistrationFunctionType * drfp = engine->GetDemonsFunction();
+   drfp->SetSDMCache( DemonsRegistrationFunctionType::SDMCacheType::New() );
+   drfp->SetSDMBandWidth( options.GetScalar("sdm_band", 0.0) );
+   drfp->SetSDMFrameWidth( options.GetCount("sdm_frame", 5) );
+   drfp->SetUseVectorizedUpdate( options.GetScalar("vectorize", 1.0) != 0 );
+   const std::string sdmMode = options.GetString("sdm_mode", "recompute");
+   if ( sdmMode == "recompute" )
+   {
+      drfp->SetSDMMode( DemonsRegistrationFunctionType::RecomputeSDM );
+   }
+   else if ( sdmMode == "warp" )
+   {
+      drfp->SetSDMMode( DemonsRegistrationFunctionType::WarpSDM );
+   }
+   else
+   {
+      throw std::runtime_error("Option --sdm_mode must be recompute or warp.");
+   }
+
+   // SDMs of the full-resolution labels, smoothed down to this level
+   drfp->SetSDMPyramidSigma( options.GetScalar("sdm_pyramid_sigma", 1.0) );
+   drfp->SetFixedSDMReferenceImage( fixedReference );
+   drfp->SetMovingSDMReferenceImage( movingReference );
+
+   const bool verbose = ( options.GetScalar("verbose", 0.0) != 0 );
+   double previousMSE = 0.0;
+   double minMSE = std::numeric_limits<double>::infinity();
+   unsigned int strike = 0;
+   for (unsigned int i=0; i<numberOfIterations; i++)
+   {
+      VectorPixelType * fieldptr = field->GetBufferPointer();
+      for (unsigned long n=0; n<numPix; n++)
+      {
+         for (unsigned int d=0; d<Dimension; d++)
+         {
+            fieldptr[n][d] = static_cast<VectorComponentType>( velocity[Dimension*n + d] );
+         }
+      }
+
+      try
+      {
+         engine->Iterate();
+      }
+      catch( itk::ExceptionObject & err )
+      {
+         std::cerr << err.GetDescription() << std::endl;
+         break;
+      }
+
+      const VectorPixelType * upptr = engine->GetUpdateField()->GetBufferPointer();
+      for (unsigned long n=0; n<numPix; n++)
+      {
+         for (unsigned int d=0; d<Dimension; d++)
+         {
+            velocity[Dimension*n + d] += upptr[n][d];
+         }
+      }
+
+      // early stopping of invconstdemonsreg3d_aux
+      const double mse = engine->GetMSE();
+      if ( verbose )
+      {
+         std::cout << "Iteration " << i+1 << ": MSE " << mse << std::endl;
+      }
+      if ( i > 0 )
+      {
+         strike = ( mse > previousMSE - 1e-8 ) ? strike + 1 : 0;
+      }
+      previousMSE = mse;
+      if ( mse < minMSE )
+      {
+         minMSE = mse;
+         bestVelocity = velocity;
+      }
+      if ( strike > 2 )
+      {
+         if ( verbose )
+         {
+            std::cout << "Terminating the optimization..." << std::endl;
+         }
+         velocity = bestVelocity;
+         break;
+      }
+   }
+
+   VectorPixelType * fieldptr = field->GetBufferPointer();
+   for (unsigned long n=0; n<numPix; n++)
+   {
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         fieldptr[n][d] = static_cast<VectorComponentType>( velocity[Dimension*n + d] );
+      }
+   }
+   return field;
+}
+
+int Run(int argc, char * argv[])
+{
+   // options, then the four file names
+   OptionTable options;
+   std::vector<std::string> filenames;
+   for (int a=1; a<argc; a++)
+   {
+      const std::string argument( argv[a] );
+      if ( argument.compare(0, 2, "--") == 0 )
+      {
+         if ( a+1 >= argc )
+         {
+            throw std::runtime_error("Option " + argument + " needs a value.");
+         }
+         options.Set( argument.substr(2), argv[++a] );
+      }
+      else
+      {
+         filenames.push_back( argument );
+      }
+   }
+   if ( filenames.size() != 4 )
+   {
+      PrintUsage( argv[0] );
+      return EXIT_FAILURE;
+   }
+   const bool verbose = ( options.GetScalar("verbose", 0.0) != 0 );
+
+   const unsigned int numberOfLevels = options.GetCount("num_multires", 4);
+   if ( numberOfLevels < 1 )
+   {
+      throw std::runtime_error("Option --num_multires must be positive.");
+   }
+   std::vector<unsigned int> numberOfIterations( numberOfLevels, options.GetCount("numiter", 150) );
+   if ( options.Has("numiter_levels") )
+   {
+      std::istringstream stream( options.GetString("numiter_levels", "") );
+      std::string count;
+      for (unsigned int level=0; level<numberOfLevels; level++)
+      {
+         if ( !std::getline(stream, count, ',') )
+         {
+            throw std::runtime_error("Option --numiter_levels needs one count per level.");
+         }
+         OptionTable single;
+         single.Set( "numiter_levels", count );
+         numberOfIterations[level] = single.GetCount("numiter_levels", 0);
+      }
+   }
+   const unsigned int minLevel = options.GetCount("min_level", 1);
+
+   const std::string sdmPyramid = options.GetString("sdm_pyramid", "label");
+   if ( sdmPyramid != "label" && sdmPyramid != "smooth" )
+   {
+      throw std::runtime_error("Option --sdm_pyramid must be label or smooth.");
+   }
+   const bool smoothSDMPyramid = ( sdmPyramid == "smooth" );
+   if ( smoothSDMPyramid && options.GetString("sdm_mode", "recompute") != "warp" )
+   {
+      throw std::runtime_error("Option --sdm_pyramid smooth needs --sdm_mode warp.");
+   }
+   if ( options.GetScalar("sdm_pyramid_sigma", 1.0) < 0 )
+   {
+      throw std::runtime_error("Option --sdm_pyramid_sigma must be non-negative.");
+   }
+
+   // volumes, on the voxel grid
+   ImageType::Pointer fixed = ReadVolume( filenames[0] );
+   ImageType::Pointer moving = ReadVolume( filenames[1] );
+   if ( fixed->GetLargestPossibleRegion().GetSize() != moving->GetLargestPossibleRegion().GetSize() )
+   {
+      throw std::runtime_error("The fixed and moving volumes must have the same size.");
+   }
+   ImageType::Pointer fixedGeometry = ImageType::New();
+   fixedGeometry->CopyInformation( fixed );
+   SetVoxelGeometry( fixed );
+   SetVoxelGeometry( moving );
+   const ImageType::SizeType size = fixed->GetLargestPossibleRegion().GetSize();
+
+   PyramidType::Pointer pyramid = PyramidType::New();
+   pyramid->SetNumberOfThreads( options.GetCount("num_threads", 0) );
+   // label images are only decimated, never smoothed
+   std::vector<ImageType::ConstPointer> fixedLevels =
+      pyramid->ComputeImagePyramid( fixed, numberOfLevels, PyramidType::LabelMode );
+   std::vector<ImageType::ConstPointer> movingLevels =
+      pyramid->ComputeImagePyramid( moving, numberOfLevels, PyramidType::LabelMode );
+
+   // initial field on the coarsest level: the affine transform, or zero
+   DeformationFieldType::Pointer field;
+   if ( options.Has("affine") )
+   {
+      field = AffineVelocityField( ReadAffineMatrix( options.GetString("affine", "") ), size );
+      for (unsigned int level=1; level<numberOfLevels; level++)
+      {
+         field = pyramid->DownsampleField( field );
+      }
+   }
+   else
+   {
+      VectorPixelType zero;
+      zero.Fill( 0.0 );
+      field = DeformationFieldType::New();
+      field->SetRegions( fixedLevels.back()->GetLargestPossibleRegion() );
+      field->Allocate();
+      field->FillBuffer( zero );
+   }
+
+   for (unsigned int level=numberOfLevels; level>=1; level--)
+   {
+      const unsigned int iterations = ( level < minLevel ) ? 0 : numberOfIterations[level-1];
+      const bool useReferences = smoothSDMPyramid && level > 1;
+      field = RegisterLevel( fixedLevels[level-1], movingLevels[level-1],
+                             useReferences ? fixed.GetPointer() : NULL,
+                             useReferences ? moving.GetPointer() : NULL,
+                             field, iterations, options );
+      if ( level != 1 )
+      {
+         field = pyramid->UpsampleField( field, fixedLevels[level-2]->GetLargestPossibleRegion().GetSize() );
+      }
+      if ( verbose )
+      {
+         std::cout << "Finished registration at pyramid level: " << level << std::endl;
+      }
+   }
+
+   // moving volume warped by exp(v), 0 outside
+   FieldExponentiatorType::Pointer exponentiator = FieldExponentiatorType::New();
+   exponentiator->SetVelocityField( field );
+   exponentiator->SetComputeInverse( false );
+   exponentiator->SetNumberOfThreads( options.GetCount("num_threads", 0) );
+   exponentiator->Compute();
+   exponentiator->ReleaseWorkspace();
+
+   typedef itk::WarpImageFilter
+      <ImageType, ImageType, DeformationFieldType>      WarperType;
+   typedef itk::NearestNeighborInterpolateImageFunction<ImageType,double> InterpolatorType;
+   WarperType::Pointer warper = WarperType::New();
+   warper->SetInput( moving );
+   warper->SetInterpolator( InterpolatorType::New() );
+   warper->SetOutputSpacing( moving->GetSpacing() );
+   warper->SetOutputOrigin( moving->GetOrigin() );
+   warper->SetDeformationField( exponentiator->GetDeformationField() );
+   warper->SetEdgePaddingValue( 0 );
+   warper->Update();
+
+   // outputs, with the geometry of the fixed volume
+   ImageType::Pointer warped = warper->GetOutput();
+   warped->DisconnectPipeline();
+   warped->CopyInformation( fixedGeometry );
+   field->CopyInformation( fixedGeometry );
+
+   typedef itk::ImageFileWriter<DeformationFieldType> FieldWriterType;
+   FieldWriterType::Pointer fieldWriter = FieldWriterType::New();
+   fieldWriter->SetInput( field );
+   fieldWriter->SetFileName( filenames[2] );
+   fieldWriter->Update();
+
+   typedef itk::ImageFileWriter<ImageType> WriterType;
+   WriterType::Pointer writer = WriterType::New();
+   writer->SetInput( warped );
+   writer->SetFileName( filenames[3] );
+   writer->Update();
+
+   return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char * argv[])
+{
+   try
+   {
+      return Run(argc, argv);
+   }
+   catch( itk::ExceptionObject & err )
+   {
+      std::cerr << err << std::endl;
+   }
+   catch( std::exception & err )
+   {
+      std::cerr << err.what() << std::endl;
+   }
+   return EXIT_FAILURE;
+}
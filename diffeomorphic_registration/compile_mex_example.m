@@ -6,8 +6,12 @@ end
 
 mex_files_cell = {'mex_deffieldharmonicenergy.cpp', ...
     'mex_deffieldjacobiandeterminant.cpp', 'mex_deffieldjacobiandist.cpp', ...
-    'mex_invcondemonsforces.cpp', 'mex_velocityfieldexp.cpp', ...
-    'mex_warpimage.cpp', 'mex_warplabelimage.cpp', 'mex_weightedfwdemonsforces.cpp'};
+    'mex_invcondemonsforces.cpp', 'mex_demonsiteration.cpp', 'mex_demons_session.cpp', ...
+    'mex_registrationmetrics.cpp', 'mex_registrationpyramid.cpp', 'mex_velocityfieldexp.cpp', ...
+    'mex_velocitytransform.cpp', ...
+    'mex_warpimage.cpp', 'mex_warpimages.cpp', 'mex_warpchain.cpp', 'mex_warpplan.cpp', ...
+    'mex_warplabelimage.cpp', 'mex_warplabels.cpp', ...
+    'mex_weightedfwdemonsforces.cpp'};
 
 INCLUDE_FLDRS = { ITK_DIR, ...
     [ITK_DIR '/Code/Common/'], ...
@@ -54,9 +54,14 @@ for i = 1:NumSbj
     
     if (nargin >= 4)
         
-        load([Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat']);
-        [def_x, def_y, def_z] = velocityfieldexp(-log_def_x, -log_def_y, -log_def_z);
-        vol1.vol = warpimage(single(vol1.vol), single(def_x), single(def_y),single(def_z));
+        warp_file = [Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat'];
+        if (~use_jac_flag)
+            vol1.vol = warp_to_template_aux(warp_file, vol1.vol);
+        else
+            [log_def_x, log_def_y, log_def_z] = load_warp_aux(warp_file);
+            [def_x, def_y, def_z] = velocityfieldexp(-log_def_x, -log_def_y, -log_def_z);
+            vol1.vol = warpimage(single(vol1.vol), single(def_x), single(def_y),single(def_z));
+        end
         vol1.vol(isnan(vol1.vol)) = 0;
         
         if (use_jac_flag)
@@ -57,9 +57,9 @@ if isfield(options,'log_def_x')
    log_def_y = options.log_def_y;
    log_def_z = options.log_def_z;
 else
-   log_def_x = zeros(size(fix_im),class(fix_im));
-   log_def_y = zeros(size(fix_im),class(fix_im));
-   log_def_z = zeros(size(fix_im),class(fix_im));
+   log_def_x = zeros(size(fix_im),'double');
+   log_def_y = zeros(size(fix_im),'double');
+   log_def_z = zeros(size(fix_im),'double');
 end
 if ~isfield(options,'verbose')
     options.verbose = 0;
@@ -72,6 +72,17 @@ end
 if ~isfield(options,'sigma_fluid')
     options.sigma_fluid = 0;
 end
+% the fused paths are opt-in, see Testing/itkDemonsIterationEngineTest.cpp
+% for the tolerances within which they follow the step-by-step one
+if ~isfield(options, 'fused_iteration')
+    options.fused_iteration = 0;
+end
+if ~isfield(options, 'demons_session')
+    options.demons_session = 0;
+end
+if ~isfield(options, 'fused_metrics')
+    options.fused_metrics = 0;
+end
 
 if options.sigma_diff>0.5
     n=ceil(options.sigma_diff*3);
@@ -93,10 +104,18 @@ stats.harmoEner = zeros(options.numiter,1);
 stats.backharmoEner = zeros(options.numiter,1);
 stats.negJacRatio = zeros(options.numiter,1);
 stats.backnegJacRatio = zeros(options.numiter,1);
-fix_im = double(fix_im);
-mov_im = double(mov_im);
+% the mex functions wrap single images instead of converting them on
+% every call
+fix_im = single(fix_im);
+mov_im = single(mov_im);
 total_time = 0;
 
+if (options.fused_iteration && options.demons_session)
+    % images, buffers, filters and SDMs are kept between the iterations
+    options.session_handle = demons_session('create', size(fix_im), iteration_options(options));
+    demons_session('setimages', options.session_handle, fix_im, mov_im);
+end
+
 strike = 0;
 min_MSE = inf;
 for i=1:options.numiter
@@ -145,19 +164,26 @@ for i=1:options.numiter
     
 end
 
+if isfield(options, 'session_handle')
+    demons_session('destroy', options.session_handle);
+end
+
 stats.total_time = total_time;
 if (options.verbose)
     disp(['Elapsed time: ' num2str(total_time) ' seconds']);
 end
 
 
-if ( nargout > 4 )
+if ( nargout > 5 )
+    [def_x, def_y, def_z, invdef_x, invdef_y, invdef_z] = velocityfieldexp(double(log_def_x), double(log_def_y), double(log_def_z));
+elseif ( nargout > 4 )
     [def_x, def_y, def_z] = velocityfieldexp(double(log_def_x), double(log_def_y), double(log_def_z));
+end
+if ( nargout > 4 )
     warped_mov_im = warplabelimage(double(mov_im), double(def_x), double(def_y), double(def_z));
     warped_mov_im( isnan(warped_mov_im) ) = 0;
 end
 if ( nargout > 5 )
-    [invdef_x, invdef_y, invdef_z] = velocityfieldexp(-double(log_def_x), -double(log_def_y), -double(log_def_z));
     backwarped_fix_im = warplabelimage(double(fix_im), double(invdef_x), double(invdef_y), double(invdef_z));
     backwarped_fix_im( isnan(backwarped_fix_im) ) = 0;
 end
@@ -169,10 +195,34 @@ function [log_def_x, log_def_y, log_def_z, stats, up_time] = make_update(...
 
 tic;
 
-[def_x, def_y, def_z] = velocityfieldexp(log_def_x, log_def_y, log_def_z);
-[invdef_x, invdef_y, invdef_z] = velocityfieldexp(-log_def_x, -log_def_y, -log_def_z);
-jacdet = deffieldjacobiandeterminant(def_x, def_y, def_z);
-inv_jacdet = deffieldjacobiandeterminant(invdef_x, invdef_y, invdef_z);
+force_opts = force_options(options);
+
+if (options.fused_iteration)
+    % the whole iteration in one mex call, intermediates stay native
+    if isfield(options, 'session_handle')
+        [log_def_x, log_def_y, log_def_z, iter_stats] = demons_session('step', options.session_handle, ...
+            double(log_def_x), double(log_def_y), double(log_def_z));
+    else
+        [log_def_x, log_def_y, log_def_z, iter_stats] = demonsiteration(fix_im, mov_im, ...
+            double(log_def_x), double(log_def_y), double(log_def_z), iteration_options(options));
+    end
+    stats.MSE(i) = iter_stats.MSE;
+    stats.backMSE(i) = iter_stats.backMSE;
+    stats.harmoEner(i) = iter_stats.harmoEner;
+    stats.backharmoEner(i) = iter_stats.backharmoEner;
+    stats.negJacRatio(i) = iter_stats.negJacRatio;
+    stats.backnegJacRatio(i) = iter_stats.backnegJacRatio;
+    up_time = toc;
+    return
+end
+
+% exp(v), exp(-v) and their Jacobian determinants in one call. They are
+% computed in single precision anyway, so they are returned as single
+% arrays, which the force and stats mex functions read like the images
+exp_opts = force_opts;
+exp_opts.jacobian = 1;
+[def_x, def_y, def_z, invdef_x, invdef_y, invdef_z, jacdet, inv_jacdet] = ...
+    velocityfieldexp(single(log_def_x), single(log_def_y), single(log_def_z), exp_opts);
 options.use_jacobian = 1;
 if (options.invcon_flag)
     jac_weight = inv_jacdet;
@@ -182,28 +232,39 @@ else
 end
 
 if (~options.invcon_flag && options.fw_weight)
-    [up_x, up_y, up_z] = weightedfwdemonsforces(double(fix_im), double(mov_im), double(def_x), double(def_y), double(def_z), double(invdef_x), double(invdef_y), double(invdef_z), jac_weight, jacdet, options.reg_weight);
+    [up_x, up_y, up_z] = weightedfwdemonsforces(fix_im, mov_im, def_x, def_y, def_z, invdef_x, invdef_y, invdef_z, jac_weight, jacdet, options.reg_weight, force_opts);
 else
-    [up_x, up_y, up_z] = invcondemonsforces(double(fix_im), double(mov_im), double(def_x), double(def_y), double(def_z), double(invdef_x), double(invdef_y), double(invdef_z), ...
-        jac_weight, options.use_jacobian, options.reg_weight);
+    [up_x, up_y, up_z] = invcondemonsforces(fix_im, mov_im, def_x, def_y, def_z, invdef_x, invdef_y, invdef_z, ...
+        jac_weight, options.use_jacobian, options.reg_weight, force_opts);
 end
 
 up_time = toc;
 
 % compute stats
-warped_mov_im = warplabelimage(mov_im, def_x, def_y, def_z);
-idx = isnan(warped_mov_im(:));
-stats.MSE(i) = mean( (warped_mov_im(~idx)-fix_im(~idx)).^2 );
-stats.harmoEner(i) = deffieldharmonicenergy(def_x, def_y, def_z);
+if (options.fused_metrics)
+    % all six in one pass over the images and fields
+    iter_stats = registrationmetrics(fix_im, mov_im, def_x, def_y, def_z, invdef_x, invdef_y, invdef_z, force_opts);
+    stats.MSE(i) = iter_stats.MSE;
+    stats.backMSE(i) = iter_stats.backMSE;
+    stats.harmoEner(i) = iter_stats.harmoEner;
+    stats.backharmoEner(i) = iter_stats.backharmoEner;
+    stats.negJacRatio(i) = iter_stats.negJacRatio;
+    stats.backnegJacRatio(i) = iter_stats.backnegJacRatio;
+else
+    warped_mov_im = warplabelimage(mov_im, def_x, def_y, def_z);
+    idx = isnan(warped_mov_im(:));
+    stats.MSE(i) = mean( double(warped_mov_im(~idx)-fix_im(~idx)).^2 );
+    stats.harmoEner(i) = deffieldharmonicenergy(def_x, def_y, def_z);
 
-stats.negJacRatio(i) = mean(jacdet(:)<=0);
+    stats.negJacRatio(i) = mean(jacdet(:)<=0);
 
-backwarped_fix_im = warplabelimage(fix_im, invdef_x, invdef_y, invdef_z);
-invidx = isnan(backwarped_fix_im(:));
-stats.backMSE(i) = mean( (backwarped_fix_im(~invidx)-mov_im(~invidx)).^2 );
-stats.backharmoEner(i) = deffieldharmonicenergy(invdef_x, invdef_y, invdef_z);
-jacdet = inv_jacdet;
-stats.backnegJacRatio(i) = mean(jacdet(:)<=0);
+    backwarped_fix_im = warplabelimage(fix_im, invdef_x, invdef_y, invdef_z);
+    invidx = isnan(backwarped_fix_im(:));
+    stats.backMSE(i) = mean( double(backwarped_fix_im(~invidx)-mov_im(~invidx)).^2 );
+    stats.backharmoEner(i) = deffieldharmonicenergy(invdef_x, invdef_y, invdef_z);
+    jacdet = inv_jacdet;
+    stats.backnegJacRatio(i) = mean(jacdet(:)<=0);
+end
 
 %%%%%
 
@@ -223,9 +284,10 @@ if options.sigma_fluid>0.5
     up_z = imfilter(up_z, shiftdim(gausskernel_fluid,-1), 'replicate');
 end
 end
-log_def_x = log_def_x + up_x;
-log_def_y = log_def_y + up_y;
-log_def_z = log_def_z + up_z;
+% v itself stays double
+log_def_x = log_def_x + double(up_x);
+log_def_y = log_def_y + double(up_y);
+log_def_z = log_def_z + double(up_z);
 if 0
 if options.sigma_diff>0.5
     log_def_x = imfilter(log_def_x, gausskernel_diff, 'replicate');
@@ -239,4 +301,47 @@ if options.sigma_diff>0.5
     log_def_z = imfilter(log_def_z, shiftdim(gausskernel_diff,-1), 'replicate');
 end
 end
-up_time = up_time + toc;
\ No newline at end of file
+up_time = up_time + toc;
+
+
+function force_opts = force_options(options)
+% options handed to the force mex functions
+force_opts = struct();
+if isfield(options, 'sdm_mode')
+    force_opts.sdm_mode = options.sdm_mode;
+end
+if isfield(options, 'sdm_band')
+    force_opts.sdm_band = options.sdm_band;
+end
+if isfield(options, 'sdm_frame')
+    force_opts.sdm_frame = options.sdm_frame;
+end
+if isfield(options, 'sdm_fixed_reference')
+    force_opts.sdm_fixed_reference = options.sdm_fixed_reference;
+    force_opts.sdm_moving_reference = options.sdm_moving_reference;
+end
+if isfield(options, 'sdm_pyramid_sigma')
+    force_opts.sdm_pyramid_sigma = options.sdm_pyramid_sigma;
+end
+if isfield(options, 'num_threads')
+    force_opts.num_threads = options.num_threads;
+end
+if isfield(options, 'vectorize')
+    force_opts.vectorize = options.vectorize;
+end
+if isfield(options, 'profile_log')
+    force_opts.profile_log = options.profile_log;
+end
+
+
+function iter_opts = iteration_options(options)
+% options handed to demonsiteration and demons_session
+iter_opts = force_options(options);
+iter_opts.invcon_flag = options.invcon_flag;
+iter_opts.reg_weight = options.reg_weight;
+if isfield(options, 'fw_weight')
+    iter_opts.fw_weight = options.fw_weight;
+end
+if isfield(options, 'exp_recompute_interval')
+    iter_opts.exp_recompute_interval = options.exp_recompute_interval;
+end
@@ -0,0 +1,221 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkDemonsIterationEngine.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkDemonsIterationEngine_h
+#define __itkDemonsIterationEngine_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImage.h"
+#include "itkESMInvConDemonsRegistrationFunction.h"
+#include "itkDemonsUpdateCalculator.h"
+#include "itkJointFieldExponentiator.h"
+#include "itkRegistrationMetricsCalculator.h"
+#include "itkRegistrationProfiler.h"
+
+namespace itk {
+
+/**
+ * \class DemonsIterationEngine
+ *
+ * \brief One iteration of the log-domain inverse consistent demons
+ *
+ * Does, in one go and without leaving ITK images, what make_update in
+ * invconstdemonsreg3d_aux.m does with separate MEX calls: from the
+ * velocity (log) field v it computes the deformations exp(v) and exp(-v)
+ * (jointly, see JointFieldExponentiator),
+ * their Jacobian determinants, the demons update of v, and the statistics
+ * of the current iteration:
+ *
+ *  - MSE / BackMSE: mean squared difference between the fixed image and
+ *    the moving image warped by exp(v) (nearest neighbour, voxels mapped
+ *    outside ignored), and between the moving image and the fixed image
+ *    warped by exp(-v);
+ *  - HarmonicEnergy / BackHarmonicEnergy of exp(v) and exp(-v);
+ *  - NegativeJacobianRatio / BackNegativeJacobianRatio: fraction of voxels
+ *    where the Jacobian determinant of exp(v) / exp(-v) is not positive.
+ *
+ * The statistics are computed in one pass, see
+ * RegistrationMetricsCalculator.
+ *
+ * The update is left in GetUpdateField(), v itself is not modified, so
+ * the caller can add it to a velocity field of any precision.
+ *
+ * With InverseConsistent on (the default) the force is weighted by the
+ * Jacobian determinant of exp(-v). Otherwise it is not, and with
+ * UseFwWeight the Jacobian determinant of exp(v) weights the moving image
+ * term instead, as weightedfwdemonsforces does.
+ *
+ * The other settings of the force (SDM mode, cache, ...) are set on
+ * GetDemonsFunction().
+ *
+ * The filters and the images they produce are kept between calls to
+ * Iterate(): as long as the size does not change, an iteration does not
+ * allocate. The inputs may be updated in place between iterations.
+ *
+ * \sa ESMInvConDemonsRegistrationFunction
+ * \sa DemonsUpdateCalculator
+ */
+template <class TImage, class TDeformationField>
+class ITK_EXPORT DemonsIterationEngine : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef DemonsIterationEngine         Self;
+  typedef Object                        Superclass;
+  typedef SmartPointer<Self>            Pointer;
+  typedef SmartPointer<const Self>      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( DemonsIterationEngine, Object );
+
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TImage::ImageDimension);
+
+  /** Image typedefs. */
+  typedef TImage                                    ImageType;
+  typedef typename ImageType::Pointer               ImagePointer;
+  typedef typename ImageType::PixelType             PixelType;
+  typedef TDeformationField                         DeformationFieldType;
+  typedef typename DeformationFieldType::Pointer    DeformationFieldPointer;
+
+  /** The demons force. */
+  typedef ESMInvConDemonsRegistrationFunction
+    <ImageType,ImageType,DeformationFieldType>      DemonsFunctionType;
+  typedef typename DemonsFunctionType::Pointer      DemonsFunctionPointer;
+
+  /** Filters of the iteration. */
+  typedef JointFieldExponentiator
+    <DeformationFieldType,ImageType>                ExponentiatorType;
+  typedef RegistrationMetricsCalculator
+    <ImageType,DeformationFieldType>                MetricsCalculatorType;
+  typedef DemonsUpdateCalculator
+    <DemonsFunctionType,DeformationFieldType>       UpdateCalculatorType;
+
+  /** Fixed and moving label images. */
+  itkSetConstObjectMacro( FixedImage, ImageType );
+  itkGetConstObjectMacro( FixedImage, ImageType );
+  itkSetConstObjectMacro( MovingImage, ImageType );
+  itkGetConstObjectMacro( MovingImage, ImageType );
+
+  /** Velocity (log) field, laid out as the fixed image. */
+  itkSetConstObjectMacro( VelocityField, DeformationFieldType );
+  itkGetConstObjectMacro( VelocityField, DeformationFieldType );
+
+  /** Weight the force by the Jacobian determinant of exp(-v) (default
+   * on). */
+  itkSetMacro( InverseConsistent, bool );
+  itkGetConstMacro( InverseConsistent, bool );
+  itkBooleanMacro( InverseConsistent );
+
+  /** Without inverse consistency, weight the moving term by the Jacobian
+   * determinant of exp(v) (default off). */
+  itkSetMacro( UseFwWeight, bool );
+  itkGetConstMacro( UseFwWeight, bool );
+  itkBooleanMacro( UseFwWeight );
+
+  /** Regularisation weight of the force (default 100). */
+  itkSetMacro( RegWeight, double );
+  itkGetConstMacro( RegWeight, double );
+
+  /** Threads used by the force, 0 (the default) uses the ITK default. */
+  itkSetMacro( NumberOfThreads, unsigned int );
+  itkGetConstMacro( NumberOfThreads, unsigned int );
+
+  /** Above 1 (or 0), exp(v) and exp(-v) are obtained by composing the
+   * previous ones with the exponential of the last update, with a full
+   * computation every ExpRecomputeInterval iterations (never with 0), see
+   * JointFieldExponentiator. Valid only if v is the previous velocity
+   * field plus GetUpdateField(). Default 1, always a full computation. */
+  itkSetMacro( ExpRecomputeInterval, unsigned int );
+  itkGetConstMacro( ExpRecomputeInterval, unsigned int );
+
+  /** Profiler of the iteration (none by default). It records the phases
+   * exp (with the Jacobian determinants), force_init, force and stats,
+   * the counters voxels, voxels_processed and exp_incremental, and is
+   * handed to the demons function. */
+  itkSetObjectMacro( Profiler, RegistrationProfiler );
+  itkGetObjectMacro( Profiler, RegistrationProfiler );
+
+  /** The demons function, to set up the force. */
+  DemonsFunctionType * GetDemonsFunction()
+    { return m_DemonsFunction; }
+
+  /** Run one iteration. */
+  void Iterate();
+
+  /** Intermediates of the last iteration. */
+  itkGetObjectMacro( DeformationField, DeformationFieldType );
+  itkGetObjectMacro( InverseDeformationField, DeformationFieldType );
+  itkGetObjectMacro( JacobianDeterminant, ImageType );
+  itkGetObjectMacro( InverseJacobianDeterminant, ImageType );
+  itkGetObjectMacro( UpdateField, DeformationFieldType );
+
+  /** Statistics of the last iteration. */
+  itkGetConstMacro( MSE, double );
+  itkGetConstMacro( BackMSE, double );
+  itkGetConstMacro( HarmonicEnergy, double );
+  itkGetConstMacro( BackHarmonicEnergy, double );
+  itkGetConstMacro( NegativeJacobianRatio, double );
+  itkGetConstMacro( BackNegativeJacobianRatio, double );
+
+protected:
+  DemonsIterationEngine();
+  ~DemonsIterationEngine() {}
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+private:
+  DemonsIterationEngine(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  typename ImageType::ConstPointer             m_FixedImage;
+  typename ImageType::ConstPointer             m_MovingImage;
+  typename DeformationFieldType::ConstPointer  m_VelocityField;
+
+  bool                          m_InverseConsistent;
+  bool                          m_UseFwWeight;
+  double                        m_RegWeight;
+  unsigned int                  m_NumberOfThreads;
+  unsigned int                  m_ExpRecomputeInterval;
+
+  DemonsFunctionPointer         m_DemonsFunction;
+  RegistrationProfiler::Pointer m_Profiler;
+
+  typename ExponentiatorType::Pointer              m_Exponentiator;
+  typename MetricsCalculatorType::Pointer          m_MetricsCalculator;
+  typename UpdateCalculatorType::Pointer           m_UpdateCalculator;
+
+  DeformationFieldPointer       m_DeformationField;
+  DeformationFieldPointer       m_InverseDeformationField;
+  ImagePointer                  m_JacobianDeterminant;
+  ImagePointer                  m_InverseJacobianDeterminant;
+  ImagePointer                  m_ZeroImage;
+  DeformationFieldPointer       m_UpdateField;
+
+  double                        m_MSE;
+  double                        m_BackMSE;
+  double                        m_HarmonicEnergy;
+  double                        m_BackHarmonicEnergy;
+  double                        m_NegativeJacobianRatio;
+  double                        m_BackNegativeJacobianRatio;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkDemonsIterationEngine.txx"
+#endif
+
+#endif
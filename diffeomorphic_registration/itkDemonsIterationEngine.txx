@@ -0,0 +1,193 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkDemonsIterationEngine.txx
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkDemonsIterationEngine_txx
+#define __itkDemonsIterationEngine_txx
+
+#include "itkDemonsIterationEngine.h"
+
+namespace itk {
+
+/**
+ * Default constructor
+ */
+template <class TImage, class TDeformationField>
+DemonsIterationEngine<TImage,TDeformationField>
+::DemonsIterationEngine()
+{
+  m_InverseConsistent = true;
+  m_UseFwWeight = false;
+  m_RegWeight = 100.0;
+  m_NumberOfThreads = 0;
+  m_ExpRecomputeInterval = 1;
+
+  m_DemonsFunction = DemonsFunctionType::New();
+  m_DemonsFunction->SetUseGradientType( DemonsFunctionType::Symmetric );
+
+  m_Exponentiator = ExponentiatorType::New();
+  m_Exponentiator->ComputeJacobianDeterminantOn();
+
+  m_MetricsCalculator = MetricsCalculatorType::New();
+  m_UpdateCalculator = UpdateCalculatorType::New();
+
+  m_MSE = 0.0;
+  m_BackMSE = 0.0;
+  m_HarmonicEnergy = 0.0;
+  m_BackHarmonicEnergy = 0.0;
+  m_NegativeJacobianRatio = 0.0;
+  m_BackNegativeJacobianRatio = 0.0;
+}
+
+
+template <class TImage, class TDeformationField>
+void
+DemonsIterationEngine<TImage,TDeformationField>
+::Iterate()
+{
+  if( !m_FixedImage || !m_MovingImage || !m_VelocityField )
+    {
+    itkExceptionMacro( << "FixedImage, MovingImage and VelocityField must be set." );
+    }
+
+  // the velocity field may have been updated in place since the last call
+  m_VelocityField->Modified();
+
+  // deformations and their Jacobian determinants
+  {
+  RegistrationProfiler::ScopedTimer timer( m_Profiler, "exp" );
+
+  // the update of the previous iteration, if any, for the incremental mode
+  m_Exponentiator->SetVelocityField( m_VelocityField );
+  m_Exponentiator->SetUpdateField( m_UpdateField );
+  m_Exponentiator->SetRecomputeInterval( m_ExpRecomputeInterval );
+  m_Exponentiator->SetNumberOfThreads( m_NumberOfThreads );
+  m_Exponentiator->Compute();
+  if( m_Profiler && m_Exponentiator->GetIncremental() )
+    {
+    m_Profiler->AddCount( "exp_incremental" );
+    }
+  m_DeformationField = m_Exponentiator->GetDeformationField();
+  m_InverseDeformationField = m_Exponentiator->GetInverseDeformationField();
+  m_JacobianDeterminant = m_Exponentiator->GetJacobianDeterminant();
+  m_InverseJacobianDeterminant = m_Exponentiator->GetInverseJacobianDeterminant();
+  }
+
+  // force, the Jacobian weight is 0 without inverse consistency
+  {
+  RegistrationProfiler::ScopedTimer timer( m_Profiler, "force_init" );
+
+  const ImageType * jacobianWeight = m_InverseJacobianDeterminant;
+  if( !m_InverseConsistent )
+    {
+    if( !m_ZeroImage
+        || m_ZeroImage->GetLargestPossibleRegion() != m_FixedImage->GetLargestPossibleRegion() )
+      {
+      m_ZeroImage = ImageType::New();
+      m_ZeroImage->CopyInformation( m_FixedImage );
+      m_ZeroImage->SetRegions( m_FixedImage->GetLargestPossibleRegion() );
+      m_ZeroImage->Allocate();
+      m_ZeroImage->FillBuffer( NumericTraits<PixelType>::Zero );
+      }
+    jacobianWeight = m_ZeroImage;
+    }
+
+  m_DemonsFunction->SetDeformationField( m_DeformationField );
+  m_DemonsFunction->SetInvDeformationField( m_InverseDeformationField );
+  m_DemonsFunction->SetFixedImage( m_FixedImage );
+  m_DemonsFunction->SetMovingImage( m_MovingImage );
+  m_DemonsFunction->SetRegWeight( m_RegWeight );
+  m_DemonsFunction->SetUseJacobian( true );
+  m_DemonsFunction->SetJacobianDetImage( jacobianWeight );
+  if( !m_InverseConsistent && m_UseFwWeight )
+    {
+    m_DemonsFunction->SetUseFwWeight( true );
+    m_DemonsFunction->SetFwWeightImage( m_JacobianDeterminant );
+    }
+  else
+    {
+    m_DemonsFunction->SetUseFwWeight( false );
+    m_DemonsFunction->SetFwWeightImage( NULL );
+    }
+  m_DemonsFunction->SetProfiler( m_Profiler );
+  m_DemonsFunction->InitializeIteration();
+  }
+
+  {
+  RegistrationProfiler::ScopedTimer timer( m_Profiler, "force" );
+
+  if( !m_UpdateField
+      || m_UpdateField->GetBufferedRegion() != m_DeformationField->GetLargestPossibleRegion() )
+    {
+    m_UpdateField = DeformationFieldType::New();
+    m_UpdateField->CopyInformation( m_DeformationField );
+    m_UpdateField->SetRegions( m_DeformationField->GetLargestPossibleRegion() );
+    m_UpdateField->Allocate();
+    }
+
+  m_UpdateCalculator->SetDemonsFunction( m_DemonsFunction );
+  m_UpdateCalculator->SetDeformationField( m_DeformationField );
+  m_UpdateCalculator->SetUpdateField( m_UpdateField );
+  m_UpdateCalculator->SetNumberOfThreads( m_NumberOfThreads );
+  m_UpdateCalculator->Compute();
+  }
+
+  if( m_Profiler )
+    {
+    m_Profiler->AddCount( "voxels", m_UpdateField->GetBufferedRegion().GetNumberOfPixels() );
+    m_Profiler->AddCount( "voxels_processed", m_DemonsFunction->GetNumberOfPixelsProcessed() );
+    }
+
+  // statistics
+  RegistrationProfiler::ScopedTimer timer( m_Profiler, "stats" );
+
+  m_MetricsCalculator->SetFixedImage( m_FixedImage );
+  m_MetricsCalculator->SetMovingImage( m_MovingImage );
+  m_MetricsCalculator->SetDeformationField( m_DeformationField );
+  m_MetricsCalculator->SetInverseDeformationField( m_InverseDeformationField );
+  m_MetricsCalculator->SetNumberOfThreads( m_NumberOfThreads );
+  m_MetricsCalculator->Compute();
+
+  m_MSE = m_MetricsCalculator->GetMSE();
+  m_HarmonicEnergy = m_MetricsCalculator->GetHarmonicEnergy();
+  m_NegativeJacobianRatio = m_MetricsCalculator->GetNegativeJacobianRatio();
+  m_BackMSE = m_MetricsCalculator->GetBackMSE();
+  m_BackHarmonicEnergy = m_MetricsCalculator->GetBackHarmonicEnergy();
+  m_BackNegativeJacobianRatio = m_MetricsCalculator->GetBackNegativeJacobianRatio();
+}
+
+
+/*
+ * Standard "PrintSelf" method.
+ */
+template <class TImage, class TDeformationField>
+void
+DemonsIterationEngine<TImage,TDeformationField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "InverseConsistent: " << m_InverseConsistent << std::endl;
+  os << indent << "UseFwWeight: " << m_UseFwWeight << std::endl;
+  os << indent << "RegWeight: " << m_RegWeight << std::endl;
+  os << indent << "NumberOfThreads: " << m_NumberOfThreads << std::endl;
+  os << indent << "ExpRecomputeInterval: " << m_ExpRecomputeInterval << std::endl;
+  os << indent << "MSE: " << m_MSE << std::endl;
+  os << indent << "BackMSE: " << m_BackMSE << std::endl;
+  os << indent << "HarmonicEnergy: " << m_HarmonicEnergy << std::endl;
+  os << indent << "BackHarmonicEnergy: " << m_BackHarmonicEnergy << std::endl;
+  os << indent << "NegativeJacobianRatio: " << m_NegativeJacobianRatio << std::endl;
+  os << indent << "BackNegativeJacobianRatio: " << m_BackNegativeJacobianRatio << std::endl;
+}
+
+} // end namespace itk
+
+#endif
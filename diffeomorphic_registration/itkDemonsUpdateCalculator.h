@@ -0,0 +1,125 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkDemonsUpdateCalculator.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkDemonsUpdateCalculator_h
+#define __itkDemonsUpdateCalculator_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkMultiThreader.h"
+
+#include <vector>
+
+namespace itk {
+
+/**
+ * \class DemonsUpdateCalculator
+ *
+ * \brief Evaluate a demons function over a whole field, on several threads
+ *
+ * This is the part of DenseFiniteDifferenceImageFilter the MEX force
+ * functions need: the function is evaluated at every voxel of the
+ * deformation field (split into interior and boundary faces) and the
+ * result written to the update field.
+ *
+ * The region is cut into a fixed number of slabs along its last
+ * non-trivial axis (NumberOfChunks, or fewer for thin regions), which the
+ * threads share out. Each slab gets its own global data (SSD, pixel count,
+ * squared change) from the function. These are handed back to the function
+ * in slab order once all threads are done. Since neither the slabs nor the
+ * order of the reduction depend on the number of threads, neither does
+ * the metric, and neither does the update field.
+ *
+ * The function is evaluated one row along the first axis at a time,
+ * through its ComputeUpdateRow() method, which is equivalent to calling
+ * ComputeUpdate() at each pixel of the row.
+ *
+ * InitializeIteration() must have been called on the function.
+ *
+ * \sa ESMInvConDemonsRegistrationFunction
+ */
+template <class TDemonsFunction, class TDeformationField>
+class ITK_EXPORT DemonsUpdateCalculator : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef DemonsUpdateCalculator        Self;
+  typedef Object                        Superclass;
+  typedef SmartPointer<Self>            Pointer;
+  typedef SmartPointer<const Self>      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( DemonsUpdateCalculator, Object );
+
+  typedef TDemonsFunction                           FunctionType;
+  typedef TDeformationField                         DeformationFieldType;
+  typedef typename DeformationFieldType::RegionType RegionType;
+
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TDeformationField::ImageDimension);
+
+  /** The demons function, the field it reads and the field written. */
+  itkSetObjectMacro( DemonsFunction, FunctionType );
+  itkSetObjectMacro( DeformationField, DeformationFieldType );
+  itkSetObjectMacro( UpdateField, DeformationFieldType );
+
+  /** Number of threads, 0 (the default) uses the global ITK default. */
+  itkSetMacro( NumberOfThreads, unsigned int );
+  itkGetConstMacro( NumberOfThreads, unsigned int );
+
+  /** Fill the update field over the buffered region of the field. */
+  void Compute();
+
+protected:
+  DemonsUpdateCalculator();
+  ~DemonsUpdateCalculator() {}
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Number of slabs the region is cut into, whatever the number of
+   * threads. */
+  itkStaticConstMacro(NumberOfChunks, unsigned int, 64);
+
+  /** Slab i of the region cut into n. Returns the number of slabs
+   * actually used. */
+  unsigned int SplitRegion( unsigned int i, unsigned int n,
+                            RegionType & slab ) const;
+
+  /** Evaluate the function over one slab. */
+  void ThreadedCompute( const RegionType & slab, void * globalData );
+
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void * arg );
+
+private:
+  DemonsUpdateCalculator(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  typename FunctionType::Pointer          m_DemonsFunction;
+  typename DeformationFieldType::Pointer  m_DeformationField;
+  typename DeformationFieldType::Pointer  m_UpdateField;
+
+  unsigned int                            m_NumberOfThreads;
+  RegionType                              m_Region;
+  unsigned int                            m_NumberOfSlabs;
+  unsigned int                            m_NumberOfThreadsUsed;
+  std::vector<void *>                     m_GlobalData;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkDemonsUpdateCalculator.txx"
+#endif
+
+#endif
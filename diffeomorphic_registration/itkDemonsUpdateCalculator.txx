@@ -0,0 +1,224 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkDemonsUpdateCalculator.txx
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkDemonsUpdateCalculator_txx
+#define __itkDemonsUpdateCalculator_txx
+
+#include "itkDemonsUpdateCalculator.h"
+#include "itkNeighborhoodAlgorithm.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+
+#include <algorithm>
+
+namespace itk {
+
+/**
+ * Default constructor
+ */
+template <class TDemonsFunction, class TDeformationField>
+DemonsUpdateCalculator<TDemonsFunction,TDeformationField>
+::DemonsUpdateCalculator()
+{
+  m_NumberOfThreads = 0;
+  m_NumberOfSlabs = 1;
+  m_NumberOfThreadsUsed = 1;
+}
+
+
+/**
+ * Split the region into slabs along its last non-trivial axis, the same
+ * way ImageSource::SplitRequestedRegion does
+ */
+template <class TDemonsFunction, class TDeformationField>
+unsigned int
+DemonsUpdateCalculator<TDemonsFunction,TDeformationField>
+::SplitRegion( unsigned int i, unsigned int n, RegionType & slab ) const
+{
+  slab = m_Region;
+  typename RegionType::IndexType index = m_Region.GetIndex();
+  typename RegionType::SizeType size = m_Region.GetSize();
+
+  int splitAxis = ImageDimension - 1;
+  while( size[splitAxis] == 1 )
+    {
+    --splitAxis;
+    if( splitAxis < 0 )
+      {
+      // cannot split
+      return 1;
+      }
+    }
+
+  const unsigned long range = size[splitAxis];
+  const unsigned long valuesPerThread = ( range + n - 1 ) / n;
+  const unsigned int maxThreadIdUsed = ( range + valuesPerThread - 1 ) / valuesPerThread - 1;
+
+  if( i < maxThreadIdUsed )
+    {
+    index[splitAxis] += i * valuesPerThread;
+    size[splitAxis] = valuesPerThread;
+    }
+  if( i == maxThreadIdUsed )
+    {
+    index[splitAxis] += i * valuesPerThread;
+    size[splitAxis] = size[splitAxis] - i * valuesPerThread;
+    }
+
+  slab.SetIndex( index );
+  slab.SetSize( size );
+  return maxThreadIdUsed + 1;
+}
+
+
+template <class TDemonsFunction, class TDeformationField>
+void
+DemonsUpdateCalculator<TDemonsFunction,TDeformationField>
+::Compute()
+{
+  if( !m_DemonsFunction || !m_DeformationField || !m_UpdateField )
+    {
+    itkExceptionMacro( << "DemonsFunction, DeformationField and UpdateField must be set." );
+    }
+
+  m_Region = m_DeformationField->GetBufferedRegion();
+
+  unsigned int numberOfThreads = m_NumberOfThreads;
+  if( numberOfThreads == 0 )
+    {
+    numberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>(
+    MultiThreader::GetGlobalMaximumNumberOfThreads() ) );
+
+  // one accumulator per slab, reduced in slab order below
+  RegionType slab;
+  m_NumberOfSlabs = this->SplitRegion( 0, NumberOfChunks, slab );
+  m_NumberOfThreadsUsed = std::min( numberOfThreads, m_NumberOfSlabs );
+  m_GlobalData.resize( m_NumberOfSlabs );
+  for( unsigned int i = 0; i < m_NumberOfSlabs; i++ )
+    {
+    m_GlobalData[i] = m_DemonsFunction->GetGlobalDataPointer();
+    }
+
+  if( m_NumberOfThreadsUsed <= 1 )
+    {
+    for( unsigned int i = 0; i < m_NumberOfSlabs; i++ )
+      {
+      this->SplitRegion( i, NumberOfChunks, slab );
+      this->ThreadedCompute( slab, m_GlobalData[i] );
+      }
+    }
+  else
+    {
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads( m_NumberOfThreadsUsed );
+    m_NumberOfThreadsUsed = threader->GetNumberOfThreads();
+    threader->SetSingleMethod( Self::ThreaderCallback, this );
+    threader->SingleMethodExecute();
+    }
+
+  for( unsigned int i = 0; i < m_NumberOfSlabs; i++ )
+    {
+    m_DemonsFunction->ReleaseGlobalDataPointer( m_GlobalData[i] );
+    }
+  m_GlobalData.clear();
+}
+
+
+template <class TDemonsFunction, class TDeformationField>
+ITK_THREAD_RETURN_TYPE
+DemonsUpdateCalculator<TDemonsFunction,TDeformationField>
+::ThreaderCallback( void * arg )
+{
+  MultiThreader::ThreadInfoStruct * info =
+    static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  Self * self = static_cast<Self *>( info->UserData );
+
+  // every thread takes every m_NumberOfThreadsUsed-th slab
+  RegionType slab;
+  for( unsigned int i = info->ThreadID; i < self->m_NumberOfSlabs;
+       i += self->m_NumberOfThreadsUsed )
+    {
+    self->SplitRegion( i, NumberOfChunks, slab );
+    self->ThreadedCompute( slab, self->m_GlobalData[i] );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+
+/**
+ * Interior region first, then the boundary faces, as in
+ * DenseFiniteDifferenceImageFilter::CalculateChange. Each face is handed
+ * to the function one row (along the first axis) at a time.
+ */
+template <class TDemonsFunction, class TDeformationField>
+void
+DemonsUpdateCalculator<TDemonsFunction,TDeformationField>
+::ThreadedCompute( const RegionType & slab, void * globalData )
+{
+  typedef NeighborhoodAlgorithm::ImageBoundaryFacesCalculator
+    <DeformationFieldType>                               FaceCalculatorType;
+  typedef typename FaceCalculatorType::FaceListType      FaceListType;
+  typedef ImageRegionConstIteratorWithIndex<DeformationFieldType> RowIteratorType;
+  typedef typename DeformationFieldType::PixelType       PixelType;
+
+  const typename FunctionType::RadiusType radius = m_DemonsFunction->GetRadius();
+
+  FaceCalculatorType faceCalculator;
+  FaceListType faceList = faceCalculator( m_DeformationField, slab, radius );
+
+  PixelType * updateBuffer = m_UpdateField->GetBufferPointer();
+
+  for( typename FaceListType::iterator fIt = faceList.begin();
+       fIt != faceList.end(); ++fIt )
+    {
+    const unsigned long rowLength = fIt->GetSize()[0];
+    if( fIt->GetNumberOfPixels() == 0 )
+      {
+      continue;
+      }
+
+    // one iteration per row start
+    RegionType rowStarts = *fIt;
+    typename RegionType::SizeType rowStartsSize = rowStarts.GetSize();
+    rowStartsSize[0] = 1;
+    rowStarts.SetSize( rowStartsSize );
+
+    RowIteratorType rIt( m_DeformationField, rowStarts );
+    for( rIt.GoToBegin(); !rIt.IsAtEnd(); ++rIt )
+      {
+      const typename RegionType::IndexType index = rIt.GetIndex();
+      m_DemonsFunction->ComputeUpdateRow( index, rowLength,
+        updateBuffer + m_UpdateField->ComputeOffset( index ), globalData );
+      }
+    }
+}
+
+
+/*
+ * Standard "PrintSelf" method.
+ */
+template <class TDemonsFunction, class TDeformationField>
+void
+DemonsUpdateCalculator<TDemonsFunction,TDeformationField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "NumberOfThreads: ";
+  os << m_NumberOfThreads << std::endl;
+}
+
+} // end namespace itk
+
+#endif
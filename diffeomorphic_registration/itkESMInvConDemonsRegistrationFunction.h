@@ -26,9 +26,13 @@
 #include "itkCentralDifferenceImageFunction.h"
 #include "itkWarpImageFilter.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
-#include "itkSignedMaurerDistanceMapImageFilter.h"
+#include "itkMultiLabelDistanceMapImageFilter.h"
 #include "itkCastImageFilter.h"
 #include "itkImageDuplicator.h"
+#include "itkSignedDistanceMapCache.h"
+#include "itkRegistrationPyramid.h"
+#include "itkESMInvConDemonsRowKernel.h"
+#include "itkRegistrationProfiler.h"
 
 namespace itk {
 
@@ -140,6 +144,21 @@ public:
       MovingImageGradientCalculatorType;
   typedef typename MovingImageGradientCalculatorType::Pointer
       MovingImageGradientCalculatorPointer;
+
+  /** Warper and interpolator of the SDM images (WarpSDM mode). */
+  typedef LinearInterpolateImageFunction<
+    FixedImageType,CoordRepType>                    SDMInterpolatorType;
+  typedef WarpImageFilter<
+    FixedImageType,
+    FixedImageType,DeformationFieldType>            SDMWarperType;
+  typedef typename SDMWarperType::Pointer           SDMWarperPointer;
+
+  /** Cache type for the SDMs of the unwarped label images. */
+  typedef SignedDistanceMapCache<FixedImageType>    SDMCacheType;
+  typedef typename SDMCacheType::Pointer            SDMCachePointer;
+
+  /** Pyramid bringing full-resolution SDMs down to a level. */
+  typedef RegistrationPyramid<FixedImageType>       SDMPyramidType;
   
     /** Set the deformation field image. */
   void SetInvDeformationField(  DeformationFieldTypePointer ptr )
@@ -198,6 +217,22 @@ public:
    const FixedImageType * GetorignalMovingSDMImage(void) const{
       return m_sdm_orignalmovingImage;
   }
+
+  /** Set/Get the cache consulted for the SDMs of the unwarped fixed and
+   * moving images. When set, those maps are only computed the first
+   * time a given label image is seen. */
+  void SetSDMCache( SDMCacheType * cache )
+    { m_SDMCache = cache; }
+  SDMCacheType * GetSDMCache(void)
+    { return m_SDMCache; }
+
+  /** Set/Get the profiler recording the phases of InitializeIteration
+   * (label_warp, sdm_unwarped, sdm_warped or sdm_resample) and the SDM
+   * counters (sdm_passes, sdm_labels, sdm_cache_hits). None by default. */
+  void SetProfiler( RegistrationProfiler * profiler )
+    { m_Profiler = profiler; }
+  RegistrationProfiler * GetProfiler(void)
+    { return m_Profiler; }
    
     /* Set/Get orignalFixedImage  */
   //void SetorignalFixedImage( const FixedImageType * ptr){
@@ -251,6 +286,12 @@ public:
   void SignedDistanceMap_movingImage();
   void SignedDistanceMap_orignalfixedImage();
   void SignedDistanceMap_orignalmovingImage();
+  void WarpSignedDistanceMaps();
+
+  /** Normalised per-label distance map of a label image, all labels
+   * computed at once by a MultiLabelDistanceMapImageFilter. */
+  template <class TLabelImage>
+  FixedImagePointer ComputeSignedDistanceMap( const TLabelImage * labels ) const;
 
   /** Set the object's state before each iteration. */
   virtual void InitializeIteration();
@@ -261,6 +302,13 @@ public:
                                    void *globalData,
                                    const FloatOffsetType &offset = FloatOffsetType(0.0));
 
+  /** Compute the updates of length consecutive pixels along the first
+   * axis, starting at index, as ComputeUpdate would one at a time. The
+   * row is evaluated several pixels at a time with SIMD instructions when
+   * the images are 3D float and UseVectorizedUpdate is on. */
+  void ComputeUpdateRow( const IndexType & index, unsigned long length,
+                         PixelType * update, void *globalData );
+
   /** Get the metric value. The metric value is the mean square difference 
    * in intensity between the fixed image and transforming moving image 
    * computed over the the overlapping region between the two images. */
@@ -271,6 +319,10 @@ public:
   virtual const double &GetRMSChange() const
     { return m_RMSChange; }
 
+  /** Get the number of pixels the metric was computed over. */
+  unsigned long GetNumberOfPixelsProcessed() const
+    { return m_NumberOfPixelsProcessed; }
+
   /** Set/Get the threshold below which the absolute difference of
    * intensity yields a match. When the intensities match between a
    * moving and fixed image pixel, the update vector (for that
@@ -298,6 +350,81 @@ public:
      MappedMoving
   };
   
+  /** How the SDMs of the warped label images are obtained.
+   * RecomputeSDM warps the label images and computes their SDMs at every
+   * iteration. WarpSDM computes the SDMs of the unwarped label images once
+   * and resamples them through the current deformation with linear
+   * interpolation. The per-label channels of a label SDM have disjoint
+   * supports and are zero outside their label, so resampling the combined
+   * map is the same as resampling every channel and adding them up. */
+  enum SDMModeType {
+     RecomputeSDM=0,
+     WarpSDM
+  };
+
+  void SetSDMMode(SDMModeType mode)
+  {
+    m_SDMMode = mode;
+  }
+
+  SDMModeType GetSDMMode() const {
+
+      return m_SDMMode;
+  }
+
+  /** Band width (in voxels) of the label SDMs, 0 computes them on the
+   * whole image. Beyond the band the distances are clamped, within it the
+   * SDMs (and the force) are those of the whole image, see
+   * MultiLabelDistanceMapImageFilter. */
+  void SetSDMBandWidth(double width)
+  {
+    m_SDMBandWidth = width;
+  }
+
+  double GetSDMBandWidth() const {
+
+      return m_SDMBandWidth;
+  }
+
+  /** Margin kept around the bounding box of the labels by the SDMs. */
+  void SetSDMFrameWidth(unsigned int width)
+  {
+    m_SDMFrameWidth = width;
+  }
+
+  unsigned int GetSDMFrameWidth() const {
+
+      return m_SDMFrameWidth;
+  }
+
+  /** Full-resolution label images the fixed and moving images of this
+   * pyramid level were decimated from, none by default. When both are
+   * set, the SDMs of the unwarped label images are computed on them and
+   * brought down to the level by SDMPyramidType in SmoothMode (a Gaussian
+   * of SDMPyramidSigma voxels before each decimation) instead of being
+   * computed on the decimated label images. Only the WarpSDM mode takes
+   * all its SDMs from the unwarped ones, so the others reject them. */
+  void SetFixedSDMReferenceImage( const FixedImageType * ptr )
+    { m_FixedSDMReferenceImage = ptr; }
+  const FixedImageType * GetFixedSDMReferenceImage(void) const
+    { return m_FixedSDMReferenceImage; }
+  void SetMovingSDMReferenceImage( const MovingImageType * ptr )
+    { m_MovingSDMReferenceImage = ptr; }
+  const MovingImageType * GetMovingSDMReferenceImage(void) const
+    { return m_MovingSDMReferenceImage; }
+
+  /** Standard deviation, in voxels of the finer level, of the Gaussian
+   * smoothing the SDMs of the reference images (default 1). */
+  void SetSDMPyramidSigma(double sigma)
+  {
+    m_SDMPyramidSigma = sigma;
+  }
+
+  double GetSDMPyramidSigma() const {
+
+      return m_SDMPyramidSigma;
+  }
+
   void SetUseJacobian(bool flag)
 {
     m_UseJacobian = flag;
@@ -328,6 +455,32 @@ public:
       return m_RegWeight;
   }
 
+  /** Use the SIMD row kernel in ComputeUpdateRow (default on). The
+   * results are the same either way. */
+  void SetUseVectorizedUpdate(bool flag)
+  {
+    m_UseVectorizedUpdate = flag;
+  }
+
+  bool GetUseVectorizedUpdate() const {
+
+      return m_UseVectorizedUpdate;
+  }
+
+  /** Instruction set of the SIMD row kernel, by default the best one the
+   * CPU has. A set the CPU does not have is lowered to the best it has. */
+  void SetRowKernelInstructionSet(ESMInvConDemonsDetail::RowKernelInstructionSet instructionSet)
+  {
+    const ESMInvConDemonsDetail::RowKernelInstructionSet best =
+      ESMInvConDemonsDetail::GetRowKernelInstructionSet();
+    m_RowKernelInstructionSet = ( instructionSet < best ) ? instructionSet : best;
+  }
+
+  ESMInvConDemonsDetail::RowKernelInstructionSet GetRowKernelInstructionSet() const {
+
+      return m_RowKernelInstructionSet;
+  }
+
   /** Set/Get the type of used image forces */
   virtual void SetUseGradientType( GradientType gtype )
     { m_UseGradientType = gtype; }
@@ -386,6 +539,36 @@ private:
   /** Filter to warp moving image for fast gradient computation. */
   WarperPointer                   m_FixedImageWarper;
 
+  /** Filters to warp the unwarped label SDMs (WarpSDM mode). */
+  SDMWarperPointer                m_MovingSDMWarper;
+  SDMWarperPointer                m_FixedSDMWarper;
+  SDMModeType                     m_SDMMode;
+  double                          m_SDMBandWidth;
+  unsigned int                    m_SDMFrameWidth;
+  double                          m_SDMPyramidSigma;
+  FixedImagePointer               m_FixedSDMReferenceImage;
+  MovingImagePointer              m_MovingSDMReferenceImage;
+
+  /** SDM of the level computed from a reference image, kept while the
+   * reference and the settings it was computed with do not change. */
+  struct SDMPyramidLevelType
+    {
+    const void *                  m_Reference;
+    TimeStamp                     m_ComputeTime;
+    std::vector<double>           m_Parameters;
+    FixedImagePointer             m_SDM;
+    };
+  SDMPyramidLevelType             m_FixedSDMPyramidLevel;
+  SDMPyramidLevelType             m_MovingSDMPyramidLevel;
+
+  /** SDM of the unwarped labels of the level from their reference, see
+   * SetFixedSDMReferenceImage. The full-resolution SDM and the level
+   * are looked up in and stored into the SDM cache. */
+  template <class TLabelImage>
+  FixedImagePointer ComputeSDMPyramidLevel( const TLabelImage * reference,
+                                            const TLabelImage * labels,
+                                            SDMPyramidLevelType & level );
+
   /** The global timestep. */
   TimeStepType                    m_TimeStep;
 
@@ -403,6 +586,8 @@ private:
   
   bool                          m_UseJacobian;
   bool                          m_UseFwWeight;
+  bool                          m_UseVectorizedUpdate;
+  ESMInvConDemonsDetail::RowKernelInstructionSet m_RowKernelInstructionSet;
     
   FixedImagePointer         m_JacobianDetImage;
   FixedImagePointer         m_FwWeightImage;
@@ -410,6 +595,27 @@ private:
   FixedImagePointer         m_sdm_fixedImage;
   FixedImagePointer         m_sdm_orignalmovingImage;
   FixedImagePointer         m_sdm_orignalfixedImage;
+  SDMCachePointer           m_SDMCache;
+  RegistrationProfiler::Pointer m_Profiler;
+
+  /** Update at the given position in, and offset into, the buffers. */
+  PixelType ComputeUpdateAt( const long position[], long offset,
+                             GlobalDataStruct * globalData ) const;
+
+  /** Buffer of an image laid out as the fixed image region. */
+  const FixedPixelType * GetRegionBuffer( const FixedImageType * image ) const;
+
+  /** Raw buffers read by ComputeUpdate, with the start, size and strides
+   * of the fixed image region they all share (set in InitializeIteration). */
+  const FixedPixelType *    m_FixedSDMBuffer;
+  const FixedPixelType *    m_MovingSDMBuffer;
+  const FixedPixelType *    m_OrignalFixedSDMBuffer;
+  const FixedPixelType *    m_OrignalMovingSDMBuffer;
+  const FixedPixelType *    m_JacobianDetBuffer;
+  const FixedPixelType *    m_FwWeightBuffer;
+  long                      m_BufferStart[ImageDimension];
+  long                      m_BufferSize[ImageDimension];
+  long                      m_BufferStride[ImageDimension];
   //FixedImagePointer         m_orignalmovingImage;
   //FixedImagePointer         m_orignalfixedImage;
   /** The metric value is the mean square difference in intensity between
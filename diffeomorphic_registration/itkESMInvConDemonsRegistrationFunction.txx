@@ -28,12 +28,245 @@
 #include "vnl/algo/vnl_determinant.h"
 
 #include "itkWarpImageFilter.h"
-#include "itkSignedMaurerDistanceMapImageFilter.h"
 #include "itkCastImageFilter.h"
 #include "itkImageDuplicator.h"
-#include "itkImageFileWriter.h"
+
+#include <algorithm>
 
 namespace itk {
+
+namespace ESMInvConDemonsDetail {
+
+/** Derivative of an SDM along one axis, as the former GetPixel based code
+ * took it: central difference, one-sided at the region border or next to
+ * a voxel holding the NumericTraits::max() "outside" value. */
+template <class TPixel, class TBufferPixel>
+inline double SDMDerivative( const TBufferPixel * center, double centerValue,
+                             long position, long size, long stride, double spacing )
+{
+    const TPixel outside = NumericTraits<TPixel>::max();
+    double derivative;
+    if( size < 2 )
+    {
+        return 0.0;
+    }
+    if( position == 0 )
+    {
+        const TPixel next = center[stride];
+        if( next == outside )
+        {
+            // weird crunched border case
+            return 0.0;
+        }
+        // forward difference
+        derivative = static_cast<double>( next ) - centerValue;
+        derivative /= spacing;
+        return derivative;
+    }
+    if( position == size - 1 )
+    {
+        const TPixel previous = center[-stride];
+        if( previous == outside )
+        {
+            // weird crunched border case
+            return 0.0;
+        }
+        // backward difference
+        derivative = centerValue - static_cast<double>( previous );
+        derivative /= spacing;
+        return derivative;
+    }
+
+    const TPixel next = center[stride];
+    const TPixel previous = center[-stride];
+    if( next == outside )
+    {
+        if( previous == outside )
+        {
+            // weird crunched border case
+            return 0.0;
+        }
+        // backward difference
+        derivative = centerValue;
+        derivative -= static_cast<double>( previous );
+        derivative /= spacing;
+        return derivative;
+    }
+    derivative = static_cast<double>( next );
+    if( previous == outside )
+    {
+        // forward difference
+        derivative -= centerValue;
+        derivative /= spacing;
+        return derivative;
+    }
+    // normal case, central difference
+    derivative -= static_cast<double>( previous );
+    derivative *= 0.5 / spacing;
+    return derivative;
+}
+
+/** Inverse of a small matrix. The 2x2 and 3x3 cases are closed form and
+ * use the operation order of vnl_inverse (and vnl_det), so that they give
+ * the same bits as the vnl_matrix code they replace, without allocating.
+ * A singular matrix gives a zero inverse, as in vnl_inverse. */
+template <unsigned int VDimension>
+struct SmallMatrixInverse
+{
+    static void Compute( const double m[VDimension][VDimension],
+                         double inv[VDimension][VDimension] )
+    {
+        vnl_matrix<double> mat( VDimension, VDimension );
+        for( unsigned int i = 0; i < VDimension; i++ )
+        {
+            for( unsigned int j = 0; j < VDimension; j++ )
+            {
+                mat(i,j) = m[i][j];
+            }
+        }
+        const vnl_matrix<double> matInv = vnl_inverse( mat );
+        for( unsigned int i = 0; i < VDimension; i++ )
+        {
+            for( unsigned int j = 0; j < VDimension; j++ )
+            {
+                inv[i][j] = matInv(i,j);
+            }
+        }
+    }
+};
+
+template <>
+struct SmallMatrixInverse<2>
+{
+    static void Compute( const double m[2][2], double inv[2][2] )
+    {
+        double det = m[0][0]*m[1][1] - m[0][1]*m[1][0];
+        if( det == 0 )
+        {
+            inv[0][0] = inv[0][1] = inv[1][0] = inv[1][1] = 0.0;
+            return;
+        }
+        det = 1.0 / det;
+        inv[0][0] = m[1][1]*det;
+        inv[0][1] = - m[0][1]*det;
+        inv[1][1] = m[0][0]*det;
+        inv[1][0] = - m[1][0]*det;
+    }
+};
+
+/** The Hessian is symmetric (bit for bit, the products commute), so only
+ * the upper triangle of the adjugate is evaluated. */
+template <>
+struct SmallMatrixInverse<3>
+{
+    static void Compute( const double m[3][3], double inv[3][3] )
+    {
+        double det =
+            + m[0][0]*m[1][1]*m[2][2]
+            - m[0][0]*m[2][1]*m[1][2]
+            - m[1][0]*m[0][1]*m[2][2]
+            + m[1][0]*m[2][1]*m[0][2]
+            + m[2][0]*m[0][1]*m[1][2]
+            - m[2][0]*m[1][1]*m[0][2];
+        if( det == 0 )
+        {
+            for( unsigned int i = 0; i < 3; i++ )
+            {
+                inv[i][0] = inv[i][1] = inv[i][2] = 0.0;
+            }
+            return;
+        }
+        det = 1.0 / det;
+        inv[0][0] = (m[1][1]*m[2][2]-m[1][2]*m[2][1])*det;
+        inv[0][1] = (m[2][1]*m[0][2]-m[2][2]*m[0][1])*det;
+        inv[0][2] = (m[0][1]*m[1][2]-m[0][2]*m[1][1])*det;
+        inv[1][1] = (m[0][0]*m[2][2]-m[0][2]*m[2][0])*det;
+        inv[1][2] = (m[1][0]*m[0][2]-m[1][2]*m[0][0])*det;
+        inv[2][2] = (m[0][0]*m[1][1]-m[0][1]*m[1][0])*det;
+        inv[1][0] = inv[0][1];
+        inv[2][0] = inv[0][2];
+        inv[2][1] = inv[1][2];
+    }
+};
+
+/** Runs the SIMD row kernel when the pixel types and dimension are the
+ * ones it handles, 3D float; otherwise nothing is done and all pixels are
+ * left to the scalar code. */
+template <class TPixel, class TUpdatePixel, unsigned int VDimension>
+struct RowKernelDispatch
+{
+    template <class TGlobalData, class TSpacing>
+    static long Compute( const TPixel *, const TPixel *, const TPixel *, const TPixel *,
+                         const TPixel *, const TPixel *, const long *, const TSpacing &,
+                         double, double, long, TUpdatePixel *, TGlobalData *,
+                         RowKernelInstructionSet )
+    {
+        return 0;
+    }
+};
+
+template <>
+struct RowKernelDispatch< float, Vector<float,3>, 3 >
+{
+    template <class TGlobalData, class TSpacing>
+    static long Compute( const float * warpedFixed, const float * warpedMoving,
+                         const float * fixed, const float * moving,
+                         const float * jacobianDet, const float * fwWeight,
+                         const long * stride, const TSpacing & spacing,
+                         double regWeight, double threshold, long length,
+                         Vector<float,3> * update, TGlobalData * globalData,
+                         RowKernelInstructionSet instructionSet )
+    {
+        if( instructionSet == ScalarInstructions )
+        {
+            return 0;
+        }
+
+        RowKernelArguments args;
+        args.m_WarpedFixedSDM = warpedFixed;
+        args.m_WarpedMovingSDM = warpedMoving;
+        args.m_FixedSDM = fixed;
+        args.m_MovingSDM = moving;
+        args.m_JacobianDet = jacobianDet;
+        args.m_FwWeight = fwWeight;
+        for( unsigned int dim = 0; dim < 3; dim++ )
+        {
+            args.m_Stride[dim] = stride[dim];
+            args.m_Spacing[dim] = spacing[dim];
+        }
+        args.m_RegWeight = regWeight;
+        args.m_IntensityDifferenceThreshold = threshold;
+
+        // the kernel adds to the running sums in voxel order, the same
+        // additions as the scalar code
+        double sumOfSquaredDifference = 0.0;
+        unsigned long numberOfPixelsProcessed = 0;
+        double sumOfSquaredChange = 0.0;
+        if( globalData )
+        {
+            sumOfSquaredDifference = globalData->m_SumOfSquaredDifference;
+            numberOfPixelsProcessed = globalData->m_NumberOfPixelsProcessed;
+            sumOfSquaredChange = globalData->m_SumOfSquaredChange;
+        }
+        args.m_SumOfSquaredDifference = sumOfSquaredDifference;
+        args.m_NumberOfPixelsProcessed = numberOfPixelsProcessed;
+        args.m_SumOfSquaredChange = sumOfSquaredChange;
+
+        const long done = ComputeRowKernel( args, length,
+            reinterpret_cast<float *>( update ), instructionSet );
+
+        if( globalData )
+        {
+            globalData->m_SumOfSquaredDifference = args.m_SumOfSquaredDifference;
+            globalData->m_NumberOfPixelsProcessed = args.m_NumberOfPixelsProcessed;
+            globalData->m_SumOfSquaredChange = args.m_SumOfSquaredChange;
+        }
+        return done;
+    }
+};
+
+} // end namespace ESMInvConDemonsDetail
+
     
 /**
  * Default constructor
@@ -62,6 +295,7 @@ namespace itk {
     this->SetInvDeformationField(NULL);
     this->SetJacobianDetImage(NULL);
     this->SetFwWeightImage(NULL);
+    this->SetSDMCache(NULL);
     
     m_FixedImageSpacing.Fill( 1.0 );
     m_FixedImageOrigin.Fill( 0.0 );
@@ -90,6 +324,30 @@ namespace itk {
     m_FixedImageWarper = WarperType::New();
     m_FixedImageWarper->SetInterpolator( m_FixedImageInterpolator );
     m_FixedImageWarper->SetEdgePaddingValue( NumericTraits<FixedPixelType>::max() );
+
+    // outside of the image is background, as for the recomputed SDMs
+    m_MovingSDMWarper = SDMWarperType::New();
+    m_MovingSDMWarper->SetInterpolator( SDMInterpolatorType::New() );
+    m_MovingSDMWarper->SetEdgePaddingValue( 0 );
+
+    m_FixedSDMWarper = SDMWarperType::New();
+    m_FixedSDMWarper->SetInterpolator( SDMInterpolatorType::New() );
+    m_FixedSDMWarper->SetEdgePaddingValue( 0 );
+    m_SDMMode = RecomputeSDM;
+    m_SDMBandWidth = 0.0;
+    m_SDMFrameWidth = 5;
+    m_SDMPyramidSigma = 1.0;
+    m_FixedSDMReferenceImage = NULL;
+    m_MovingSDMReferenceImage = NULL;
+    m_FixedSDMPyramidLevel.m_Reference = NULL;
+    m_MovingSDMPyramidLevel.m_Reference = NULL;
+
+    m_FixedSDMBuffer = NULL;
+    m_MovingSDMBuffer = NULL;
+    m_OrignalFixedSDMBuffer = NULL;
+    m_OrignalMovingSDMBuffer = NULL;
+    m_JacobianDetBuffer = NULL;
+    m_FwWeightBuffer = NULL;
     
     m_Metric = NumericTraits<double>::max();
     m_SumOfSquaredDifference = 0.0;
@@ -98,6 +356,8 @@ namespace itk {
     m_SumOfSquaredChange = 0.0;
     m_UseJacobian = false;
     m_UseFwWeight = false;
+    m_UseVectorizedUpdate = true;
+    m_RowKernelInstructionSet = ESMInvConDemonsDetail::GetRowKernelInstructionSet();
     }
     
     
@@ -126,6 +386,20 @@ namespace itk {
     os << m_DenominatorThreshold << std::endl;
     os << indent << "IntensityDifferenceThreshold: ";
     os << m_IntensityDifferenceThreshold << std::endl;
+    os << indent << "SDMMode: ";
+    os << m_SDMMode << std::endl;
+    os << indent << "SDMBandWidth: ";
+    os << m_SDMBandWidth << std::endl;
+    os << indent << "SDMPyramidSigma: ";
+    os << m_SDMPyramidSigma << std::endl;
+    os << indent << "FixedSDMReferenceImage: ";
+    os << m_FixedSDMReferenceImage.GetPointer() << std::endl;
+    os << indent << "MovingSDMReferenceImage: ";
+    os << m_MovingSDMReferenceImage.GetPointer() << std::endl;
+    os << indent << "UseVectorizedUpdate: ";
+    os << m_UseVectorizedUpdate << std::endl;
+    os << indent << "RowKernelInstructionSet: ";
+    os << m_RowKernelInstructionSet << std::endl;
     
     os << indent << "Metric: ";
     os << m_Metric << std::endl;
@@ -221,6 +495,10 @@ namespace itk {
 //writer3->Update();
 
 
+    if( m_SDMMode == RecomputeSDM )
+    {
+    RegistrationProfiler::ScopedTimer labelWarpTimer( m_Profiler, "label_warp" );
+
     // Compute warped moving image
     m_MovingImageWarper->SetOutputSpacing( this->GetFixedImage()->GetSpacing() );
     m_MovingImageWarper->SetOutputOrigin( this->GetFixedImage()->GetOrigin() );
@@ -245,6 +523,7 @@ namespace itk {
     m_FixedImageWarper->SetDeformationField( this->GetInvDeformationField() );
     m_FixedImageWarper->GetOutput()->SetRequestedRegion( this->GetInvDeformationField()->GetRequestedRegion() );
     m_FixedImageWarper->Update();
+    }
     
   //typename WriterType::Pointer writer5 = WriterType::New();
 //writer5->SetFileName( "fixed_afterwarp2.nii.gz" );
@@ -259,10 +538,82 @@ namespace itk {
 
 
 //std::cout << "54321" << std::endl;
-SignedDistanceMap_fixedImage();
-SignedDistanceMap_movingImage();
-SignedDistanceMap_orignalfixedImage();
-SignedDistanceMap_orignalmovingImage();
+
+    // the unwarped label images are the same for every iteration of a
+    // pyramid level, so their SDMs are looked up before being recomputed
+    {
+    RegistrationProfiler::ScopedTimer sdmTimer( m_Profiler, "sdm_unwarped" );
+    if( m_FixedSDMReferenceImage || m_MovingSDMReferenceImage )
+    {
+        if( !m_FixedSDMReferenceImage || !m_MovingSDMReferenceImage )
+        {
+            itkExceptionMacro( << "The fixed and moving SDM reference images must be set together." );
+        }
+        if( m_SDMMode != WarpSDM )
+        {
+            itkExceptionMacro( << "SDM reference images need the WarpSDM mode." );
+        }
+        this->SetorignalFixedSDMImage( this->ComputeSDMPyramidLevel(
+            m_FixedSDMReferenceImage.GetPointer(), this->GetFixedImage(), m_FixedSDMPyramidLevel ) );
+        this->SetorignalMovingSDMImage( this->ComputeSDMPyramidLevel(
+            m_MovingSDMReferenceImage.GetPointer(), this->GetMovingImage(), m_MovingSDMPyramidLevel ) );
+    }
+    else if( m_SDMCache )
+    {
+        typename SDMCacheType::KeyType fixedKey =
+            m_SDMCache->ComputeKey( this->GetFixedImage() );
+        fixedKey.m_Parameters.push_back( m_SDMBandWidth );
+        const FixedImageType * cachedFixedSDM = m_SDMCache->Find( fixedKey );
+        if( cachedFixedSDM )
+        {
+            this->SetorignalFixedSDMImage( cachedFixedSDM );
+            if( m_Profiler )
+            {
+                m_Profiler->AddCount( "sdm_cache_hits" );
+            }
+        }
+        else
+        {
+            SignedDistanceMap_orignalfixedImage();
+            m_SDMCache->Insert( fixedKey, m_sdm_orignalfixedImage );
+        }
+
+        typename SDMCacheType::KeyType movingKey =
+            m_SDMCache->ComputeKey( this->GetMovingImage() );
+        movingKey.m_Parameters.push_back( m_SDMBandWidth );
+        const FixedImageType * cachedMovingSDM = m_SDMCache->Find( movingKey );
+        if( cachedMovingSDM )
+        {
+            this->SetorignalMovingSDMImage( cachedMovingSDM );
+            if( m_Profiler )
+            {
+                m_Profiler->AddCount( "sdm_cache_hits" );
+            }
+        }
+        else
+        {
+            SignedDistanceMap_orignalmovingImage();
+            m_SDMCache->Insert( movingKey, m_sdm_orignalmovingImage );
+        }
+    }
+    else
+    {
+        SignedDistanceMap_orignalfixedImage();
+        SignedDistanceMap_orignalmovingImage();
+    }
+    }
+
+    if( m_SDMMode == RecomputeSDM )
+    {
+        RegistrationProfiler::ScopedTimer sdmTimer( m_Profiler, "sdm_warped" );
+        SignedDistanceMap_fixedImage();
+        SignedDistanceMap_movingImage();
+    }
+    else
+    {
+        RegistrationProfiler::ScopedTimer sdmTimer( m_Profiler, "sdm_resample" );
+        WarpSignedDistanceMaps();
+    }
 
 //std::cout << "2222222222222222222" << std::endl;
 //  typedef float      PixelType;
@@ -287,6 +638,24 @@ SignedDistanceMap_orignalmovingImage();
     // setup moving image interpolator for further access
     m_MovingImageInterpolator->SetInputImage( this->GetMovingImage() );
     m_FixedImageInterpolator->SetInputImage( this->GetFixedImage() );
+
+    // raw buffers and strides for ComputeUpdate
+    const typename FixedImageType::RegionType & fixedRegion =
+        this->GetFixedImage()->GetLargestPossibleRegion();
+    long bufferStride = 1;
+    for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+    {
+        m_BufferStart[dim] = fixedRegion.GetIndex()[dim];
+        m_BufferSize[dim] = static_cast<long>( fixedRegion.GetSize()[dim] );
+        m_BufferStride[dim] = bufferStride;
+        bufferStride *= m_BufferSize[dim];
+    }
+    m_FixedSDMBuffer = this->GetRegionBuffer( this->GetFixedSDMImage() );
+    m_MovingSDMBuffer = this->GetRegionBuffer( this->GetMovingSDMImage() );
+    m_OrignalFixedSDMBuffer = this->GetRegionBuffer( this->GetorignalFixedSDMImage() );
+    m_OrignalMovingSDMBuffer = this->GetRegionBuffer( this->GetorignalMovingSDMImage() );
+    m_JacobianDetBuffer = m_UseJacobian ? this->GetRegionBuffer( this->GetJacobianDetImage() ) : NULL;
+    m_FwWeightBuffer = m_UseFwWeight ? this->GetRegionBuffer( this->GetFwWeightImage() ) : NULL;
     
     // initialize metric computation variables
     m_SumOfSquaredDifference  = 0.0;
@@ -305,345 +674,202 @@ SignedDistanceMap_orignalmovingImage();
     ::ComputeUpdate(const NeighborhoodType &it, void * gd,
     const FloatOffsetType& itkNotUsed(offset))
 {
- 
-    GlobalDataStruct *globalData = (GlobalDataStruct *)gd;
-    PixelType update;
-    IndexType FirstIndex = this->GetFixedImage()->GetLargestPossibleRegion().GetIndex();
-    IndexType LastIndex = this->GetFixedImage()->GetLargestPossibleRegion().GetIndex() +
-    this->GetFixedImage()->GetLargestPossibleRegion().GetSize();
-    
-    const IndexType index = it.GetIndex();
-    //std::cout << "222" << std::endl;
-    // Get fixed image related information
     // Note: no need to check if the index is within
     // fixed image buffer. This is done by the external filter.
-    const double fixedValue = static_cast<double>(this->GetorignalFixedSDMImage()->GetPixel( index ) );
+    // All buffers share the layout of the fixed image region, see
+    // InitializeIteration.
+    const IndexType index = it.GetIndex();
+    long position[ImageDimension];
+    long offset = 0;
+    for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+    {
+        position[dim] = index[dim] - m_BufferStart[dim];
+        offset += position[dim] * m_BufferStride[dim];
+    }
+
+    return this->ComputeUpdateAt( position, offset, (GlobalDataStruct *)gd );
+}
+
+
+/**
+ * Compute the updates along a row, see ComputeUpdate
+ */
+    template <class TFixedImage, class TMovingImage, class TDeformationField>
+    void
+    ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
+    ::ComputeUpdateRow(const IndexType &index, unsigned long length,
+    PixelType * update, void * gd)
+{
+    GlobalDataStruct *globalData = (GlobalDataStruct *)gd;
+
+    long position[ImageDimension];
+    long offset = 0;
+    bool interiorRow = true;
+    for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+    {
+        position[dim] = index[dim] - m_BufferStart[dim];
+        offset += position[dim] * m_BufferStride[dim];
+        if( dim > 0 && ( position[dim] < 1 || position[dim] > m_BufferSize[dim] - 2 ) )
+        {
+            interiorRow = false;
+        }
+    }
+    const long rowStart = position[0];
+    const long rowLength = static_cast<long>( length );
+
+    long x = 0;
+    if( m_UseVectorizedUpdate && interiorRow )
+    {
+        // the first voxel may sit on the border, the kernel takes the
+        // voxels up to the one before the last of the buffer
+        if( rowStart == 0 )
+        {
+            update[x] = this->ComputeUpdateAt( position, offset, globalData );
+            ++x;
+        }
+        const long count = std::min( rowLength, m_BufferSize[0] - 1 - rowStart ) - x;
+        if( count > 0 )
+        {
+            x += ESMInvConDemonsDetail::RowKernelDispatch
+                <FixedPixelType, PixelType, ImageDimension>::Compute(
+                    m_FixedSDMBuffer + offset + x, m_MovingSDMBuffer + offset + x,
+                    m_OrignalFixedSDMBuffer + offset + x, m_OrignalMovingSDMBuffer + offset + x,
+                    m_JacobianDetBuffer ? m_JacobianDetBuffer + offset + x : NULL,
+                    m_FwWeightBuffer ? m_FwWeightBuffer + offset + x : NULL,
+                    m_BufferStride, m_FixedImageSpacing, m_RegWeight,
+                    m_IntensityDifferenceThreshold, count, update + x, globalData,
+                    m_RowKernelInstructionSet );
+        }
+    }
+
+    for( ; x < rowLength; x++ )
+    {
+        position[0] = rowStart + x;
+        update[x] = this->ComputeUpdateAt( position, offset + x, globalData );
+    }
+}
+
+
+/**
+ * Compute update at one voxel
+ */
+    template <class TFixedImage, class TMovingImage, class TDeformationField>
+    typename ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
+    ::PixelType
+    ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
+    ::ComputeUpdateAt(const long position[], long offset,
+    GlobalDataStruct * globalData) const
+{
+    using ESMInvConDemonsDetail::SDMDerivative;
+
+    PixelType update;
+
+    const double fixedValue = static_cast<double>( m_OrignalFixedSDMBuffer[offset] );
     double jacobian = 1.0f;
     double fw_weight = 1.0f;
     if (m_UseJacobian)
     {
-        jacobian = static_cast<double>(this->GetJacobianDetImage()->GetPixel(index));
+        jacobian = static_cast<double>( m_JacobianDetBuffer[offset] );
     }
-    
+
     if (m_UseFwWeight)
     {
-        fw_weight = static_cast<double>(this->GetFwWeightImage()->GetPixel(index));
+        fw_weight = static_cast<double>( m_FwWeightBuffer[offset] );
     }
- //std::cout << "333" << std::endl;
-    //MovingPixelType warpedFixedPixValue = m_FixedImageWarper->GetOutput()->GetPixel( index );
-    //MovingPixelType warpedFixedPixValue= m_sdm_fixedImage->GetPixel( index );
- MovingPixelType warpedFixedPixValue= this->GetFixedSDMImage()->GetPixel( index );
-        //std::cout << "444" << std::endl;
+
+    // check if the point was mapped outside of the images using
+    // the "special value" NumericTraits<PixelType>::max()
+    const FixedPixelType * warpedFixedPtr = m_FixedSDMBuffer + offset;
+    const MovingPixelType warpedFixedPixValue = *warpedFixedPtr;
     if( warpedFixedPixValue == NumericTraits <FixedPixelType>::max() )
     {
         update.Fill( 0.0 );
         return update;
     }
-    double warpedFixedValue = static_cast<double>( warpedFixedPixValue );
-    //std::cout << "3" << std::endl;
-    const double movingValue = static_cast<double>(this->GetorignalMovingSDMImage()->GetPixel( index ) );
-    // Get moving image related information
-    // check if the point was mapped outside of the moving image using
-    // the "special value" NumericTraits<MovingPixelType>::max()
-    
-    //MovingPixelType warpedMovingPixValue = m_MovingImageWarper->GetOutput()->GetPixel( index );
-    //MovingPixelType warpedMovingPixValue = m_sdm_movingImage->GetPixel( index );
-MovingPixelType warpedMovingPixValue = this->GetMovingSDMImage()->GetPixel( index );
+    const double warpedFixedValue = static_cast<double>( warpedFixedPixValue );
+    const double movingValue = static_cast<double>( m_OrignalMovingSDMBuffer[offset] );
+
+    const FixedPixelType * warpedMovingPtr = m_MovingSDMBuffer + offset;
+    const MovingPixelType warpedMovingPixValue = *warpedMovingPtr;
     if( warpedMovingPixValue == NumericTraits <MovingPixelType>::max() )
     {
         update.Fill( 0.0 );
         return update;
     }
-    
-    
-    double warpedMovingValue = static_cast<double>( warpedMovingPixValue );
-    //const double movingValue = static_cast<double>( movingPixValue );
-    
-    CovariantVectorType usedGradientTimes2;
-    
+    const double warpedMovingValue = static_cast<double>( warpedMovingPixValue );
+
     // we don't use a CentralDifferenceImageFunction here to be able to
     // check for NumericTraits<MovingPixelType>::max()
-    CovariantVectorType warpedMovingGradient;
-    IndexType tmpIndex = index;
+    double warpedMovingGradient[ImageDimension];
+    double warpedFixedGradient[ImageDimension];
     for( unsigned int dim = 0; dim < ImageDimension; dim++ )
     {
-        // bounds checking
-        if( FirstIndex[dim]==LastIndex[dim]  || index[dim]<FirstIndex[dim] || index[dim]>=LastIndex[dim] )
-        {
-            warpedMovingGradient[dim] = 0.0;
-            continue;
-        }
-        else if ( index[dim] == FirstIndex[dim] )
-        {
-            // compute derivative
-            tmpIndex[dim] += 1;
-            //warpedMovingPixValue = m_MovingImageWarper->GetOutput()->GetPixel( tmpIndex );
-            //warpedMovingPixValue = m_sdm_movingImage->GetPixel( tmpIndex );
-warpedMovingPixValue = this->GetMovingSDMImage()->GetPixel( tmpIndex );
-            if( warpedMovingPixValue == NumericTraits <MovingPixelType>::max() )
-            {
-                // weird crunched border case
-                warpedMovingGradient[dim] = 0.0;
-            }
-            else
-            {
-                // forward difference
-                warpedMovingGradient[dim] = static_cast<double>( warpedMovingPixValue ) - warpedMovingValue;
-                warpedMovingGradient[dim] /= m_FixedImageSpacing[dim];
-            }
-            tmpIndex[dim] -= 1;
-            continue;
-        }
-        else if ( index[dim] == (LastIndex[dim]-1) )
-        {
-            // compute derivative
-            tmpIndex[dim] -= 1;
-            //warpedMovingPixValue = m_MovingImageWarper->GetOutput()->GetPixel( tmpIndex );
-            //warpedMovingPixValue = m_sdm_movingImage->GetPixel( tmpIndex );
-warpedMovingPixValue = this->GetMovingSDMImage()->GetPixel( tmpIndex );
-            if( warpedMovingPixValue == NumericTraits<MovingPixelType>::max() )
-            {
-                // weird crunched border case
-                warpedMovingGradient[dim] = 0.0;
-            }
-            else
-            {
-                // backward difference
-                warpedMovingGradient[dim] = warpedMovingValue - static_cast<double>( warpedMovingPixValue );
-                warpedMovingGradient[dim] /= m_FixedImageSpacing[dim];
-            }
-            tmpIndex[dim] += 1;
-            continue;
-        }
-        
-       // std::cout << "4" << std::endl;
-        // compute derivative
-        tmpIndex[dim] += 1;
-        //warpedMovingPixValue = m_MovingImageWarper->GetOutput()->GetPixel( tmpIndex );
-        //warpedMovingPixValue = m_sdm_movingImage->GetPixel( tmpIndex );
-warpedMovingPixValue = this->GetMovingSDMImage()->GetPixel( tmpIndex );
-        if ( warpedMovingPixValue == NumericTraits<MovingPixelType>::max() )
-        {
-            // backward differencem_MovingImageWarper->GetOutput()->GetPixel( 
-            warpedMovingGradient[dim] = warpedMovingValue;
-    
-            tmpIndex[dim] -= 2;
-            //warpedMovingPixValue = m_MovingImageWarper->GetOutput()->GetPixel( tmpIndex );
-            //warpedMovingPixValue = m_sdm_movingImage->GetPixel( tmpIndex );
-warpedMovingPixValue = this->GetMovingSDMImage()->GetPixel( tmpIndex );
-            if( warpedMovingPixValue == NumericTraits<MovingPixelType>::max() )
-            {
-            // weird crunched border case
-                warpedMovingGradient[dim] = 0.0;
-            }
-            else
-            {
-                // backward difference
-                warpedMovingGradient[dim] -= static_cast<double>(
-                this->GetMovingSDMImage()->GetPixel( tmpIndex ) );
-        
-                warpedMovingGradient[dim] /= m_FixedImageSpacing[dim];
-            }
-        }
-        else
-        {
-            warpedMovingGradient[dim] = static_cast<double>( warpedMovingPixValue );
-            
-            tmpIndex[dim] -= 2;
-            //warpedMovingPixValue = m_MovingImageWarper->GetOutput()->GetPixel( tmpIndex );
-            //warpedMovingPixValue = m_sdm_movingImage->GetPixel( tmpIndex );
-warpedMovingPixValue = this->GetMovingSDMImage()->GetPixel( tmpIndex );
-            if ( warpedMovingPixValue == NumericTraits<MovingPixelType>::max() )
-            {
-                // forward difference
-                warpedMovingGradient[dim] -= warpedMovingValue;
-                warpedMovingGradient[dim] /= m_FixedImageSpacing[dim];
-            }
-            else
-            {
-                // normal case, central difference
-                warpedMovingGradient[dim] -= static_cast<double>( warpedMovingPixValue );
-                warpedMovingGradient[dim] *= 0.5 / m_FixedImageSpacing[dim];
-            }
-        }
-        tmpIndex[dim] += 1;
+        warpedMovingGradient[dim] = SDMDerivative<MovingPixelType>( warpedMovingPtr,
+            warpedMovingValue, position[dim], m_BufferSize[dim], m_BufferStride[dim],
+            m_FixedImageSpacing[dim] );
+        warpedFixedGradient[dim] = SDMDerivative<FixedPixelType>( warpedFixedPtr,
+            warpedFixedValue, position[dim], m_BufferSize[dim], m_BufferStride[dim],
+            m_FixedImageSpacing[dim] );
     }
-    //std::cout << "5" << std::endl;
-    CovariantVectorType warpedFixedGradient;
-    IndexType tmpIndex2 = index;
-    for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+
+    const double speedValue = fixedValue - warpedMovingValue;
+    const double speedValue2 = warpedFixedValue - movingValue;
+
+    // Gauss-Newton system of both directions, evaluated term by term in
+    // the order the former vnl_matrix expression did
+    const double movingWeight = 0.25*fw_weight;
+    const double fixedWeight = jacobian * 0.25;
+    const double jacobianScale = ( jacobian == 0 ) ? 4.0 : 1.0;
+
+    double Hess[ImageDimension][ImageDimension];
+    double invHess[ImageDimension][ImageDimension];
+    double temp[ImageDimension];
+    for( unsigned int i = 0; i < ImageDimension; i++ )
     {
-        // bounds checking
-        if( FirstIndex[dim]==LastIndex[dim] || index[dim]<FirstIndex[dim] || index[dim]>=LastIndex[dim] )
-        {
-            warpedFixedGradient[dim] = 0.0;
-            continue;
-        }
-        else if ( index[dim] == FirstIndex[dim] )
-        {
-            // compute derivative
-            tmpIndex2[dim] += 1;
-            //warpedFixedPixValue = m_FixedImageWarper->GetOutput()->GetPixel( tmpIndex2 );
-            //warpedFixedPixValue = m_sdm_fixedImage->GetPixel( tmpIndex2 );
-warpedFixedPixValue = this->GetFixedSDMImage()->GetPixel( tmpIndex2 );
-            if( warpedFixedPixValue == NumericTraits <FixedPixelType>::max() )
-            {
-                // weird crunched border case
-                warpedFixedGradient[dim] = 0.0;
-            }
-            else
-            {
-                // forward difference
-                warpedFixedGradient[dim] = static_cast<double>( warpedFixedPixValue ) - warpedFixedValue;
-                warpedFixedGradient[dim] /= m_FixedImageSpacing[dim];
-            }
-            tmpIndex2[dim] -= 1;
-            continue;
-        }
-        else if ( index[dim] == (LastIndex[dim]-1) )
+        for( unsigned int j = 0; j < ImageDimension; j++ )
         {
-            // compute derivative
-            tmpIndex2[dim] -= 1;
-            //warpedFixedPixValue = m_FixedImageWarper->GetOutput()->GetPixel( tmpIndex2 );
-            //warpedFixedPixValue = m_sdm_fixedImage->GetPixel( tmpIndex2 );
-warpedFixedPixValue = this->GetFixedSDMImage()->GetPixel( tmpIndex2 );
-            if( warpedFixedPixValue == NumericTraits<FixedPixelType>::max() )
+            Hess[i][j] = movingWeight * ( warpedMovingGradient[i] * warpedMovingGradient[j] ) +
+                fixedWeight * ( warpedFixedGradient[i] * warpedFixedGradient[j] );
+            if (jacobian == 0)
             {
-                // weird crunched border case
-                warpedFixedGradient[dim] = 0.0;
+                Hess[i][j] = jacobianScale * Hess[i][j];
             }
-            else
-            {
-                // backward difference
-                warpedFixedGradient[dim] = warpedFixedValue - static_cast<double>( warpedFixedPixValue );
-                warpedFixedGradient[dim] /= m_FixedImageSpacing[dim];
-            }
-            tmpIndex2[dim] += 1;
-            continue;
         }
-        
-        
-        // compute derivative
-        tmpIndex2[dim] += 1;
-        //warpedFixedPixValue = m_FixedImageWarper->GetOutput()->GetPixel( tmpIndex2 );
-       // warpedFixedPixValue = m_sdm_fixedImage->GetPixel( tmpIndex2 );
-warpedFixedPixValue = this->GetFixedSDMImage()->GetPixel( tmpIndex2 );
-        if ( warpedFixedPixValue == NumericTraits<FixedPixelType>::max() )
-        {
-            // backward difference
-            warpedFixedGradient[dim] = warpedFixedValue;
-    
-            tmpIndex2[dim] -= 2;
-            //warpedFixedPixValue = m_FixedImageWarper->GetOutput()->GetPixel( tmpIndex2 );
-            //warpedFixedPixValue = m_sdm_fixedImage->GetPixel( tmpIndex2 );
-warpedFixedPixValue = this->GetFixedSDMImage()->GetPixel( tmpIndex2 );
-            if( warpedFixedPixValue == NumericTraits<FixedPixelType>::max() )
-            {
-                // weird crunched border case
-                 warpedFixedGradient[dim] = 0.0;
-            }
-            else
-            {
-                // backward difference
-                warpedFixedGradient[dim] -= static_cast<double>(
-                this->GetFixedSDMImage()->GetPixel( tmpIndex2 ) );
-        
-                warpedFixedGradient[dim] /= m_FixedImageSpacing[dim];
-            }
-        }
-        else
+        Hess[i][i] += this->m_RegWeight;
+
+        temp[i] = ( movingWeight * speedValue ) * warpedMovingGradient[i] +
+            ( fixedWeight * speedValue2 ) * warpedFixedGradient[i];
+        if (jacobian == 0)
         {
-            warpedFixedGradient[dim] = static_cast<double>( warpedFixedPixValue );
-            
-            tmpIndex2[dim] -= 2;
-            //warpedFixedPixValue = m_FixedImageWarper->GetOutput()->GetPixel( tmpIndex2 );
-           // warpedFixedPixValue = m_sdm_fixedImage->GetPixel( tmpIndex2 );
-warpedFixedPixValue = this->GetFixedSDMImage()->GetPixel( tmpIndex2 );
-            if ( warpedFixedPixValue == NumericTraits<FixedPixelType>::max() )
-            {
-                // forward difference
-                warpedFixedGradient[dim] -= warpedFixedValue;
-                warpedFixedGradient[dim] /= m_FixedImageSpacing[dim];
-            }
-            else
-            {
-                // normal case, central difference
-                warpedFixedGradient[dim] -= static_cast<double>( warpedFixedPixValue );
-                warpedFixedGradient[dim] *= 0.5 / m_FixedImageSpacing[dim];
-            }
+            temp[i] = jacobianScale * temp[i];
         }
-        tmpIndex2[dim] += 1;
-    }
-    
-    vnl_vector<double> warpedFixedGradient_vec(ImageDimension);
-    vnl_vector<double> warpedMovingGradient_vec(ImageDimension);
-    
-    vnl_matrix<double> Hess(ImageDimension, ImageDimension);
-    vnl_matrix<double> invHess(ImageDimension, ImageDimension);
-    
-    
-    const double speedValue = fixedValue - warpedMovingValue;
-    const double speedValue2 = warpedFixedValue - movingValue;
-    
-    //std::cout << "Reg Weight (inside) " << this->m_RegWeight << std::endl;
-    
-    vnl_diag_matrix<double> Reg(ImageDimension, this->m_RegWeight);
-    warpedFixedGradient_vec = warpedFixedGradient.GetVnlVector();
-    warpedMovingGradient_vec = warpedMovingGradient.GetVnlVector();
-    
-     
-    //std::cout << "Jacobian " << jacobian << "Fw weight: " << fw_weight << std::endl;
-    
-    Hess = 0.25*fw_weight*outer_product(warpedMovingGradient_vec, warpedMovingGradient_vec) + 
-        jacobian * 0.25*outer_product(warpedFixedGradient_vec, warpedFixedGradient_vec);
-    
-    //Hess = 0.25*outer_product(warpedMovingGradient_vec, warpedMovingGradient_vec) + 
-    //    0.25*outer_product(warpedFixedGradient_vec, warpedFixedGradient_vec);
-    
-    if (jacobian == 0)
-    {
-       Hess = 4.0*Hess;
     }
-    
-    invHess = vnl_inverse(Hess + Reg);
-    vnl_matrix<double> temp_mat(ImageDimension,1);
-
 
+    ESMInvConDemonsDetail::SmallMatrixInverse<ImageDimension>::Compute( Hess, invHess );
 
-          temp_mat.set_column(0,0.25*fw_weight*(fixedValue - warpedMovingValue)*warpedMovingGradient_vec + 
-                jacobian * 0.25*(warpedFixedValue - movingValue)*warpedFixedGradient_vec);
-    
-
-    if (jacobian == 0)
-    {
-        temp_mat = 4.0*temp_mat;
-    }
-    
-    vnl_matrix<double> update_mat(ImageDimension,1);
-    
-    update_mat = invHess * temp_mat;
-    
-           
   /**
    * Compute Update.
    * We avoid the mismatch in units between the two terms.
    * and avoid large step using a normalization term.
    */
-        
+
     if ( vnl_math_abs(speedValue) < m_IntensityDifferenceThreshold || vnl_math_abs(speedValue2) < m_IntensityDifferenceThreshold)
     {
         update.Fill( 0.0 );
     }
     else
     {
-        for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+        for( unsigned int i = 0; i < ImageDimension; i++ )
         {
-            update[dim] = update_mat[dim][0];
-            
+            double sum = 0.0;
+            for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+                sum += invHess[i][j] * temp[j];
+            }
+            update[i] = sum;
         }
     }
-    
-        
+
     // WARNING!! We compute the global data without taking into account the current update step.
     // There are several reasons for that: If an exponential, a smoothing or any other operation
     // is applied on the update field, we cannot compute the newMappedCenterPoint here; and even
@@ -654,664 +880,218 @@ warpedFixedPixValue = this->GetFixedSDMImage()->GetPixel( tmpIndex2 );
         globalData->m_NumberOfPixelsProcessed += 1;
         globalData->m_SumOfSquaredChange += update.GetSquaredNorm();
     }
-    
+
     return update;
 }
- 
 
-  template <class TFixedImage, class TMovingImage, class TDeformationField>
-void ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
-    ::SignedDistanceMap_movingImage()
-{
 
-float eps = 0.0001;
-typedef float      PixelType;
-typedef unsigned int maximum,minimum;
-//const   unsigned int        Dimension = 3;
-typedef itk::Image< PixelType, ImageDimension >    ImageType;
-//typedef itk::Image<float, ImageDimension>          FloatImageType;
-
-typedef  itk::SignedMaurerDistanceMapImageFilter< ImageType, ImageType  > SignedMaurerDistanceMapImageFilterType;
-
-  typedef itk::ImageDuplicator< ImageType > DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(m_MovingImageWarper->GetOutput());
-  duplicator->Update();
-  typename ImageType::Pointer image_label = duplicator->GetOutput();
-
-  typename ImageType::Pointer m_movingImage = ImageType::New();
-  typename ImageType::Pointer image2 = duplicator->GetOutput();
-
-   typedef itk::CastImageFilter< ImageType, ImageType > CastFilterType;
-   typename CastFilterType::Pointer castFilter = CastFilterType::New();
-   castFilter->SetInput(image2);
-   castFilter->Update();
-   m_movingImage = castFilter->GetOutput();
-
-itk::ImageRegionIterator<ImageType> imageIterator_1(m_movingImage,m_movingImage->GetLargestPossibleRegion());
-while(!imageIterator_1.IsAtEnd())
-  {
-     imageIterator_1.Set(0);
-       ++imageIterator_1;
-  }
-
-
-//get the array of labels
-unsigned int array_label[100]={0};
-unsigned int i=0,j,pixelValue_label;
-itk::ImageRegionIterator<ImageType> imageIterator_2(m_MovingImageWarper->GetOutput(),m_MovingImageWarper->GetOutput()->GetLargestPossibleRegion());
-while(!imageIterator_2.IsAtEnd())
-  {
-        pixelValue_label = imageIterator_2.Get();
-	  unsigned int k=0;
-	  if (pixelValue_label !=0)
-  	    {
-    		for(j=1;j<100;j++)
-     		   {
-       	              if( pixelValue_label == array_label[j-1])
-         	         {
-               		    k=k+1;
-         		 }
-     		    }
-   		if(k==0 )
-        	 {
-                    array_label[i]=pixelValue_label;
-                   // std::cout << array_label[i]<< std::endl;
-                    i=i+1;
-         	  }
-
-            }
-   ++imageIterator_2;
-  }
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+const typename ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>::FixedPixelType *
+ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
+    ::GetRegionBuffer( const FixedImageType * image ) const
+{
+    if( !image )
+    {
+        return NULL;
+    }
+    if( image->GetBufferedRegion() != this->GetFixedImage()->GetLargestPossibleRegion() )
+    {
+        itkExceptionMacro( << "Image buffers must cover the fixed image region." );
+    }
+    return image->GetBufferPointer();
+}
 
 
-// calculate sdt
-unsigned int m;
-for(m=0;array_label[m]>0;m++)
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+template <class TLabelImage>
+typename ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>::FixedImagePointer
+ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
+    ::ComputeSignedDistanceMap( const TLabelImage * labels ) const
 {
-//get the single label region
-itk::ImageRegionIterator<ImageType> imageIterator_3(m_MovingImageWarper->GetOutput(),m_MovingImageWarper->GetOutput()->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_4(image_label,image_label->GetLargestPossibleRegion());
-while(!imageIterator_3.IsAtEnd())
-  {    
-      unsigned int pixelValue = imageIterator_3.Get();
-      if (pixelValue == array_label[m]) 
-        {
-        imageIterator_4.Set(0);
-        }
-      else
-        {
-	  imageIterator_4.Set(1);
-	}
-    ++imageIterator_3;
-    ++imageIterator_4;
-  }
- // sdt the single label region
-typename SignedMaurerDistanceMapImageFilterType::Pointer distanceMapImageFilter = SignedMaurerDistanceMapImageFilterType::New();
-distanceMapImageFilter->SetInput(image_label);
-
-//get the minimum and maximum in the single label sdm
-
-typename ImageType::Pointer image_sdt = ImageType::New();
-image_sdt = distanceMapImageFilter->GetOutput();// because the array_label have a lot zeros label
-image_sdt->Update();
-
-float minimum=0, maximum, pixelValue_am;
-bool flag1=true;
-itk::ImageRegionIterator<ImageType> imageIterator_5(image_sdt,image_sdt->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_6(image_label,image_label->GetLargestPossibleRegion());
-while(!imageIterator_5.IsAtEnd())
-  {
-        pixelValue_am = imageIterator_5.Get();
-           if (imageIterator_6.Get()==0)
-           {
-             if(flag1)
-               {
-                      flag1=false;
-              //        minimum = pixelValue_am;
-                      maximum = pixelValue_am;
-                }
-             if(pixelValue_am < minimum)
-                {
-              //    minimum = pixelValue_am;
-                }
-             else if(pixelValue_am > maximum)
-                {
-                  maximum = pixelValue_am;
-                }
-           }
-    ++imageIterator_5;
-    ++imageIterator_6;
+    // all labels in one pass, see MultiLabelDistanceMapImageFilter for the
+    // normalisation (it is the one the per-label Maurer loop used)
+    typedef MultiLabelDistanceMapImageFilter<TLabelImage,FixedImageType> DistanceMapFilterType;
+    typename DistanceMapFilterType::Pointer distanceMapFilter = DistanceMapFilterType::New();
+    distanceMapFilter->SetInput( labels );
+    distanceMapFilter->SetBandWidth( m_SDMBandWidth );
+    distanceMapFilter->SetFrameWidth( m_SDMFrameWidth );
+    distanceMapFilter->Update();
+
+    if( m_Profiler )
+    {
+        m_Profiler->AddCount( "sdm_passes" );
+        m_Profiler->AddCount( "sdm_labels", distanceMapFilter->GetLabels().size() );
     }
 
-// norm the sdt single region and send it to totalsignedmap
-float pixelValue_sdt, pixelValue_sdt_norm,diff;
-diff=(maximum-minimum)+eps;  // may be zeros, should be think again;
-//std::cout<< "moving the diff is: "<<diff<<std::endl;
-//std::cout<< "the minmum is: "<<minimum<<std::endl;
-bool flag2; // for debug only
-itk::ImageRegionIterator<ImageType> imageIterator_7(image_sdt,image_sdt->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_8(image_label,image_label->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_9(m_movingImage,m_movingImage->GetLargestPossibleRegion());
-while(!imageIterator_7.IsAtEnd())
-  {
-        pixelValue_sdt = imageIterator_7.Get();
-        if (imageIterator_8.Get()==0)
-	{
-	      pixelValue_sdt_norm = (pixelValue_sdt-minimum)/diff;
-          pixelValue_sdt_norm = pixelValue_sdt_norm*255;
-	      imageIterator_9.Set(pixelValue_sdt_norm);
-	}
-    ++imageIterator_7;
-    ++imageIterator_8;
-    ++imageIterator_9;
-  }
-
+    typename FixedImageType::Pointer sdm = distanceMapFilter->GetOutput();
+    sdm->DisconnectPipeline();
+    return sdm.GetPointer();
 }
 
-this->SetMovingSDMImage(m_movingImage);
-} 
-    
-
- template <class TFixedImage, class TMovingImage, class TDeformationField>
 
-  void  ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
-    ::SignedDistanceMap_fixedImage()
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+template <class TLabelImage>
+typename ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>::FixedImagePointer
+ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
+    ::ComputeSDMPyramidLevel( const TLabelImage * reference, const TLabelImage * labels,
+                              SDMPyramidLevelType & level )
 {
+    typedef typename SDMPyramidType::SizeType SizeType;
+
+    std::vector<double> parameters;
+    parameters.push_back( m_SDMBandWidth );
+    parameters.push_back( m_SDMFrameWidth );
+    parameters.push_back( m_SDMPyramidSigma );
+
+    // the reference of a pyramid level does not change between iterations
+    const SizeType levelSize = labels->GetLargestPossibleRegion().GetSize();
+    if( level.m_SDM && level.m_Reference == reference
+        && reference->GetMTime() < level.m_ComputeTime.GetMTime()
+        && level.m_Parameters == parameters
+        && level.m_SDM->GetLargestPossibleRegion().GetSize() == levelSize )
+    {
+        return level.m_SDM;
+    }
 
-float eps = 0.0001;
-typedef float      PixelType;
-typedef unsigned int maximum,minimum;
-//const   unsigned int        Dimension = 3;
-typedef itk::Image< PixelType, ImageDimension >    ImageType;
-//typedef itk::Image<float, ImageDimension>          FloatImageType;
-
-typedef  itk::SignedMaurerDistanceMapImageFilter< ImageType, ImageType  > SignedMaurerDistanceMapImageFilterType;
+    // number of decimations from the reference down to the level
+    SizeType size = reference->GetLargestPossibleRegion().GetSize();
+    unsigned int numberOfDecimations = 0;
+    while( size != levelSize )
+    {
+        for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+        {
+            if( size[dim] <= levelSize[dim] )
+            {
+                itkExceptionMacro( << "The SDM reference images must be finer levels of the label images." );
+            }
+        }
+        size = SDMPyramidType::GetDownsampledSize( size );
+        ++numberOfDecimations;
+    }
 
-  typedef itk::ImageDuplicator< ImageType > DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(m_FixedImageWarper->GetOutput());
-  duplicator->Update();
-  typename ImageType::Pointer image_label = duplicator->GetOutput();
+    typename SDMCacheType::KeyType fullKey;
+    typename SDMCacheType::KeyType levelKey;
+    const FixedImageType * cachedSDM = NULL;
+    if( m_SDMCache )
+    {
+        fullKey = m_SDMCache->ComputeKey( reference );
+        fullKey.m_Parameters.push_back( m_SDMBandWidth );
+        levelKey = fullKey;
+        levelKey.m_Parameters.push_back( numberOfDecimations );
+        levelKey.m_Parameters.push_back( m_SDMPyramidSigma );
+        cachedSDM = m_SDMCache->Find( levelKey );
+    }
 
+    FixedImagePointer sdm = cachedSDM;
+    if( !sdm )
+    {
+        FixedImagePointer fullSDM = m_SDMCache ? m_SDMCache->Find( fullKey ) : NULL;
+        if( !fullSDM )
+        {
+            fullSDM = this->ComputeSignedDistanceMap( reference );
+            if( m_SDMCache )
+            {
+                m_SDMCache->Insert( fullKey, fullSDM );
+            }
+        }
 
-  typename ImageType::Pointer m_fixedImage = ImageType::New();
-  typename ImageType::Pointer image2 = duplicator->GetOutput();
-  
-//typedef itk::ImageFileWriter< ImageType >  WriterType;
-//typename WriterType::Pointer writer = WriterType::New();
-//writer->SetFileName( "test_warpedfixedimage.nii.gz" );
-//writer->SetInput( m_FixedImageWarper->GetOutput() );
-//writer->Update();
-
-
-
-//image_label = image;
-
-   typedef itk::CastImageFilter< ImageType, ImageType > CastFilterType;
-   typename CastFilterType::Pointer castFilter = CastFilterType::New();
-   castFilter->SetInput(image2);
-   castFilter->Update();
-   m_fixedImage = castFilter->GetOutput();
-
-itk::ImageRegionIterator<ImageType> imageIterator_1(m_fixedImage,m_fixedImage->GetLargestPossibleRegion());
-while(!imageIterator_1.IsAtEnd())
-  {
-     imageIterator_1.Set(0);
-       ++imageIterator_1;
-  }
-
-
-//get the array of labels
-unsigned int array_label[100]={0};
-unsigned int i=0,j,pixelValue_label;
-itk::ImageRegionIterator<ImageType> imageIterator_2(m_FixedImageWarper->GetOutput(),m_FixedImageWarper->GetOutput()->GetLargestPossibleRegion());
-while(!imageIterator_2.IsAtEnd())
-  {
-        pixelValue_label = imageIterator_2.Get();
-	  unsigned int k=0;
-	  if (pixelValue_label !=0)
-  	    {
-    		for(j=1;j<100;j++)
-     		   {
-       	              if( pixelValue_label == array_label[j-1])
-         	         {
-               		    k=k+1;
-         		 }
-     		    }
-   		if(k==0 )
-        	 {
-                    array_label[i]=pixelValue_label;
-                   // std::cout << array_label[i]<< std::endl;
-                    i=i+1;
-         	  }
-
-      
-      }
-   ++imageIterator_2;
-  }
-
-
-// calculate sdt
-unsigned int m;
-for(m=0;array_label[m]>0;m++)
-{
-//get the single label region
-itk::ImageRegionIterator<ImageType> imageIterator_3(m_FixedImageWarper->GetOutput(),m_FixedImageWarper->GetOutput()->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_4(image_label,image_label->GetLargestPossibleRegion());
-while(!imageIterator_3.IsAtEnd())
-  {    
-      unsigned int pixelValue = imageIterator_3.Get();
-      if (pixelValue == array_label[m]) 
+        // the SDMs, unlike the labels, can be smoothed before decimation
+        typename SDMPyramidType::Pointer pyramid = SDMPyramidType::New();
+        pyramid->SetSmoothingSigma( m_SDMPyramidSigma );
+        typename FixedImageType::Pointer coarser;
+        const FixedImageType * finer = fullSDM;
+        for( unsigned int l = 0; l < numberOfDecimations; l++ )
         {
-        imageIterator_4.Set(0);
+            coarser = pyramid->DownsampleImage( finer, SDMPyramidType::SmoothMode );
+            finer = coarser;
         }
-      else
+        if( coarser )
         {
-	  imageIterator_4.Set(1);
-	}
-    ++imageIterator_3;
-    ++imageIterator_4;
-  }
- // sdt the single label region
-typename SignedMaurerDistanceMapImageFilterType::Pointer distanceMapImageFilter = SignedMaurerDistanceMapImageFilterType::New();
-distanceMapImageFilter->SetInput(image_label);
-
-//get the minimum and maximum in the single label sdm
-
-typename ImageType::Pointer image_sdt = ImageType::New();
-image_sdt = distanceMapImageFilter->GetOutput();// because the array_label have a lot zeros label
-image_sdt->Update();
-
-float minimum=0, maximum, pixelValue_am;
-bool flag1=true;
-itk::ImageRegionIterator<ImageType> imageIterator_5(image_sdt,image_sdt->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_6(image_label,image_label->GetLargestPossibleRegion());
-while(!imageIterator_5.IsAtEnd())
-  {
-        pixelValue_am = imageIterator_5.Get();
-           if (imageIterator_6.Get()==0)
-           {
-             if(flag1)
-               {
-                      flag1=false;
-              //        minimum = pixelValue_am;
-                      maximum = pixelValue_am;
-                }
-             if(pixelValue_am < minimum)
-                {
-              //    minimum = pixelValue_am;
-                }
-             else if(pixelValue_am > maximum)
-                {
-                  maximum = pixelValue_am;
-                }
-           }
-    ++imageIterator_5;
-    ++imageIterator_6;
+            coarser->SetSpacing( labels->GetSpacing() );
+            coarser->SetOrigin( labels->GetOrigin() );
+            coarser->SetDirection( labels->GetDirection() );
+            sdm = coarser.GetPointer();
+        }
+        else
+        {
+            sdm = fullSDM;
+        }
+        if( m_SDMCache )
+        {
+            m_SDMCache->Insert( levelKey, sdm );
+        }
+    }
+    else if( m_Profiler )
+    {
+        m_Profiler->AddCount( "sdm_cache_hits" );
     }
 
-// norm the sdt single region and send it to totalsignedmap
-float pixelValue_sdt, pixelValue_sdt_norm,diff;
-diff=(maximum-minimum)+eps;  // may be zeros, should be think again;
-//std::cout<< "fixed the diff is: "<<diff<<std::endl;
-//std::cout<< "the minmum is: "<<minimum<<std::endl;
-bool flag2; // for debug only
-itk::ImageRegionIterator<ImageType> imageIterator_7(image_sdt,image_sdt->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_8(image_label,image_label->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_9(m_fixedImage,m_fixedImage->GetLargestPossibleRegion());
-while(!imageIterator_7.IsAtEnd())
-  {
-        pixelValue_sdt = imageIterator_7.Get();
-        if (imageIterator_8.Get()==0)
-	{
-	      pixelValue_sdt_norm = (pixelValue_sdt-minimum)/diff;
-          pixelValue_sdt_norm = pixelValue_sdt_norm*255;
-	      imageIterator_9.Set(pixelValue_sdt_norm);
-	}
-    ++imageIterator_7;
-    ++imageIterator_8;
-    ++imageIterator_9;
-  }
-
-}
-typedef itk::ImageFileWriter< ImageType >  WriterType;
-typename WriterType::Pointer writer1 = WriterType::New();
-writer1->SetFileName( "test_warpedfixedsdmimage.nii.gz" );
-writer1->SetInput( m_fixedImage.GetPointer() );
-writer1->Update();
-this->SetFixedSDMImage(m_fixedImage);
-
+    level.m_Reference = reference;
+    level.m_Parameters = parameters;
+    level.m_SDM = sdm;
+    level.m_ComputeTime.Modified();
+    return sdm;
 }
 
 
 template <class TFixedImage, class TMovingImage, class TDeformationField>
 void ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
-    ::SignedDistanceMap_orignalmovingImage()
+    ::SignedDistanceMap_movingImage()
 {
-
-float eps = 0.0001;
-typedef float      PixelType;
-typedef unsigned int maximum,minimum;
-typedef itk::Image< PixelType, ImageDimension >    ImageType;
-
-typedef  itk::SignedMaurerDistanceMapImageFilter< ImageType, ImageType  > SignedMaurerDistanceMapImageFilterType;
-
-  typedef itk::ImageDuplicator< ImageType > DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(this->GetMovingImage());
-  duplicator->Update();
-
-  typename ImageType::Pointer image_label2 = duplicator->GetOutput();
-
-  typename DuplicatorType::Pointer duplicator1 = DuplicatorType::New();
-  duplicator1->SetInputImage(this->GetMovingImage());
-  duplicator1->Update();
-  typename ImageType::Pointer image_initial = duplicator1->GetOutput();
-
-  typename ImageType::Pointer m_orignalmovingImage = ImageType::New();
-  typename ImageType::Pointer image22 = duplicator->GetOutput();
-
-   typedef itk::CastImageFilter< ImageType, ImageType > CastFilterType;
-   typename CastFilterType::Pointer castFilter = CastFilterType::New();
-   castFilter->SetInput(image22);
-   castFilter->Update();
-   m_orignalmovingImage = castFilter->GetOutput();
-
-itk::ImageRegionIterator<ImageType> imageIterator_1(m_orignalmovingImage,m_orignalmovingImage->GetLargestPossibleRegion());
-while(!imageIterator_1.IsAtEnd())
-  {
-     imageIterator_1.Set(0);
-       ++imageIterator_1;
-  }
-
-
-//get the array of labels
-unsigned int array_label[100]={0};
-unsigned int i=0,j,pixelValue_label;
-itk::ImageRegionIterator<ImageType> imageIterator_2(image_initial,image_initial->GetLargestPossibleRegion());
-while(!imageIterator_2.IsAtEnd())
-  {
-        pixelValue_label = imageIterator_2.Get();
-	  unsigned int k=0;
-	  if (pixelValue_label !=0)
-  	    {
-    		for(j=1;j<100;j++)
-     		   {
-       	              if( pixelValue_label == array_label[j-1])
-         	         {
-               		    k=k+1;
-         		 }
-     		    }
-   		if(k==0 )
-        	 {
-                    array_label[i]=pixelValue_label;
-                   // std::cout << array_label[i]<< std::endl;
-                    i=i+1;
-         	  }
-
-            }
-   ++imageIterator_2;
-  }
+    this->SetMovingSDMImage( this->ComputeSignedDistanceMap( m_MovingImageWarper->GetOutput() ) );
+}
 
 
-// calculate sdt
-unsigned int m;
-for(m=0;array_label[m]>0;m++)
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+void ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
+    ::SignedDistanceMap_fixedImage()
 {
-//get the single label region
-itk::ImageRegionIterator<ImageType> imageIterator_3(image_initial,image_initial->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_4(image_label2,image_label2->GetLargestPossibleRegion());
-while(!imageIterator_3.IsAtEnd())
-  {    
-      unsigned int pixelValue = imageIterator_3.Get();
-      if (pixelValue == array_label[m]) 
-        {
-        imageIterator_4.Set(0);
-        }
-      else
-        {
-	  imageIterator_4.Set(1);
-	}
-    ++imageIterator_3;
-    ++imageIterator_4;
-  }
- // sdt the single label region
-typename SignedMaurerDistanceMapImageFilterType::Pointer distanceMapImageFilter = SignedMaurerDistanceMapImageFilterType::New();
-distanceMapImageFilter->SetInput(image_label2);
-
-//get the minimum and maximum in the single label sdm
-
-typename ImageType::Pointer image_sdt2 = ImageType::New();
-image_sdt2 = distanceMapImageFilter->GetOutput();// because the array_label have a lot zeros label
-image_sdt2->Update();
-
-float minimum=0, maximum, pixelValue_am;
-bool flag1=true;
-itk::ImageRegionIterator<ImageType> imageIterator_5(image_sdt2,image_sdt2->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_6(image_label2,image_label2->GetLargestPossibleRegion());
-while(!imageIterator_5.IsAtEnd())
-  {
-        pixelValue_am = imageIterator_5.Get();
-           if (imageIterator_6.Get()==0)
-           {
-             if(flag1)
-               {
-                      flag1=false;
-              //        minimum = pixelValue_am;
-                      maximum = pixelValue_am;
-                }
-             if(pixelValue_am < minimum)
-                {
-              //    minimum = pixelValue_am;
-                }
-             else if(pixelValue_am > maximum)
-                {
-                  maximum = pixelValue_am;
-                }
-           }
-    ++imageIterator_5;
-    ++imageIterator_6;
-    }
+    this->SetFixedSDMImage( this->ComputeSignedDistanceMap( m_FixedImageWarper->GetOutput() ) );
+}
 
-// norm the sdt single region and send it to totalsignedmap
-float pixelValue_sdt, pixelValue_sdt_norm,diff;
-diff=(maximum-minimum)+eps;  // may be zeros, should be think again;
-//std::cout<< "moving the diff is: "<<diff<<std::endl;
-//std::cout<< "the minmum is: "<<minimum<<std::endl;
-bool flag2; // for debug only
-itk::ImageRegionIterator<ImageType> imageIterator_7(image_sdt2,image_sdt2->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_8(image_label2,image_label2->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_9(m_orignalmovingImage,m_orignalmovingImage->GetLargestPossibleRegion());
-while(!imageIterator_7.IsAtEnd())
-  {
-        pixelValue_sdt = imageIterator_7.Get();
-        if (imageIterator_8.Get()==0)
-	{
-	      pixelValue_sdt_norm = (pixelValue_sdt-minimum)/diff;
-          pixelValue_sdt_norm = pixelValue_sdt_norm*255;
-	      imageIterator_9.Set(pixelValue_sdt_norm);
-	}
-    ++imageIterator_7;
-    ++imageIterator_8;
-    ++imageIterator_9;
-  }
 
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+void ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
+    ::SignedDistanceMap_orignalmovingImage()
+{
+    this->SetorignalMovingSDMImage( this->ComputeSignedDistanceMap( this->GetMovingImage() ) );
 }
 
-this->SetorignalMovingSDMImage(m_orignalmovingImage);
-} 
-    
 
 template <class TFixedImage, class TMovingImage, class TDeformationField>
 void ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
     ::SignedDistanceMap_orignalfixedImage()
 {
+    this->SetorignalFixedSDMImage( this->ComputeSignedDistanceMap( this->GetFixedImage() ) );
+}
+    
 
-float eps = 0.0001;
-typedef float      PixelType;
-typedef unsigned int maximum,minimum;
-typedef itk::Image< PixelType, ImageDimension >    ImageType;
-typedef  itk::SignedMaurerDistanceMapImageFilter< ImageType, ImageType  > SignedMaurerDistanceMapImageFilterType;
-
-  typedef itk::ImageDuplicator< ImageType > DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(this->GetFixedImage());
-  duplicator->Update();
-
-//typedef itk::ImageFileWriter< ImageType >  WriterType;
-//typename WriterType::Pointer writer1 = WriterType::New();
-//writer1->SetFileName( "test_fixedimage.nii.gz" );
-//writer1->SetInput( this->GetFixedImage() );
-//writer1->Update();
-
-  
-  typename ImageType::Pointer image_label = duplicator->GetOutput();
-
-  typename DuplicatorType::Pointer duplicator2 = DuplicatorType::New();
-  duplicator2->SetInputImage(this->GetFixedImage());
-  duplicator2->Update();
-typename ImageType::Pointer image_initial = duplicator2->GetOutput();
-  typename ImageType::Pointer m_orignalfixedImage = ImageType::New();
-  typename ImageType::Pointer image2 = duplicator->GetOutput();
-
-   typedef itk::CastImageFilter< ImageType, ImageType > CastFilterType;
-   typename CastFilterType::Pointer castFilter = CastFilterType::New();
-   castFilter->SetInput(image2);
-   castFilter->Update();
-   m_orignalfixedImage = castFilter->GetOutput();
-
-itk::ImageRegionIterator<ImageType> imageIterator_1(m_orignalfixedImage,m_orignalfixedImage->GetLargestPossibleRegion());
-while(!imageIterator_1.IsAtEnd())
-  {
-     imageIterator_1.Set(0);
-       ++imageIterator_1;
-  }
-
-
-//get the array of labels
-unsigned int array_label[100]={0};
-unsigned int i=0,j,pixelValue_label;
-itk::ImageRegionIterator<ImageType> imageIterator_2(image_initial,image_initial->GetLargestPossibleRegion());
-while(!imageIterator_2.IsAtEnd())
-  {
-        pixelValue_label = imageIterator_2.Get();
-	  unsigned int k=0;
-	  if (pixelValue_label !=0)
-  	    {
-    		for(j=1;j<100;j++)
-     		   {
-       	              if( pixelValue_label == array_label[j-1])
-         	         {
-               		    k=k+1;
-         		 }
-     		    }
-   		if(k==0 )
-        	 {
-                    array_label[i]=pixelValue_label;
-                   // std::cout << array_label[i]<< std::endl;
-                    i=i+1;
-         	  }
-
-            }
-   ++imageIterator_2;
-  }
-
-
-// calculate sdt
-unsigned int m;
-for(m=0;array_label[m]>0;m++)
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+void ESMInvConDemonsRegistrationFunction<TFixedImage,TMovingImage,TDeformationField>
+    ::WarpSignedDistanceMaps()
 {
-//get the single label region
-itk::ImageRegionIterator<ImageType> imageIterator_3(image_initial,image_initial->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_4(image_label,image_label->GetLargestPossibleRegion());
-while(!imageIterator_3.IsAtEnd())
-  {    
-      unsigned int pixelValue = imageIterator_3.Get();
-      if (pixelValue == array_label[m]) 
-        {
-        imageIterator_4.Set(0);
-        }
-      else
-        {
-	  imageIterator_4.Set(1);
-	}
-    ++imageIterator_3;
-    ++imageIterator_4;
-  }
- // sdt the single label region
-typename SignedMaurerDistanceMapImageFilterType::Pointer distanceMapImageFilter = SignedMaurerDistanceMapImageFilterType::New();
-distanceMapImageFilter->SetInput(image_label);
-
-//get the minimum and maximum in the single label sdm
-
-typename ImageType::Pointer image_sdt = ImageType::New();
-image_sdt = distanceMapImageFilter->GetOutput();// because the array_label have a lot zeros label
-image_sdt->Update();
-
-float minimum=0, maximum, pixelValue_am;
-bool flag1=true;
-itk::ImageRegionIterator<ImageType> imageIterator_5(image_sdt,image_sdt->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_6(image_label,image_label->GetLargestPossibleRegion());
-while(!imageIterator_5.IsAtEnd())
-  {
-        pixelValue_am = imageIterator_5.Get();
-           if (imageIterator_6.Get()==0)
-           {
-             if(flag1)
-               {
-                      flag1=false;
-              //        minimum = pixelValue_am;
-                      maximum = pixelValue_am;
-                }
-             if(pixelValue_am < minimum)
-                {
-              //    minimum = pixelValue_am;
-                }
-             else if(pixelValue_am > maximum)
-                {
-                  maximum = pixelValue_am;
-                }
-           }
-    ++imageIterator_5;
-    ++imageIterator_6;
-    }
-
-// norm the sdt single region and send it to totalsignedmap
-float pixelValue_sdt, pixelValue_sdt_norm,diff;
-diff=(maximum-minimum)+eps;  // may be zeros, should be think again;
-//std::cout<< "moving the diff is: "<<diff<<std::endl;
-//std::cout<< "the minmum is: "<<minimum<<std::endl;
-bool flag2; // for debug only
-itk::ImageRegionIterator<ImageType> imageIterator_7(image_sdt,image_sdt->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_8(image_label,image_label->GetLargestPossibleRegion());
-itk::ImageRegionIterator<ImageType> imageIterator_9(m_orignalfixedImage,m_orignalfixedImage->GetLargestPossibleRegion());
-while(!imageIterator_7.IsAtEnd())
-  {
-        pixelValue_sdt = imageIterator_7.Get();
-        if (imageIterator_8.Get()==0)
-	{
-	      pixelValue_sdt_norm = (pixelValue_sdt-minimum)/diff;
-          pixelValue_sdt_norm = pixelValue_sdt_norm*255;
-	      imageIterator_9.Set(pixelValue_sdt_norm);
-	}
-    ++imageIterator_7;
-    ++imageIterator_8;
-    ++imageIterator_9;
-  }
-
+    // resample the SDMs of the unwarped label images instead of
+    // recomputing the SDMs of the warped ones
+    m_MovingSDMWarper->SetOutputSpacing( this->GetFixedImage()->GetSpacing() );
+    m_MovingSDMWarper->SetOutputOrigin( this->GetFixedImage()->GetOrigin() );
+    m_MovingSDMWarper->SetOutputDirection( this->GetFixedImage()->GetDirection() );
+    m_MovingSDMWarper->SetInput( this->GetorignalMovingSDMImage() );
+    m_MovingSDMWarper->SetDeformationField( this->GetDeformationField() );
+    m_MovingSDMWarper->GetOutput()->SetRequestedRegion( this->GetDeformationField()->GetRequestedRegion() );
+    m_MovingSDMWarper->Update();
+    this->SetMovingSDMImage( m_MovingSDMWarper->GetOutput() );
+
+    m_FixedSDMWarper->SetOutputSpacing( this->GetFixedImage()->GetSpacing() );
+    m_FixedSDMWarper->SetOutputOrigin( this->GetFixedImage()->GetOrigin() );
+    m_FixedSDMWarper->SetOutputDirection( this->GetFixedImage()->GetDirection() );
+    m_FixedSDMWarper->SetInput( this->GetorignalFixedSDMImage() );
+    m_FixedSDMWarper->SetDeformationField( this->GetInvDeformationField() );
+    m_FixedSDMWarper->GetOutput()->SetRequestedRegion( this->GetInvDeformationField()->GetRequestedRegion() );
+    m_FixedSDMWarper->Update();
+    this->SetFixedSDMImage( m_FixedSDMWarper->GetOutput() );
 }
-//typedef itk::ImageFileWriter< ImageType >  WriterType;
-//typename WriterType::Pointer writer = WriterType::New();
-//writer->SetFileName( "test_fixedsdmimage.nii.gz" );
-//writer->SetInput( m_orignalfixedImage.GetPointer() );
-//writer->Update();
 
 
-this->SetorignalFixedSDMImage(m_orignalfixedImage);
-} 
-    
-
 /**
  * Update the metric and release the per-thread-global data.
  */
@@ -0,0 +1,479 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkESMInvConDemonsRowKernel.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkESMInvConDemonsRowKernel_h
+#define __itkESMInvConDemonsRowKernel_h
+
+// Vectorized evaluation of the ESMInvConDemonsRegistrationFunction update
+// along a row of 3D float images. This header only depends on the compiler
+// intrinsics so that it can be built and checked on its own.
+//
+// The kernel works on double lanes (4 with AVX, 2 with SSE4.1) and repeats
+// the scalar ComputeUpdate operation by operation, so the updates and the
+// metric sums are the same bits as the scalar code (unless the latter is
+// built with contracted multiply-adds, e.g. -march with FMA in GNU mode,
+// in which case they agree to float rounding). The instruction set is
+// picked at run time; where none is available (or on compilers without
+// target attributes) the kernel reports that it processed nothing and the
+// caller falls back to the scalar code. Define ITK_ESM_NO_SIMD to disable
+// it altogether.
+
+#include <cfloat>
+
+#if !defined(ITK_ESM_NO_SIMD) \
+  && ( defined(__x86_64__) || defined(__i386__) ) \
+  && ( defined(__clang__) \
+    || ( defined(__GNUC__) && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) ) ) )
+#define ITK_ESM_ROW_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+namespace itk {
+
+namespace ESMInvConDemonsDetail {
+
+/** Inputs of one row, and the running metric sums it adds to. The image
+ * pointers point at the first voxel of the row; the row must stay at
+ * least one voxel away from the region border along every axis. */
+struct RowKernelArguments
+{
+  const float * m_WarpedFixedSDM;
+  const float * m_WarpedMovingSDM;
+  const float * m_FixedSDM;
+  const float * m_MovingSDM;
+  const float * m_JacobianDet;        // NULL: weight of 1
+  const float * m_FwWeight;           // NULL: weight of 1
+  long          m_Stride[3];          // m_Stride[0] must be 1
+  double        m_Spacing[3];
+  double        m_RegWeight;
+  double        m_IntensityDifferenceThreshold;
+
+  double        m_SumOfSquaredDifference;
+  unsigned long m_NumberOfPixelsProcessed;
+  double        m_SumOfSquaredChange;
+};
+
+/** Instruction sets the row kernel can use. */
+enum RowKernelInstructionSet
+{
+  ScalarInstructions = 0,
+  SSE41Instructions,
+  AVXInstructions
+};
+
+#if defined(ITK_ESM_ROW_KERNEL_X86)
+
+/** Per-lane tail of the kernel: store the float update and add the lane
+ * to the metric sums in voxel order, as ComputeUpdate does. */
+inline void RowKernelStoreLanes( RowKernelArguments & args, unsigned int lanes,
+                                 const double * u0, const double * u1,
+                                 const double * u2, const double * speed,
+                                 const double * invalid, float * update )
+{
+  for( unsigned int l = 0; l < lanes; l++ )
+    {
+    float * u = update + 3 * l;
+    if( invalid[l] != 0.0 )
+      {
+      u[0] = u[1] = u[2] = 0.0f;
+      continue;
+      }
+    u[0] = static_cast<float>( u0[l] );
+    u[1] = static_cast<float>( u1[l] );
+    u[2] = static_cast<float>( u2[l] );
+
+    double squaredNorm = 0.0;
+    for( unsigned int k = 0; k < 3; k++ )
+      {
+      const double value = u[k];
+      squaredNorm += value * value;
+      }
+    args.m_SumOfSquaredDifference += speed[l] * speed[l];
+    args.m_NumberOfPixelsProcessed += 1;
+    args.m_SumOfSquaredChange += squaredNorm;
+    }
+}
+
+/** Derivative of an SDM along one axis away from the border, see
+ * SDMDerivative. */
+__attribute__((target("avx")))
+inline __m256d RowKernelDerivativeAVX( const float * center, __m256d centerValue,
+                                       long stride, __m256d spacing,
+                                       __m256d halfOverSpacing )
+{
+  const __m256d outside = _mm256_set1_pd( static_cast<double>( FLT_MAX ) );
+  const __m256d next = _mm256_cvtps_pd( _mm_loadu_ps( center + stride ) );
+  const __m256d previous = _mm256_cvtps_pd( _mm_loadu_ps( center - stride ) );
+  const __m256d nextOutside = _mm256_cmp_pd( next, outside, _CMP_EQ_OQ );
+  const __m256d previousOutside = _mm256_cmp_pd( previous, outside, _CMP_EQ_OQ );
+
+  __m256d derivative = _mm256_mul_pd( _mm256_sub_pd( next, previous ), halfOverSpacing );
+  derivative = _mm256_blendv_pd( derivative,
+    _mm256_div_pd( _mm256_sub_pd( next, centerValue ), spacing ), previousOutside );
+  derivative = _mm256_blendv_pd( derivative,
+    _mm256_div_pd( _mm256_sub_pd( centerValue, previous ), spacing ), nextOutside );
+  return _mm256_blendv_pd( derivative, _mm256_setzero_pd(),
+    _mm256_and_pd( nextOutside, previousOutside ) );
+}
+
+/** Four voxels at a time. Returns the number of voxels processed. */
+__attribute__((target("avx")))
+inline long RowKernelAVX( RowKernelArguments & args, long length, float * update )
+{
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd( 1.0 );
+  const __m256d four = _mm256_set1_pd( 4.0 );
+  const __m256d quarter = _mm256_set1_pd( 0.25 );
+  const __m256d outside = _mm256_set1_pd( static_cast<double>( FLT_MAX ) );
+  const __m256d signMask = _mm256_set1_pd( -0.0 );
+  const __m256d regWeight = _mm256_set1_pd( args.m_RegWeight );
+  const __m256d threshold = _mm256_set1_pd( args.m_IntensityDifferenceThreshold );
+  __m256d spacing[3];
+  __m256d halfOverSpacing[3];
+  for( unsigned int dim = 0; dim < 3; dim++ )
+    {
+    spacing[dim] = _mm256_set1_pd( args.m_Spacing[dim] );
+    halfOverSpacing[dim] = _mm256_set1_pd( 0.5 / args.m_Spacing[dim] );
+    }
+
+  double u0[4], u1[4], u2[4], speedLanes[4], invalidLanes[4];
+  long x = 0;
+  for( ; x + 4 <= length; x += 4 )
+    {
+    const float * warpedFixedPtr = args.m_WarpedFixedSDM + x;
+    const float * warpedMovingPtr = args.m_WarpedMovingSDM + x;
+    const __m256d warpedFixed = _mm256_cvtps_pd( _mm_loadu_ps( warpedFixedPtr ) );
+    const __m256d warpedMoving = _mm256_cvtps_pd( _mm_loadu_ps( warpedMovingPtr ) );
+    const __m256d fixed = _mm256_cvtps_pd( _mm_loadu_ps( args.m_FixedSDM + x ) );
+    const __m256d moving = _mm256_cvtps_pd( _mm_loadu_ps( args.m_MovingSDM + x ) );
+    const __m256d jacobian = args.m_JacobianDet ?
+      _mm256_cvtps_pd( _mm_loadu_ps( args.m_JacobianDet + x ) ) : one;
+    const __m256d fwWeight = args.m_FwWeight ?
+      _mm256_cvtps_pd( _mm_loadu_ps( args.m_FwWeight + x ) ) : one;
+
+    // mapped outside of the images
+    const __m256d invalid = _mm256_or_pd(
+      _mm256_cmp_pd( warpedFixed, outside, _CMP_EQ_OQ ),
+      _mm256_cmp_pd( warpedMoving, outside, _CMP_EQ_OQ ) );
+
+    __m256d gm[3], gf[3];
+    for( unsigned int dim = 0; dim < 3; dim++ )
+      {
+      gm[dim] = RowKernelDerivativeAVX( warpedMovingPtr, warpedMoving,
+        args.m_Stride[dim], spacing[dim], halfOverSpacing[dim] );
+      gf[dim] = RowKernelDerivativeAVX( warpedFixedPtr, warpedFixed,
+        args.m_Stride[dim], spacing[dim], halfOverSpacing[dim] );
+      }
+
+    const __m256d speed = _mm256_sub_pd( fixed, warpedMoving );
+    const __m256d speed2 = _mm256_sub_pd( warpedFixed, moving );
+
+    const __m256d movingWeight = _mm256_mul_pd( quarter, fwWeight );
+    const __m256d fixedWeight = _mm256_mul_pd( jacobian, quarter );
+    const __m256d jacobianScale = _mm256_blendv_pd( one, four,
+      _mm256_cmp_pd( jacobian, zero, _CMP_EQ_OQ ) );
+
+    __m256d hess[3][3];
+    __m256d temp[3];
+    const __m256d movingSpeed = _mm256_mul_pd( movingWeight, speed );
+    const __m256d fixedSpeed = _mm256_mul_pd( fixedWeight, speed2 );
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      for( unsigned int j = i; j < 3; j++ )
+        {
+        hess[i][j] = _mm256_mul_pd( jacobianScale, _mm256_add_pd(
+          _mm256_mul_pd( movingWeight, _mm256_mul_pd( gm[i], gm[j] ) ),
+          _mm256_mul_pd( fixedWeight, _mm256_mul_pd( gf[i], gf[j] ) ) ) );
+        hess[j][i] = hess[i][j];
+        }
+      hess[i][i] = _mm256_add_pd( hess[i][i], regWeight );
+      temp[i] = _mm256_mul_pd( jacobianScale, _mm256_add_pd(
+        _mm256_mul_pd( movingSpeed, gm[i] ), _mm256_mul_pd( fixedSpeed, gf[i] ) ) );
+      }
+
+    // closed form inverse, in the order of SmallMatrixInverse<3>, zero
+    // when singular
+    __m256d det = _mm256_mul_pd( _mm256_mul_pd( hess[0][0], hess[1][1] ), hess[2][2] );
+    det = _mm256_sub_pd( det, _mm256_mul_pd( _mm256_mul_pd( hess[0][0], hess[2][1] ), hess[1][2] ) );
+    det = _mm256_sub_pd( det, _mm256_mul_pd( _mm256_mul_pd( hess[1][0], hess[0][1] ), hess[2][2] ) );
+    det = _mm256_add_pd( det, _mm256_mul_pd( _mm256_mul_pd( hess[1][0], hess[2][1] ), hess[0][2] ) );
+    det = _mm256_add_pd( det, _mm256_mul_pd( _mm256_mul_pd( hess[2][0], hess[0][1] ), hess[1][2] ) );
+    det = _mm256_sub_pd( det, _mm256_mul_pd( _mm256_mul_pd( hess[2][0], hess[1][1] ), hess[0][2] ) );
+    const __m256d singular = _mm256_cmp_pd( det, zero, _CMP_EQ_OQ );
+    det = _mm256_div_pd( one, det );
+
+    __m256d inv[3][3];
+    inv[0][0] = _mm256_mul_pd( _mm256_sub_pd( _mm256_mul_pd( hess[1][1], hess[2][2] ),
+      _mm256_mul_pd( hess[1][2], hess[2][1] ) ), det );
+    inv[0][1] = _mm256_mul_pd( _mm256_sub_pd( _mm256_mul_pd( hess[2][1], hess[0][2] ),
+      _mm256_mul_pd( hess[2][2], hess[0][1] ) ), det );
+    inv[0][2] = _mm256_mul_pd( _mm256_sub_pd( _mm256_mul_pd( hess[0][1], hess[1][2] ),
+      _mm256_mul_pd( hess[0][2], hess[1][1] ) ), det );
+    inv[1][1] = _mm256_mul_pd( _mm256_sub_pd( _mm256_mul_pd( hess[0][0], hess[2][2] ),
+      _mm256_mul_pd( hess[0][2], hess[2][0] ) ), det );
+    inv[1][2] = _mm256_mul_pd( _mm256_sub_pd( _mm256_mul_pd( hess[1][0], hess[0][2] ),
+      _mm256_mul_pd( hess[1][2], hess[0][0] ) ), det );
+    inv[2][2] = _mm256_mul_pd( _mm256_sub_pd( _mm256_mul_pd( hess[0][0], hess[1][1] ),
+      _mm256_mul_pd( hess[0][1], hess[1][0] ) ), det );
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      for( unsigned int j = i; j < 3; j++ )
+        {
+        inv[i][j] = _mm256_blendv_pd( inv[i][j], zero, singular );
+        inv[j][i] = inv[i][j];
+        }
+      }
+
+    // intensities already match: no update
+    const __m256d match = _mm256_or_pd(
+      _mm256_cmp_pd( _mm256_andnot_pd( signMask, speed ), threshold, _CMP_LT_OQ ),
+      _mm256_cmp_pd( _mm256_andnot_pd( signMask, speed2 ), threshold, _CMP_LT_OQ ) );
+    
+    __m256d u[3];
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      __m256d sum = zero;
+      for( unsigned int j = 0; j < 3; j++ )
+        {
+        sum = _mm256_add_pd( sum, _mm256_mul_pd( inv[i][j], temp[j] ) );
+        }
+      u[i] = _mm256_blendv_pd( sum, zero, match );
+      }
+
+    _mm256_storeu_pd( u0, u[0] );
+    _mm256_storeu_pd( u1, u[1] );
+    _mm256_storeu_pd( u2, u[2] );
+    _mm256_storeu_pd( speedLanes, speed );
+    _mm256_storeu_pd( invalidLanes, _mm256_and_pd( invalid, one ) );
+    RowKernelStoreLanes( args, 4, u0, u1, u2, speedLanes, invalidLanes, update + 3 * x );
+    }
+  return x;
+}
+
+/** Derivative of an SDM along one axis away from the border, see
+ * SDMDerivative. */
+__attribute__((target("sse4.1")))
+inline __m128d RowKernelDerivativeSSE41( const float * center, __m128d centerValue,
+                                         long stride, __m128d spacing,
+                                         __m128d halfOverSpacing )
+{
+  const __m128d outside = _mm_set1_pd( static_cast<double>( FLT_MAX ) );
+  const __m128d next = _mm_cvtps_pd( _mm_castpd_ps(
+    _mm_load_sd( reinterpret_cast<const double *>( center + stride ) ) ) );
+  const __m128d previous = _mm_cvtps_pd( _mm_castpd_ps(
+    _mm_load_sd( reinterpret_cast<const double *>( center - stride ) ) ) );
+  const __m128d nextOutside = _mm_cmpeq_pd( next, outside );
+  const __m128d previousOutside = _mm_cmpeq_pd( previous, outside );
+
+  __m128d derivative = _mm_mul_pd( _mm_sub_pd( next, previous ), halfOverSpacing );
+  derivative = _mm_blendv_pd( derivative,
+    _mm_div_pd( _mm_sub_pd( next, centerValue ), spacing ), previousOutside );
+  derivative = _mm_blendv_pd( derivative,
+    _mm_div_pd( _mm_sub_pd( centerValue, previous ), spacing ), nextOutside );
+  return _mm_blendv_pd( derivative, _mm_setzero_pd(),
+    _mm_and_pd( nextOutside, previousOutside ) );
+}
+
+/** Two floats widened to double lanes. */
+__attribute__((target("sse4.1")))
+inline __m128d RowKernelLoadSSE41( const float * p )
+{
+  return _mm_cvtps_pd( _mm_castpd_ps( _mm_load_sd( reinterpret_cast<const double *>( p ) ) ) );
+}
+
+/** Two voxels at a time. Returns the number of voxels processed. */
+__attribute__((target("sse4.1")))
+inline long RowKernelSSE41( RowKernelArguments & args, long length, float * update )
+{
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d one = _mm_set1_pd( 1.0 );
+  const __m128d four = _mm_set1_pd( 4.0 );
+  const __m128d quarter = _mm_set1_pd( 0.25 );
+  const __m128d outside = _mm_set1_pd( static_cast<double>( FLT_MAX ) );
+  const __m128d signMask = _mm_set1_pd( -0.0 );
+  const __m128d regWeight = _mm_set1_pd( args.m_RegWeight );
+  const __m128d threshold = _mm_set1_pd( args.m_IntensityDifferenceThreshold );
+  __m128d spacing[3];
+  __m128d halfOverSpacing[3];
+  for( unsigned int dim = 0; dim < 3; dim++ )
+    {
+    spacing[dim] = _mm_set1_pd( args.m_Spacing[dim] );
+    halfOverSpacing[dim] = _mm_set1_pd( 0.5 / args.m_Spacing[dim] );
+    }
+
+  double u0[2], u1[2], u2[2], speedLanes[2], invalidLanes[2];
+  long x = 0;
+  for( ; x + 2 <= length; x += 2 )
+    {
+    const float * warpedFixedPtr = args.m_WarpedFixedSDM + x;
+    const float * warpedMovingPtr = args.m_WarpedMovingSDM + x;
+    const __m128d warpedFixed = RowKernelLoadSSE41( warpedFixedPtr );
+    const __m128d warpedMoving = RowKernelLoadSSE41( warpedMovingPtr );
+    const __m128d fixed = RowKernelLoadSSE41( args.m_FixedSDM + x );
+    const __m128d moving = RowKernelLoadSSE41( args.m_MovingSDM + x );
+    const __m128d jacobian = args.m_JacobianDet ?
+      RowKernelLoadSSE41( args.m_JacobianDet + x ) : one;
+    const __m128d fwWeight = args.m_FwWeight ?
+      RowKernelLoadSSE41( args.m_FwWeight + x ) : one;
+
+    // mapped outside of the images
+    const __m128d invalid = _mm_or_pd( _mm_cmpeq_pd( warpedFixed, outside ),
+                                       _mm_cmpeq_pd( warpedMoving, outside ) );
+
+    __m128d gm[3], gf[3];
+    for( unsigned int dim = 0; dim < 3; dim++ )
+      {
+      gm[dim] = RowKernelDerivativeSSE41( warpedMovingPtr, warpedMoving,
+        args.m_Stride[dim], spacing[dim], halfOverSpacing[dim] );
+      gf[dim] = RowKernelDerivativeSSE41( warpedFixedPtr, warpedFixed,
+        args.m_Stride[dim], spacing[dim], halfOverSpacing[dim] );
+      }
+
+    const __m128d speed = _mm_sub_pd( fixed, warpedMoving );
+    const __m128d speed2 = _mm_sub_pd( warpedFixed, moving );
+
+    const __m128d movingWeight = _mm_mul_pd( quarter, fwWeight );
+    const __m128d fixedWeight = _mm_mul_pd( jacobian, quarter );
+    const __m128d jacobianScale = _mm_blendv_pd( one, four, _mm_cmpeq_pd( jacobian, zero ) );
+
+    __m128d hess[3][3];
+    __m128d temp[3];
+    const __m128d movingSpeed = _mm_mul_pd( movingWeight, speed );
+    const __m128d fixedSpeed = _mm_mul_pd( fixedWeight, speed2 );
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      for( unsigned int j = i; j < 3; j++ )
+        {
+        hess[i][j] = _mm_mul_pd( jacobianScale, _mm_add_pd(
+          _mm_mul_pd( movingWeight, _mm_mul_pd( gm[i], gm[j] ) ),
+          _mm_mul_pd( fixedWeight, _mm_mul_pd( gf[i], gf[j] ) ) ) );
+        hess[j][i] = hess[i][j];
+        }
+      hess[i][i] = _mm_add_pd( hess[i][i], regWeight );
+      temp[i] = _mm_mul_pd( jacobianScale, _mm_add_pd(
+        _mm_mul_pd( movingSpeed, gm[i] ), _mm_mul_pd( fixedSpeed, gf[i] ) ) );
+      }
+
+    // closed form inverse, in the order of SmallMatrixInverse<3>, zero
+    // when singular
+    __m128d det = _mm_mul_pd( _mm_mul_pd( hess[0][0], hess[1][1] ), hess[2][2] );
+    det = _mm_sub_pd( det, _mm_mul_pd( _mm_mul_pd( hess[0][0], hess[2][1] ), hess[1][2] ) );
+    det = _mm_sub_pd( det, _mm_mul_pd( _mm_mul_pd( hess[1][0], hess[0][1] ), hess[2][2] ) );
+    det = _mm_add_pd( det, _mm_mul_pd( _mm_mul_pd( hess[1][0], hess[2][1] ), hess[0][2] ) );
+    det = _mm_add_pd( det, _mm_mul_pd( _mm_mul_pd( hess[2][0], hess[0][1] ), hess[1][2] ) );
+    det = _mm_sub_pd( det, _mm_mul_pd( _mm_mul_pd( hess[2][0], hess[1][1] ), hess[0][2] ) );
+    const __m128d singular = _mm_cmpeq_pd( det, zero );
+    det = _mm_div_pd( one, det );
+
+    __m128d inv[3][3];
+    inv[0][0] = _mm_mul_pd( _mm_sub_pd( _mm_mul_pd( hess[1][1], hess[2][2] ),
+      _mm_mul_pd( hess[1][2], hess[2][1] ) ), det );
+    inv[0][1] = _mm_mul_pd( _mm_sub_pd( _mm_mul_pd( hess[2][1], hess[0][2] ),
+      _mm_mul_pd( hess[2][2], hess[0][1] ) ), det );
+    inv[0][2] = _mm_mul_pd( _mm_sub_pd( _mm_mul_pd( hess[0][1], hess[1][2] ),
+      _mm_mul_pd( hess[0][2], hess[1][1] ) ), det );
+    inv[1][1] = _mm_mul_pd( _mm_sub_pd( _mm_mul_pd( hess[0][0], hess[2][2] ),
+      _mm_mul_pd( hess[0][2], hess[2][0] ) ), det );
+    inv[1][2] = _mm_mul_pd( _mm_sub_pd( _mm_mul_pd( hess[1][0], hess[0][2] ),
+      _mm_mul_pd( hess[1][2], hess[0][0] ) ), det );
+    inv[2][2] = _mm_mul_pd( _mm_sub_pd( _mm_mul_pd( hess[0][0], hess[1][1] ),
+      _mm_mul_pd( hess[0][1], hess[1][0] ) ), det );
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      for( unsigned int j = i; j < 3; j++ )
+        {
+        inv[i][j] = _mm_blendv_pd( inv[i][j], zero, singular );
+        inv[j][i] = inv[i][j];
+        }
+      }
+
+    // intensities already match: no update
+    const __m128d match = _mm_or_pd(
+      _mm_cmplt_pd( _mm_andnot_pd( signMask, speed ), threshold ),
+      _mm_cmplt_pd( _mm_andnot_pd( signMask, speed2 ), threshold ) );
+    
+    __m128d u[3];
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      __m128d sum = zero;
+      for( unsigned int j = 0; j < 3; j++ )
+        {
+        sum = _mm_add_pd( sum, _mm_mul_pd( inv[i][j], temp[j] ) );
+        }
+      u[i] = _mm_blendv_pd( sum, zero, match );
+      }
+
+    _mm_storeu_pd( u0, u[0] );
+    _mm_storeu_pd( u1, u[1] );
+    _mm_storeu_pd( u2, u[2] );
+    _mm_storeu_pd( speedLanes, speed );
+    _mm_storeu_pd( invalidLanes, _mm_and_pd( invalid, one ) );
+    RowKernelStoreLanes( args, 2, u0, u1, u2, speedLanes, invalidLanes, update + 3 * x );
+    }
+  return x;
+}
+
+inline RowKernelInstructionSet DetectRowKernelInstructionSet()
+{
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx" ) )
+    {
+    return AVXInstructions;
+    }
+  if( __builtin_cpu_supports( "sse4.1" ) )
+    {
+    return SSE41Instructions;
+    }
+  return ScalarInstructions;
+}
+
+#endif
+
+/** Best instruction set of the running CPU, detected once. */
+inline RowKernelInstructionSet GetRowKernelInstructionSet()
+{
+#if defined(ITK_ESM_ROW_KERNEL_X86)
+  static const RowKernelInstructionSet instructionSet = DetectRowKernelInstructionSet();
+  return instructionSet;
+#else
+  return ScalarInstructions;
+#endif
+}
+
+/** Compute the updates (3 interleaved floats per voxel) of the first
+ * voxels of a row of the given length, with the given instruction set.
+ * Returns how many voxels were done: a multiple of the lane count, 0 for
+ * ScalarInstructions. The remaining voxels are left to the scalar code. */
+inline long ComputeRowKernel( RowKernelArguments & args, long length, float * update,
+                              RowKernelInstructionSet instructionSet )
+{
+#if defined(ITK_ESM_ROW_KERNEL_X86)
+  switch( instructionSet )
+    {
+    case AVXInstructions:
+      return RowKernelAVX( args, length, update );
+    case SSE41Instructions:
+      return RowKernelSSE41( args, length, update );
+    default:
+      break;
+    }
+#else
+  (void)args; (void)length; (void)update; (void)instructionSet;
+#endif
+  return 0;
+}
+
+} // end namespace ESMInvConDemonsDetail
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,239 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkJointFieldExponentiator.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkJointFieldExponentiator_h
+#define __itkJointFieldExponentiator_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+#include "itkMatrix.h"
+
+namespace itk {
+
+/**
+ * \class JointFieldExponentiator
+ *
+ * \brief exp(v) and exp(-v) of a velocity field by scaling and squaring
+ *
+ * Computes the same as two ExponentialDeformationFieldImageFilter runs
+ * with AutomaticNumberOfIterations on, one on v and one on -v, in a single
+ * pass:
+ *
+ *  - the number of squarings N is derived once from the maximum norm of v
+ *    (it is the same for -v), with the formula of the ITK filter;
+ *  - both fields start at +-v / 2^N;
+ *  - each squaring replaces u by u + u o (Id + u), the composition
+ *    interpolating u linearly and taking it as zero outside the image, as
+ *    WarpVectorImageFilter with a VectorLinearInterpolateImageFunction.
+ *    Both fields are composed in the same sweep, on several threads, each
+ *    working on a slab along the last axis, row by row.
+ *
+ * The interpolation follows the ITK 4 conventions (points up to half a
+ * voxel outside the image are interpolated from the border voxels), so
+ * the result agrees with the ITK filter up to float rounding.
+ *
+ * The output fields are reused by the next Compute() as long as the size
+ * does not change. Without ComputeInverse only exp(v) is computed.
+ *
+ * With ComputeJacobianDeterminant, the Jacobian determinants of the
+ * resulting deformations are computed in a last threaded sweep over both
+ * fields, as DisplacementFieldJacobianDeterminantFilter does without
+ * image spacing.
+ *
+ * Incremental mode: when v is the previous velocity field plus a small
+ * update u, given by SetUpdateField(), Compute() approximates exp(v) by
+ * exp(v - u) o exp(u), and exp(-v) by exp(-u) o exp(-(v - u)), from the
+ * previous results (or those given by SetPreviousDeformationFields()).
+ * exp(u) needs few squarings since u is small. This is exact to first
+ * order only (the fields do not commute), so every RecomputeInterval-th
+ * Compute() starts again from v to bound the drift.
+ *
+ * \sa ExponentialDeformationFieldImageFilter
+ */
+template <class TDeformationField,
+          class TJacobianImage = Image<typename TDeformationField::PixelType::ValueType,
+                                       TDeformationField::ImageDimension> >
+class ITK_EXPORT JointFieldExponentiator : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef JointFieldExponentiator       Self;
+  typedef Object                        Superclass;
+  typedef SmartPointer<Self>            Pointer;
+  typedef SmartPointer<const Self>      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( JointFieldExponentiator, Object );
+
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TDeformationField::ImageDimension);
+
+  /** Field typedefs. */
+  typedef TDeformationField                         DeformationFieldType;
+  typedef typename DeformationFieldType::Pointer    DeformationFieldPointer;
+  typedef typename DeformationFieldType::PixelType  PixelType;
+  typedef typename PixelType::ValueType             ValueType;
+  typedef typename DeformationFieldType::RegionType RegionType;
+  typedef typename DeformationFieldType::IndexType  IndexType;
+  typedef Matrix<double, ImageDimension, ImageDimension> MatrixType;
+  typedef TJacobianImage                            JacobianImageType;
+  typedef typename JacobianImageType::Pointer       JacobianImagePointer;
+  typedef typename JacobianImageType::PixelType     JacobianPixelType;
+
+  /** Velocity field v. */
+  itkSetConstObjectMacro( VelocityField, DeformationFieldType );
+  itkGetConstObjectMacro( VelocityField, DeformationFieldType );
+
+  /** Compute exp(-v) too (default on). */
+  itkSetMacro( ComputeInverse, bool );
+  itkGetConstMacro( ComputeInverse, bool );
+  itkBooleanMacro( ComputeInverse );
+
+  /** Compute the Jacobian determinants of exp(v) (and exp(-v)) too
+   * (default off). */
+  itkSetMacro( ComputeJacobianDeterminant, bool );
+  itkGetConstMacro( ComputeJacobianDeterminant, bool );
+  itkBooleanMacro( ComputeJacobianDeterminant );
+
+  /** Upper bound of the number of squarings (default 2000, as the MEX
+   * functions used with the ITK filter). */
+  itkSetMacro( MaximumNumberOfIterations, unsigned int );
+  itkGetConstMacro( MaximumNumberOfIterations, unsigned int );
+
+  /** Threads used, 0 (the default) uses the ITK default. */
+  itkSetMacro( NumberOfThreads, unsigned int );
+  itkGetConstMacro( NumberOfThreads, unsigned int );
+
+  /** Update u added to the previous velocity field, NULL (the default)
+   * disables the incremental mode. */
+  itkSetConstObjectMacro( UpdateField, DeformationFieldType );
+  itkGetConstObjectMacro( UpdateField, DeformationFieldType );
+
+  /** In incremental mode, every RecomputeInterval-th Compute() is a full
+   * one. 1 (the default) never increments, 0 never recomputes. */
+  itkSetMacro( RecomputeInterval, unsigned int );
+  itkGetConstMacro( RecomputeInterval, unsigned int );
+
+  /** exp(v - u) and exp(-(v - u)) to increment from, instead of the
+   * results of the previous Compute(). The inverse may be NULL without
+   * ComputeInverse. The fields are overwritten by later calls. */
+  void SetPreviousDeformationFields( DeformationFieldType * field,
+                                     DeformationFieldType * inverseField );
+
+  /** Compute exp(v), and exp(-v) with ComputeInverse. */
+  void Compute();
+
+  /** Free the workspaces and increments kept for the next Compute(), as
+   * large as the outputs, when no other call follows. */
+  void ReleaseWorkspace();
+
+  /** Whether the last Compute() incremented the previous results. */
+  itkGetConstMacro( Incremental, bool );
+
+  /** exp(v) and exp(-v) of the last Compute(). */
+  itkGetObjectMacro( DeformationField, DeformationFieldType );
+  itkGetObjectMacro( InverseDeformationField, DeformationFieldType );
+
+  /** Jacobian determinants of the last Compute(), with
+   * ComputeJacobianDeterminant. */
+  itkGetObjectMacro( JacobianDeterminant, JacobianImageType );
+  itkGetObjectMacro( InverseJacobianDeterminant, JacobianImageType );
+
+  /** Number of squarings of the last Compute() (of u if incremental). */
+  itkGetConstMacro( NumberOfIterations, unsigned int );
+
+protected:
+  JointFieldExponentiator();
+  ~JointFieldExponentiator() {}
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Squarings needed for field / 2^N to be at most half a voxel. */
+  unsigned int ComputeNumberOfIterations( const DeformationFieldType * field ) const;
+
+  /** Whether the next Compute() may increment the previous results. */
+  bool CanIncrement() const;
+
+  /** Scaling and squaring of velocity and -velocity. */
+  void Exponentiate( const DeformationFieldType * velocity,
+                     DeformationFieldPointer & field,
+                     DeformationFieldPointer & inverseField );
+
+  /** Compose the fields, each with its shift, see ThreadedCompose. */
+  void ComposeFields( DeformationFieldPointer * fields[2] );
+
+  /** Split the region into slabs along its last non-trivial axis. */
+  unsigned int SplitRegion( unsigned int i, unsigned int n, RegionType & slab ) const;
+
+  /** Compose the fields on a slab. */
+  void ThreadedCompose( const RegionType & slab );
+
+  /** Jacobian determinants of the fields on a slab. */
+  void ThreadedJacobianDeterminant( const RegionType & slab );
+
+  /** Static function used as a "callback" by the MultiThreader. */
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg );
+
+private:
+  JointFieldExponentiator(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  /** A field laid out as the velocity field, reallocated if needed. */
+  void AllocateField( DeformationFieldPointer & field ) const;
+  void AllocateJacobianDeterminant( JacobianImagePointer & image ) const;
+
+  typename DeformationFieldType::ConstPointer  m_VelocityField;
+  typename DeformationFieldType::ConstPointer  m_UpdateField;
+
+  bool                          m_ComputeInverse;
+  unsigned int                  m_MaximumNumberOfIterations;
+  unsigned int                  m_NumberOfThreads;
+  unsigned int                  m_NumberOfIterations;
+  unsigned int                  m_RecomputeInterval;
+  unsigned int                  m_NumberOfIncrements;
+  bool                          m_Incremental;
+  bool                          m_HasPreviousInverse;
+  bool                          m_ComputeJacobianDeterminant;
+
+  DeformationFieldPointer       m_DeformationField;
+  DeformationFieldPointer       m_InverseDeformationField;
+  DeformationFieldPointer       m_Workspace[2];
+  DeformationFieldPointer       m_Increment[2];
+  JacobianImagePointer          m_JacobianDeterminant;
+  JacobianImagePointer          m_InverseJacobianDeterminant;
+
+  /** State of the current pass, read by the threads. */
+  enum ThreadedPassType { ComposePass, JacobianPass };
+  ThreadedPassType              m_ThreadedPass;
+  RegionType                    m_Region;
+  MultiThreader::Pointer        m_Threader;
+  unsigned int                  m_NumberOfSplits;
+  unsigned int                  m_NumberOfSlabs;
+  unsigned int                  m_NumberOfFields;
+  const PixelType *             m_Shift[2];
+  const PixelType *             m_Input[2];
+  PixelType *                   m_Output[2];
+  JacobianPixelType *           m_Determinant[2];
+  MatrixType                    m_PhysicalToIndex;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkJointFieldExponentiator.txx"
+#endif
+
+#endif
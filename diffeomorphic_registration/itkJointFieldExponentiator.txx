@@ -0,0 +1,692 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkJointFieldExponentiator.txx
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkJointFieldExponentiator_txx
+#define __itkJointFieldExponentiator_txx
+
+#include "itkJointFieldExponentiator.h"
+
+#include "vnl/vnl_det.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace itk {
+
+/**
+ * Default constructor
+ */
+template <class TDeformationField, class TJacobianImage>
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::JointFieldExponentiator()
+{
+  m_ComputeInverse = true;
+  m_MaximumNumberOfIterations = 2000;
+  m_NumberOfThreads = 0;
+  m_NumberOfIterations = 0;
+  m_RecomputeInterval = 1;
+  m_NumberOfIncrements = 0;
+  m_Incremental = false;
+  m_HasPreviousInverse = false;
+  m_ComputeJacobianDeterminant = false;
+  m_ThreadedPass = ComposePass;
+  m_NumberOfSplits = 1;
+  m_NumberOfSlabs = 1;
+  m_NumberOfFields = 0;
+  for( unsigned int f = 0; f < 2; f++ )
+    {
+    m_Shift[f] = NULL;
+    m_Input[f] = NULL;
+    m_Output[f] = NULL;
+    m_Determinant[f] = NULL;
+    }
+  m_Threader = MultiThreader::New();
+}
+
+
+/**
+ * Same rationale as ExponentialDeformationFieldImageFilter: the first
+ * order approximation exp(v/2^N) = v/2^N is diffeomorphic if v/2^N is at
+ * most half a voxel in each direction
+ */
+template <class TDeformationField, class TJacobianImage>
+unsigned int
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::ComputeNumberOfIterations( const DeformationFieldType * field ) const
+{
+  double minPixelSpacing = field->GetSpacing()[0];
+  for( unsigned int i = 1; i < ImageDimension; i++ )
+    {
+    minPixelSpacing = std::min( minPixelSpacing,
+      static_cast<double>( field->GetSpacing()[i] ) );
+    }
+
+  const PixelType * v = field->GetBufferPointer();
+  const PixelType * const v_end = v + field->GetBufferedRegion().GetNumberOfPixels();
+  double maxNorm2 = 0.0;
+  for( ; v != v_end; ++v )
+    {
+    maxNorm2 = std::max( maxNorm2, static_cast<double>( v->GetSquaredNorm() ) );
+    }
+  maxNorm2 /= minPixelSpacing * minPixelSpacing;
+
+  const double numberOfIterations = 2.0 + 0.5 * std::log( maxNorm2 ) / std::log( 2.0 );
+  if( numberOfIterations >= 0.0 )
+    {
+    return std::min( static_cast<unsigned int>( numberOfIterations + 1.0 ),
+                     m_MaximumNumberOfIterations );
+    }
+  // also when v is zero (log is -inf)
+  return 0;
+}
+
+
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::AllocateField( DeformationFieldPointer & field ) const
+{
+  if( field
+      && field->GetBufferedRegion() == m_VelocityField->GetBufferedRegion() )
+    {
+    field->CopyInformation( m_VelocityField );
+    return;
+    }
+  field = DeformationFieldType::New();
+  field->CopyInformation( m_VelocityField );
+  field->SetRegions( m_VelocityField->GetBufferedRegion() );
+  field->Allocate();
+}
+
+
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::AllocateJacobianDeterminant( JacobianImagePointer & image ) const
+{
+  if( image
+      && image->GetBufferedRegion() == m_VelocityField->GetBufferedRegion() )
+    {
+    image->CopyInformation( m_VelocityField );
+    return;
+    }
+  image = JacobianImageType::New();
+  image->CopyInformation( m_VelocityField );
+  image->SetRegions( m_VelocityField->GetBufferedRegion() );
+  image->Allocate();
+}
+
+
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::SetPreviousDeformationFields( DeformationFieldType * field,
+                                DeformationFieldType * inverseField )
+{
+  m_DeformationField = field;
+  m_InverseDeformationField = inverseField;
+  m_HasPreviousInverse = ( inverseField != NULL );
+  m_NumberOfIncrements = 0;
+  this->Modified();
+}
+
+
+template <class TDeformationField, class TJacobianImage>
+bool
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::CanIncrement() const
+{
+  if( !m_UpdateField || m_RecomputeInterval == 1 )
+    {
+    return false;
+    }
+  if( m_RecomputeInterval != 0 && m_NumberOfIncrements + 1 >= m_RecomputeInterval )
+    {
+    return false;
+    }
+  const RegionType & region = m_VelocityField->GetBufferedRegion();
+  if( m_UpdateField->GetBufferedRegion() != region
+      || !m_DeformationField || m_DeformationField->GetBufferedRegion() != region )
+    {
+    return false;
+    }
+  return !m_ComputeInverse
+    || ( m_HasPreviousInverse && m_InverseDeformationField
+         && m_InverseDeformationField->GetBufferedRegion() == region );
+}
+
+
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::Compute()
+{
+  if( !m_VelocityField )
+    {
+    itkExceptionMacro( << "VelocityField must be set." );
+    }
+
+  m_NumberOfFields = m_ComputeInverse ? 2 : 1;
+  m_Region = m_VelocityField->GetBufferedRegion();
+
+  // continuous index offset of a displacement: (Direction * Spacing)^-1
+  const MatrixType directionInverse( m_VelocityField->GetDirection().GetInverse() );
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      m_PhysicalToIndex[i][j] = directionInverse[i][j] / m_VelocityField->GetSpacing()[i];
+      }
+    }
+
+  unsigned int numberOfThreads = m_NumberOfThreads;
+  if( numberOfThreads == 0 )
+    {
+    numberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>(
+    MultiThreader::GetGlobalMaximumNumberOfThreads() ) );
+  m_NumberOfSplits = numberOfThreads;
+  RegionType slab;
+  m_NumberOfSlabs = this->SplitRegion( 0, m_NumberOfSplits, slab );
+  m_Threader->SetNumberOfThreads( m_NumberOfSlabs );
+  m_Threader->SetSingleMethod( Self::ThreaderCallback, this );
+
+  m_Incremental = this->CanIncrement();
+  if( !m_Incremental )
+    {
+    this->AllocateField( m_DeformationField );
+    if( m_ComputeInverse )
+      {
+      this->AllocateField( m_InverseDeformationField );
+      }
+    this->Exponentiate( m_VelocityField, m_DeformationField, m_InverseDeformationField );
+    m_NumberOfIncrements = 0;
+    }
+  else
+    {
+    // exp(u) and exp(-u), few squarings since u is small
+    this->AllocateField( m_Increment[0] );
+    if( m_ComputeInverse )
+      {
+      this->AllocateField( m_Increment[1] );
+      }
+    this->Exponentiate( m_UpdateField, m_Increment[0], m_Increment[1] );
+
+    // exp(v) o exp(u) and exp(-u) o exp(-v): the increment is applied
+    // first on the forward side, last on the inverse side, so that they
+    // stay inverse of each other
+    DeformationFieldPointer * fields[2] = { &m_DeformationField, &m_InverseDeformationField };
+    m_Shift[0] = m_Increment[0]->GetBufferPointer();
+    m_Input[0] = m_DeformationField->GetBufferPointer();
+    if( m_ComputeInverse )
+      {
+      m_Shift[1] = m_InverseDeformationField->GetBufferPointer();
+      m_Input[1] = m_Increment[1]->GetBufferPointer();
+      }
+    this->ComposeFields( fields );
+    ++m_NumberOfIncrements;
+    }
+
+  m_HasPreviousInverse = m_ComputeInverse;
+  m_DeformationField->Modified();
+  if( m_ComputeInverse )
+    {
+    m_InverseDeformationField->Modified();
+    }
+
+  if( m_ComputeJacobianDeterminant )
+    {
+    // one more sweep over the final fields, in the same threads
+    this->AllocateJacobianDeterminant( m_JacobianDeterminant );
+    m_Input[0] = m_DeformationField->GetBufferPointer();
+    m_Determinant[0] = m_JacobianDeterminant->GetBufferPointer();
+    if( m_ComputeInverse )
+      {
+      this->AllocateJacobianDeterminant( m_InverseJacobianDeterminant );
+      m_Input[1] = m_InverseDeformationField->GetBufferPointer();
+      m_Determinant[1] = m_InverseJacobianDeterminant->GetBufferPointer();
+      }
+
+    m_ThreadedPass = JacobianPass;
+    if( m_NumberOfSlabs == 1 )
+      {
+      this->ThreadedJacobianDeterminant( m_Region );
+      }
+    else
+      {
+      m_Threader->SingleMethodExecute();
+      }
+    m_ThreadedPass = ComposePass;
+
+    m_JacobianDeterminant->Modified();
+    if( m_ComputeInverse )
+      {
+      m_InverseJacobianDeterminant->Modified();
+      }
+    }
+}
+
+
+/**
+ * Free the workspaces, the next Compute() reallocates them
+ */
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::ReleaseWorkspace()
+{
+  for( unsigned int f = 0; f < 2; f++ )
+    {
+    m_Workspace[f] = NULL;
+    m_Increment[f] = NULL;
+    m_Shift[f] = NULL;
+    m_Input[f] = NULL;
+    m_Output[f] = NULL;
+    }
+}
+
+
+/**
+ * Scaling and squaring of +-velocity into field and inverseField (the
+ * latter only with ComputeInverse)
+ */
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::Exponentiate( const DeformationFieldType * velocity,
+                DeformationFieldPointer & field,
+                DeformationFieldPointer & inverseField )
+{
+  // one scan for both fields, |-v| = |v|
+  m_NumberOfIterations = this->ComputeNumberOfIterations( velocity );
+
+  // first order approximation +-v/2^N (exact, a power of two)
+  const double scale = std::ldexp( 1.0, -static_cast<int>( m_NumberOfIterations ) );
+  const unsigned long numberOfPixels = m_Region.GetNumberOfPixels();
+  const PixelType * v = velocity->GetBufferPointer();
+  PixelType * forward = field->GetBufferPointer();
+  PixelType * inverse = m_ComputeInverse ? inverseField->GetBufferPointer() : NULL;
+  for( unsigned long n = 0; n < numberOfPixels; n++ )
+    {
+    for( unsigned int k = 0; k < ImageDimension; k++ )
+      {
+      const ValueType value = static_cast<ValueType>( v[n][k] * scale );
+      forward[n][k] = value;
+      if( inverse )
+        {
+        inverse[n][k] = -value;
+        }
+      }
+    }
+
+  // squarings u + u o (Id + u)
+  DeformationFieldPointer * fields[2] = { &field, &inverseField };
+  for( unsigned int i = 0; i < m_NumberOfIterations; i++ )
+    {
+    for( unsigned int f = 0; f < m_NumberOfFields; f++ )
+      {
+      m_Shift[f] = (*fields[f])->GetBufferPointer();
+      m_Input[f] = m_Shift[f];
+      }
+    this->ComposeFields( fields );
+    }
+}
+
+
+/**
+ * One composition pass over all the fields, into the workspaces which
+ * then replace the fields
+ */
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::ComposeFields( DeformationFieldPointer * fields[2] )
+{
+  for( unsigned int f = 0; f < m_NumberOfFields; f++ )
+    {
+    this->AllocateField( m_Workspace[f] );
+    m_Output[f] = m_Workspace[f]->GetBufferPointer();
+    }
+
+  if( m_NumberOfSlabs == 1 )
+    {
+    this->ThreadedCompose( m_Region );
+    }
+  else
+    {
+    m_Threader->SingleMethodExecute();
+    }
+
+  for( unsigned int f = 0; f < m_NumberOfFields; f++ )
+    {
+    DeformationFieldPointer composed = m_Workspace[f];
+    m_Workspace[f] = *fields[f];
+    *fields[f] = composed;
+    }
+}
+
+
+/**
+ * Split the region into slabs along its last non-trivial axis, the same
+ * way ImageSource::SplitRequestedRegion does
+ */
+template <class TDeformationField, class TJacobianImage>
+unsigned int
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::SplitRegion( unsigned int i, unsigned int n, RegionType & slab ) const
+{
+  slab = m_Region;
+  typename RegionType::IndexType index = m_Region.GetIndex();
+  typename RegionType::SizeType size = m_Region.GetSize();
+
+  int splitAxis = ImageDimension - 1;
+  while( size[splitAxis] == 1 )
+    {
+    --splitAxis;
+    if( splitAxis < 0 )
+      {
+      // cannot split
+      return 1;
+      }
+    }
+
+  const unsigned long range = size[splitAxis];
+  const unsigned long valuesPerThread = ( range + n - 1 ) / n;
+  const unsigned int maxThreadIdUsed = ( range + valuesPerThread - 1 ) / valuesPerThread - 1;
+
+  if( i < maxThreadIdUsed )
+    {
+    index[splitAxis] += i * valuesPerThread;
+    size[splitAxis] = valuesPerThread;
+    }
+  if( i == maxThreadIdUsed )
+    {
+    index[splitAxis] += i * valuesPerThread;
+    size[splitAxis] = size[splitAxis] - i * valuesPerThread;
+    }
+
+  slab.SetIndex( index );
+  slab.SetSize( size );
+  return maxThreadIdUsed + 1;
+}
+
+
+template <class TDeformationField, class TJacobianImage>
+ITK_THREAD_RETURN_TYPE
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::ThreaderCallback( void * arg )
+{
+  MultiThreader::ThreadInfoStruct * info =
+    static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  Self * self = static_cast<Self *>( info->UserData );
+
+  const unsigned int threadId = info->ThreadID;
+  RegionType slab;
+  const unsigned int numberOfSlabs =
+    self->SplitRegion( threadId, self->m_NumberOfSplits, slab );
+  if( threadId < numberOfSlabs )
+    {
+    if( self->m_ThreadedPass == JacobianPass )
+      {
+      self->ThreadedJacobianDeterminant( slab );
+      }
+    else
+      {
+      self->ThreadedCompose( slab );
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+
+/**
+ * s + u o (Id + s) on a slab, for each field with its shift s and input u
+ * (both the field itself when squaring). The voxels are visited row by row
+ * along the first axis, the interpolation reads the 2^Dimension neighbours
+ * directly from the buffer.
+ */
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::ThreadedCompose( const RegionType & slab )
+{
+  const unsigned int numberOfNeighbors = 1u << ImageDimension;
+
+  long start[ImageDimension];
+  long end[ImageDimension];
+  long stride[ImageDimension];
+  double lowerBound[ImageDimension];
+  double upperBound[ImageDimension];
+  long bufferStride = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    start[d] = m_Region.GetIndex()[d];
+    end[d] = start[d] + static_cast<long>( m_Region.GetSize()[d] ) - 1;
+    stride[d] = bufferStride;
+    bufferStride *= static_cast<long>( m_Region.GetSize()[d] );
+    lowerBound[d] = start[d] - 0.5;
+    upperBound[d] = end[d] + 0.5;
+    }
+
+  const unsigned long rowLength = slab.GetSize()[0];
+  const unsigned long numberOfRows = slab.GetNumberOfPixels() / rowLength;
+
+  IndexType index = slab.GetIndex();
+  for( unsigned long row = 0; row < numberOfRows; row++ )
+    {
+    long rowOffset = 0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      rowOffset += ( index[d] - start[d] ) * stride[d];
+      }
+
+    for( unsigned long x = 0; x < rowLength; x++ )
+      {
+      const long offset = rowOffset + static_cast<long>( x );
+
+      for( unsigned int f = 0; f < m_NumberOfFields; f++ )
+        {
+        const PixelType * input = m_Input[f];
+        const PixelType & s = m_Shift[f][offset];
+
+        // continuous index of the displaced voxel
+        double cindex[ImageDimension];
+        bool inside = true;
+        for( unsigned int i = 0; i < ImageDimension; i++ )
+          {
+          cindex[i] = static_cast<double>( index[i] ) + ( i == 0 ? static_cast<double>( x ) : 0.0 );
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            cindex[i] += m_PhysicalToIndex[i][j] * s[j];
+            }
+          inside = inside && cindex[i] >= lowerBound[i] && cindex[i] < upperBound[i];
+          }
+
+        PixelType & out = m_Output[f][offset];
+        if( !inside )
+          {
+          // padded with zero
+          out = s;
+          continue;
+          }
+
+        long base[ImageDimension];
+        double distance[ImageDimension];
+        for( unsigned int i = 0; i < ImageDimension; i++ )
+          {
+          base[i] = static_cast<long>( std::floor( cindex[i] ) );
+          distance[i] = cindex[i] - static_cast<double>( base[i] );
+          }
+
+        double value[ImageDimension];
+        for( unsigned int k = 0; k < ImageDimension; k++ )
+          {
+          value[k] = 0.0;
+          }
+        for( unsigned int counter = 0; counter < numberOfNeighbors; counter++ )
+          {
+          double overlap = 1.0;
+          long neighborOffset = 0;
+          unsigned int upper = counter;
+          for( unsigned int i = 0; i < ImageDimension; i++ )
+            {
+            long neighbor;
+            if( upper & 1 )
+              {
+              neighbor = std::min( base[i] + 1, end[i] );
+              overlap *= distance[i];
+              }
+            else
+              {
+              neighbor = std::max( base[i], start[i] );
+              overlap *= 1.0 - distance[i];
+              }
+            neighborOffset += ( neighbor - start[i] ) * stride[i];
+            upper >>= 1;
+            }
+          if( overlap )
+            {
+            const PixelType & neighborValue = input[neighborOffset];
+            for( unsigned int k = 0; k < ImageDimension; k++ )
+              {
+              value[k] += overlap * static_cast<double>( neighborValue[k] );
+              }
+            }
+          }
+
+        for( unsigned int k = 0; k < ImageDimension; k++ )
+          {
+          out[k] = s[k] + static_cast<ValueType>( value[k] );
+          }
+        }
+      }
+
+    // next row start
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      ++index[d];
+      if( index[d] < slab.GetIndex()[d] + static_cast<long>( slab.GetSize()[d] ) )
+        {
+        break;
+        }
+      index[d] = slab.GetIndex()[d];
+      }
+    }
+}
+
+
+/**
+ * Jacobian determinant of Id + u on a slab, for each field, as
+ * DisplacementFieldJacobianDeterminantFilter without image spacing:
+ * central differences, the border voxels repeated outside the image, and
+ * computed in the precision of the field.
+ */
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::ThreadedJacobianDeterminant( const RegionType & slab )
+{
+  long start[ImageDimension];
+  long end[ImageDimension];
+  long stride[ImageDimension];
+  long bufferStride = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    start[d] = m_Region.GetIndex()[d];
+    end[d] = start[d] + static_cast<long>( m_Region.GetSize()[d] ) - 1;
+    stride[d] = bufferStride;
+    bufferStride *= static_cast<long>( m_Region.GetSize()[d] );
+    }
+
+  const unsigned long rowLength = slab.GetSize()[0];
+  const unsigned long numberOfRows = slab.GetNumberOfPixels() / rowLength;
+  const ValueType half = 0.5;
+
+  IndexType index = slab.GetIndex();
+  for( unsigned long row = 0; row < numberOfRows; row++ )
+    {
+    long rowOffset = 0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      rowOffset += ( index[d] - start[d] ) * stride[d];
+      }
+
+    for( unsigned long x = 0; x < rowLength; x++ )
+      {
+      const long offset = rowOffset + static_cast<long>( x );
+
+      // offsets of the previous and next voxels along each axis
+      long previous[ImageDimension];
+      long next[ImageDimension];
+      for( unsigned int i = 0; i < ImageDimension; i++ )
+        {
+        const long position = index[i] + ( i == 0 ? static_cast<long>( x ) : 0 );
+        previous[i] = position > start[i] ? offset - stride[i] : offset;
+        next[i] = position < end[i] ? offset + stride[i] : offset;
+        }
+
+      for( unsigned int f = 0; f < m_NumberOfFields; f++ )
+        {
+        const PixelType * input = m_Input[f];
+        vnl_matrix_fixed<ValueType, ImageDimension, ImageDimension> jacobian;
+        for( unsigned int i = 0; i < ImageDimension; i++ )
+          {
+          const PixelType & nextValue = input[next[i]];
+          const PixelType & previousValue = input[previous[i]];
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            jacobian[i][j] = half * ( nextValue[j] - previousValue[j] );
+            }
+          jacobian[i][i] += 1.0;
+          }
+        m_Determinant[f][offset] = static_cast<JacobianPixelType>( vnl_det( jacobian ) );
+        }
+      }
+
+    // next row start
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      ++index[d];
+      if( index[d] < slab.GetIndex()[d] + static_cast<long>( slab.GetSize()[d] ) )
+        {
+        break;
+        }
+      index[d] = slab.GetIndex()[d];
+      }
+    }
+}
+
+
+/*
+ * Standard "PrintSelf" method.
+ */
+template <class TDeformationField, class TJacobianImage>
+void
+JointFieldExponentiator<TDeformationField,TJacobianImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "ComputeInverse: " << m_ComputeInverse << std::endl;
+  os << indent << "MaximumNumberOfIterations: " << m_MaximumNumberOfIterations << std::endl;
+  os << indent << "NumberOfThreads: " << m_NumberOfThreads << std::endl;
+  os << indent << "NumberOfIterations: " << m_NumberOfIterations << std::endl;
+  os << indent << "ComputeJacobianDeterminant: " << m_ComputeJacobianDeterminant << std::endl;
+  os << indent << "RecomputeInterval: " << m_RecomputeInterval << std::endl;
+  os << indent << "NumberOfIncrements: " << m_NumberOfIncrements << std::endl;
+}
+
+} // end namespace itk
+
+#endif
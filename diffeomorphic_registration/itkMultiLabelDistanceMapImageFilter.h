@@ -0,0 +1,252 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkMultiLabelDistanceMapImageFilter.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkMultiLabelDistanceMapImageFilter_h
+#define __itkMultiLabelDistanceMapImageFilter_h
+
+#include "itkImageToImageFilter.h"
+
+#include <vector>
+
+namespace itk {
+
+/**
+ * \class MultiLabelDistanceMapImageFilter
+ *
+ * \brief Per-label boundary distance of every label of a label map at once
+ *
+ * For every voxel carrying a non-zero label l, the output holds the squared
+ * Euclidean distance (in voxels) to the closest voxel whose label is not l,
+ * divided by the largest such distance found inside l and scaled to
+ * [0,255]. Background voxels are set to zero. This is what the demons
+ * force used to obtain by running one SignedMaurerDistanceMapImageFilter
+ * (squared distance, no image spacing) per label and normalising it.
+ *
+ * Instead of one full transform per label, all labels are handled by one
+ * separable transform (one pass per image dimension) that keeps, for each
+ * voxel, the two closest sites of distinct labels. Keeping two distinct
+ * labels is enough for the result to be exact: the closest site of another
+ * label is always the first or second entry. Labels are mapped to a compact
+ * lookup table first, so there is no limit on their values and at most
+ * 65534 distinct labels are supported.
+ *
+ * Input values that do not fit an unsigned int (e.g. the
+ * NumericTraits::max() padding of a warped image) count as background.
+ *
+ * A BandWidth (in voxels) can be set. Distances are then computed exactly
+ * up to the band and clamped to BandWidth^2 beyond it, one label at a time:
+ * the sites of a label are only the voxels of other labels next to it (its
+ * closest other label is always one of them), and its band is transformed
+ * sparsely from them inside the label's bounding box, each pass only
+ * storing and visiting the voxels within the band. The work and the memory
+ * then follow the label surfaces times the band rather than the volume.
+ *
+ * The normalisation does not change with the band: every label is still
+ * divided by its true maximum. For a label thicker than the band, that
+ * maximum is found exactly from the transforms of a few planes of its box,
+ * which bound the distances in between, plus the slabs where the bound
+ * leaves room for a deeper voxel. Within the band the output is therefore
+ * the one of the full transform, bit for bit, and the band only clamps the
+ * voxels further inside. A BandWidth of 0 (the default) computes the full
+ * transform.
+ *
+ * The full transform runs on the bounding box of all labels grown by
+ * FrameWidth voxels, as fast_compute_distance_transform.m does per label.
+ * Any frame of at least one voxel gives the same result as the full image.
+ *
+ * \sa SignedMaurerDistanceMapImageFilter
+ * \sa ESMInvConDemonsRegistrationFunction
+ */
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT MultiLabelDistanceMapImageFilter :
+    public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef MultiLabelDistanceMapImageFilter                Self;
+  typedef ImageToImageFilter<TInputImage,TOutputImage>    Superclass;
+  typedef SmartPointer<Self>                              Pointer;
+  typedef SmartPointer<const Self>                        ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( MultiLabelDistanceMapImageFilter, ImageToImageFilter );
+
+  /** Image typedefs. */
+  typedef TInputImage                             InputImageType;
+  typedef typename InputImageType::PixelType      InputPixelType;
+  typedef typename InputImageType::SizeType       SizeType;
+  typedef TOutputImage                            OutputImageType;
+  typedef typename OutputImageType::PixelType     OutputPixelType;
+
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TInputImage::ImageDimension);
+
+  /** Band width in voxels, 0 computes the distances everywhere. Beyond
+   * the band the distances are clamped, the normalisation is unchanged. */
+  itkSetMacro( BandWidth, double );
+  itkGetConstMacro( BandWidth, double );
+
+  /** Margin kept around the bounding box of the labels by the full
+   * transform, at least 1. */
+  itkSetMacro( FrameWidth, unsigned int );
+  itkGetConstMacro( FrameWidth, unsigned int );
+
+  /** Label lookup table: the sorted non-zero labels of the last input. */
+  typedef std::vector<unsigned int>               LabelArrayType;
+  const LabelArrayType & GetLabels() const
+    { return m_Labels; }
+
+  /** Largest squared boundary distance inside each label, in the order
+   * of GetLabels(), with or without a band. The output of a voxel is its
+   * squared distance times 255/(maximum + 0.0001). */
+  const std::vector<float> & GetMaximumDistances() const
+    { return m_MaximumDistances; }
+
+protected:
+  MultiLabelDistanceMapImageFilter();
+  ~MultiLabelDistanceMapImageFilter() {}
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** The whole input is needed and the whole output is produced. */
+  void GenerateInputRequestedRegion();
+  void EnlargeOutputRequestedRegion( DataObject * output );
+
+  void GenerateData();
+
+  /** Compact label index type. */
+  typedef unsigned short                          LabelIndexType;
+
+  /** The two closest sites of distinct labels seen so far. */
+  struct NearestPairType
+    {
+    float           m_Distance[2];
+    LabelIndexType  m_Label[2];
+    };
+
+  /** One candidate site along a line. */
+  struct SiteType
+    {
+    LabelIndexType  m_Label;
+    long            m_Position;
+    float           m_Distance;
+
+    bool operator<( const SiteType & other ) const
+      {
+      return m_Label < other.m_Label
+        || ( m_Label == other.m_Label && m_Position < other.m_Position );
+      }
+    };
+
+  /** A voxel of the band of one label. */
+  struct BandVoxelType
+    {
+    long            m_Position[ImageDimension];
+    float           m_Distance;
+    };
+
+  /** Orders band voxels line by line along one axis. */
+  struct BandLineOrder
+    {
+    unsigned int    m_Axis;
+
+    bool SameLine( const BandVoxelType & a, const BandVoxelType & b ) const
+      {
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        if( d != m_Axis && a.m_Position[d] != b.m_Position[d] )
+          {
+          return false;
+          }
+        }
+      return true;
+      }
+
+    bool operator()( const BandVoxelType & a, const BandVoxelType & b ) const
+      {
+      for( unsigned int d = ImageDimension; d-- > 0; )
+        {
+        if( d != m_Axis && a.m_Position[d] != b.m_Position[d] )
+          {
+          return a.m_Position[d] < b.m_Position[d];
+          }
+        }
+      return a.m_Position[m_Axis] < b.m_Position[m_Axis];
+      }
+    };
+
+  /** Collect the lookup table only. */
+  void CollectLabels();
+
+  /** Build the lookup table and the per-voxel label index. */
+  void BuildLabelTable( std::vector<LabelIndexType> & labelIndex );
+
+  /** Run the 1D squared distance transform along one line. */
+  void TransformLine( NearestPairType * line, long length, long stride,
+                      std::vector<SiteType> & sites,
+                      std::vector<NearestPairType> & result,
+                      std::vector<long> & hullPositions,
+                      std::vector<double> & hullBounds ) const;
+
+  /** Banded mode of GenerateData(). */
+  void GenerateBandData();
+
+  /** Transform the band of one label from its seeds, within the label's
+   * bounding box [lower,upper], dropping distances above maximumDistance. */
+  void TransformBand( std::vector<BandVoxelType> & voxels,
+                      const long * lower, const long * upper,
+                      float maximumDistance ) const;
+
+  /** Run the 1D squared distance transform of a sampled function along one
+   * line, in place. */
+  void TransformSampledLine( float * line, long length, long stride,
+                             std::vector<long> & positions,
+                             std::vector<float> & values,
+                             std::vector<long> & hullPositions,
+                             std::vector<double> & hullBounds ) const;
+
+  /** Transform the plane at x of a crop, given the seeds of its rows. */
+  void TransformPlane( long x, const long * cropSize,
+                       const std::vector<long> & rowStart,
+                       const std::vector<long> & seedPositions,
+                       std::vector<float> & plane,
+                       std::vector<long> & positions,
+                       std::vector<float> & values,
+                       std::vector<long> & hullPositions,
+                       std::vector<double> & hullBounds ) const;
+
+  /** Exact maximum of a label thicker than the band, given its seeds, its
+   * bounding box and a lower bound. */
+  float ComputeLabelMaximum( const std::vector<long> & seeds, unsigned int label,
+                             const long * lower, const long * upper,
+                             float lowerBound ) const;
+
+private:
+  MultiLabelDistanceMapImageFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  double                  m_BandWidth;
+  unsigned int            m_FrameWidth;
+
+  LabelArrayType          m_Labels;
+  std::vector<float>      m_MaximumDistances;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkMultiLabelDistanceMapImageFilter.txx"
+#endif
+
+#endif
@@ -0,0 +1,1065 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkMultiLabelDistanceMapImageFilter.txx
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkMultiLabelDistanceMapImageFilter_txx
+#define __itkMultiLabelDistanceMapImageFilter_txx
+
+#include "itkMultiLabelDistanceMapImageFilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace itk {
+
+namespace MultiLabelDistanceMapDetail {
+
+/** Label index marking an empty slot of a NearestPairType. */
+const unsigned short NoLabel = 0xFFFF;
+
+/** Read a label the way the demons code always did (cast to unsigned
+ * int), mapping values that do not fit to the background. */
+template <class TPixel>
+inline unsigned int ToLabel( const TPixel & value )
+{
+  const double v = static_cast<double>( value );
+  if( !( v >= 0.0 ) || v >= 4294967296.0 )
+    {
+    return 0;
+    }
+  return static_cast<unsigned int>( v );
+}
+
+/** Lower envelope of the parabolas (x - positions[i])^2 + values[i] of n
+ * sites with increasing positions, as in Felzenszwalb & Huttenlocher. On
+ * return parabola hull[k] is the lowest one on [bounds[k], bounds[k+1]]. */
+inline void LowerEnvelope( const long * positions, const float * values, long n,
+                           std::vector<long> & hull, std::vector<double> & bounds )
+{
+  if( static_cast<long>( hull.size() ) < n + 1 )
+    {
+    hull.resize( n + 1 );
+    bounds.resize( n + 2 );
+    }
+
+  long k = 0;
+  hull[0] = 0;
+  bounds[0] = -std::numeric_limits<double>::max();
+  bounds[1] = std::numeric_limits<double>::max();
+  for( long q = 1; q < n; q++ )
+    {
+    const double pq = static_cast<double>( positions[q] );
+    const double fq = values[q] + pq * pq;
+    double s;
+    do
+      {
+      // bounds[0] is -max, so this stops at k == 0 at the latest
+      const double pv = static_cast<double>( positions[hull[k]] );
+      s = ( fq - ( values[hull[k]] + pv * pv ) ) / ( 2.0 * ( pq - pv ) );
+      }
+    while( s <= bounds[k] && --k >= 0 );
+    ++k;
+    hull[k] = q;
+    bounds[k] = s;
+    bounds[k+1] = std::numeric_limits<double>::max();
+    }
+}
+
+} // end namespace MultiLabelDistanceMapDetail
+
+
+/**
+ * Default constructor
+ */
+template <class TInputImage, class TOutputImage>
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::MultiLabelDistanceMapImageFilter()
+{
+  m_BandWidth = 0.0;
+  m_FrameWidth = 5;
+}
+
+
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  InputImageType * input = const_cast<InputImageType *>( this->GetInput() );
+  if( input )
+    {
+    input->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::EnlargeOutputRequestedRegion( DataObject * output )
+{
+  Superclass::EnlargeOutputRequestedRegion( output );
+  output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+
+/**
+ * Collect the sorted set of the non-zero labels of the input
+ */
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::CollectLabels()
+{
+  using MultiLabelDistanceMapDetail::ToLabel;
+
+  const InputImageType * input = this->GetInput();
+  const InputPixelType * begin = input->GetBufferPointer();
+  const InputPixelType * const end =
+    begin + input->GetBufferedRegion().GetNumberOfPixels();
+
+  // label maps come in runs, only look the value up when it changes
+  m_Labels.clear();
+  unsigned int lastLabel = 0;
+  for( const InputPixelType * ptr = begin; ptr != end; ++ptr )
+    {
+    const unsigned int label = ToLabel( *ptr );
+    if( label == 0 || label == lastLabel )
+      {
+      continue;
+      }
+    lastLabel = label;
+    typename LabelArrayType::iterator pos =
+      std::lower_bound( m_Labels.begin(), m_Labels.end(), label );
+    if( pos == m_Labels.end() || *pos != label )
+      {
+      m_Labels.insert( pos, label );
+      }
+    }
+
+  if( m_Labels.size() >= MultiLabelDistanceMapDetail::NoLabel - 1 )
+    {
+    itkExceptionMacro( << "Too many labels: " << m_Labels.size() );
+    }
+}
+
+
+/**
+ * Collect the sorted label set and give every voxel its compact index.
+ * Index 0 is the background, 1..L follow m_Labels.
+ */
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::BuildLabelTable( std::vector<LabelIndexType> & labelIndex )
+{
+  using MultiLabelDistanceMapDetail::ToLabel;
+
+  this->CollectLabels();
+
+  const InputImageType * input = this->GetInput();
+  const InputPixelType * begin = input->GetBufferPointer();
+  const InputPixelType * const end =
+    begin + input->GetBufferedRegion().GetNumberOfPixels();
+
+  labelIndex.resize( end - begin );
+  typename std::vector<LabelIndexType>::iterator out = labelIndex.begin();
+  unsigned int lastLabel = 0;
+  LabelIndexType lastIndex = 0;
+  for( const InputPixelType * ptr = begin; ptr != end; ++ptr, ++out )
+    {
+    const unsigned int label = ToLabel( *ptr );
+    if( label != lastLabel )
+      {
+      lastLabel = label;
+      lastIndex = ( label == 0 ) ? 0 : static_cast<LabelIndexType>( 1 +
+        ( std::lower_bound( m_Labels.begin(), m_Labels.end(), label )
+          - m_Labels.begin() ) );
+      }
+    *out = lastIndex;
+    }
+}
+
+
+/**
+ * 1D squared distance transform of one line, per label, keeping the two
+ * closest distinct labels at each position. For each label the lower
+ * envelope of the parabolas rooted at its sites is built as in
+ * Felzenszwalb & Huttenlocher, "Distance Transforms of Sampled Functions".
+ */
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::TransformLine( NearestPairType * line, long length, long stride,
+                 std::vector<SiteType> & sites,
+                 std::vector<NearestPairType> & result,
+                 std::vector<long> & hullPositions,
+                 std::vector<double> & hullBounds ) const
+{
+  using MultiLabelDistanceMapDetail::NoLabel;
+
+  const float infinity = std::numeric_limits<float>::max();
+
+  sites.clear();
+  for( long i = 0; i < length; i++ )
+    {
+    const NearestPairType & pair = line[i*stride];
+    for( unsigned int k = 0; k < 2; k++ )
+      {
+      if( pair.m_Label[k] != NoLabel )
+        {
+        SiteType site;
+        site.m_Label = pair.m_Label[k];
+        site.m_Position = i;
+        site.m_Distance = pair.m_Distance[k];
+        sites.push_back( site );
+        }
+      }
+    }
+  std::sort( sites.begin(), sites.end() );
+
+  NearestPairType empty;
+  empty.m_Distance[0] = infinity;
+  empty.m_Distance[1] = infinity;
+  empty.m_Label[0] = NoLabel;
+  empty.m_Label[1] = NoLabel;
+  result.assign( length, empty );
+
+  if( hullPositions.size() < sites.size() + 1 )
+    {
+    hullPositions.resize( sites.size() + 1 );
+    hullBounds.resize( sites.size() + 2 );
+    }
+
+  const long numberOfSites = static_cast<long>( sites.size() );
+  long groupBegin = 0;
+  while( groupBegin < numberOfSites )
+    {
+    const LabelIndexType label = sites[groupBegin].m_Label;
+    long groupEnd = groupBegin + 1;
+    while( groupEnd < numberOfSites && sites[groupEnd].m_Label == label )
+      {
+      ++groupEnd;
+      }
+
+    // lower envelope of this label's parabolas
+    long k = 0;
+    hullPositions[0] = groupBegin;
+    hullBounds[0] = -std::numeric_limits<double>::max();
+    hullBounds[1] = std::numeric_limits<double>::max();
+    for( long q = groupBegin + 1; q < groupEnd; q++ )
+      {
+      const double pq = static_cast<double>( sites[q].m_Position );
+      const double fq = sites[q].m_Distance + pq * pq;
+      double s;
+      do
+        {
+        // hullBounds[0] is -max, so this stops at k == 0 at the latest
+        const SiteType & vk = sites[hullPositions[k]];
+        const double pv = static_cast<double>( vk.m_Position );
+        s = ( fq - ( vk.m_Distance + pv * pv ) ) / ( 2.0 * ( pq - pv ) );
+        }
+      while( s <= hullBounds[k] && --k >= 0 );
+      ++k;
+      hullPositions[k] = q;
+      hullBounds[k] = s;
+      hullBounds[k+1] = std::numeric_limits<double>::max();
+      }
+
+    // evaluate the envelope and merge it into the two best labels
+    k = 0;
+    for( long x = 0; x < length; x++ )
+      {
+      while( hullBounds[k+1] < static_cast<double>( x ) )
+        {
+        ++k;
+        }
+      const SiteType & site = sites[hullPositions[k]];
+      const float dx = static_cast<float>( x - site.m_Position );
+      const float value = dx * dx + site.m_Distance;
+
+      NearestPairType & best = result[x];
+      if( value < best.m_Distance[0] )
+        {
+        best.m_Distance[1] = best.m_Distance[0];
+        best.m_Label[1] = best.m_Label[0];
+        best.m_Distance[0] = value;
+        best.m_Label[0] = label;
+        }
+      else if( value < best.m_Distance[1] )
+        {
+        best.m_Distance[1] = value;
+        best.m_Label[1] = label;
+        }
+      }
+
+    groupBegin = groupEnd;
+    }
+
+  for( long i = 0; i < length; i++ )
+    {
+    line[i*stride] = result[i];
+    }
+}
+
+
+/**
+ * Compute the normalised per-label distance map
+ */
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::GenerateData()
+{
+  using MultiLabelDistanceMapDetail::NoLabel;
+
+  this->AllocateOutputs();
+
+  if( m_BandWidth > 0.0 )
+    {
+    this->GenerateBandData();
+    return;
+    }
+
+  const SizeType size = this->GetInput()->GetBufferedRegion().GetSize();
+  long numberOfPixels = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    numberOfPixels *= static_cast<long>( size[d] );
+    }
+
+  std::vector<LabelIndexType> labelIndex;
+  this->BuildLabelTable( labelIndex );
+
+  OutputPixelType * out = this->GetOutput()->GetBufferPointer();
+  std::fill( out, out + numberOfPixels, static_cast<OutputPixelType>( 0 ) );
+  m_MaximumDistances.assign( m_Labels.size(), 0.0f );
+  if( m_Labels.empty() )
+    {
+    return;
+    }
+
+  // bounding box of the labels, grown by the frame
+  long cropBegin[ImageDimension];
+  long cropSize[ImageDimension];
+  long imageStride[ImageDimension];
+  long lower[ImageDimension];
+  long upper[ImageDimension];
+  long stride = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    imageStride[d] = stride;
+    stride *= static_cast<long>( size[d] );
+    lower[d] = static_cast<long>( size[d] );
+    upper[d] = -1;
+    }
+  for( long i = 0; i < numberOfPixels; i++ )
+    {
+    if( labelIndex[i] == 0 )
+      {
+      continue;
+      }
+    long rest = i;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const long position = rest % static_cast<long>( size[d] );
+      rest /= static_cast<long>( size[d] );
+      lower[d] = std::min( lower[d], position );
+      upper[d] = std::max( upper[d], position );
+      }
+    }
+  const long frame = std::max( m_FrameWidth, 1u );
+  long numberOfCropPixels = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    cropBegin[d] = std::max( lower[d] - frame, 0L );
+    cropSize[d] = std::min( upper[d] + frame, static_cast<long>( size[d] ) - 1 )
+      - cropBegin[d] + 1;
+    numberOfCropPixels *= cropSize[d];
+    }
+
+  // offset in the image of each cropped voxel, in cropped order
+  std::vector<long> imageOffset( numberOfCropPixels );
+  for( long c = 0; c < numberOfCropPixels; c++ )
+    {
+    long rest = c;
+    long offset = 0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      offset += ( cropBegin[d] + rest % cropSize[d] ) * imageStride[d];
+      rest /= cropSize[d];
+      }
+    imageOffset[c] = offset;
+    }
+
+  // every voxel is a site of its own label at distance zero
+  std::vector<NearestPairType> nearest( numberOfCropPixels );
+  for( long c = 0; c < numberOfCropPixels; c++ )
+    {
+    nearest[c].m_Distance[0] = 0.0f;
+    nearest[c].m_Label[0] = labelIndex[imageOffset[c]];
+    nearest[c].m_Distance[1] = std::numeric_limits<float>::max();
+    nearest[c].m_Label[1] = NoLabel;
+    }
+
+  // one separable pass per dimension
+  std::vector<SiteType>          sites;
+  std::vector<NearestPairType>   result;
+  std::vector<long>              hullPositions;
+  std::vector<double>            hullBounds;
+  stride = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    const long length = cropSize[d];
+    const long numberOfLines = numberOfCropPixels / length;
+    for( long l = 0; l < numberOfLines; l++ )
+      {
+      const long inner = l % stride;
+      const long outer = l / stride;
+      this->TransformLine( &nearest[outer * stride * length + inner],
+                           length, stride, sites, result,
+                           hullPositions, hullBounds );
+      }
+    stride *= length;
+    }
+
+  // distance to the closest other label, and its maximum inside each label
+  std::vector<float> distance( numberOfCropPixels, 0.0f );
+  for( long c = 0; c < numberOfCropPixels; c++ )
+    {
+    const LabelIndexType own = labelIndex[imageOffset[c]];
+    if( own == 0 )
+      {
+      continue;
+      }
+    const NearestPairType & pair = nearest[c];
+    float value = 0.0f;
+    for( unsigned int k = 0; k < 2; k++ )
+      {
+      if( pair.m_Label[k] != own && pair.m_Label[k] != NoLabel )
+        {
+        value = pair.m_Distance[k];
+        break;
+        }
+      }
+    distance[c] = value;
+    if( value > m_MaximumDistances[own-1] )
+      {
+      m_MaximumDistances[own-1] = value;
+      }
+    }
+
+  // normalise as the per-label Maurer loop did
+  const float eps = 0.0001;
+  for( long c = 0; c < numberOfCropPixels; c++ )
+    {
+    const LabelIndexType own = labelIndex[imageOffset[c]];
+    if( own == 0 )
+      {
+      continue;
+      }
+    const float diff = m_MaximumDistances[own-1] + eps;
+    float normalised = distance[c] / diff;
+    normalised = normalised * 255;
+    out[imageOffset[c]] = static_cast<OutputPixelType>( normalised );
+    }
+}
+
+
+/**
+ * Sparse separable transform of the band of one label. The voxels start as
+ * the seeds of the label at distance zero. Each pass along an axis replaces
+ * them by the positions of [lower,upper] along that axis that lie within
+ * maximumDistance of a site of their line, so only the band is ever stored
+ * or visited.
+ */
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::TransformBand( std::vector<BandVoxelType> & voxels,
+                 const long * lower, const long * upper,
+                 float maximumDistance ) const
+{
+  using MultiLabelDistanceMapDetail::LowerEnvelope;
+
+  // no site reaches further than this along a line
+  const long reach = static_cast<long>( std::sqrt( maximumDistance ) ) + 1;
+
+  std::vector<BandVoxelType>  result;
+  std::vector<long>           positions;
+  std::vector<float>          values;
+  std::vector<long>           hullPositions;
+  std::vector<double>         hullBounds;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    BandLineOrder order;
+    order.m_Axis = d;
+    std::sort( voxels.begin(), voxels.end(), order );
+
+    result.clear();
+    const long numberOfVoxels = static_cast<long>( voxels.size() );
+    long lineBegin = 0;
+    while( lineBegin < numberOfVoxels )
+      {
+      long lineEnd = lineBegin + 1;
+      while( lineEnd < numberOfVoxels
+             && order.SameLine( voxels[lineBegin], voxels[lineEnd] ) )
+        {
+        ++lineEnd;
+        }
+      const long numberOfSites = lineEnd - lineBegin;
+      positions.resize( numberOfSites );
+      values.resize( numberOfSites );
+      for( long i = 0; i < numberOfSites; i++ )
+        {
+        positions[i] = voxels[lineBegin+i].m_Position[d];
+        values[i] = voxels[lineBegin+i].m_Distance;
+        }
+      LowerEnvelope( &positions[0], &values[0], numberOfSites,
+                     hullPositions, hullBounds );
+
+      // evaluate the envelope around the sites only, skipping the gaps
+      long k = 0;
+      long next = lower[d];
+      for( long i = 0; i < numberOfSites; i++ )
+        {
+        const long first = std::max( positions[i] - reach, next );
+        const long last = std::min( positions[i] + reach, upper[d] );
+        for( long x = first; x <= last; x++ )
+          {
+          while( hullBounds[k+1] < static_cast<double>( x ) )
+            {
+            ++k;
+            }
+          const float dx = static_cast<float>( x - positions[hullPositions[k]] );
+          const float value = dx * dx + values[hullPositions[k]];
+          if( value <= maximumDistance )
+            {
+            BandVoxelType voxel = voxels[lineBegin];
+            voxel.m_Position[d] = x;
+            voxel.m_Distance = value;
+            result.push_back( voxel );
+            }
+          }
+        next = std::max( next, last + 1 );
+        }
+
+      lineBegin = lineEnd;
+      }
+    voxels.swap( result );
+    }
+}
+
+
+/**
+ * 1D squared distance transform of a sampled function along one line, in
+ * place. Infinite samples are not sites.
+ */
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::TransformSampledLine( float * line, long length, long stride,
+                        std::vector<long> & positions,
+                        std::vector<float> & values,
+                        std::vector<long> & hullPositions,
+                        std::vector<double> & hullBounds ) const
+{
+  const float infinity = std::numeric_limits<float>::max();
+
+  positions.clear();
+  values.clear();
+  for( long i = 0; i < length; i++ )
+    {
+    if( line[i*stride] < infinity )
+      {
+      positions.push_back( i );
+      values.push_back( line[i*stride] );
+      }
+    }
+  if( positions.empty() )
+    {
+    return;
+    }
+  MultiLabelDistanceMapDetail::LowerEnvelope( &positions[0], &values[0],
+    static_cast<long>( positions.size() ), hullPositions, hullBounds );
+
+  long k = 0;
+  for( long x = 0; x < length; x++ )
+    {
+    while( hullBounds[k+1] < static_cast<double>( x ) )
+      {
+      ++k;
+      }
+    const float dx = static_cast<float>( x - positions[hullPositions[k]] );
+    line[x*stride] = dx * dx + values[hullPositions[k]];
+    }
+}
+
+
+/**
+ * Exact squared distances to the seeds of a crop on its plane at position
+ * x along the first axis. The seeds of each row along that axis are given
+ * sorted, from seedPositions[rowStart[r]] to seedPositions[rowStart[r+1]],
+ * the rows following the other axes of the crop in image order.
+ */
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::TransformPlane( long x, const long * cropSize,
+                  const std::vector<long> & rowStart,
+                  const std::vector<long> & seedPositions,
+                  std::vector<float> & plane,
+                  std::vector<long> & positions,
+                  std::vector<float> & values,
+                  std::vector<long> & hullPositions,
+                  std::vector<double> & hullBounds ) const
+{
+  const float infinity = std::numeric_limits<float>::max();
+
+  // closest seed along each row
+  const long numberOfRows = static_cast<long>( rowStart.size() ) - 1;
+  plane.resize( numberOfRows );
+  for( long r = 0; r < numberOfRows; r++ )
+    {
+    std::vector<long>::const_iterator rowBegin = seedPositions.begin() + rowStart[r];
+    std::vector<long>::const_iterator rowEnd = seedPositions.begin() + rowStart[r+1];
+    std::vector<long>::const_iterator pos = std::lower_bound( rowBegin, rowEnd, x );
+    float best = infinity;
+    if( pos != rowEnd )
+      {
+      const float dx = static_cast<float>( *pos - x );
+      best = dx * dx;
+      }
+    if( pos != rowBegin )
+      {
+      const float dx = static_cast<float>( x - *( pos - 1 ) );
+      best = std::min( best, dx * dx );
+      }
+    plane[r] = best;
+    }
+
+  // then one pass per other dimension
+  long stride = 1;
+  for( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    const long length = cropSize[d];
+    const long numberOfLines = numberOfRows / length;
+    for( long l = 0; l < numberOfLines; l++ )
+      {
+      const long inner = l % stride;
+      const long outer = l / stride;
+      this->TransformSampledLine( &plane[outer * stride * length + inner],
+                                  length, stride, positions, values,
+                                  hullPositions, hullBounds );
+      }
+    stride *= length;
+    }
+}
+
+
+/**
+ * Largest squared distance to the seeds inside one label, exactly, for a
+ * label whose deepest voxels lie beyond the band. The distances are
+ * computed on the planes of the label's crop at every step-th position
+ * along the first axis. Since the distance to the seeds changes by at most
+ * one per voxel, the planes bound it on the slabs in between: a voxel
+ * between planes a and b on a row where the distances are da and db is at
+ * most (da + db + b - a) / 2 away. Only the slabs whose bound on a row
+ * crossing the label beats the maximum found so far are transformed in
+ * full, deepest bound first.
+ */
+template <class TInputImage, class TOutputImage>
+float
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::ComputeLabelMaximum( const std::vector<long> & seeds, unsigned int label,
+                       const long * lower, const long * upper,
+                       float lowerBound ) const
+{
+  using MultiLabelDistanceMapDetail::ToLabel;
+
+  const InputImageType * input = this->GetInput();
+  const InputPixelType * buffer = input->GetBufferPointer();
+  const SizeType size = input->GetBufferedRegion().GetSize();
+
+  // the label's box grown by the ring of voxels its seeds lie in
+  long imageStride[ImageDimension];
+  long cropBegin[ImageDimension];
+  long cropSize[ImageDimension];
+  long stride = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    imageStride[d] = stride;
+    stride *= static_cast<long>( size[d] );
+    cropBegin[d] = std::max( lower[d] - 1, 0L );
+    cropSize[d] = std::min( upper[d] + 1, static_cast<long>( size[d] ) - 1 )
+      - cropBegin[d] + 1;
+    }
+
+  // rows along the first axis, and the image offset of the rows crossing
+  // the label's box (-1 for the others)
+  long numberOfRows = 1;
+  for( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    numberOfRows *= cropSize[d];
+    }
+  std::vector<long> rowOffset( numberOfRows );
+  for( long r = 0; r < numberOfRows; r++ )
+    {
+    long rest = r;
+    long offset = 0;
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      const long position = cropBegin[d] + rest % cropSize[d];
+      rest /= cropSize[d];
+      if( position < lower[d] || position > upper[d] )
+        {
+        offset = -1;
+        break;
+        }
+      offset += position * imageStride[d];
+      }
+    rowOffset[r] = offset;
+    }
+
+  // seeds of each row, sorted along it
+  std::vector< std::pair<long,long> > rowSeeds( seeds.size() );
+  for( unsigned long i = 0; i < seeds.size(); i++ )
+    {
+    long rest = seeds[i] / static_cast<long>( size[0] );
+    long row = 0;
+    long rowStride = 1;
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      row += ( rest % static_cast<long>( size[d] ) - cropBegin[d] ) * rowStride;
+      rest /= static_cast<long>( size[d] );
+      rowStride *= cropSize[d];
+      }
+    rowSeeds[i].first = row;
+    rowSeeds[i].second = seeds[i] % static_cast<long>( size[0] );
+    }
+  std::sort( rowSeeds.begin(), rowSeeds.end() );
+  std::vector<long> rowStart( numberOfRows + 1, 0 );
+  std::vector<long> seedPositions( rowSeeds.size() );
+  for( unsigned long i = 0; i < rowSeeds.size(); i++ )
+    {
+    ++rowStart[rowSeeds[i].first + 1];
+    seedPositions[i] = rowSeeds[i].second;
+    }
+  for( long r = 0; r < numberOfRows; r++ )
+    {
+    rowStart[r+1] += rowStart[r];
+    }
+
+  float maximum = lowerBound;
+  std::vector<float>   plane;
+  std::vector<float>   previous;
+  std::vector<long>    positions;
+  std::vector<float>   values;
+  std::vector<long>    hullPositions;
+  std::vector<double>  hullBounds;
+
+  // bound on the squared distance inside each slab, and its first plane
+  std::vector< std::pair<double,long> > slabs;
+  const long step = std::max( static_cast<long>( m_BandWidth ), 2L );
+  long x = lower[0];
+  long previousX = x;
+  while( true )
+    {
+    this->TransformPlane( x, cropSize, rowStart, seedPositions, plane,
+                          positions, values, hullPositions, hullBounds );
+    for( long r = 0; r < numberOfRows; r++ )
+      {
+      if( rowOffset[r] >= 0 && plane[r] > maximum
+          && ToLabel( buffer[rowOffset[r] + x] ) == label )
+        {
+        maximum = plane[r];
+        }
+      }
+
+    if( x - previousX > 1 )
+      {
+      double slabBound = -1.0;
+      const double width = static_cast<double>( x - previousX );
+      for( long r = 0; r < numberOfRows; r++ )
+        {
+        if( rowOffset[r] < 0 )
+          {
+          continue;
+          }
+        const double bound = 0.5 * ( std::sqrt( static_cast<double>( previous[r] ) )
+          + std::sqrt( static_cast<double>( plane[r] ) ) + width );
+        // squared distances are integers, half a unit absorbs the rounding
+        if( bound * bound <= maximum + 0.5 || bound * bound <= slabBound )
+          {
+          continue;
+          }
+        for( long xi = previousX + 1; xi < x; xi++ )
+          {
+          if( ToLabel( buffer[rowOffset[r] + xi] ) == label )
+            {
+            slabBound = bound * bound;
+            break;
+            }
+          }
+        }
+      if( slabBound >= 0.0 )
+        {
+        slabs.push_back( std::make_pair( slabBound, previousX ) );
+        }
+      }
+
+    if( x == upper[0] )
+      {
+      break;
+      }
+    previous.swap( plane );
+    previousX = x;
+    x = std::min( x + step, upper[0] );
+    }
+
+  // transform the slabs that may still hold a deeper voxel
+  std::sort( slabs.rbegin(), slabs.rend() );
+  for( unsigned long s = 0; s < slabs.size(); s++ )
+    {
+    if( slabs[s].first <= maximum + 0.5 )
+      {
+      break;
+      }
+    const long slabEnd = std::min( slabs[s].second + step, upper[0] );
+    for( long xi = slabs[s].second + 1; xi < slabEnd; xi++ )
+      {
+      this->TransformPlane( xi, cropSize, rowStart, seedPositions, plane,
+                            positions, values, hullPositions, hullBounds );
+      for( long r = 0; r < numberOfRows; r++ )
+        {
+        if( rowOffset[r] >= 0 && plane[r] > maximum
+            && ToLabel( buffer[rowOffset[r] + xi] ) == label )
+          {
+          maximum = plane[r];
+          }
+        }
+      }
+    }
+
+  return maximum;
+}
+
+
+/**
+ * Banded distance map. Each label is handled on its own: its seeds are the
+ * voxels of other labels next to it, which is where its closest other
+ * label always is, and its band is transformed sparsely from them within
+ * its bounding box. The normalisation keeps the true maximum of the label,
+ * computed exactly by ComputeLabelMaximum() for the labels thicker than
+ * the band, so the band only clamps the voxels beyond it.
+ */
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::GenerateBandData()
+{
+  using MultiLabelDistanceMapDetail::ToLabel;
+
+  const InputImageType * input = this->GetInput();
+  const InputPixelType * buffer = input->GetBufferPointer();
+  const SizeType size = input->GetBufferedRegion().GetSize();
+  long numberOfPixels = 1;
+  long imageStride[ImageDimension];
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    imageStride[d] = numberOfPixels;
+    numberOfPixels *= static_cast<long>( size[d] );
+    }
+
+  this->CollectLabels();
+
+  OutputPixelType * out = this->GetOutput()->GetBufferPointer();
+  std::fill( out, out + numberOfPixels, static_cast<OutputPixelType>( 0 ) );
+  const unsigned long numberOfLabels = m_Labels.size();
+  m_MaximumDistances.assign( numberOfLabels, 0.0f );
+  if( numberOfLabels == 0 )
+    {
+    return;
+    }
+
+  const float maximumDistance = static_cast<float>( m_BandWidth * m_BandWidth );
+
+  // bounding box, size and seeds of every label in one scan
+  std::vector<long> lower( numberOfLabels * ImageDimension );
+  std::vector<long> upper( numberOfLabels * ImageDimension, -1 );
+  for( unsigned long l = 0; l < numberOfLabels; l++ )
+    {
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      lower[l*ImageDimension + d] = static_cast<long>( size[d] );
+      }
+    }
+  std::vector<long> numberOfVoxels( numberOfLabels, 0 );
+  std::vector< std::vector<long> > seeds( numberOfLabels );
+  long position[ImageDimension];
+  std::fill( position, position + ImageDimension, 0L );
+  unsigned int lastLabel = 0;
+  unsigned long l = 0;
+  for( long i = 0; i < numberOfPixels; i++ )
+    {
+    const unsigned int label = ToLabel( buffer[i] );
+    if( label != 0 )
+      {
+      if( label != lastLabel )
+        {
+        lastLabel = label;
+        l = std::lower_bound( m_Labels.begin(), m_Labels.end(), label )
+          - m_Labels.begin();
+        }
+      ++numberOfVoxels[l];
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        lower[l*ImageDimension + d] = std::min( lower[l*ImageDimension + d], position[d] );
+        upper[l*ImageDimension + d] = std::max( upper[l*ImageDimension + d], position[d] );
+        if( position[d] > 0 && ToLabel( buffer[i - imageStride[d]] ) != label )
+          {
+          seeds[l].push_back( i - imageStride[d] );
+          }
+        if( position[d] + 1 < static_cast<long>( size[d] )
+            && ToLabel( buffer[i + imageStride[d]] ) != label )
+          {
+          seeds[l].push_back( i + imageStride[d] );
+          }
+        }
+      }
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      if( ++position[d] < static_cast<long>( size[d] ) )
+        {
+        break;
+        }
+      position[d] = 0;
+      }
+    }
+
+  // band of each label, kept as (offset, squared distance)
+  std::vector< std::pair<long,float> > band;
+  std::vector<unsigned long> bandBegin( numberOfLabels + 1, 0 );
+  std::vector<BandVoxelType> voxels;
+  for( l = 0; l < numberOfLabels; l++ )
+    {
+    bandBegin[l] = band.size();
+    std::vector<long> & labelSeeds = seeds[l];
+    std::sort( labelSeeds.begin(), labelSeeds.end() );
+    labelSeeds.erase( std::unique( labelSeeds.begin(), labelSeeds.end() ),
+                      labelSeeds.end() );
+    if( labelSeeds.empty() )
+      {
+      // the label fills the image, there is no other label to be far from
+      continue;
+      }
+
+    voxels.resize( labelSeeds.size() );
+    for( unsigned long s = 0; s < labelSeeds.size(); s++ )
+      {
+      long rest = labelSeeds[s];
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        voxels[s].m_Position[d] = rest % static_cast<long>( size[d] );
+        rest /= static_cast<long>( size[d] );
+        }
+      voxels[s].m_Distance = 0.0f;
+      }
+    this->TransformBand( voxels, &lower[l*ImageDimension],
+                         &upper[l*ImageDimension], maximumDistance );
+
+    float maximum = 0.0f;
+    for( unsigned long v = 0; v < voxels.size(); v++ )
+      {
+      long offset = 0;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        offset += voxels[v].m_Position[d] * imageStride[d];
+        }
+      if( ToLabel( buffer[offset] ) == m_Labels[l] )
+        {
+        band.push_back( std::make_pair( offset, voxels[v].m_Distance ) );
+        maximum = std::max( maximum, voxels[v].m_Distance );
+        }
+      }
+    if( static_cast<long>( band.size() - bandBegin[l] ) < numberOfVoxels[l] )
+      {
+      maximum = this->ComputeLabelMaximum( labelSeeds, m_Labels[l],
+        &lower[l*ImageDimension], &upper[l*ImageDimension], maximumDistance );
+      }
+    m_MaximumDistances[l] = maximum;
+    }
+  bandBegin[numberOfLabels] = band.size();
+
+  // normalise as the full transform does, the voxels beyond the band being
+  // clamped to it
+  const float eps = 0.0001;
+  std::vector<OutputPixelType> clamped( numberOfLabels );
+  for( l = 0; l < numberOfLabels; l++ )
+    {
+    const float diff = m_MaximumDistances[l] + eps;
+    float normalised = ( seeds[l].empty() ? 0.0f : maximumDistance ) / diff;
+    normalised = normalised * 255;
+    clamped[l] = static_cast<OutputPixelType>( normalised );
+    }
+  lastLabel = 0;
+  for( long i = 0; i < numberOfPixels; i++ )
+    {
+    const unsigned int label = ToLabel( buffer[i] );
+    if( label == 0 )
+      {
+      continue;
+      }
+    if( label != lastLabel )
+      {
+      lastLabel = label;
+      l = std::lower_bound( m_Labels.begin(), m_Labels.end(), label )
+        - m_Labels.begin();
+      }
+    out[i] = clamped[l];
+    }
+  for( l = 0; l < numberOfLabels; l++ )
+    {
+    const float diff = m_MaximumDistances[l] + eps;
+    for( unsigned long b = bandBegin[l]; b < bandBegin[l+1]; b++ )
+      {
+      float normalised = band[b].second / diff;
+      normalised = normalised * 255;
+      out[band[b].first] = static_cast<OutputPixelType>( normalised );
+      }
+    }
+}
+
+
+/*
+ * Standard "PrintSelf" method.
+ */
+template <class TInputImage, class TOutputImage>
+void
+MultiLabelDistanceMapImageFilter<TInputImage,TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "BandWidth: ";
+  os << m_BandWidth << std::endl;
+  os << indent << "FrameWidth: ";
+  os << m_FrameWidth << std::endl;
+  os << indent << "NumberOfLabels: ";
+  os << m_Labels.size() << std::endl;
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,181 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkRegistrationMetricsCalculator.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkRegistrationMetricsCalculator_h
+#define __itkRegistrationMetricsCalculator_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkMultiThreader.h"
+#include "itkMatrix.h"
+
+#include <vector>
+
+namespace itk {
+
+/**
+ * \class RegistrationMetricsCalculator
+ *
+ * \brief Statistics of a demons iteration in one pass over the data
+ *
+ * Given the fixed and moving images, the deformation exp(v) and its
+ * inverse exp(-v), computes in a single threaded sweep what
+ * invconstdemonsreg3d_aux.m gets from warplabelimage,
+ * deffieldharmonicenergy and deffieldjacobiandeterminant:
+ *
+ *  - MSE: mean squared difference between the fixed image and the moving
+ *    image warped by exp(v) with nearest neighbour interpolation, over the
+ *    voxels not mapped outside the moving image (NaN if there are none);
+ *    BackMSE the same between the moving image and the fixed image warped
+ *    by exp(-v);
+ *  - HarmonicEnergy / BackHarmonicEnergy: mean squared Frobenius norm of
+ *    the gradient of each field, as WarpHarmonicEnergyCalculator (central
+ *    differences scaled by the spacing);
+ *  - NegativeJacobianRatio / BackNegativeJacobianRatio: fraction of voxels
+ *    where the Jacobian determinant of each deformation is not positive,
+ *    computed as DisplacementFieldJacobianDeterminantFilter without image
+ *    spacing.
+ *
+ * The gradient of a field is shared by its harmonic energy and Jacobian.
+ * All images and fields must have the same buffered region; each field
+ * lives on the grid of the image it is compared to. Without inverse field
+ * the back statistics are not computed (left at 0).
+ *
+ * The region is cut into slabs along its last non-trivial axis, one per
+ * thread. Each thread accumulates its own partial sums, which are added
+ * in thread order, so a run gives the same result for a given number of
+ * threads.
+ *
+ * \sa DemonsIterationEngine
+ */
+template <class TImage, class TDeformationField>
+class ITK_EXPORT RegistrationMetricsCalculator : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef RegistrationMetricsCalculator Self;
+  typedef Object                        Superclass;
+  typedef SmartPointer<Self>            Pointer;
+  typedef SmartPointer<const Self>      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( RegistrationMetricsCalculator, Object );
+
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TDeformationField::ImageDimension);
+
+  typedef TImage                                    ImageType;
+  typedef typename ImageType::PixelType             PixelType;
+  typedef TDeformationField                         DeformationFieldType;
+  typedef typename DeformationFieldType::PixelType  VectorPixelType;
+  typedef typename VectorPixelType::ValueType       ValueType;
+  typedef typename DeformationFieldType::RegionType RegionType;
+  typedef typename DeformationFieldType::IndexType  IndexType;
+  typedef Matrix<double, ImageDimension, ImageDimension> MatrixType;
+  typedef Vector<double, ImageDimension>            OffsetVectorType;
+
+  /** Fixed and moving images. */
+  itkSetConstObjectMacro( FixedImage, ImageType );
+  itkGetConstObjectMacro( FixedImage, ImageType );
+  itkSetConstObjectMacro( MovingImage, ImageType );
+  itkGetConstObjectMacro( MovingImage, ImageType );
+
+  /** exp(v), on the grid of the fixed image, and exp(-v), on the grid of
+   * the moving image (optional). */
+  itkSetConstObjectMacro( DeformationField, DeformationFieldType );
+  itkGetConstObjectMacro( DeformationField, DeformationFieldType );
+  itkSetConstObjectMacro( InverseDeformationField, DeformationFieldType );
+  itkGetConstObjectMacro( InverseDeformationField, DeformationFieldType );
+
+  /** Threads used, 0 (the default) uses the ITK default. */
+  itkSetMacro( NumberOfThreads, unsigned int );
+  itkGetConstMacro( NumberOfThreads, unsigned int );
+
+  /** Compute all the statistics. */
+  void Compute();
+
+  itkGetConstMacro( MSE, double );
+  itkGetConstMacro( BackMSE, double );
+  itkGetConstMacro( HarmonicEnergy, double );
+  itkGetConstMacro( BackHarmonicEnergy, double );
+  itkGetConstMacro( NegativeJacobianRatio, double );
+  itkGetConstMacro( BackNegativeJacobianRatio, double );
+
+protected:
+  RegistrationMetricsCalculator();
+  ~RegistrationMetricsCalculator() {}
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Partial sums of one thread, for the forward [0] and inverse [1]
+   * side. */
+  struct PartialSums
+    {
+    double         m_SquaredDifference[2];
+    unsigned long  m_Count[2];
+    double         m_HarmonicEnergy[2];
+    unsigned long  m_NonPositive[2];
+    };
+
+  /** Slab of the region handled by thread i of n. Returns the number of
+   * slabs actually used. */
+  unsigned int SplitRegion( unsigned int i, unsigned int n,
+                            RegionType & slab ) const;
+
+  /** Accumulate the statistics of one slab. */
+  void ThreadedCompute( const RegionType & slab, PartialSums & sums ) const;
+
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void * arg );
+
+private:
+  RegistrationMetricsCalculator(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  typename ImageType::ConstPointer             m_FixedImage;
+  typename ImageType::ConstPointer             m_MovingImage;
+  typename DeformationFieldType::ConstPointer  m_DeformationField;
+  typename DeformationFieldType::ConstPointer  m_InverseDeformationField;
+
+  unsigned int                  m_NumberOfThreads;
+
+  double                        m_MSE;
+  double                        m_BackMSE;
+  double                        m_HarmonicEnergy;
+  double                        m_BackHarmonicEnergy;
+  double                        m_NegativeJacobianRatio;
+  double                        m_BackNegativeJacobianRatio;
+
+  /** State of the current Compute(), read by the threads. For each side,
+   * the continuous index in the warped image of voxel x displaced by d is
+   * m_IndexToIndex x + m_IndexOffset + m_PhysicalToIndex d. */
+  RegionType                    m_Region;
+  unsigned int                  m_NumberOfSplits;
+  unsigned int                  m_NumberOfSides;
+  const VectorPixelType *       m_Field[2];
+  const PixelType *             m_Warped[2];
+  const PixelType *             m_Reference[2];
+  MatrixType                    m_IndexToIndex[2];
+  OffsetVectorType              m_IndexOffset[2];
+  MatrixType                    m_PhysicalToIndex[2];
+  double                        m_DerivativeWeights[2][ImageDimension];
+  std::vector<PartialSums>      m_PartialSums;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkRegistrationMetricsCalculator.txx"
+#endif
+
+#endif
@@ -0,0 +1,402 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkRegistrationMetricsCalculator.txx
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkRegistrationMetricsCalculator_txx
+#define __itkRegistrationMetricsCalculator_txx
+
+#include "itkRegistrationMetricsCalculator.h"
+
+#include "vnl/vnl_det.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace itk {
+
+/**
+ * Default constructor
+ */
+template <class TImage, class TDeformationField>
+RegistrationMetricsCalculator<TImage,TDeformationField>
+::RegistrationMetricsCalculator()
+{
+  m_NumberOfThreads = 0;
+  m_NumberOfSplits = 1;
+  m_NumberOfSides = 0;
+
+  m_MSE = 0.0;
+  m_BackMSE = 0.0;
+  m_HarmonicEnergy = 0.0;
+  m_BackHarmonicEnergy = 0.0;
+  m_NegativeJacobianRatio = 0.0;
+  m_BackNegativeJacobianRatio = 0.0;
+
+  for( unsigned int s = 0; s < 2; s++ )
+    {
+    m_Field[s] = NULL;
+    m_Warped[s] = NULL;
+    m_Reference[s] = NULL;
+    }
+}
+
+
+template <class TImage, class TDeformationField>
+void
+RegistrationMetricsCalculator<TImage,TDeformationField>
+::Compute()
+{
+  if( !m_FixedImage || !m_MovingImage || !m_DeformationField )
+    {
+    itkExceptionMacro( << "FixedImage, MovingImage and DeformationField must be set." );
+    }
+
+  m_Region = m_DeformationField->GetBufferedRegion();
+  if( m_FixedImage->GetBufferedRegion() != m_Region
+      || m_MovingImage->GetBufferedRegion() != m_Region
+      || ( m_InverseDeformationField
+           && m_InverseDeformationField->GetBufferedRegion() != m_Region ) )
+    {
+    itkExceptionMacro( << "The images and fields must have the same buffered region." );
+    }
+
+  // side 0: moving warped by exp(v) against fixed, side 1: fixed warped by
+  // exp(-v) against moving
+  m_NumberOfSides = m_InverseDeformationField ? 2 : 1;
+  const ImageType * references[2] = { m_FixedImage, m_MovingImage };
+  const ImageType * warpedImages[2] = { m_MovingImage, m_FixedImage };
+  const DeformationFieldType * fields[2] = { m_DeformationField, m_InverseDeformationField };
+  for( unsigned int s = 0; s < m_NumberOfSides; s++ )
+    {
+    const ImageType * reference = references[s];
+    const ImageType * warped = warpedImages[s];
+    m_Field[s] = fields[s]->GetBufferPointer();
+    m_Warped[s] = warped->GetBufferPointer();
+    m_Reference[s] = reference->GetBufferPointer();
+
+    // (Direction * Spacing)^-1 of the warped image
+    const MatrixType directionInverse( warped->GetDirection().GetInverse() );
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        m_PhysicalToIndex[s][i][j] = directionInverse[i][j] / warped->GetSpacing()[i];
+        }
+      }
+
+    // index of the reference to physical point: Direction * Spacing
+    MatrixType indexToPhysical;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        indexToPhysical[i][j] = reference->GetDirection()[i][j] * reference->GetSpacing()[j];
+        }
+      }
+    m_IndexToIndex[s] = m_PhysicalToIndex[s] * indexToPhysical;
+
+    OffsetVectorType originOffset;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      originOffset[i] = reference->GetOrigin()[i] - warped->GetOrigin()[i];
+      }
+    m_IndexOffset[s] = m_PhysicalToIndex[s] * originOffset;
+
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      m_DerivativeWeights[s][i] = 1.0 / static_cast<double>( fields[s]->GetSpacing()[i] );
+      }
+    }
+
+  unsigned int numberOfThreads = m_NumberOfThreads;
+  if( numberOfThreads == 0 )
+    {
+    numberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numberOfThreads = std::min( numberOfThreads, static_cast<unsigned int>(
+    MultiThreader::GetGlobalMaximumNumberOfThreads() ) );
+  m_NumberOfSplits = numberOfThreads;
+
+  RegionType slab;
+  const unsigned int numberOfSlabs = this->SplitRegion( 0, m_NumberOfSplits, slab );
+  m_PartialSums.assign( numberOfSlabs, PartialSums() );
+
+  if( numberOfSlabs == 1 )
+    {
+    this->ThreadedCompute( m_Region, m_PartialSums[0] );
+    }
+  else
+    {
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfSlabs );
+    threader->SetSingleMethod( Self::ThreaderCallback, this );
+    threader->SingleMethodExecute();
+    }
+
+  // reduce in thread order
+  double squaredDifference[2] = { 0.0, 0.0 };
+  double count[2] = { 0.0, 0.0 };
+  double harmonicEnergy[2] = { 0.0, 0.0 };
+  double nonPositive[2] = { 0.0, 0.0 };
+  for( unsigned int t = 0; t < numberOfSlabs; t++ )
+    {
+    for( unsigned int s = 0; s < m_NumberOfSides; s++ )
+      {
+      squaredDifference[s] += m_PartialSums[t].m_SquaredDifference[s];
+      count[s] += m_PartialSums[t].m_Count[s];
+      harmonicEnergy[s] += m_PartialSums[t].m_HarmonicEnergy[s];
+      nonPositive[s] += m_PartialSums[t].m_NonPositive[s];
+      }
+    }
+
+  const double numberOfPixels = static_cast<double>( m_Region.GetNumberOfPixels() );
+  double mse[2] = { 0.0, 0.0 };
+  double energy[2] = { 0.0, 0.0 };
+  double ratio[2] = { 0.0, 0.0 };
+  for( unsigned int s = 0; s < m_NumberOfSides; s++ )
+    {
+    mse[s] = count[s] > 0 ? squaredDifference[s] / count[s]
+      : std::numeric_limits<double>::quiet_NaN();
+    energy[s] = numberOfPixels > 0 ? harmonicEnergy[s] / numberOfPixels : 0.0;
+    ratio[s] = numberOfPixels > 0 ? nonPositive[s] / numberOfPixels : 0.0;
+    }
+  m_MSE = mse[0];
+  m_HarmonicEnergy = energy[0];
+  m_NegativeJacobianRatio = ratio[0];
+  m_BackMSE = mse[1];
+  m_BackHarmonicEnergy = energy[1];
+  m_BackNegativeJacobianRatio = ratio[1];
+}
+
+
+/**
+ * Split the region into slabs along its last non-trivial axis, the same
+ * way ImageSource::SplitRequestedRegion does
+ */
+template <class TImage, class TDeformationField>
+unsigned int
+RegistrationMetricsCalculator<TImage,TDeformationField>
+::SplitRegion( unsigned int i, unsigned int n, RegionType & slab ) const
+{
+  slab = m_Region;
+  typename RegionType::IndexType index = m_Region.GetIndex();
+  typename RegionType::SizeType size = m_Region.GetSize();
+
+  int splitAxis = ImageDimension - 1;
+  while( size[splitAxis] == 1 )
+    {
+    --splitAxis;
+    if( splitAxis < 0 )
+      {
+      // cannot split
+      return 1;
+      }
+    }
+
+  const unsigned long range = size[splitAxis];
+  const unsigned long valuesPerThread = ( range + n - 1 ) / n;
+  const unsigned int maxThreadIdUsed = ( range + valuesPerThread - 1 ) / valuesPerThread - 1;
+
+  if( i < maxThreadIdUsed )
+    {
+    index[splitAxis] += i * valuesPerThread;
+    size[splitAxis] = valuesPerThread;
+    }
+  if( i == maxThreadIdUsed )
+    {
+    index[splitAxis] += i * valuesPerThread;
+    size[splitAxis] = size[splitAxis] - i * valuesPerThread;
+    }
+
+  slab.SetIndex( index );
+  slab.SetSize( size );
+  return maxThreadIdUsed + 1;
+}
+
+
+template <class TImage, class TDeformationField>
+ITK_THREAD_RETURN_TYPE
+RegistrationMetricsCalculator<TImage,TDeformationField>
+::ThreaderCallback( void * arg )
+{
+  MultiThreader::ThreadInfoStruct * info =
+    static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  Self * self = static_cast<Self *>( info->UserData );
+
+  const unsigned int threadId = info->ThreadID;
+  RegionType slab;
+  const unsigned int numberOfSlabs =
+    self->SplitRegion( threadId, self->m_NumberOfSplits, slab );
+  if( threadId < numberOfSlabs )
+    {
+    self->ThreadedCompute( slab, self->m_PartialSums[threadId] );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+
+/**
+ * Visit the slab row by row along the first axis. At each voxel and for
+ * each side: the nearest neighbour of the displaced voxel in the warped
+ * image (inside if within half a voxel of the buffer), and the central
+ * differences of the field, the border voxels repeated outside the image.
+ */
+template <class TImage, class TDeformationField>
+void
+RegistrationMetricsCalculator<TImage,TDeformationField>
+::ThreadedCompute( const RegionType & slab, PartialSums & sums ) const
+{
+  long start[ImageDimension];
+  long end[ImageDimension];
+  long stride[ImageDimension];
+  double lowerBound[ImageDimension];
+  double upperBound[ImageDimension];
+  long bufferStride = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    start[d] = m_Region.GetIndex()[d];
+    end[d] = start[d] + static_cast<long>( m_Region.GetSize()[d] ) - 1;
+    stride[d] = bufferStride;
+    bufferStride *= static_cast<long>( m_Region.GetSize()[d] );
+    lowerBound[d] = start[d] - 0.5;
+    upperBound[d] = end[d] + 0.5;
+    }
+
+  for( unsigned int s = 0; s < 2; s++ )
+    {
+    sums.m_SquaredDifference[s] = 0.0;
+    sums.m_Count[s] = 0;
+    sums.m_HarmonicEnergy[s] = 0.0;
+    sums.m_NonPositive[s] = 0;
+    }
+
+  const unsigned long rowLength = slab.GetSize()[0];
+  const unsigned long numberOfRows = slab.GetNumberOfPixels() / rowLength;
+  const ValueType half = 0.5;
+
+  IndexType index = slab.GetIndex();
+  for( unsigned long row = 0; row < numberOfRows; row++ )
+    {
+    long rowOffset = 0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      rowOffset += ( index[d] - start[d] ) * stride[d];
+      }
+
+    for( unsigned long x = 0; x < rowLength; x++ )
+      {
+      const long offset = rowOffset + static_cast<long>( x );
+
+      long position[ImageDimension];
+      long previous[ImageDimension];
+      long next[ImageDimension];
+      for( unsigned int i = 0; i < ImageDimension; i++ )
+        {
+        position[i] = index[i] + ( i == 0 ? static_cast<long>( x ) : 0 );
+        previous[i] = position[i] > start[i] ? offset - stride[i] : offset;
+        next[i] = position[i] < end[i] ? offset + stride[i] : offset;
+        }
+
+      for( unsigned int s = 0; s < m_NumberOfSides; s++ )
+        {
+        const VectorPixelType * field = m_Field[s];
+        const VectorPixelType & displacement = field[offset];
+
+        // nearest neighbour of the displaced voxel
+        bool inside = true;
+        long warpedOffset = 0;
+        for( unsigned int i = 0; i < ImageDimension && inside; i++ )
+          {
+          double cindex = m_IndexOffset[s][i];
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            cindex += m_IndexToIndex[s][i][j] * static_cast<double>( position[j] )
+              + m_PhysicalToIndex[s][i][j] * displacement[j];
+            }
+          inside = cindex >= lowerBound[i] && cindex < upperBound[i];
+          const long nearest = std::min( static_cast<long>( std::floor( cindex + 0.5 ) ), end[i] );
+          warpedOffset += ( nearest - start[i] ) * stride[i];
+          }
+        if( inside )
+          {
+          const double difference = static_cast<double>( m_Warped[s][warpedOffset] )
+            - static_cast<double>( m_Reference[s][offset] );
+          if( difference == difference )
+            {
+            sums.m_SquaredDifference[s] += difference * difference;
+            ++sums.m_Count[s];
+            }
+          }
+
+        // gradient: harmonic energy in double with the spacing, Jacobian
+        // in the precision of the field without
+        double energy = 0.0;
+        vnl_matrix_fixed<ValueType, ImageDimension, ImageDimension> jacobian;
+        for( unsigned int i = 0; i < ImageDimension; i++ )
+          {
+          const VectorPixelType & nextValue = field[next[i]];
+          const VectorPixelType & previousValue = field[previous[i]];
+          const double weight = 0.5 * m_DerivativeWeights[s][i];
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            const double derivative = weight * ( static_cast<double>( nextValue[j] )
+                                                 - static_cast<double>( previousValue[j] ) );
+            energy += derivative * derivative;
+            jacobian[i][j] = half * ( nextValue[j] - previousValue[j] );
+            }
+          jacobian[i][i] += 1.0;
+          }
+        sums.m_HarmonicEnergy[s] += energy;
+        if( vnl_det( jacobian ) <= 0 )
+          {
+          ++sums.m_NonPositive[s];
+          }
+        }
+      }
+
+    // next row start
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      ++index[d];
+      if( index[d] < slab.GetIndex()[d] + static_cast<long>( slab.GetSize()[d] ) )
+        {
+        break;
+        }
+      index[d] = slab.GetIndex()[d];
+      }
+    }
+}
+
+
+/*
+ * Standard "PrintSelf" method.
+ */
+template <class TImage, class TDeformationField>
+void
+RegistrationMetricsCalculator<TImage,TDeformationField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "NumberOfThreads: " << m_NumberOfThreads << std::endl;
+  os << indent << "MSE: " << m_MSE << std::endl;
+  os << indent << "BackMSE: " << m_BackMSE << std::endl;
+  os << indent << "HarmonicEnergy: " << m_HarmonicEnergy << std::endl;
+  os << indent << "BackHarmonicEnergy: " << m_BackHarmonicEnergy << std::endl;
+  os << indent << "NegativeJacobianRatio: " << m_NegativeJacobianRatio << std::endl;
+  os << indent << "BackNegativeJacobianRatio: " << m_BackNegativeJacobianRatio << std::endl;
+}
+
+} // end namespace itk
+
+#endif
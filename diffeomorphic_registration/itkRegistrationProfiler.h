@@ -0,0 +1,170 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkRegistrationProfiler.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkRegistrationProfiler_h
+#define __itkRegistrationProfiler_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include <map>
+#include <string>
+
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+namespace itk {
+
+/**
+ * \class RegistrationProfiler
+ *
+ * \brief Wall-clock time per phase and event counters of a registration
+ *
+ * Phases are timed with ScopedTimer, on a monotonic clock. A phase may be
+ * entered several times (its time and number of calls add up) and phases
+ * may nest, e.g. the SDM computation inside the force initialisation.
+ * Counters (voxels, labels, SDM passes, ...) are incremented with AddCount.
+ *
+ * The classes taking a profiler do nothing when it is NULL, so profiling
+ * costs a pointer test when it is off. A profiler is not thread safe:
+ * phases and counters are recorded from the thread driving the
+ * registration.
+ */
+class RegistrationProfiler : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef RegistrationProfiler          Self;
+  typedef Object                        Superclass;
+  typedef SmartPointer<Self>            Pointer;
+  typedef SmartPointer<const Self>      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( RegistrationProfiler, Object );
+
+  /** Accumulated time of a phase. */
+  struct PhaseRecord
+    {
+    PhaseRecord() : m_Seconds( 0.0 ), m_Calls( 0 ) {}
+    double         m_Seconds;
+    unsigned long  m_Calls;
+    };
+
+  typedef std::map<std::string, PhaseRecord>   PhaseMapType;
+  typedef std::map<std::string, double>        CounterMapType;
+
+  /** Seconds on a monotonic clock, from an arbitrary origin. */
+  static double GetTime()
+    {
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+    if( timebase.denom == 0 )
+      {
+      mach_timebase_info( &timebase );
+      }
+    return static_cast<double>( mach_absolute_time() ) * timebase.numer / timebase.denom * 1e-9;
+#else
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return static_cast<double>( now.tv_sec ) + 1e-9 * static_cast<double>( now.tv_nsec );
+#endif
+    }
+
+  /** Add one call of the given duration to a phase. */
+  void AddTime( const std::string & phase, double seconds )
+    {
+    PhaseRecord & record = m_Phases[phase];
+    record.m_Seconds += seconds;
+    ++record.m_Calls;
+    }
+
+  /** Increment a counter. */
+  void AddCount( const std::string & counter, double count = 1.0 )
+    {
+    m_Counters[counter] += count;
+    }
+
+  const PhaseMapType & GetPhases() const
+    { return m_Phases; }
+  const CounterMapType & GetCounters() const
+    { return m_Counters; }
+
+  /** Forget all phases and counters. */
+  void Reset()
+    {
+    m_Phases.clear();
+    m_Counters.clear();
+    }
+
+  /** Times its scope as a phase of the profiler, if there is one. */
+  class ScopedTimer
+  {
+  public:
+    ScopedTimer( RegistrationProfiler * profiler, const char * phase )
+      : m_Profiler( profiler ), m_Phase( phase ), m_Start( 0.0 )
+      {
+      if( m_Profiler )
+        {
+        m_Start = RegistrationProfiler::GetTime();
+        }
+      }
+    ~ScopedTimer()
+      {
+      if( m_Profiler )
+        {
+        m_Profiler->AddTime( m_Phase, RegistrationProfiler::GetTime() - m_Start );
+        }
+      }
+  private:
+    ScopedTimer(const ScopedTimer&); //purposely not implemented
+    void operator=(const ScopedTimer&); //purposely not implemented
+
+    RegistrationProfiler *  m_Profiler;
+    const char *            m_Phase;
+    double                  m_Start;
+  };
+
+protected:
+  RegistrationProfiler() {}
+  ~RegistrationProfiler() {}
+
+  void PrintSelf(std::ostream& os, Indent indent) const
+    {
+    Superclass::PrintSelf(os, indent);
+    for( PhaseMapType::const_iterator it = m_Phases.begin(); it != m_Phases.end(); ++it )
+      {
+      os << indent << it->first << ": " << it->second.m_Seconds << " s, "
+         << it->second.m_Calls << " calls" << std::endl;
+      }
+    for( CounterMapType::const_iterator it = m_Counters.begin(); it != m_Counters.end(); ++it )
+      {
+      os << indent << it->first << ": " << it->second << std::endl;
+      }
+    }
+
+private:
+  RegistrationProfiler(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  PhaseMapType    m_Phases;
+  CounterMapType  m_Counters;
+};
+
+} // end namespace itk
+
+#endif
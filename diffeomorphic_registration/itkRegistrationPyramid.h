@@ -0,0 +1,184 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkRegistrationPyramid.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkRegistrationPyramid_h
+#define __itkRegistrationPyramid_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkMultiThreader.h"
+
+#include <vector>
+
+namespace itk {
+
+/**
+ * \class RegistrationPyramid
+ *
+ * \brief Images and fields between the levels of the multi-resolution
+ * pyramid of BFL_pairwise_reg3D
+ *
+ * Each level halves the size of the previous one (rounding down, as the
+ * 1:2:end decimation did) and is registered in voxel units of its own
+ * grid, so displacements are halved on the way down and doubled on the
+ * way up. The spacing, origin and direction of the inputs are kept.
+ *
+ *  - DownsampleImage() keeps every other voxel, from the first, in
+ *    LabelMode; in SmoothMode the image is first smoothed by a Gaussian
+ *    of SmoothingSigma voxels of the finer grid, evaluated only at the
+ *    kept voxels. SmoothMode is for intensities and signed distance maps:
+ *    label images must be decimated, smoothing would mix their labels.
+ *    ESMInvConDemonsRegistrationFunction builds its smoothed SDM levels
+ *    from the SDMs of the full-resolution label images.
+ *  - DownsampleField() decimates a field the same way and halves it.
+ *  - UpsampleField() interpolates a field trilinearly onto the finer grid
+ *    of the given size, voxel j of the finer grid being at j/2 on the
+ *    coarser one, and doubles it. Voxels beyond the last coarser voxel
+ *    take its value.
+ *
+ * All of these are separable: one pass per axis, each a weighted sum of
+ * a few voxels along the axis, accumulated in double. The passes are
+ * shared between threads by rows of the output. Fields are handled as
+ * images of ImageDimension components, whose type must be the pixel type
+ * of the images.
+ *
+ * \sa JointFieldExponentiator
+ */
+template <class TImage,
+          class TDeformationField = Image<Vector<typename TImage::PixelType, TImage::ImageDimension>,
+                                          TImage::ImageDimension> >
+class ITK_EXPORT RegistrationPyramid : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef RegistrationPyramid           Self;
+  typedef Object                        Superclass;
+  typedef SmartPointer<Self>            Pointer;
+  typedef SmartPointer<const Self>      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( RegistrationPyramid, Object );
+
+  itkStaticConstMacro(ImageDimension, unsigned int, TImage::ImageDimension);
+
+  /** Image and field typedefs. */
+  typedef TImage                                    ImageType;
+  typedef typename ImageType::Pointer               ImagePointer;
+  typedef typename ImageType::ConstPointer          ImageConstPointer;
+  typedef typename ImageType::PixelType             ValueType;
+  typedef typename ImageType::SizeType              SizeType;
+  typedef TDeformationField                         DeformationFieldType;
+  typedef typename DeformationFieldType::Pointer    DeformationFieldPointer;
+
+  /** How images are brought to the next coarser level. */
+  enum ImageModeType { LabelMode, SmoothMode };
+
+  /** Standard deviation, in voxels of the finer grid, of the Gaussian of
+   * SmoothMode. Default is 1, 0 decimates without smoothing. */
+  itkSetMacro( SmoothingSigma, double );
+  itkGetConstMacro( SmoothingSigma, double );
+
+  /** Threads of the passes, 0 (the default) for the ITK default. */
+  itkSetMacro( NumberOfThreads, unsigned int );
+  itkGetConstMacro( NumberOfThreads, unsigned int );
+
+  /** Size of the next coarser level. */
+  static SizeType GetDownsampledSize( const SizeType & size );
+
+  /** Image of the next coarser level. */
+  ImagePointer DownsampleImage( const ImageType * image, ImageModeType mode );
+
+  /** Levels of an image, the finest (the image itself) first. */
+  std::vector<ImageConstPointer> ComputeImagePyramid( const ImageType * image,
+                                                      unsigned int numberOfLevels,
+                                                      ImageModeType mode );
+
+  /** Field of the next coarser level, halved. */
+  DeformationFieldPointer DownsampleField( const DeformationFieldType * field );
+
+  /** Field on the finer grid of the given size, doubled. */
+  DeformationFieldPointer UpsampleField( const DeformationFieldType * field,
+                                         const SizeType & size );
+
+protected:
+  RegistrationPyramid();
+  ~RegistrationPyramid() {}
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Taps keeping every other voxel, weighted by the kernel (of odd
+   * length, centred on the kept voxel) times scale. */
+  void SetDecimationTaps( unsigned long inputLength, unsigned long outputLength,
+                          const std::vector<double> & kernel, double scale );
+
+  /** Taps interpolating linearly at half the output position, times
+   * scale. */
+  void SetInterpolationTaps( unsigned long inputLength, unsigned long outputLength,
+                             double scale );
+
+  /** Resample the buffer along the axis with the current taps, each voxel
+   * holding numberOfComponents values. */
+  void ResampleAxis( const ValueType * input, const SizeType & inputSize,
+                     unsigned int numberOfComponents, unsigned int axis,
+                     unsigned long outputLength, ValueType * output );
+
+  /** Resample the rows [firstRow, endRow) of the current pass. */
+  void ThreadedResampleAxis( unsigned long firstRow, unsigned long endRow ) const;
+
+  /** Static function used as a "callback" by the MultiThreader. */
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg );
+
+private:
+  RegistrationPyramid(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  /** Resample a buffer along every axis, with the taps set by
+   * SetDecimationTaps (downsampling) or SetInterpolationTaps. */
+  void Resample( const ValueType * input, const SizeType & inputSize,
+                 unsigned int numberOfComponents, const SizeType & outputSize,
+                 bool downsample, const std::vector<double> & kernel, double scale,
+                 ValueType * output );
+
+  /** New image of the given size with the geometry of another. */
+  template <class TOutputImage, class TInputImage>
+  static typename TOutputImage::Pointer AllocateLike( const TInputImage * image,
+                                                      const SizeType & size );
+
+  double                        m_SmoothingSigma;
+  unsigned int                  m_NumberOfThreads;
+
+  /** State of the current pass, read by the threads. */
+  std::vector<long>             m_TapIndex;
+  std::vector<double>           m_TapWeight;
+  unsigned int                  m_NumberOfTaps;
+  const ValueType *             m_PassInput;
+  ValueType *                   m_PassOutput;
+  unsigned long                 m_InputLength;
+  unsigned long                 m_OutputLength;
+  unsigned long                 m_RowLength;
+  unsigned long                 m_NumberOfRows;
+  unsigned long                 m_RowsPerThread;
+
+  MultiThreader::Pointer        m_Threader;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkRegistrationPyramid.txx"
+#endif
+
+#endif
@@ -0,0 +1,407 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkRegistrationPyramid.txx
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkRegistrationPyramid_txx
+#define __itkRegistrationPyramid_txx
+
+#include "itkRegistrationPyramid.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace itk {
+
+/**
+ * Default constructor
+ */
+template <class TImage, class TDeformationField>
+RegistrationPyramid<TImage,TDeformationField>
+::RegistrationPyramid()
+{
+  m_SmoothingSigma = 1.0;
+  m_NumberOfThreads = 0;
+  m_NumberOfTaps = 0;
+  m_PassInput = NULL;
+  m_PassOutput = NULL;
+  m_InputLength = 0;
+  m_OutputLength = 0;
+  m_RowLength = 0;
+  m_NumberOfRows = 0;
+  m_RowsPerThread = 0;
+  m_Threader = MultiThreader::New();
+}
+
+
+/**
+ * Half the size, rounded down, at least one voxel
+ */
+template <class TImage, class TDeformationField>
+typename RegistrationPyramid<TImage,TDeformationField>::SizeType
+RegistrationPyramid<TImage,TDeformationField>
+::GetDownsampledSize( const SizeType & size )
+{
+  SizeType downsampled;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    downsampled[i] = std::max( size[i] / 2, static_cast<typename SizeType::SizeValueType>( 1 ) );
+    }
+  return downsampled;
+}
+
+
+/**
+ * Image of the next coarser level
+ */
+template <class TImage, class TDeformationField>
+typename RegistrationPyramid<TImage,TDeformationField>::ImagePointer
+RegistrationPyramid<TImage,TDeformationField>
+::DownsampleImage( const ImageType * image, ImageModeType mode )
+{
+  // normalized Gaussian, truncated at three standard deviations
+  std::vector<double> kernel( 1, 1.0 );
+  if( mode == SmoothMode && m_SmoothingSigma > 0.0 )
+    {
+    const int radius = static_cast<int>( std::ceil( 3.0 * m_SmoothingSigma ) );
+    kernel.resize( 2 * radius + 1 );
+    double sum = 0.0;
+    for( int k = -radius; k <= radius; k++ )
+      {
+      kernel[k + radius] = std::exp( -0.5 * k * k / ( m_SmoothingSigma * m_SmoothingSigma ) );
+      sum += kernel[k + radius];
+      }
+    for( unsigned int k = 0; k < kernel.size(); k++ )
+      {
+      kernel[k] /= sum;
+      }
+    }
+
+  const SizeType size = GetDownsampledSize( image->GetBufferedRegion().GetSize() );
+  ImagePointer output = AllocateLike<ImageType>( image, size );
+  this->Resample( image->GetBufferPointer(), image->GetBufferedRegion().GetSize(), 1,
+                  size, true, kernel, 1.0, output->GetBufferPointer() );
+  return output;
+}
+
+
+/**
+ * Levels of an image, the finest first
+ */
+template <class TImage, class TDeformationField>
+std::vector<typename RegistrationPyramid<TImage,TDeformationField>::ImageConstPointer>
+RegistrationPyramid<TImage,TDeformationField>
+::ComputeImagePyramid( const ImageType * image, unsigned int numberOfLevels,
+                       ImageModeType mode )
+{
+  std::vector<ImageConstPointer> levels;
+  if( numberOfLevels == 0 )
+    {
+    return levels;
+    }
+  levels.push_back( image );
+  for( unsigned int level = 1; level < numberOfLevels; level++ )
+    {
+    ImagePointer coarser = this->DownsampleImage( levels.back(), mode );
+    levels.push_back( coarser.GetPointer() );
+    }
+  return levels;
+}
+
+
+/**
+ * Field of the next coarser level, halved
+ */
+template <class TImage, class TDeformationField>
+typename RegistrationPyramid<TImage,TDeformationField>::DeformationFieldPointer
+RegistrationPyramid<TImage,TDeformationField>
+::DownsampleField( const DeformationFieldType * field )
+{
+  const SizeType size = GetDownsampledSize( field->GetBufferedRegion().GetSize() );
+  DeformationFieldPointer output = AllocateLike<DeformationFieldType>( field, size );
+  this->Resample( reinterpret_cast<const ValueType *>( field->GetBufferPointer() ), field->GetBufferedRegion().GetSize(),
+                  ImageDimension, size, true, std::vector<double>( 1, 1.0 ), 0.5,
+                  reinterpret_cast<ValueType *>( output->GetBufferPointer() ) );
+  return output;
+}
+
+
+/**
+ * Field on the finer grid, doubled
+ */
+template <class TImage, class TDeformationField>
+typename RegistrationPyramid<TImage,TDeformationField>::DeformationFieldPointer
+RegistrationPyramid<TImage,TDeformationField>
+::UpsampleField( const DeformationFieldType * field, const SizeType & size )
+{
+  DeformationFieldPointer output = AllocateLike<DeformationFieldType>( field, size );
+  this->Resample( reinterpret_cast<const ValueType *>( field->GetBufferPointer() ), field->GetBufferedRegion().GetSize(),
+                  ImageDimension, size, false, std::vector<double>(), 2.0,
+                  reinterpret_cast<ValueType *>( output->GetBufferPointer() ) );
+  return output;
+}
+
+
+/**
+ * One pass per axis, through intermediate buffers. The scale is applied
+ * by the first pass only.
+ */
+template <class TImage, class TDeformationField>
+void
+RegistrationPyramid<TImage,TDeformationField>
+::Resample( const ValueType * input, const SizeType & inputSize,
+            unsigned int numberOfComponents, const SizeType & outputSize,
+            bool downsample, const std::vector<double> & kernel, double scale,
+            ValueType * output )
+{
+  std::vector<ValueType> buffers[2];
+  SizeType size = inputSize;
+  const ValueType * passInput = input;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    const double passScale = ( i == 0 ) ? scale : 1.0;
+    if( downsample )
+      {
+      this->SetDecimationTaps( size[i], outputSize[i], kernel, passScale );
+      }
+    else
+      {
+      this->SetInterpolationTaps( size[i], outputSize[i], passScale );
+      }
+
+    ValueType * passOutput = output;
+    if( i + 1 < ImageDimension )
+      {
+      unsigned long numberOfValues = numberOfComponents * outputSize[i];
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        numberOfValues *= ( j == i ) ? 1 : size[j];
+        }
+      buffers[i % 2].resize( numberOfValues );
+      passOutput = &buffers[i % 2][0];
+      }
+
+    this->ResampleAxis( passInput, size, numberOfComponents, i, outputSize[i], passOutput );
+    size[i] = outputSize[i];
+    passInput = passOutput;
+    }
+}
+
+
+/**
+ * Every other voxel, the kernel clamped at the borders
+ */
+template <class TImage, class TDeformationField>
+void
+RegistrationPyramid<TImage,TDeformationField>
+::SetDecimationTaps( unsigned long inputLength, unsigned long outputLength,
+                     const std::vector<double> & kernel, double scale )
+{
+  const long radius = static_cast<long>( kernel.size() / 2 );
+  const long last = static_cast<long>( inputLength ) - 1;
+  m_NumberOfTaps = kernel.size();
+  m_TapIndex.resize( outputLength * m_NumberOfTaps );
+  m_TapWeight.resize( outputLength * m_NumberOfTaps );
+  for( unsigned long o = 0; o < outputLength; o++ )
+    {
+    for( unsigned int t = 0; t < m_NumberOfTaps; t++ )
+      {
+      const long index = 2 * static_cast<long>( o ) + static_cast<long>( t ) - radius;
+      m_TapIndex[o * m_NumberOfTaps + t] = std::max( 0L, std::min( index, last ) );
+      m_TapWeight[o * m_NumberOfTaps + t] = kernel[t] * scale;
+      }
+    }
+}
+
+
+/**
+ * Output voxel o at o/2 on the input, beyond the last voxel clamped to it
+ */
+template <class TImage, class TDeformationField>
+void
+RegistrationPyramid<TImage,TDeformationField>
+::SetInterpolationTaps( unsigned long inputLength, unsigned long outputLength,
+                        double scale )
+{
+  const long last = static_cast<long>( inputLength ) - 1;
+  m_NumberOfTaps = 2;
+  m_TapIndex.resize( outputLength * 2 );
+  m_TapWeight.resize( outputLength * 2 );
+  for( unsigned long o = 0; o < outputLength; o++ )
+    {
+    const long base = static_cast<long>( o / 2 );
+    const double distance = ( base < last && ( o % 2 ) ) ? 0.5 : 0.0;
+    m_TapIndex[2 * o] = std::min( base, last );
+    m_TapIndex[2 * o + 1] = std::min( base + 1, last );
+    m_TapWeight[2 * o] = ( 1.0 - distance ) * scale;
+    m_TapWeight[2 * o + 1] = distance * scale;
+    }
+}
+
+
+/**
+ * Resample along an axis: the buffer is seen as rows of RowLength values
+ * (the components and the axes before this one), InputLength rows per
+ * line along the axis
+ */
+template <class TImage, class TDeformationField>
+void
+RegistrationPyramid<TImage,TDeformationField>
+::ResampleAxis( const ValueType * input, const SizeType & inputSize,
+                unsigned int numberOfComponents, unsigned int axis,
+                unsigned long outputLength, ValueType * output )
+{
+  m_PassInput = input;
+  m_PassOutput = output;
+  m_InputLength = inputSize[axis];
+  m_OutputLength = outputLength;
+  m_RowLength = numberOfComponents;
+  unsigned long numberOfLines = 1;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    if( i < axis )
+      {
+      m_RowLength *= inputSize[i];
+      }
+    else if( i > axis )
+      {
+      numberOfLines *= inputSize[i];
+      }
+    }
+  m_NumberOfRows = numberOfLines * outputLength;
+  if( m_NumberOfRows == 0 || m_RowLength == 0 )
+    {
+    return;
+    }
+
+  unsigned int numberOfThreads = m_NumberOfThreads;
+  if( numberOfThreads == 0 )
+    {
+    numberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numberOfThreads = std::max( 1u, std::min( numberOfThreads, static_cast<unsigned int>(
+    MultiThreader::GetGlobalMaximumNumberOfThreads() ) ) );
+  m_RowsPerThread = ( m_NumberOfRows + numberOfThreads - 1 ) / numberOfThreads;
+  numberOfThreads = ( m_NumberOfRows + m_RowsPerThread - 1 ) / m_RowsPerThread;
+
+  if( numberOfThreads == 1 )
+    {
+    this->ThreadedResampleAxis( 0, m_NumberOfRows );
+    }
+  else
+    {
+    m_Threader->SetNumberOfThreads( numberOfThreads );
+    m_Threader->SetSingleMethod( Self::ThreaderCallback, this );
+    m_Threader->SingleMethodExecute();
+    }
+}
+
+
+/**
+ * Weighted sums of input rows, accumulated in double
+ */
+template <class TImage, class TDeformationField>
+void
+RegistrationPyramid<TImage,TDeformationField>
+::ThreadedResampleAxis( unsigned long firstRow, unsigned long endRow ) const
+{
+  std::vector<double> sum( m_RowLength );
+  for( unsigned long row = firstRow; row < endRow; row++ )
+    {
+    const unsigned long line = row / m_OutputLength;
+    const unsigned long o = row % m_OutputLength;
+    const ValueType * lineInput = m_PassInput + line * m_InputLength * m_RowLength;
+
+    std::fill( sum.begin(), sum.end(), 0.0 );
+    for( unsigned int t = 0; t < m_NumberOfTaps; t++ )
+      {
+      const double weight = m_TapWeight[o * m_NumberOfTaps + t];
+      if( weight == 0.0 )
+        {
+        continue;
+        }
+      const ValueType * in = lineInput + m_TapIndex[o * m_NumberOfTaps + t] * m_RowLength;
+      for( unsigned long n = 0; n < m_RowLength; n++ )
+        {
+        sum[n] += weight * static_cast<double>( in[n] );
+        }
+      }
+
+    ValueType * out = m_PassOutput + row * m_RowLength;
+    for( unsigned long n = 0; n < m_RowLength; n++ )
+      {
+      out[n] = static_cast<ValueType>( sum[n] );
+      }
+    }
+}
+
+
+/**
+ * Static function used as a "callback" by the MultiThreader
+ */
+template <class TImage, class TDeformationField>
+ITK_THREAD_RETURN_TYPE
+RegistrationPyramid<TImage,TDeformationField>
+::ThreaderCallback( void * arg )
+{
+  MultiThreader::ThreadInfoStruct * info =
+    static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  const Self * self = static_cast<const Self *>( info->UserData );
+
+  const unsigned long firstRow = info->ThreadID * self->m_RowsPerThread;
+  const unsigned long endRow = std::min( firstRow + self->m_RowsPerThread, self->m_NumberOfRows );
+  if( firstRow < endRow )
+    {
+    self->ThreadedResampleAxis( firstRow, endRow );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+
+/**
+ * New image of the given size, index zero, with the spacing, origin and
+ * direction of another
+ */
+template <class TImage, class TDeformationField>
+template <class TOutputImage, class TInputImage>
+typename TOutputImage::Pointer
+RegistrationPyramid<TImage,TDeformationField>
+::AllocateLike( const TInputImage * image, const SizeType & size )
+{
+  typename TOutputImage::RegionType region;
+  region.SetSize( size );
+  typename TOutputImage::Pointer output = TOutputImage::New();
+  output->SetRegions( region );
+  output->SetSpacing( image->GetSpacing() );
+  output->SetOrigin( image->GetOrigin() );
+  output->SetDirection( image->GetDirection() );
+  output->Allocate();
+  return output;
+}
+
+
+/**
+ * Standard "PrintSelf" method
+ */
+template <class TImage, class TDeformationField>
+void
+RegistrationPyramid<TImage,TDeformationField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "SmoothingSigma: " << m_SmoothingSigma << std::endl;
+  os << indent << "NumberOfThreads: " << m_NumberOfThreads << std::endl;
+}
+
+} // end namespace itk
+
+#endif
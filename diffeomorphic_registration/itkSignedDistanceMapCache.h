@@ -0,0 +1,133 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkSignedDistanceMapCache.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkSignedDistanceMapCache_h
+#define __itkSignedDistanceMapCache_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImage.h"
+
+#include <list>
+#include <vector>
+
+namespace itk {
+
+/**
+ * \class SignedDistanceMapCache
+ *
+ * \brief Content-keyed store of label signed distance maps
+ *
+ * The label images handed to the demons force do not change between
+ * iterations of one pyramid level, yet their signed distance maps used
+ * to be rebuilt at every call. This cache keys an SDM on the content of
+ * the label image it was computed from (a 64 bit FNV-1a hash of the pixel
+ * buffer, the image size and the sorted set of non-zero labels) so that
+ * a later call with the same label image gets the stored map back.
+ *
+ * Entries are kept in most-recently-used order and the oldest entry is
+ * dropped once MaximumNumberOfEntries is exceeded. The cache is meant to
+ * live across MEX calls, e.g. as a static in the MEX function.
+ *
+ * \sa ESMInvConDemonsRegistrationFunction
+ */
+template <class TImage>
+class ITK_EXPORT SignedDistanceMapCache : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef SignedDistanceMapCache        Self;
+  typedef Object                        Superclass;
+  typedef SmartPointer<Self>            Pointer;
+  typedef SmartPointer<const Self>      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( SignedDistanceMapCache, Object );
+
+  /** Image type of the stored distance maps. */
+  typedef TImage                                ImageType;
+  typedef typename ImageType::ConstPointer      ImageConstPointer;
+  typedef typename ImageType::SizeType          SizeType;
+
+  /** Content key of a label image. m_Parameters holds the settings the
+   * map is computed with (e.g. its band width), filled in by the caller. */
+  struct KeyType
+    {
+    unsigned long long          m_Hash;
+    SizeType                    m_Size;
+    std::vector<unsigned int>   m_Labels;
+    std::vector<double>         m_Parameters;
+
+    bool operator==( const KeyType & other ) const
+      {
+      return m_Hash == other.m_Hash && m_Size == other.m_Size
+        && m_Labels == other.m_Labels && m_Parameters == other.m_Parameters;
+      }
+    };
+
+  /** Compute the key of a label image. Labels are compared after a cast
+   * to unsigned int, as in the SDM computation itself. */
+  template <class TLabelImage>
+  KeyType ComputeKey( const TLabelImage * labels ) const;
+
+  /** Return the map stored under key, or NULL if there is none. */
+  const ImageType * Find( const KeyType & key );
+
+  /** Store a map under key, replacing any previous entry. */
+  void Insert( const KeyType & key, const ImageType * sdm );
+
+  /** Drop all entries. */
+  void Clear();
+
+  /** Number of entries kept before the least recently used one is
+   * dropped. Default is 8, i.e. fixed and moving maps of four levels. */
+  itkSetMacro( MaximumNumberOfEntries, unsigned int );
+  itkGetConstMacro( MaximumNumberOfEntries, unsigned int );
+
+  /** Lookup statistics. */
+  itkGetConstMacro( NumberOfHits, unsigned long );
+  itkGetConstMacro( NumberOfMisses, unsigned long );
+
+protected:
+  SignedDistanceMapCache();
+  ~SignedDistanceMapCache() {}
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+private:
+  SignedDistanceMapCache(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  struct EntryType
+    {
+    KeyType             m_Key;
+    ImageConstPointer   m_Map;
+    };
+  typedef std::list<EntryType>  EntryListType;
+
+  /** Entries, most recently used first. */
+  EntryListType                 m_Entries;
+
+  unsigned int                  m_MaximumNumberOfEntries;
+  unsigned long                 m_NumberOfHits;
+  unsigned long                 m_NumberOfMisses;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkSignedDistanceMapCache.txx"
+#endif
+
+#endif
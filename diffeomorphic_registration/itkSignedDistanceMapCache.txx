@@ -0,0 +1,186 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkSignedDistanceMapCache.txx
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkSignedDistanceMapCache_txx
+#define __itkSignedDistanceMapCache_txx
+
+#include "itkSignedDistanceMapCache.h"
+
+#include <algorithm>
+
+namespace itk {
+
+/**
+ * Default constructor
+ */
+template <class TImage>
+SignedDistanceMapCache<TImage>
+::SignedDistanceMapCache()
+{
+  m_MaximumNumberOfEntries = 8;
+  m_NumberOfHits = 0;
+  m_NumberOfMisses = 0;
+}
+
+
+/**
+ * Hash the buffer and collect the label set in a single pass
+ */
+template <class TImage>
+template <class TLabelImage>
+typename SignedDistanceMapCache<TImage>::KeyType
+SignedDistanceMapCache<TImage>
+::ComputeKey( const TLabelImage * labels ) const
+{
+  typedef typename TLabelImage::PixelType LabelPixelType;
+
+  KeyType key;
+  const typename TLabelImage::RegionType region = labels->GetBufferedRegion();
+  for( unsigned int d = 0; d < TLabelImage::ImageDimension; d++ )
+    {
+    key.m_Size[d] = region.GetSize()[d];
+    }
+
+  // 64 bit FNV-1a
+  unsigned long long hash = 14695981039346656037ULL;
+  const unsigned long long prime = 1099511628211ULL;
+
+  const LabelPixelType * ptr = labels->GetBufferPointer();
+  const LabelPixelType * const end = ptr + region.GetNumberOfPixels();
+
+  // label images come in runs, so only consult the set when the value changes
+  bool first = true;
+  unsigned int lastLabel = 0;
+  while( ptr != end )
+    {
+    const unsigned char * bytes = reinterpret_cast<const unsigned char *>( ptr );
+    for( unsigned int b = 0; b < sizeof(LabelPixelType); b++ )
+      {
+      hash ^= bytes[b];
+      hash *= prime;
+      }
+
+    const unsigned int label = static_cast<unsigned int>( *ptr );
+    if( first || label != lastLabel )
+      {
+      first = false;
+      lastLabel = label;
+      if( label != 0 )
+        {
+        typename std::vector<unsigned int>::iterator pos =
+          std::lower_bound( key.m_Labels.begin(), key.m_Labels.end(), label );
+        if( pos == key.m_Labels.end() || *pos != label )
+          {
+          key.m_Labels.insert( pos, label );
+          }
+        }
+      }
+    ++ptr;
+    }
+
+  key.m_Hash = hash;
+  return key;
+}
+
+
+/**
+ * Lookup, moving a hit to the front of the list
+ */
+template <class TImage>
+const typename SignedDistanceMapCache<TImage>::ImageType *
+SignedDistanceMapCache<TImage>
+::Find( const KeyType & key )
+{
+  for( typename EntryListType::iterator it = m_Entries.begin();
+       it != m_Entries.end(); ++it )
+    {
+    if( it->m_Key == key )
+      {
+      if( it != m_Entries.begin() )
+        {
+        m_Entries.splice( m_Entries.begin(), m_Entries, it );
+        }
+      ++m_NumberOfHits;
+      return m_Entries.front().m_Map.GetPointer();
+      }
+    }
+  ++m_NumberOfMisses;
+  return NULL;
+}
+
+
+/**
+ * Insert a new map, evicting the least recently used entries
+ */
+template <class TImage>
+void
+SignedDistanceMapCache<TImage>
+::Insert( const KeyType & key, const ImageType * sdm )
+{
+  for( typename EntryListType::iterator it = m_Entries.begin();
+       it != m_Entries.end(); ++it )
+    {
+    if( it->m_Key == key )
+      {
+      m_Entries.erase( it );
+      break;
+      }
+    }
+
+  EntryType entry;
+  entry.m_Key = key;
+  entry.m_Map = sdm;
+  m_Entries.push_front( entry );
+
+  while( m_Entries.size() > m_MaximumNumberOfEntries )
+    {
+    m_Entries.pop_back();
+    }
+  this->Modified();
+}
+
+
+template <class TImage>
+void
+SignedDistanceMapCache<TImage>
+::Clear()
+{
+  m_Entries.clear();
+  m_NumberOfHits = 0;
+  m_NumberOfMisses = 0;
+  this->Modified();
+}
+
+
+/*
+ * Standard "PrintSelf" method.
+ */
+template <class TImage>
+void
+SignedDistanceMapCache<TImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "NumberOfEntries: ";
+  os << m_Entries.size() << std::endl;
+  os << indent << "MaximumNumberOfEntries: ";
+  os << m_MaximumNumberOfEntries << std::endl;
+  os << indent << "NumberOfHits: ";
+  os << m_NumberOfHits << std::endl;
+  os << indent << "NumberOfMisses: ";
+  os << m_NumberOfMisses << std::endl;
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,255 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkWarpFieldFile.h
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkWarpFieldFile_h
+#define __itkWarpFieldFile_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace itk {
+
+/**
+ * \class WarpFieldFile
+ *
+ * \brief Displacement fields stored losslessly, in the native .bflwarp
+ * container, and read back through a memory mapping
+ *
+ * The file holds the components of the field one after the other (planar,
+ * as MATLAB passes them), in float32:
+ *
+ *  - a header of one page: magic "BFLWARP", version, dimension, byte order
+ *    mark, size, spacing, origin, direction, compression, block size, and
+ *    a CRC-32 of itself and of the block table;
+ *  - the block table, from the second page: for each component, for each
+ *    block of BlockSize bytes of it, the offset and length of the block in
+ *    the file, the CRC-32 of its uncompressed values and whether it is
+ *    stored raw;
+ *  - the blocks, each starting on a page boundary. Uncompressed, the
+ *    blocks of a component follow each other, so that the component is one
+ *    contiguous array of the file (GetMappedComponent()). With
+ *    BlockCompression each block is deflated on its own (zlib, fastest
+ *    level), or stored raw when that does not make it smaller.
+ *
+ * Open() maps the file and reads the header and the block table only.
+ * ReadComponents() then reads the pixels [first, first+count) of every
+ * component: only the blocks holding them are touched, decompressed and
+ * checked, in parallel. Values are converted to the output type on the
+ * fly. The byte order is the one of the machine that wrote the file; a
+ * file of the other byte order is refused.
+ *
+ * Errors (I/O, corrupt or truncated files, checksum mismatches) throw an
+ * ExceptionObject.
+ */
+template <unsigned int VDimension>
+class ITK_EXPORT WarpFieldFile : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef WarpFieldFile                 Self;
+  typedef Object                        Superclass;
+  typedef SmartPointer<Self>            Pointer;
+  typedef SmartPointer<const Self>      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( WarpFieldFile, Object );
+
+  itkStaticConstMacro(ImageDimension, unsigned int, VDimension);
+
+  /** Geometry typedefs. */
+  typedef Image<float, VDimension>                  ImageType;
+  typedef typename ImageType::SizeType              SizeType;
+  typedef typename ImageType::SpacingType           SpacingType;
+  typedef typename ImageType::PointType             PointType;
+  typedef typename ImageType::DirectionType         DirectionType;
+
+  /** How the blocks are stored. */
+  enum CompressionType { NoCompression = 0, BlockCompression = 1 };
+
+  /** File written or read. */
+  itkSetStringMacro( FileName );
+  itkGetStringMacro( FileName );
+
+  /** Geometry of the field, set before Write(), read by Open(). The
+   * defaults are spacing 1, origin 0 and the identity. */
+  itkSetMacro( Size, SizeType );
+  itkGetConstReferenceMacro( Size, SizeType );
+  itkSetMacro( Spacing, SpacingType );
+  itkGetConstReferenceMacro( Spacing, SpacingType );
+  itkSetMacro( Origin, PointType );
+  itkGetConstReferenceMacro( Origin, PointType );
+  itkSetMacro( Direction, DirectionType );
+  itkGetConstReferenceMacro( Direction, DirectionType );
+
+  /** Compression of Write() (default NoCompression), that of the file
+   * after Open(). */
+  itkSetMacro( Compression, CompressionType );
+  itkGetConstMacro( Compression, CompressionType );
+
+  /** Bytes of a component per block, a multiple of the page size (4096).
+   * Default 1 MB. */
+  itkSetMacro( BlockSize, unsigned long );
+  itkGetConstMacro( BlockSize, unsigned long );
+
+  /** Check the CRC-32 of the blocks read (default on). */
+  itkSetMacro( VerifyChecksums, bool );
+  itkGetConstMacro( VerifyChecksums, bool );
+  itkBooleanMacro( VerifyChecksums );
+
+  /** Threads compressing and reading the blocks, 0 (the default) for the
+   * ITK default. */
+  itkSetMacro( NumberOfThreads, unsigned int );
+  itkGetConstMacro( NumberOfThreads, unsigned int );
+
+  /** Whether the file name has the .bflwarp extension. */
+  static bool HasWarpFieldExtension( const std::string & filename );
+
+  /** Dimension of the field of a file, from its header only. */
+  static unsigned int ReadDimension( const std::string & filename );
+
+  /** Number of pixels of the field. */
+  unsigned long GetNumberOfPixels() const;
+
+  /** Write the field of the given components, each of GetNumberOfPixels()
+   * values. */
+  void Write( const float * const components[VDimension] );
+
+  /** Map the file and read its header and block table. */
+  void Open();
+
+  /** Unmap the file, done by the destructor too. */
+  void Close();
+
+  /** Pixels [first, first+count) of each component, into the outputs. */
+  void ReadComponents( unsigned long first, unsigned long count,
+                       float * const outputs[VDimension] );
+  void ReadComponents( unsigned long first, unsigned long count,
+                       double * const outputs[VDimension] );
+
+  /** Values of a component in the mapping, without copy or checksum test,
+   * NULL for a compressed file. Valid until Close(). */
+  const float * GetMappedComponent( unsigned int component ) const;
+
+protected:
+  WarpFieldFile();
+  ~WarpFieldFile();
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Blocks [firstBlock, endBlock) of the current pass, numbered from 0
+   * in the pass. */
+  void ThreadedProcessBlocks( unsigned long firstBlock, unsigned long endBlock,
+                              unsigned int threadId );
+
+  /** Static function used as a "callback" by the MultiThreader. */
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback( void *arg );
+
+private:
+  WarpFieldFile(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  /** Layout of the file. */
+  struct FileHeader
+    {
+    char          Magic[8];
+    uint32_t      Version;
+    uint32_t      Dimension;
+    uint32_t      ByteOrderMark;
+    uint32_t      Compression;
+    uint64_t      Size[3];
+    double        Spacing[3];
+    double        Origin[3];
+    double        Direction[9];
+    uint64_t      BlockSize;
+    uint64_t      BlocksPerComponent;
+    uint32_t      TableChecksum;
+    uint32_t      HeaderChecksum;
+    };
+  struct BlockEntry
+    {
+    uint64_t      Offset;
+    uint64_t      Length;
+    uint32_t      Checksum;
+    uint32_t      Raw;
+    };
+
+  enum PassType { CompressPass, ReadFloatPass, ReadDoublePass };
+
+  /** Bytes of block b of any component. */
+  unsigned long GetBlockBytes( unsigned long b ) const;
+
+  /** Run ThreadedProcessBlocks on the numberOfBlocks blocks of the pass. */
+  void ProcessBlocks( unsigned long numberOfBlocks );
+
+  /** Pixels [m_PassFirstPixel, m_PassEndPixel) of block b of a component,
+   * given its table entry. */
+  template <class TOutput>
+  void ReadBlock( const BlockEntry & entry, unsigned long b,
+                  std::vector<float> & scratch, TOutput * output,
+                  std::string & error ) const;
+
+  template <class TOutput>
+  void Read( unsigned long first, unsigned long count,
+             TOutput * const outputs[VDimension], PassType pass );
+
+  std::string                   m_FileName;
+  SizeType                      m_Size;
+  SpacingType                   m_Spacing;
+  PointType                     m_Origin;
+  DirectionType                 m_Direction;
+  CompressionType               m_Compression;
+  unsigned long                 m_BlockSize;
+  bool                          m_VerifyChecksums;
+  unsigned int                  m_NumberOfThreads;
+
+  /** The mapping of the open file and its block table. */
+  const char *                  m_Map;
+  unsigned long                 m_MapLength;
+  std::vector<char>             m_FileBuffer;
+  std::vector<BlockEntry>       m_Table;
+  unsigned long                 m_BlocksPerComponent;
+
+  /** State of the current pass, read by the threads. A compress pass
+   * handles the blocks from m_PassFirstBlock on, in the numbering of the
+   * table; a read pass the blocks [m_PassFirstBlock, m_PassFirstBlock +
+   * m_PassBlocksPerComponent) of each component. */
+  PassType                      m_Pass;
+  const float *                 m_PassInput[VDimension];
+  void *                        m_PassOutput[VDimension];
+  unsigned long                 m_PassFirstBlock;
+  unsigned long                 m_PassBlocksPerComponent;
+  unsigned long                 m_PassFirstPixel;
+  unsigned long                 m_PassEndPixel;
+  unsigned long                 m_PassNumberOfBlocks;
+  unsigned long                 m_BlocksPerThread;
+  std::vector< std::vector<char> >  m_Compressed;
+  std::vector< std::vector<float> > m_Scratch;
+  std::vector<std::string>      m_PassErrors;
+
+  MultiThreader::Pointer        m_Threader;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkWarpFieldFile.txx"
+#endif
+
+#endif
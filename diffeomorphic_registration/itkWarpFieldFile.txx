@@ -0,0 +1,685 @@
+/*=========================================================================
+
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    itkWarpFieldFile.txx
+  Language:  C++
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notices for more information.
+
+=========================================================================*/
+
+#ifndef __itkWarpFieldFile_txx
+#define __itkWarpFieldFile_txx
+
+#include "itkWarpFieldFile.h"
+
+#include "itk_zlib.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#if defined(_WIN32)
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace itk {
+
+namespace WarpFieldFileConstants {
+const unsigned long PageSize = 4096;
+const uint32_t Version = 1;
+const uint32_t ByteOrderMark = 0x01020304;
+const char Magic[8] = "BFLWARP";
+
+inline unsigned long PageAlign( unsigned long offset )
+{
+  return ( offset + PageSize - 1 ) / PageSize * PageSize;
+}
+}
+
+
+/**
+ * Default constructor
+ */
+template <unsigned int VDimension>
+WarpFieldFile<VDimension>
+::WarpFieldFile()
+{
+  m_Size.Fill( 0 );
+  m_Spacing.Fill( 1.0 );
+  m_Origin.Fill( 0.0 );
+  m_Direction.SetIdentity();
+  m_Compression = NoCompression;
+  m_BlockSize = 1024 * 1024;
+  m_VerifyChecksums = true;
+  m_NumberOfThreads = 0;
+  m_Map = NULL;
+  m_MapLength = 0;
+  m_BlocksPerComponent = 0;
+  m_Pass = CompressPass;
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    m_PassInput[d] = NULL;
+    m_PassOutput[d] = NULL;
+    }
+  m_PassFirstBlock = 0;
+  m_PassBlocksPerComponent = 0;
+  m_PassFirstPixel = 0;
+  m_PassEndPixel = 0;
+  m_PassNumberOfBlocks = 0;
+  m_BlocksPerThread = 0;
+  m_Threader = MultiThreader::New();
+}
+
+
+template <unsigned int VDimension>
+WarpFieldFile<VDimension>
+::~WarpFieldFile()
+{
+  this->Close();
+}
+
+
+template <unsigned int VDimension>
+bool
+WarpFieldFile<VDimension>
+::HasWarpFieldExtension( const std::string & filename )
+{
+  const std::string extension( ".bflwarp" );
+  return filename.size() >= extension.size()
+    && filename.compare( filename.size() - extension.size(), extension.size(), extension ) == 0;
+}
+
+
+template <unsigned int VDimension>
+unsigned int
+WarpFieldFile<VDimension>
+::ReadDimension( const std::string & filename )
+{
+  FileHeader header;
+  std::ifstream file( filename.c_str(), std::ios::in | std::ios::binary );
+  if( !file.read( reinterpret_cast<char *>( &header ), sizeof(header) )
+      || std::memcmp( header.Magic, WarpFieldFileConstants::Magic, sizeof(header.Magic) ) != 0 )
+    {
+    ExceptionObject err( __FILE__, __LINE__ );
+    err.SetDescription( filename + " cannot be read or is not a warp field file." );
+    throw err;
+    }
+  return header.Dimension;
+}
+
+
+template <unsigned int VDimension>
+unsigned long
+WarpFieldFile<VDimension>
+::GetNumberOfPixels() const
+{
+  unsigned long numPix = 1;
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    numPix *= m_Size[d];
+    }
+  return numPix;
+}
+
+
+/**
+ * All blocks are full but the last one of each component
+ */
+template <unsigned int VDimension>
+unsigned long
+WarpFieldFile<VDimension>
+::GetBlockBytes( unsigned long b ) const
+{
+  const unsigned long componentBytes = this->GetNumberOfPixels() * sizeof(float);
+  return std::min( m_BlockSize, componentBytes - b * m_BlockSize );
+}
+
+
+/**
+ * Header and table first, as placeholders, then the blocks, compressed
+ * in parallel a batch at a time so that only a batch of compressed blocks
+ * is held
+ */
+template <unsigned int VDimension>
+void
+WarpFieldFile<VDimension>
+::Write( const float * const components[VDimension] )
+{
+  using namespace WarpFieldFileConstants;
+
+  this->Close();
+  if( m_BlockSize == 0 || m_BlockSize % PageSize != 0 || m_BlockSize > ( 1ul << 30 ) )
+    {
+    itkExceptionMacro( << "BlockSize must be a multiple of " << PageSize << " bytes, of at most 1 GB." );
+    }
+
+  const unsigned long numPix = this->GetNumberOfPixels();
+  m_BlocksPerComponent = ( numPix * sizeof(float) + m_BlockSize - 1 ) / m_BlockSize;
+  const unsigned long numberOfBlocks = VDimension * m_BlocksPerComponent;
+  m_Table.assign( numberOfBlocks, BlockEntry() );
+
+  std::ofstream file( m_FileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+  if( !file )
+    {
+    itkExceptionMacro( << "Cannot open " << m_FileName << " for writing." );
+    }
+
+  // room for the header and the table
+  const unsigned long dataOffset = PageAlign( PageSize + numberOfBlocks * sizeof(BlockEntry) );
+  const std::vector<char> padding( PageSize, 0 );
+  for( unsigned long offset = 0; offset < dataOffset; offset += PageSize )
+    {
+    file.write( &padding[0], PageSize );
+    }
+
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    m_PassInput[d] = components[d];
+    }
+  m_Pass = CompressPass;
+
+  const unsigned long batchSize = 64;
+  unsigned long offset = dataOffset;
+  for( unsigned long first = 0; first < numberOfBlocks; first += batchSize )
+    {
+    const unsigned long count = std::min( batchSize, numberOfBlocks - first );
+    m_PassFirstBlock = first;
+    m_Compressed.resize( count );
+    this->ProcessBlocks( count );
+
+    for( unsigned long k = 0; k < count; k++ )
+      {
+      BlockEntry & entry = m_Table[first + k];
+      const unsigned long c = ( first + k ) / m_BlocksPerComponent;
+      const unsigned long b = ( first + k ) % m_BlocksPerComponent;
+      entry.Offset = offset;
+      if( entry.Raw )
+        {
+        entry.Length = this->GetBlockBytes( b );
+        file.write( reinterpret_cast<const char *>( components[c] ) + b * m_BlockSize, entry.Length );
+        }
+      else
+        {
+        entry.Length = m_Compressed[k].size();
+        file.write( &m_Compressed[k][0], entry.Length );
+        }
+      // uncompressed components stay contiguous, their blocks being full
+      // pages but the last one
+      const unsigned long end = PageAlign( offset + entry.Length );
+      file.write( &padding[0], end - offset - entry.Length );
+      offset = end;
+      }
+    }
+  m_Compressed.clear();
+
+  FileHeader header;
+  std::memset( &header, 0, sizeof(header) );
+  std::memcpy( header.Magic, Magic, sizeof(header.Magic) );
+  header.Version = Version;
+  header.Dimension = VDimension;
+  header.ByteOrderMark = ByteOrderMark;
+  header.Compression = m_Compression;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    header.Size[i] = ( i < VDimension ) ? m_Size[i] : 1;
+    header.Spacing[i] = ( i < VDimension ) ? m_Spacing[i] : 1.0;
+    header.Origin[i] = ( i < VDimension ) ? m_Origin[i] : 0.0;
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      header.Direction[3 * i + j] = ( i < VDimension && j < VDimension ) ? m_Direction[i][j]
+                                                                         : ( i == j ? 1.0 : 0.0 );
+      }
+    }
+  header.BlockSize = m_BlockSize;
+  header.BlocksPerComponent = m_BlocksPerComponent;
+  if( numberOfBlocks > 0 )
+    {
+    header.TableChecksum = crc32( crc32( 0L, Z_NULL, 0 ), reinterpret_cast<const Bytef *>( &m_Table[0] ),
+                                  numberOfBlocks * sizeof(BlockEntry) );
+    file.seekp( PageSize );
+    file.write( reinterpret_cast<const char *>( &m_Table[0] ), numberOfBlocks * sizeof(BlockEntry) );
+    }
+  header.HeaderChecksum = crc32( crc32( 0L, Z_NULL, 0 ), reinterpret_cast<const Bytef *>( &header ),
+                                 sizeof(header) );
+  file.seekp( 0 );
+  file.write( reinterpret_cast<const char *>( &header ), sizeof(header) );
+
+  file.close();
+  m_Table.clear();
+  if( !file )
+    {
+    itkExceptionMacro( << "Cannot write " << m_FileName << "." );
+    }
+}
+
+
+/**
+ * Map the whole file (read into memory where mmap is not available),
+ * then check the header and the table
+ */
+template <unsigned int VDimension>
+void
+WarpFieldFile<VDimension>
+::Open()
+{
+  using namespace WarpFieldFileConstants;
+
+  this->Close();
+
+#if defined(_WIN32)
+  std::ifstream file( m_FileName.c_str(), std::ios::in | std::ios::binary );
+  if( !file )
+    {
+    itkExceptionMacro( << "Cannot open " << m_FileName << "." );
+    }
+  file.seekg( 0, std::ios::end );
+  m_FileBuffer.resize( file.tellg() );
+  file.seekg( 0 );
+  if( !m_FileBuffer.empty() )
+    {
+    file.read( &m_FileBuffer[0], m_FileBuffer.size() );
+    }
+  if( !file )
+    {
+    itkExceptionMacro( << "Cannot read " << m_FileName << "." );
+    }
+  m_Map = m_FileBuffer.empty() ? NULL : &m_FileBuffer[0];
+  m_MapLength = m_FileBuffer.size();
+#else
+  const int fd = open( m_FileName.c_str(), O_RDONLY );
+  if( fd < 0 )
+    {
+    itkExceptionMacro( << "Cannot open " << m_FileName << "." );
+    }
+  struct stat status;
+  if( fstat( fd, &status ) != 0 )
+    {
+    close( fd );
+    itkExceptionMacro( << "Cannot read " << m_FileName << "." );
+    }
+  m_MapLength = status.st_size;
+  if( m_MapLength > 0 )
+    {
+    void * map = mmap( NULL, m_MapLength, PROT_READ, MAP_SHARED, fd, 0 );
+    if( map == MAP_FAILED )
+      {
+      close( fd );
+      m_MapLength = 0;
+      itkExceptionMacro( << "Cannot map " << m_FileName << "." );
+      }
+    m_Map = static_cast<const char *>( map );
+    }
+  close( fd );
+#endif
+
+  // header
+  FileHeader header;
+  if( m_MapLength < PageSize )
+    {
+    this->Close();
+    itkExceptionMacro( << m_FileName << " is not a warp field file, or is truncated." );
+    }
+  std::memcpy( &header, m_Map, sizeof(header) );
+  if( std::memcmp( header.Magic, Magic, sizeof(header.Magic) ) != 0 )
+    {
+    this->Close();
+    itkExceptionMacro( << m_FileName << " is not a warp field file." );
+    }
+  if( header.ByteOrderMark != ByteOrderMark )
+    {
+    this->Close();
+    itkExceptionMacro( << m_FileName << " was written on a machine of another byte order." );
+    }
+  const uint32_t headerChecksum = header.HeaderChecksum;
+  header.HeaderChecksum = 0;
+  if( header.Version != Version
+      || crc32( crc32( 0L, Z_NULL, 0 ), reinterpret_cast<const Bytef *>( &header ), sizeof(header) ) != headerChecksum )
+    {
+    this->Close();
+    itkExceptionMacro( << "The header of " << m_FileName << " is corrupt or of an unknown version." );
+    }
+  if( header.Dimension != VDimension )
+    {
+    this->Close();
+    itkExceptionMacro( << m_FileName << " holds a field of dimension " << header.Dimension
+                       << ", not " << VDimension << "." );
+    }
+
+  for( unsigned int i = 0; i < VDimension; i++ )
+    {
+    m_Size[i] = header.Size[i];
+    m_Spacing[i] = header.Spacing[i];
+    m_Origin[i] = header.Origin[i];
+    for( unsigned int j = 0; j < VDimension; j++ )
+      {
+      m_Direction[i][j] = header.Direction[3 * i + j];
+      }
+    }
+  m_Compression = ( header.Compression == BlockCompression ) ? BlockCompression : NoCompression;
+  m_BlockSize = header.BlockSize;
+  m_BlocksPerComponent = header.BlocksPerComponent;
+
+  // table
+  const unsigned long numberOfBlocks = VDimension * m_BlocksPerComponent;
+  if( m_BlockSize == 0 || m_BlockSize % PageSize != 0
+      || m_BlocksPerComponent != ( this->GetNumberOfPixels() * sizeof(float) + m_BlockSize - 1 ) / m_BlockSize
+      || m_MapLength < PageSize + numberOfBlocks * sizeof(BlockEntry) )
+    {
+    this->Close();
+    itkExceptionMacro( << "The header of " << m_FileName << " is corrupt, or the file is truncated." );
+    }
+  m_Table.resize( numberOfBlocks );
+  if( numberOfBlocks > 0 )
+    {
+    std::memcpy( &m_Table[0], m_Map + PageSize, numberOfBlocks * sizeof(BlockEntry) );
+    if( crc32( crc32( 0L, Z_NULL, 0 ), reinterpret_cast<const Bytef *>( &m_Table[0] ),
+               numberOfBlocks * sizeof(BlockEntry) ) != header.TableChecksum )
+      {
+      this->Close();
+      itkExceptionMacro( << "The block table of " << m_FileName << " is corrupt." );
+      }
+    }
+  for( unsigned long k = 0; k < numberOfBlocks; k++ )
+    {
+    const BlockEntry & entry = m_Table[k];
+    const unsigned long b = k % m_BlocksPerComponent;
+    const bool contiguous = ( b == 0 ) || ( entry.Offset == m_Table[k - 1].Offset + m_BlockSize );
+    if( entry.Offset % PageSize != 0 || entry.Offset > m_MapLength || entry.Length > m_MapLength - entry.Offset
+        || ( entry.Raw && entry.Length != this->GetBlockBytes( b ) )
+        || ( m_Compression == NoCompression && !( entry.Raw && contiguous ) ) )
+      {
+      this->Close();
+      itkExceptionMacro( << "The block table of " << m_FileName << " is corrupt, or the file is truncated." );
+      }
+    }
+}
+
+
+template <unsigned int VDimension>
+void
+WarpFieldFile<VDimension>
+::Close()
+{
+#if !defined(_WIN32)
+  if( m_Map && m_FileBuffer.empty() )
+    {
+    munmap( const_cast<char *>( m_Map ), m_MapLength );
+    }
+#endif
+  m_Map = NULL;
+  m_MapLength = 0;
+  m_FileBuffer.clear();
+  m_Table.clear();
+}
+
+
+template <unsigned int VDimension>
+const float *
+WarpFieldFile<VDimension>
+::GetMappedComponent( unsigned int component ) const
+{
+  if( !m_Map || m_Compression != NoCompression || m_BlocksPerComponent == 0 )
+    {
+    return NULL;
+    }
+  return reinterpret_cast<const float *>( m_Map + m_Table[component * m_BlocksPerComponent].Offset );
+}
+
+
+template <unsigned int VDimension>
+void
+WarpFieldFile<VDimension>
+::ReadComponents( unsigned long first, unsigned long count,
+                  float * const outputs[VDimension] )
+{
+  this->Read( first, count, outputs, ReadFloatPass );
+}
+
+
+template <unsigned int VDimension>
+void
+WarpFieldFile<VDimension>
+::ReadComponents( unsigned long first, unsigned long count,
+                  double * const outputs[VDimension] )
+{
+  this->Read( first, count, outputs, ReadDoublePass );
+}
+
+
+/**
+ * Only the blocks holding the pixels are processed
+ */
+template <unsigned int VDimension>
+template <class TOutput>
+void
+WarpFieldFile<VDimension>
+::Read( unsigned long first, unsigned long count,
+        TOutput * const outputs[VDimension], PassType pass )
+{
+  if( !m_Map )
+    {
+    itkExceptionMacro( << "Open() must be called before reading." );
+    }
+  if( first > this->GetNumberOfPixels() || count > this->GetNumberOfPixels() - first )
+    {
+    itkExceptionMacro( << "Pixels [" << first << ", " << first + count << ") out of the field." );
+    }
+  if( count == 0 )
+    {
+    return;
+    }
+
+  const unsigned long pixelsPerBlock = m_BlockSize / sizeof(float);
+  m_Pass = pass;
+  m_PassFirstPixel = first;
+  m_PassEndPixel = first + count;
+  m_PassFirstBlock = first / pixelsPerBlock;
+  m_PassBlocksPerComponent = ( m_PassEndPixel - 1 ) / pixelsPerBlock + 1 - m_PassFirstBlock;
+  for( unsigned int d = 0; d < VDimension; d++ )
+    {
+    m_PassOutput[d] = outputs[d];
+    }
+  this->ProcessBlocks( VDimension * m_PassBlocksPerComponent );
+}
+
+
+/**
+ * Blocks shared between threads by contiguous ranges, the errors of the
+ * threads collected and thrown once they are done
+ */
+template <unsigned int VDimension>
+void
+WarpFieldFile<VDimension>
+::ProcessBlocks( unsigned long numberOfBlocks )
+{
+  m_PassNumberOfBlocks = numberOfBlocks;
+  if( numberOfBlocks == 0 )
+    {
+    return;
+    }
+
+  unsigned int numberOfThreads = m_NumberOfThreads;
+  if( numberOfThreads == 0 )
+    {
+    numberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numberOfThreads = std::max( 1u, std::min( numberOfThreads, static_cast<unsigned int>(
+    MultiThreader::GetGlobalMaximumNumberOfThreads() ) ) );
+  m_BlocksPerThread = ( numberOfBlocks + numberOfThreads - 1 ) / numberOfThreads;
+  numberOfThreads = ( numberOfBlocks + m_BlocksPerThread - 1 ) / m_BlocksPerThread;
+
+  m_Scratch.resize( numberOfThreads );
+  m_PassErrors.assign( numberOfThreads, std::string() );
+  if( numberOfThreads == 1 )
+    {
+    this->ThreadedProcessBlocks( 0, numberOfBlocks, 0 );
+    }
+  else
+    {
+    m_Threader->SetNumberOfThreads( numberOfThreads );
+    m_Threader->SetSingleMethod( Self::ThreaderCallback, this );
+    m_Threader->SingleMethodExecute();
+    }
+
+  for( unsigned int t = 0; t < numberOfThreads; t++ )
+    {
+    if( !m_PassErrors[t].empty() )
+      {
+      itkExceptionMacro( << m_PassErrors[t] );
+      }
+    }
+}
+
+
+template <unsigned int VDimension>
+void
+WarpFieldFile<VDimension>
+::ThreadedProcessBlocks( unsigned long firstBlock, unsigned long endBlock,
+                         unsigned int threadId )
+{
+  for( unsigned long k = firstBlock; k < endBlock && m_PassErrors[threadId].empty(); k++ )
+    {
+    if( m_Pass == CompressPass )
+      {
+      // checksum of the values, deflated when it makes the block smaller
+      BlockEntry & entry = m_Table[m_PassFirstBlock + k];
+      const unsigned long c = ( m_PassFirstBlock + k ) / m_BlocksPerComponent;
+      const unsigned long b = ( m_PassFirstBlock + k ) % m_BlocksPerComponent;
+      const Bytef * input = reinterpret_cast<const Bytef *>( m_PassInput[c] ) + b * m_BlockSize;
+      const unsigned long bytes = this->GetBlockBytes( b );
+      entry.Checksum = crc32( crc32( 0L, Z_NULL, 0 ), input, bytes );
+      entry.Raw = 1;
+
+      std::vector<char> & compressed = m_Compressed[k];
+      compressed.clear();
+      if( m_Compression == BlockCompression )
+        {
+        uLongf length = compressBound( bytes );
+        compressed.resize( length );
+        if( compress2( reinterpret_cast<Bytef *>( &compressed[0] ), &length, input, bytes,
+                       Z_BEST_SPEED ) == Z_OK && length < bytes )
+          {
+          compressed.resize( length );
+          entry.Raw = 0;
+          }
+        else
+          {
+          compressed.clear();
+          }
+        }
+      }
+    else
+      {
+      const unsigned long c = k / m_PassBlocksPerComponent;
+      const unsigned long b = m_PassFirstBlock + k % m_PassBlocksPerComponent;
+      const BlockEntry & entry = m_Table[c * m_BlocksPerComponent + b];
+      if( m_Pass == ReadFloatPass )
+        {
+        this->ReadBlock( entry, b, m_Scratch[threadId], static_cast<float *>( m_PassOutput[c] ),
+                         m_PassErrors[threadId] );
+        }
+      else
+        {
+        this->ReadBlock( entry, b, m_Scratch[threadId], static_cast<double *>( m_PassOutput[c] ),
+                         m_PassErrors[threadId] );
+        }
+      }
+    }
+}
+
+
+/**
+ * Inflate the block unless it is raw, check it, and convert the pixels of
+ * the pass it holds
+ */
+template <unsigned int VDimension>
+template <class TOutput>
+void
+WarpFieldFile<VDimension>
+::ReadBlock( const BlockEntry & entry, unsigned long b,
+             std::vector<float> & scratch, TOutput * output,
+             std::string & error ) const
+{
+  const unsigned long bytes = this->GetBlockBytes( b );
+  const unsigned long blockFirstPixel = b * ( m_BlockSize / sizeof(float) );
+
+  const float * values = reinterpret_cast<const float *>( m_Map + entry.Offset );
+  if( !entry.Raw )
+    {
+    scratch.resize( bytes / sizeof(float) );
+    uLongf length = bytes;
+    if( uncompress( reinterpret_cast<Bytef *>( &scratch[0] ), &length,
+                    reinterpret_cast<const Bytef *>( m_Map + entry.Offset ), entry.Length ) != Z_OK
+        || length != bytes )
+      {
+      error = "A block of " + m_FileName + " is corrupt.";
+      return;
+      }
+    values = &scratch[0];
+    }
+
+  if( m_VerifyChecksums
+      && crc32( crc32( 0L, Z_NULL, 0 ), reinterpret_cast<const Bytef *>( values ), bytes ) != entry.Checksum )
+    {
+    error = "Checksum mismatch in a block of " + m_FileName + ".";
+    return;
+    }
+
+  const unsigned long begin = std::max( m_PassFirstPixel, blockFirstPixel );
+  const unsigned long end = std::min( m_PassEndPixel, blockFirstPixel + bytes / sizeof(float) );
+  TOutput * out = output + ( begin - m_PassFirstPixel );
+  for( unsigned long n = begin; n < end; n++ )
+    {
+    *out++ = values[n - blockFirstPixel];
+    }
+}
+
+
+template <unsigned int VDimension>
+ITK_THREAD_RETURN_TYPE
+WarpFieldFile<VDimension>
+::ThreaderCallback( void * arg )
+{
+  MultiThreader::ThreadInfoStruct * info =
+    static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  Self * self = static_cast<Self *>( info->UserData );
+
+  const unsigned long firstBlock = info->ThreadID * self->m_BlocksPerThread;
+  const unsigned long endBlock = std::min( firstBlock + self->m_BlocksPerThread, self->m_PassNumberOfBlocks );
+  if( firstBlock < endBlock )
+    {
+    self->ThreadedProcessBlocks( firstBlock, endBlock, info->ThreadID );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+
+/**
+ * Standard "PrintSelf" method
+ */
+template <unsigned int VDimension>
+void
+WarpFieldFile<VDimension>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "FileName: " << m_FileName << std::endl;
+  os << indent << "Size: " << m_Size << std::endl;
+  os << indent << "Compression: " << m_Compression << std::endl;
+  os << indent << "BlockSize: " << m_BlockSize << std::endl;
+  os << indent << "VerifyChecksums: " << m_VerifyChecksums << std::endl;
+  os << indent << "NumberOfThreads: " << m_NumberOfThreads << std::endl;
+}
+
+} // end namespace itk
+
+#endif
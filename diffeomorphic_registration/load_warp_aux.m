@@ -0,0 +1,54 @@
+function [log_def_x, log_def_y, log_def_z] = load_warp_aux(warp_file)
+
+% Velocity field of a subject saved by save_warp_aux, on the full grid, or
+% log_def_x/y/z of a warp file of an older version.
+
+%%% THIS IS AN AUXILARY FUNCTION AND IS NOT MEANT TO BE CALLED DIRECTLY.
+%%% THE FUNCTION TO BE CALLED IS: BFL_groupwise_reg3D
+
+%=========================================================================
+%  Brain Fuse Lab 
+%  Copyright (c) 2010-2011 Mert R. Sabuncu
+%  A.A. Martinos Center for Biomedical Imaging, 
+%  Mass. General Hospital, Harvard Medical School
+%  CSAIL, Mass. Institute of Technology 
+%  All rights reserved.
+%
+%Redistribution and use in source and binary forms, with or without
+%modification, are permitted provided that the following conditions are met:
+%
+%    * Redistributions of source code must retain the above copyright notice,
+%      this list of conditions and the following disclaimer.
+%
+%    * Redistributions in binary form must reproduce the above copyright notice,
+%      this list of conditions and the following disclaimer in the documentation
+%      and/or other materials provided with the distribution.
+%
+%    * Neither the names of the copyright holders nor the names of future
+%      contributors may be used to endorse or promote products derived from this
+%      software without specific prior written permission.
+%
+%THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+%ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+%WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+%DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+%ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+%(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+%LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+%ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+%SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.    
+%
+%=========================================================================
+
+
+warp = load(warp_file);
+if (isfield(warp, 'transform'))
+    h = velocitytransform('create', warp.transform);
+    [log_def_x, log_def_y, log_def_z] = velocitytransform('velocity', h);
+    velocitytransform('destroy', h);
+else
+    log_def_x = warp.log_def_x;
+    log_def_y = warp.log_def_y;
+    log_def_z = warp.log_def_z;
+end
@@ -6,6 +6,8 @@
 
 #include <mex.h>
 
+#include "mex_itkimage.h"
+
 template <class MatlabPixelType, unsigned int Dimension>
 void deffieldharmonicenergy(int nlhs,
                             mxArray *plhs[],
@@ -21,55 +23,9 @@ void deffieldharmonicenergy(int nlhs,
 
    //boost::timer timer;
 
-   // Allocate deformation field
+   // Interleave the field components
    typename DeformationFieldType::Pointer field =
-      DeformationFieldType::New();
-   
-   typename DeformationFieldType::SpacingType spacing;
-   spacing.Fill( 1.0 );
-   
-   typename DeformationFieldType::PointType origin;
-   origin.Fill( 0.0 );
-   
-   typename DeformationFieldType::RegionType     region;
-   typename DeformationFieldType::SizeType       size;
-   typename DeformationFieldType::IndexType      start;
-
-   unsigned int numPix(1u);
-   const MatlabPixelType * inptrs[Dimension];
-   mwSize matlabdims[Dimension];
-   for (unsigned int d=0; d<Dimension; d++)
-   {
-      matlabdims[d]= mxGetDimensions(prhs[0])[d];
-      size[d] = matlabdims[d];
-      start[d] = 0;
-      numPix *= size[d];
-
-      inptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[d]));
-   }
-   
-   region.SetSize( size );
-   region.SetIndex( start );
-   
-   field->SetOrigin( origin );
-   field->SetSpacing( spacing );
-   field->SetRegions( region );
-   field->Allocate();
-
-   //mexPrintf("done field->Allocate(); %f sec\n", timer.elapsed());
-   //timer.restart();
-
-   VectorPixelType * ptr = field->GetBufferPointer();
-   const VectorPixelType * const buff_end = ptr + numPix;
-   
-   while ( ptr != buff_end )
-   {
-      for (unsigned int d=0; d<Dimension; d++)
-      {
-         (*ptr)[d] = *(inptrs[d])++;
-      }
-      ++ptr;
-   }
+      mexImportField<DeformationFieldType, MatlabPixelType>( prhs );
 
    //mexPrintf("done inputs copy %f sec\n", timer.elapsed());
    //timer.restart();
@@ -8,6 +8,8 @@
 
 #include <mex.h>
 
+#include "mex_itkimage.h"
+
 template <class MatlabPixelType, unsigned int Dimension>
 void deffieldjacobiandeterminant(int nlhs,
                                  mxArray *plhs[],
@@ -26,55 +28,9 @@ void deffieldjacobiandeterminant(int nlhs,
 
    //boost::timer timer;
 
-   // Allocate deformation field
+   // Interleave the field components
    typename DeformationFieldType::Pointer field =
-      DeformationFieldType::New();
-   
-   typename DeformationFieldType::SpacingType spacing;
-   spacing.Fill( 1.0 );
-   
-   typename DeformationFieldType::PointType origin;
-   origin.Fill( 0.0 );
-   
-   typename DeformationFieldType::RegionType     region;
-   typename DeformationFieldType::SizeType       size;
-   typename DeformationFieldType::IndexType      start;
-
-   unsigned int numPix(1u);
-   const MatlabPixelType * inptrs[Dimension];
-   mwSize matlabdims[Dimension];
-   for (unsigned int d=0; d<Dimension; d++)
-   {
-      matlabdims[d]= mxGetDimensions(prhs[0])[d];
-      size[d] = matlabdims[d];
-      start[d] = 0;
-      numPix *= size[d];
-
-      inptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[d]));
-   }
-   
-   region.SetSize( size );
-   region.SetIndex( start );
-   
-   field->SetOrigin( origin );
-   field->SetSpacing( spacing );
-   field->SetRegions( region );
-   field->Allocate();
-
-   //mexPrintf("done field->Allocate(); %f sec\n", timer.elapsed());
-   //timer.restart();
-
-   VectorPixelType * ptr = field->GetBufferPointer();
-   const VectorPixelType * const buff_end = ptr + numPix;
-   
-   while ( ptr != buff_end )
-   {
-      for (unsigned int d=0; d<Dimension; d++)
-      {
-         (*ptr)[d] = *(inptrs[d])++;
-      }
-      ++ptr;
-   }
+      mexImportField<DeformationFieldType, MatlabPixelType>( prhs );
 
    //mexPrintf("done inputs copy %f sec\n", timer.elapsed());
    //timer.restart();
@@ -91,19 +47,8 @@ void deffieldjacobiandeterminant(int nlhs,
    //mexPrintf("done jacobianFilter->UpdateLargestPossibleRegion; %f sec\n", timer.elapsed());
    //timer.restart();
 
-   const mxClassID classID = mxGetClassID(prhs[0]);
-   plhs[0] = mxCreateNumericArray(
-      Dimension, matlabdims, classID, mxREAL);
-   MatlabPixelType * outptr = static_cast<MatlabPixelType *>(mxGetData(plhs[0]));
-
-   //mexPrintf("done allocate output %f sec\n", timer.elapsed());
-   //timer.restart();
-   
-
-   // put result into output
-   const PixelType * jacdetptr = jacdetfilter->GetOutput()->GetBufferPointer();
-   //mz::copy(jacdetptr, jacdetptr + numPix, outptr);
-   std::copy(jacdetptr, jacdetptr + numPix, outptr);
+   // Allocate output and copy the result
+   plhs[0] = mexExportImage<MatlabPixelType>( jacdetfilter->GetOutput(), mxGetClassID(prhs[0]) );
 
    //mexPrintf("done output copy %f sec\n", timer.elapsed());
 }
@@ -1,132 +1,187 @@
-#include "itkVectorCentralDifferenceImageFunction.h"
+#include "itkMultiThreader.h"
 
-#include <itkImageRegionConstIteratorWithIndex.h>
-
-//#include <boost/timer.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 
 #include <mex.h>
 
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// d = deffieldjacobiandist(lx, ly, (lz), rx, ry, (rz), (options))
+//
+// Root mean square over the voxels of the Frobenius norm of the difference
+// between the gradients of the left and right fields, the gradients being
+// computed as VectorCentralDifferenceImageFunction does: central
+// differences, zero along an axis at the first and last voxels. The fields
+// are read in place from the MATLAB arrays, one row along x at a time, the
+// voxels of a row being independent so that the compiler vectorizes the
+// loops. The rows are shared between threads (option num_threads); the
+// squared norms of a row and then the row sums are added pairwise, in the
+// same order whatever the number of threads.
+
+// Pairwise sum of values[0..n)
+inline double PairwiseSum(const double * values, size_t n)
+{
+   if ( n <= 8 )
+   {
+      double sum = 0.0;
+      for (size_t i=0; i<n; i++)
+      {
+         sum += values[i];
+      }
+      return sum;
+   }
+   const size_t half = n/2;
+   return PairwiseSum(values, half) + PairwiseSum(values+half, n-half);
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+struct JacobianDistanceData
+{
+   const mexPlanarField<MatlabPixelType, Dimension> * m_Left;
+   const mexPlanarField<MatlabPixelType, Dimension> * m_Right;
+   size_t          m_Size[Dimension];
+   long            m_Stride[Dimension];
+   size_t          m_NumberOfRows;
+   size_t          m_RowsPerThread;
+   double *        m_RowSums;
+};
+
+// Add the squared gradient differences of one component along one axis
+// to terms, for the voxels [first, end) of a row
+template <class MatlabPixelType>
+inline void AddGradientDifference(const MatlabPixelType * left, const MatlabPixelType * right,
+                                  long stride, long first, long end, double * terms)
+{
+   for (long x=first; x<end; x++)
+   {
+      const double leftDerivative = 0.5 * static_cast<double>(
+         static_cast<float>(left[x+stride]) - static_cast<float>(left[x-stride]) );
+      const double rightDerivative = 0.5 * static_cast<double>(
+         static_cast<float>(right[x+stride]) - static_cast<float>(right[x-stride]) );
+      const double difference = leftDerivative - rightDerivative;
+      terms[x] += difference * difference;
+   }
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+ITK_THREAD_RETURN_TYPE JacobianDistanceThreaderCallback(void * arg)
+{
+   typedef JacobianDistanceData<MatlabPixelType, Dimension> DataType;
+
+   itk::MultiThreader::ThreadInfoStruct * info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+   const DataType & data = *static_cast<const DataType *>( info->UserData );
+
+   const size_t firstRow = info->ThreadID * data.m_RowsPerThread;
+   const size_t endRow = std::min( firstRow + data.m_RowsPerThread, data.m_NumberOfRows );
+   const size_t rowLength = data.m_Size[0];
+
+   // squared norms of the voxels of the current row
+   std::vector<double> terms( rowLength );
+
+   for (size_t row=firstRow; row<endRow; row++)
+   {
+      const size_t rowStart = row * rowLength;
+      std::fill( terms.begin(), terms.end(), 0.0 );
+
+      // along y and z, the row is either inside or on the border
+      bool interior[Dimension];
+      size_t coordinates = row;
+      for (unsigned int d=1; d<Dimension; d++)
+      {
+         const size_t coordinate = coordinates % data.m_Size[d];
+         coordinates /= data.m_Size[d];
+         interior[d] = ( coordinate >= 1 && coordinate+1 < data.m_Size[d] );
+      }
+
+      for (unsigned int c=0; c<Dimension; c++)
+      {
+         const MatlabPixelType * left = data.m_Left->GetComponent(c) + rowStart;
+         const MatlabPixelType * right = data.m_Right->GetComponent(c) + rowStart;
+
+         if ( rowLength > 2 )
+         {
+            AddGradientDifference( left, right, 1, 1, static_cast<long>(rowLength)-1, &terms[0] );
+         }
+         for (unsigned int d=1; d<Dimension; d++)
+         {
+            if ( interior[d] )
+            {
+               AddGradientDifference( left, right, data.m_Stride[d], 0, static_cast<long>(rowLength), &terms[0] );
+            }
+         }
+      }
+
+      data.m_RowSums[row] = PairwiseSum( &terms[0], rowLength );
+   }
+
+   return ITK_THREAD_RETURN_VALUE;
+}
+
 template <class MatlabPixelType, unsigned int Dimension>
 void deffieldjacobiandist(int nlhs,
                           mxArray *plhs[],
                           int nrhs,
                           const mxArray *prhs[])
 {
-   typedef float                                        VectorComponentType;
-   typedef itk::Vector<VectorComponentType, Dimension>  VectorPixelType;
-   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
-
-   typedef itk::VectorCentralDifferenceImageFunction
-      <DeformationFieldType>                            WarpGradientCalculatorType;
-
-   typedef typename WarpGradientCalculatorType::OutputType
-                                                        WarpGradientType;
-
-   typedef itk::ImageRegionConstIteratorWithIndex
-      <DeformationFieldType>                            FieldIteratorType;
-
-   //boost::timer timer;
-
-   // Allocate deformation fields
-   typename DeformationFieldType::Pointer leftfield =
-      DeformationFieldType::New();
-   typename DeformationFieldType::Pointer rightfield =
-      DeformationFieldType::New();
-   
-   typename DeformationFieldType::SpacingType spacing;
-   spacing.Fill( 1.0 );
-   
-   typename DeformationFieldType::PointType origin;
-   origin.Fill( 0.0 );
-   
-   typename DeformationFieldType::RegionType     region;
-   typename DeformationFieldType::SizeType       size;
-   typename DeformationFieldType::IndexType      start;
-
-   unsigned int numPix(1u);
-   const MatlabPixelType * leftinptrs[Dimension];
-   const MatlabPixelType * rightinptrs[Dimension];
-   mwSize matlabdims[Dimension];
+   typedef JacobianDistanceData<MatlabPixelType, Dimension> DataType;
+
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+
+   // The fields are read in place
+   const mexPlanarField<MatlabPixelType, Dimension> leftfield( prhs );
+   const mexPlanarField<MatlabPixelType, Dimension> rightfield( prhs + Dimension );
+   const size_t numPix = leftfield.GetNumberOfPixels();
+
+   DataType data;
+   data.m_Left = &leftfield;
+   data.m_Right = &rightfield;
+   size_t stride = 1;
    for (unsigned int d=0; d<Dimension; d++)
    {
-      matlabdims[d]= mxGetDimensions(prhs[0])[d];
-      size[d] = matlabdims[d];
-      start[d] = 0;
-      numPix *= size[d];
-
-      leftinptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[d]));
-      rightinptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[Dimension+d]));
+      data.m_Size[d] = mxGetDimensions(prhs[0])[d];
+      data.m_Stride[d] = static_cast<long>(stride);
+      stride *= data.m_Size[d];
    }
-   
-   region.SetSize( size );
-   region.SetIndex( start );
-   
-   leftfield->SetOrigin( origin );
-   leftfield->SetSpacing( spacing );
-   leftfield->SetRegions( region );
-   leftfield->Allocate();
-
-   rightfield->SetOrigin( origin );
-   rightfield->SetSpacing( spacing );
-   rightfield->SetRegions( region );
-   rightfield->Allocate();
-
-   //mexPrintf("done field->Allocate(); %f sec\n", timer.elapsed());
-   //timer.restart();
-
-   VectorPixelType * leftptr = leftfield->GetBufferPointer();
-   const VectorPixelType * const leftbuff_end = leftptr + numPix;
-   VectorPixelType * rightptr = rightfield->GetBufferPointer();
-   
-   while ( leftptr != leftbuff_end )
+   data.m_NumberOfRows = data.m_Size[0] ? numPix / data.m_Size[0] : 0;
+
+   std::vector<double> rowSums( data.m_NumberOfRows, 0.0 );
+   data.m_RowSums = rowSums.empty() ? NULL : &rowSums[0];
+
+   unsigned int numberOfThreads = mexGetNumberOfThreads( opts );
+   if ( numberOfThreads == 0 )
    {
-      for (unsigned int d=0; d<Dimension; d++)
-      {
-         (*leftptr)[d] = *(leftinptrs[d])++;
-         (*rightptr)[d] = *(rightinptrs[d])++;
-      }
-      ++leftptr;
-      ++rightptr;
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
    }
+   numberOfThreads = std::max( 1u, std::min( numberOfThreads, static_cast<unsigned int>(
+      itk::MultiThreader::GetGlobalMaximumNumberOfThreads() ) ) );
+   data.m_RowsPerThread = ( data.m_NumberOfRows + numberOfThreads - 1 ) / numberOfThreads;
 
-   //mexPrintf("done inputs copy %f sec\n", timer.elapsed());
-   //timer.restart();
-
-   
    // Compute distance between jacobians
-   typename WarpGradientCalculatorType::Pointer
-      leftgradcomp =  WarpGradientCalculatorType::New();
-   leftgradcomp->SetInputImage( leftfield );
-   
-   typename WarpGradientCalculatorType::Pointer
-      rightgradcomp =  WarpGradientCalculatorType::New();
-   rightgradcomp->SetInputImage( rightfield );
-
-   FieldIteratorType leftIter( leftfield, region );
-   leftIter.GoToBegin();
-   FieldIteratorType rightIter( rightfield, region );
-   rightIter.GoToBegin();
-
-   double fieldGradDist2(0.0), tmp;
-   while ( not leftIter.IsAtEnd() )
+   if ( numberOfThreads == 1 || data.m_NumberOfRows <= 1 )
    {
-      tmp = ( ( leftgradcomp->EvaluateAtIndex(leftIter.GetIndex())
-                - rightgradcomp->EvaluateAtIndex(rightIter.GetIndex()) )
-              .GetVnlMatrix() ).frobenius_norm();
-      fieldGradDist2 += tmp*tmp;
-      ++leftIter;
-      ++rightIter;
+      data.m_RowsPerThread = data.m_NumberOfRows;
+      itk::MultiThreader::ThreadInfoStruct info;
+      info.ThreadID = 0;
+      info.UserData = &data;
+      JacobianDistanceThreaderCallback<MatlabPixelType, Dimension>( &info );
+   }
+   else
+   {
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      threader->SetNumberOfThreads( numberOfThreads );
+      threader->SetSingleMethod( JacobianDistanceThreaderCallback<MatlabPixelType, Dimension>, &data );
+      threader->SingleMethodExecute();
    }
 
-   //mexPrintf("done computing output %f sec\n", timer.elapsed());
-   //timer.restart();
-
+   const double fieldGradDist2 = data.m_NumberOfRows ? PairwiseSum( &rowSums[0], data.m_NumberOfRows ) : 0.0;
 
    plhs[0] = mxCreateDoubleMatrix(1,1, mxREAL);
    double * outptr = mxGetPr(plhs[0]);
    *outptr = std::sqrt( fieldGradDist2/static_cast<double>(numPix) );
-
-   //mexPrintf("done output copy %f sec\n", timer.elapsed());
 }
 
 
@@ -135,18 +190,19 @@ void mexFunction(int nlhs,
                  int nrhs,
                  const mxArray *prhs[])
 {
-   /* Check for proper number of arguments. */
-   if (nrhs!=4 and nrhs!=6)
+   /* Check for proper number of arguments. An options struct may follow. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   if (nargs!=4 and nargs!=6)
    {
-      mexErrMsgTxt("Four or six inputs required.");
+      mexErrMsgTxt("Four or six inputs required, optionally followed by an options struct.");
    }
 
-   const int dim=nrhs/2;
+   const int dim=nargs/2;
 
    const mxClassID classID = mxGetClassID(prhs[0]);
 
    /* The inputs must be noncomplex double matrices.*/
-   for (int n=0; n<nrhs; n++)
+   for (int n=0; n<nargs; n++)
    {
       if ( mxGetClassID(prhs[n])!=classID || mxIsComplex(prhs[n]) )
       {
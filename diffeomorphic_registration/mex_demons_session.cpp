@@ -0,0 +1,428 @@
+#include "itkDemonsIterationEngine.h"
+
+//#include <boost/timer.hpp>
+
+#include <map>
+#include <string>
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+#include "mex_profiler.h"
+
+// h = demons_session('create', size, options)
+// demons_session('setimages', h, fix_im, mov_im)
+// [log_def_x, log_def_y, log_def_z, stats, profile] = demons_session('step', h, log_def_x, log_def_y, log_def_z)
+// demons_session('destroy', h)
+//
+// Same iteration as demonsiteration, but the images, the velocity field,
+// the filters of the iteration and the cached SDMs are kept in the session
+// between calls, so the steady-state loop does not allocate. size is the
+// size of the images (2 or 3 values). options takes the same fields as for
+// demonsiteration and is applied once at creation.
+//
+// The fixed and moving images are copied by 'setimages', which has to be
+// called before the first 'step' and again whenever they change. 'step'
+// returns the updated velocity field in the class of its inputs, the
+// statistics of the iteration and, when asked for or with the profile and
+// profile_log options (see mex_profiler.h), the profile of the step.
+//
+// With the option exp_recompute_interval N (default 1), the deformations
+// of a step are those of the previous step composed with the exponential
+// of its update, and fully recomputed every N steps (never if 0). Each
+// 'step' must then be given the velocity field returned by the previous
+// one.
+//
+// The MEX file stays locked while sessions are open. Sessions not
+// destroyed are freed when MATLAB exits.
+
+class DemonsSessionBase
+{
+public:
+   virtual ~DemonsSessionBase() {}
+
+   virtual void SetImages(const mxArray * fixed, const mxArray * moving) = 0;
+   virtual void Step(int nlhs, mxArray *plhs[], const mxArray * const fields[]) = 0;
+   virtual unsigned int GetDimension() const = 0;
+};
+
+
+template <unsigned int Dimension>
+class DemonsSession : public DemonsSessionBase
+{
+public:
+   typedef float PixelType;
+   typedef itk::Image< PixelType, Dimension >           ImageType;
+
+   typedef float                                        VectorComponentType;
+   typedef itk::Vector<VectorComponentType, Dimension>  VectorPixelType;
+   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
+
+   typedef itk::DemonsIterationEngine
+      <ImageType,DeformationFieldType>                  DemonsIterationEngineType;
+   typedef typename DemonsIterationEngineType::DemonsFunctionType DemonsRegistrationFunctionType;
+
+   DemonsSession(const double * size, const mxArray * opts)
+   {
+      typename ImageType::RegionType     region;
+      typename ImageType::SizeType       imsize;
+      typename ImageType::IndexType      start;
+      typename ImageType::SpacingType    spacing;
+      typename ImageType::PointType      origin;
+
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         imsize[d] = static_cast<typename ImageType::SizeType::SizeValueType>( size[d] );
+         start[d] = 0;
+      }
+      region.SetSize( imsize );
+      region.SetIndex( start );
+      spacing.Fill( 1.0 );
+      origin.Fill( 0.0 );
+
+      m_FixedImage = ImageType::New();
+      m_MovingImage = ImageType::New();
+      m_VelocityField = DeformationFieldType::New();
+
+      m_FixedImage->SetOrigin( origin );
+      m_FixedImage->SetSpacing( spacing );
+      m_FixedImage->SetRegions( region );
+      m_FixedImage->Allocate();
+
+      m_MovingImage->CopyInformation( m_FixedImage );
+      m_MovingImage->SetRegions( region );
+      m_MovingImage->Allocate();
+
+      m_VelocityField->CopyInformation( m_FixedImage );
+      m_VelocityField->SetRegions( region );
+      m_VelocityField->Allocate();
+
+      m_HasImages = false;
+
+      m_Engine = DemonsIterationEngineType::New();
+      m_Engine->SetFixedImage( m_FixedImage );
+      m_Engine->SetMovingImage( m_MovingImage );
+      m_Engine->SetVelocityField( m_VelocityField );
+      m_Engine->SetInverseConsistent( mexGetScalarOption(opts, "invcon_flag", 1.0) != 0 );
+      m_Engine->SetUseFwWeight( mexGetScalarOption(opts, "fw_weight", 0.0) != 0 );
+      m_Engine->SetRegWeight( mexGetScalarOption(opts, "reg_weight", 100.0) );
+      m_Engine->SetNumberOfThreads( mexGetNumberOfThreads(opts) );
+      m_Engine->SetExpRecomputeInterval( static_cast<unsigned int>(
+         mexGetScalarOption(opts, "exp_recompute_interval", 1.0) ) );
+
+      // kept for the profiling options of the steps, and for the SDM
+      // reference images, which may wrap their buffers
+      m_Options = NULL;
+      if ( opts )
+      {
+         m_Options = mxDuplicateArray(opts);
+         mexMakeArrayPersistent(m_Options);
+      }
+
+      // each session has its own SDM cache, released with the session
+      m_Engine->GetDemonsFunction()->SetSDMCache(
+         DemonsRegistrationFunctionType::SDMCacheType::New() );
+      mexSetForceOptions( m_Engine->GetDemonsFunction(), m_Options );
+   }
+
+   virtual ~DemonsSession()
+   {
+      // the engine may still wrap buffers of the options
+      m_Engine = NULL;
+      if ( m_Options )
+      {
+         mxDestroyArray(m_Options);
+      }
+   }
+
+   virtual unsigned int GetDimension() const
+   {
+      return Dimension;
+   }
+
+   virtual void SetImages(const mxArray * fixed, const mxArray * moving)
+   {
+      this->CheckInput( fixed );
+      this->CheckInput( moving );
+      if ( mxGetClassID(fixed) != mxGetClassID(moving) )
+      {
+         mexErrMsgTxt("The fixed and moving images must have the same class.");
+      }
+
+      switch ( mxGetClassID(fixed) )
+      {
+         case mxSINGLE_CLASS:
+            mexCopyToImage<float>( fixed, m_FixedImage.GetPointer() );
+            mexCopyToImage<float>( moving, m_MovingImage.GetPointer() );
+            break;
+         case mxDOUBLE_CLASS:
+            mexCopyToImage<double>( fixed, m_FixedImage.GetPointer() );
+            mexCopyToImage<double>( moving, m_MovingImage.GetPointer() );
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+      m_FixedImage->Modified();
+      m_MovingImage->Modified();
+      m_HasImages = true;
+   }
+
+   virtual void Step(int nlhs, mxArray *plhs[], const mxArray * const fields[])
+   {
+      if ( !m_HasImages )
+      {
+         mexErrMsgTxt("The images of the session must be set before the first step.");
+      }
+
+      const mxClassID classID = mxGetClassID(fields[0]);
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         this->CheckInput( fields[d] );
+         if ( mxGetClassID(fields[d]) != classID )
+         {
+            mexErrMsgTxt("The velocity field components must have the same class.");
+         }
+      }
+
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            this->template StepImpl<float>(nlhs, plhs, fields);
+            break;
+         case mxDOUBLE_CLASS:
+            this->template StepImpl<double>(nlhs, plhs, fields);
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+   }
+
+private:
+   // Noncomplex floating point array of the size of the session
+   void CheckInput(const mxArray * array) const
+   {
+      if ( mxIsComplex(array) || !(mxIsSingle(array) || mxIsDouble(array)) )
+      {
+         mexErrMsgTxt("Input must be a noncomplex floating point.");
+      }
+      if ( mxGetNumberOfDimensions(array) != Dimension )
+      {
+         mexErrMsgTxt("The dimension of the inputs must agree with the session.");
+      }
+      const typename ImageType::SizeType & size =
+         m_FixedImage->GetLargestPossibleRegion().GetSize();
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         if ( mxGetDimensions(array)[d] != size[d] )
+         {
+            mexErrMsgTxt("Inputs must have the size of the session.");
+         }
+      }
+   }
+
+   template <class MatlabPixelType>
+   void StepImpl(int nlhs, mxArray *plhs[], const mxArray * const fields[])
+   {
+      itk::RegistrationProfiler::Pointer profiler =
+         mexCreateProfiler( m_Options, nlhs > static_cast<int>(Dimension)+1 );
+      mexPhaseTimer timer( profiler );
+      m_Engine->SetProfiler( profiler );
+
+      // the velocity field is updated in place, the engine takes it as
+      // modified at each iteration
+      const mexPlanarField<MatlabPixelType, Dimension> velocity( fields );
+      velocity.CopyTo( m_VelocityField.GetPointer() );
+      timer.Lap("import");
+
+      try
+      {
+         m_Engine->Iterate();
+      }
+      catch( itk::ExceptionObject & err )
+      {
+         mexErrMsgTxt( err.GetDescription() );
+      }
+      timer.Lap("iteration");
+
+      // the update is added to the velocity field in the precision of the
+      // inputs
+      const mxClassID classID = mxGetClassID(fields[0]);
+      const mwSize * matlabdims = mxGetDimensions(fields[0]);
+      const VectorPixelType * upptr = m_Engine->GetUpdateField()->GetBufferPointer();
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         plhs[d] = mxCreateNumericArray(
+            Dimension, matlabdims, classID, mxREAL);
+
+         MatlabPixelType * outptr = static_cast<MatlabPixelType *>(mxGetData(plhs[d]));
+         const MatlabPixelType * vptr = velocity.GetComponent(d);
+         for (size_t i=0; i<velocity.GetNumberOfPixels(); i++)
+         {
+            outptr[i] = vptr[i] + upptr[i][d];
+         }
+      }
+
+      if (nlhs > static_cast<int>(Dimension))
+      {
+         const char * fieldnames[] = { "MSE", "backMSE", "harmoEner",
+            "backharmoEner", "negJacRatio", "backnegJacRatio" };
+         const double values[] = { m_Engine->GetMSE(), m_Engine->GetBackMSE(),
+            m_Engine->GetHarmonicEnergy(), m_Engine->GetBackHarmonicEnergy(),
+            m_Engine->GetNegativeJacobianRatio(), m_Engine->GetBackNegativeJacobianRatio() };
+
+         plhs[Dimension] = mxCreateStructMatrix(1, 1, 6, fieldnames);
+         for (int n=0; n<6; n++)
+         {
+            mxSetFieldByNumber(plhs[Dimension], 0, n, mxCreateDoubleScalar(values[n]));
+         }
+      }
+      timer.Lap("export");
+
+      if ( profiler )
+      {
+         mexWriteProfileLog( profiler, m_Options, "demons_session" );
+         if (nlhs > static_cast<int>(Dimension)+1)
+         {
+            plhs[Dimension+1] = mexCreateProfileStruct( profiler );
+         }
+      }
+   }
+
+   typename ImageType::Pointer                  m_FixedImage;
+   typename ImageType::Pointer                  m_MovingImage;
+   typename DeformationFieldType::Pointer       m_VelocityField;
+   typename DemonsIterationEngineType::Pointer  m_Engine;
+   bool                                         m_HasImages;
+   mxArray *                                    m_Options;
+};
+
+
+// Open sessions by handle
+typedef std::map<unsigned int, DemonsSessionBase *> SessionTable;
+static SessionTable sessions;
+static unsigned int nextHandle = 1u;
+
+static void DestroyAllSessions()
+{
+   for (SessionTable::iterator it=sessions.begin(); it!=sessions.end(); ++it)
+   {
+      delete it->second;
+   }
+   sessions.clear();
+}
+
+static SessionTable::iterator GetSession(const mxArray * handle)
+{
+   if ( !mxIsNumeric(handle) || mxGetNumberOfElements(handle) != 1 )
+   {
+      mexErrMsgTxt("The session handle must be a scalar.");
+   }
+   SessionTable::iterator it = sessions.find( static_cast<unsigned int>( mxGetScalar(handle) ) );
+   if ( it == sessions.end() )
+   {
+      mexErrMsgTxt("Invalid or destroyed session handle.");
+   }
+   return it;
+}
+
+
+void mexFunction(int nlhs,
+                 mxArray *plhs[],
+                 int nrhs,
+                 const mxArray *prhs[])
+{
+   if ( nrhs < 1 || !mxIsChar(prhs[0]) )
+   {
+      mexErrMsgTxt("The first input must be a command: 'create', 'setimages', 'step' or 'destroy'.");
+   }
+   char * buffer = mxArrayToString(prhs[0]);
+   const std::string command(buffer);
+   mxFree(buffer);
+
+   if ( command == "create" )
+   {
+      /* The options struct may be omitted. */
+      const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+      if ( nargs != 2 || nlhs > 1 )
+      {
+         mexErrMsgTxt("Usage: h = demons_session('create', size, options)");
+      }
+      const size_t dim = mxGetNumberOfElements(prhs[1]);
+      if ( !mxIsDouble(prhs[1]) || (dim != 2 && dim != 3) )
+      {
+         mexErrMsgTxt("The size must be a vector of 2 or 3 doubles.");
+      }
+      const double * size = mxGetPr(prhs[1]);
+      for (size_t d=0; d<dim; d++)
+      {
+         if ( size[d] < 1 )
+         {
+            mexErrMsgTxt("The size must be positive.");
+         }
+      }
+
+      const mxArray * opts = mexGetOptions(nrhs, prhs);
+      DemonsSessionBase * session = NULL;
+      if ( dim == 2 )
+      {
+         session = new DemonsSession<2>(size, opts);
+      }
+      else
+      {
+         session = new DemonsSession<3>(size, opts);
+      }
+
+      if ( sessions.empty() )
+      {
+         mexAtExit( DestroyAllSessions );
+      }
+      sessions[nextHandle] = session;
+      mexLock();
+
+      plhs[0] = mxCreateDoubleScalar( nextHandle++ );
+   }
+   else if ( command == "setimages" )
+   {
+      if ( nrhs != 4 || nlhs > 0 )
+      {
+         mexErrMsgTxt("Usage: demons_session('setimages', h, fix_im, mov_im)");
+      }
+      GetSession(prhs[1])->second->SetImages( prhs[2], prhs[3] );
+   }
+   else if ( command == "step" )
+   {
+      if ( nrhs < 2 )
+      {
+         mexErrMsgTxt("Usage: [log_def_x, log_def_y, (log_def_z), stats, profile] = demons_session('step', h, log_def_x, log_def_y, (log_def_z))");
+      }
+      DemonsSessionBase * session = GetSession(prhs[1])->second;
+      const int dim = session->GetDimension();
+      if ( nrhs != 2+dim )
+      {
+         mexErrMsgTxt("Usage: [log_def_x, log_def_y, (log_def_z), stats, profile] = demons_session('step', h, log_def_x, log_def_y, (log_def_z))");
+      }
+      if ( nlhs < dim || nlhs > dim+2 )
+      {
+         mexErrMsgTxt("Number of outputs must agree with the session dimension, optionally followed by the stats and the profile.");
+      }
+      session->Step( nlhs, plhs, prhs + 2 );
+   }
+   else if ( command == "destroy" )
+   {
+      if ( nrhs != 2 || nlhs > 0 )
+      {
+         mexErrMsgTxt("Usage: demons_session('destroy', h)");
+      }
+      SessionTable::iterator it = GetSession(prhs[1]);
+      delete it->second;
+      sessions.erase( it );
+      mexUnlock();
+   }
+   else
+   {
+      mexErrMsgTxt(("Unknown command " + command + ".").c_str());
+   }
+
+   return;
+}
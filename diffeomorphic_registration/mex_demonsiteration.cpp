@@ -0,0 +1,227 @@
+#include "itkDemonsIterationEngine.h"
+
+//#include <boost/timer.hpp>
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+#include "mex_profiler.h"
+
+// [log_def_x, log_def_y, log_def_z, stats, profile] = demonsiteration(fix_im, mov_im, log_def_x, log_def_y, log_def_z, options)
+//
+// One iteration of make_update in invconstdemonsreg3d_aux.m: returns the
+// updated velocity field and the statistics of the iteration (MSE, backMSE,
+// harmoEner, backharmoEner, negJacRatio, backnegJacRatio). Besides the force
+// options of mex_options.h, options may hold invcon_flag (default 1),
+// fw_weight (default 0) and reg_weight (default 100). profile and the
+// profile_log option are described in mex_profiler.h.
+//
+// The images and the velocity field may be of different classes: single
+// images are wrapped without a copy, a double velocity field keeps v in
+// double. The field is interleaved for ITK whatever its class.
+template <class MatlabImagePixelType, class MatlabPixelType, unsigned int Dimension>
+void demonsiteration(int nlhs,
+                     mxArray *plhs[],
+                     int nrhs,
+                     const mxArray *prhs[])
+{
+   typedef float PixelType;
+   typedef itk::Image< PixelType, Dimension >           ImageType;
+
+   typedef float                                        VectorComponentType;
+   typedef itk::Vector<VectorComponentType, Dimension>  VectorPixelType;
+   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
+
+   typedef itk::DemonsIterationEngine
+      <ImageType,DeformationFieldType>                  DemonsIterationEngineType;
+   typedef typename DemonsIterationEngineType::DemonsFunctionType DemonsRegistrationFunctionType;
+
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+   itk::RegistrationProfiler::Pointer profiler =
+      mexCreateProfiler( opts, nlhs > static_cast<int>(Dimension)+1 );
+   mexPhaseTimer timer( profiler );
+
+   // The label images wrap the MATLAB buffers when they are single, the
+   // velocity field is interleaved
+   typename ImageType::Pointer fixedimage =
+      mexImportImage<ImageType, MatlabImagePixelType>( prhs[0] );
+   typename ImageType::Pointer movingimage =
+      mexImportImage<ImageType, MatlabImagePixelType>( prhs[1] );
+
+   const mexPlanarField<MatlabPixelType, Dimension> velocity( prhs + 2 );
+   typename DeformationFieldType::Pointer field =
+      mexAllocateImage<DeformationFieldType>( prhs[0] );
+   velocity.CopyTo( field.GetPointer() );
+
+   timer.Lap("import");
+
+   typename DemonsIterationEngineType::Pointer engine
+      = DemonsIterationEngineType::New();
+   engine->SetFixedImage( fixedimage );
+   engine->SetMovingImage( movingimage );
+   engine->SetVelocityField( field );
+   engine->SetInverseConsistent( mexGetScalarOption(opts, "invcon_flag", 1.0) != 0 );
+   engine->SetUseFwWeight( mexGetScalarOption(opts, "fw_weight", 0.0) != 0 );
+   engine->SetRegWeight( mexGetScalarOption(opts, "reg_weight", 100.0) );
+   engine->SetNumberOfThreads( mexGetNumberOfThreads(opts) );
+   engine->SetProfiler( profiler );
+
+   // The SDMs of the unwarped label images are kept between calls, so
+   // they are computed once per pyramid level ("clear mex" drops them)
+   static typename DemonsRegistrationFunctionType::SDMCachePointer sdmCache;
+   if ( !sdmCache )
+   {
+      sdmCache = DemonsRegistrationFunctionType::SDMCacheType::New();
+   }
+   engine->GetDemonsFunction()->SetSDMCache( sdmCache );
+   mexSetForceOptions( engine->GetDemonsFunction(), opts );
+
+   try
+   {
+      engine->Iterate();
+   }
+   catch( itk::ExceptionObject & err )
+   {
+      mexErrMsgTxt( err.GetDescription() );
+   }
+
+   timer.Lap("iteration");
+
+   // Allocate outputs, the update is added to the velocity field in the
+   // precision of its inputs
+   const mxClassID classID = mxGetClassID(prhs[2]);
+   const mwSize * matlabdims = mxGetDimensions(prhs[0]);
+   const VectorPixelType * upptr = engine->GetUpdateField()->GetBufferPointer();
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      plhs[d] = mxCreateNumericArray(
+         Dimension, matlabdims, classID, mxREAL);
+
+      MatlabPixelType * outptr = static_cast<MatlabPixelType *>(mxGetData(plhs[d]));
+      const MatlabPixelType * vptr = velocity.GetComponent(d);
+      for (size_t i=0; i<velocity.GetNumberOfPixels(); i++)
+      {
+         outptr[i] = vptr[i] + upptr[i][d];
+      }
+   }
+
+   if (nlhs > static_cast<int>(Dimension))
+   {
+      const char * fieldnames[] = { "MSE", "backMSE", "harmoEner",
+         "backharmoEner", "negJacRatio", "backnegJacRatio" };
+      const double values[] = { engine->GetMSE(), engine->GetBackMSE(),
+         engine->GetHarmonicEnergy(), engine->GetBackHarmonicEnergy(),
+         engine->GetNegativeJacobianRatio(), engine->GetBackNegativeJacobianRatio() };
+
+      plhs[Dimension] = mxCreateStructMatrix(1, 1, 6, fieldnames);
+      for (int n=0; n<6; n++)
+      {
+         mxSetFieldByNumber(plhs[Dimension], 0, n, mxCreateDoubleScalar(values[n]));
+      }
+   }
+
+   timer.Lap("export");
+
+   if ( profiler )
+   {
+      mexWriteProfileLog( profiler, opts, "demonsiteration" );
+      if (nlhs > static_cast<int>(Dimension)+1)
+      {
+         plhs[Dimension+1] = mexCreateProfileStruct( profiler );
+      }
+   }
+}
+
+
+// Instantiate demonsiteration for the classes of the images and the field
+template <unsigned int Dimension>
+void demonsiterationDispatch(mxClassID imageClassID,
+                             mxClassID classID,
+                             int nlhs,
+                             mxArray *plhs[],
+                             int nrhs,
+                             const mxArray *prhs[])
+{
+   if ( imageClassID == mxSINGLE_CLASS && classID == mxSINGLE_CLASS )
+   {
+      demonsiteration<float,float,Dimension>(nlhs, plhs, nrhs, prhs);
+   }
+   else if ( imageClassID == mxSINGLE_CLASS && classID == mxDOUBLE_CLASS )
+   {
+      demonsiteration<float,double,Dimension>(nlhs, plhs, nrhs, prhs);
+   }
+   else if ( imageClassID == mxDOUBLE_CLASS && classID == mxSINGLE_CLASS )
+   {
+      demonsiteration<double,float,Dimension>(nlhs, plhs, nrhs, prhs);
+   }
+   else if ( imageClassID == mxDOUBLE_CLASS && classID == mxDOUBLE_CLASS )
+   {
+      demonsiteration<double,double,Dimension>(nlhs, plhs, nrhs, prhs);
+   }
+   else
+   {
+      mexErrMsgTxt("Pixel type unsupported.");
+   }
+}
+
+
+void mexFunction(int nlhs,
+                 mxArray *plhs[],
+                 int nrhs,
+                 const mxArray *prhs[])
+{
+   /* Check for proper number of arguments. An options struct may follow. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   if (nargs!=4 and nargs!=5)
+   {
+      mexErrMsgTxt("4 or 5 inputs required, optionally followed by an options struct.");
+   }
+
+   const int dim=nargs-2;
+
+   const mxClassID imageClassID = mxGetClassID(prhs[0]);
+   const mxClassID classID = mxGetClassID(prhs[2]);
+
+   /* The inputs must be noncomplex floating point matrices, the images of
+      one class and the velocity field of one class.*/
+   for (int n=0; n<nargs; n++)
+   {
+      if ( mxGetClassID(prhs[n])!=(n < 2 ? imageClassID : classID) || mxIsComplex(prhs[n]) )
+      {
+         mexErrMsgTxt("Input must be a noncomplex floating point.");
+      }
+
+      if ( mxGetNumberOfDimensions(prhs[n]) != dim )
+      {
+         mexErrMsgTxt("The dimension of the inputs must agree with the number of inputs.");
+      }
+
+      for (int dd=0; dd<dim; dd++)
+      {
+         if ( mxGetDimensions(prhs[n])[dd] != mxGetDimensions(prhs[0])[dd] )
+         {
+            mexErrMsgTxt("Inputs must have the same size.");
+         }
+      }
+   }
+
+   if (nlhs < dim or nlhs > dim+2)
+   {
+      mexErrMsgTxt("Number of outputs must agree with the number of inputs, optionally followed by the stats and the profile.");
+   }
+
+   switch ( dim )
+   {
+   case 2:
+      demonsiterationDispatch<2>(imageClassID, classID, nlhs, plhs, nrhs, prhs);
+      break;
+   case 3:
+      demonsiterationDispatch<3>(imageClassID, classID, nlhs, plhs, nrhs, prhs);
+      break;
+   default:
+      mexErrMsgTxt("Dimension unsupported.");
+   }
+
+   return;
+}
@@ -0,0 +1,259 @@
+#ifndef __mex_itkimage_h
+#define __mex_itkimage_h
+
+// Conversions between MATLAB arrays and the ITK images of the MEX functions.
+// Images get spacing 1, origin 0 and the size of the MATLAB array.
+//
+// Scalar images whose pixel type matches the MATLAB class (single arrays
+// for float images) wrap the MATLAB buffer without a copy. Such images are
+// read only: MATLAB may share the buffer with other variables, so they
+// must never be written to or run through an in-place filter. Other
+// classes are converted into a new buffer.
+//
+// Displacement fields are passed by MATLAB as one array per component.
+// mexPlanarField reads them in place, but ITK filters need interleaved
+// vectors: every field handed to ITK is still copied once, by
+// mexImportField or mexPlanarField::CopyTo, whatever its class.
+
+#include <itkImage.h>
+#include <itkImportImageContainer.h>
+
+#include <algorithm>
+
+#include <mex.h>
+
+// Region, spacing and origin of a MATLAB array of the image dimension
+template <class TImage>
+void mexSetImageGeometry(TImage * image, const mxArray * array)
+{
+   typename TImage::RegionType     region;
+   typename TImage::SizeType       size;
+   typename TImage::IndexType      start;
+   typename TImage::SpacingType    spacing;
+   typename TImage::PointType      origin;
+
+   for (unsigned int d=0; d<TImage::ImageDimension; d++)
+   {
+      size[d] = mxGetDimensions(array)[d];
+      start[d] = 0;
+   }
+   region.SetSize( size );
+   region.SetIndex( start );
+   spacing.Fill( 1.0 );
+   origin.Fill( 0.0 );
+
+   image->SetOrigin( origin );
+   image->SetSpacing( spacing );
+   image->SetRegions( region );
+}
+
+// Same for the slices [first, first+count) along the last axis of the
+// array, which keep their index in the whole array
+template <class TImage>
+void mexSetImageSlabGeometry(TImage * image, const mxArray * array, size_t first, size_t count)
+{
+   mexSetImageGeometry( image, array );
+   typename TImage::RegionType region = image->GetBufferedRegion();
+   region.SetIndex( TImage::ImageDimension-1, static_cast<long>( first ) );
+   region.SetSize( TImage::ImageDimension-1, count );
+   image->SetRegions( region );
+}
+
+// New image with the geometry of a MATLAB array, allocated
+template <class TImage>
+typename TImage::Pointer mexAllocateImage(const mxArray * array)
+{
+   typename TImage::Pointer image = TImage::New();
+   mexSetImageGeometry( image.GetPointer(), array );
+   image->Allocate();
+   return image;
+}
+
+// Copy a MATLAB array, from its element first on, into an allocated
+// scalar image
+template <class MatlabPixelType, class TImage>
+void mexCopyToImage(const mxArray * array, TImage * image, size_t first = 0)
+{
+   typedef typename TImage::PixelType PixelType;
+
+   const MatlabPixelType * inptr = static_cast<const MatlabPixelType *>(mxGetData(array)) + first;
+   PixelType * ptr = image->GetBufferPointer();
+   const PixelType * const buff_end = ptr + image->GetBufferedRegion().GetNumberOfPixels();
+   while ( ptr != buff_end )
+   {
+      *ptr++ = static_cast<PixelType>( *inptr++ );
+   }
+}
+
+// Copy or wrap the buffer of a MATLAB array, see mexImportImage
+template <class TPixel, class MatlabPixelType>
+struct mexImageImporter
+{
+   template <class TImage>
+   static void Import(TImage * image, const mxArray * array, size_t first = 0)
+   {
+      image->Allocate();
+      mexCopyToImage<MatlabPixelType>( array, image, first );
+   }
+};
+
+template <class TPixel>
+struct mexImageImporter<TPixel, TPixel>
+{
+   template <class TImage>
+   static void Import(TImage * image, const mxArray * array, size_t first = 0)
+   {
+      // the container does not own (and will not free) the MATLAB buffer
+      image->GetPixelContainer()->SetImportPointer(
+         static_cast<TPixel *>(mxGetData(array)) + first,
+         image->GetBufferedRegion().GetNumberOfPixels(), false );
+   }
+};
+
+// Scalar image of a MATLAB array, without copy when the classes match
+template <class TImage, class MatlabPixelType>
+typename TImage::Pointer mexImportImage(const mxArray * array)
+{
+   typename TImage::Pointer image = TImage::New();
+   mexSetImageGeometry( image.GetPointer(), array );
+   mexImageImporter<typename TImage::PixelType, MatlabPixelType>::Import( image.GetPointer(), array );
+   return image;
+}
+
+// Slices [first, first+count) along the last axis of a MATLAB array, see
+// mexSetImageSlabGeometry, without copy when the classes match
+template <class TImage, class MatlabPixelType>
+typename TImage::Pointer mexImportImageSlab(const mxArray * array, size_t first, size_t count)
+{
+   typename TImage::Pointer image = TImage::New();
+   mexSetImageSlabGeometry( image.GetPointer(), array, first, count );
+   mexImageImporter<typename TImage::PixelType, MatlabPixelType>::Import(
+      image.GetPointer(), array, first * ( mxGetNumberOfElements(array) / mxGetDimensions(array)[TImage::ImageDimension-1] ) );
+   return image;
+}
+
+// Displacement field given as one MATLAB array per component
+template <class MatlabPixelType, unsigned int Dimension>
+class mexPlanarField
+{
+public:
+   mexPlanarField(const mxArray * const arrays[])
+   {
+      m_NumberOfPixels = mxGetNumberOfElements(arrays[0]);
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         m_Components[d] = static_cast<const MatlabPixelType *>(mxGetData(arrays[d]));
+      }
+   }
+
+   const MatlabPixelType * GetComponent(unsigned int d) const
+   {
+      return m_Components[d];
+   }
+
+   MatlabPixelType Get(size_t i, unsigned int d) const
+   {
+      return m_Components[d][i];
+   }
+
+   size_t GetNumberOfPixels() const
+   {
+      return m_NumberOfPixels;
+   }
+
+   // Interleave into a field, from pixel first on
+   template <class TField>
+   void CopyTo(TField * field, size_t first = 0) const
+   {
+      typedef typename TField::PixelType VectorPixelType;
+      typedef typename VectorPixelType::ValueType VectorComponentType;
+
+      VectorPixelType * ptr = field->GetBufferPointer();
+      const size_t end = first + field->GetBufferedRegion().GetNumberOfPixels();
+      for (size_t i=first; i<end; i++, ++ptr)
+      {
+         for (unsigned int d=0; d<Dimension; d++)
+         {
+            (*ptr)[d] = static_cast<VectorComponentType>( m_Components[d][i] );
+         }
+      }
+   }
+
+private:
+   const MatlabPixelType * m_Components[Dimension];
+   size_t                  m_NumberOfPixels;
+};
+
+// Interleaved ITK field of the planar MATLAB arrays
+template <class TField, class MatlabPixelType>
+typename TField::Pointer mexImportField(const mxArray * const arrays[])
+{
+   typename TField::Pointer field = mexAllocateImage<TField>( arrays[0] );
+   mexPlanarField<MatlabPixelType, TField::ImageDimension>( arrays ).CopyTo( field.GetPointer() );
+   return field;
+}
+
+// Interleaved slices [first, first+count) of the field, see
+// mexSetImageSlabGeometry
+template <class TField, class MatlabPixelType>
+typename TField::Pointer mexImportFieldSlab(const mxArray * const arrays[], size_t first, size_t count)
+{
+   typename TField::Pointer field = TField::New();
+   mexSetImageSlabGeometry( field.GetPointer(), arrays[0], first, count );
+   field->Allocate();
+   mexPlanarField<MatlabPixelType, TField::ImageDimension>( arrays ).CopyTo(
+      field.GetPointer(), first * ( mxGetNumberOfElements(arrays[0]) / mxGetDimensions(arrays[0])[TField::ImageDimension-1] ) );
+   return field;
+}
+
+// New MATLAB array of the given class holding a scalar image
+template <class MatlabPixelType, class TImage>
+mxArray * mexExportImage(const TImage * image, mxClassID classID)
+{
+   const unsigned int Dimension = TImage::ImageDimension;
+   mwSize matlabdims[Dimension];
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      matlabdims[d] = image->GetBufferedRegion().GetSize()[d];
+   }
+   mxArray * array = mxCreateNumericArray(Dimension, matlabdims, classID, mxREAL);
+
+   const typename TImage::PixelType * ptr = image->GetBufferPointer();
+   const size_t numPix = image->GetBufferedRegion().GetNumberOfPixels();
+   std::copy(ptr, ptr + numPix, static_cast<MatlabPixelType *>(mxGetData(array)));
+   return array;
+}
+
+// One new MATLAB array of the given class per component of a field
+template <class MatlabPixelType, class TField>
+void mexExportField(const TField * field, mxClassID classID, mxArray * outputs[])
+{
+   typedef typename TField::PixelType VectorPixelType;
+   const unsigned int Dimension = TField::ImageDimension;
+
+   mwSize matlabdims[Dimension];
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      matlabdims[d] = field->GetBufferedRegion().GetSize()[d];
+   }
+
+   MatlabPixelType * outptrs[Dimension];
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      outputs[d] = mxCreateNumericArray(Dimension, matlabdims, classID, mxREAL);
+      outptrs[d] = static_cast<MatlabPixelType *>(mxGetData(outputs[d]));
+   }
+
+   const VectorPixelType * ptr = field->GetBufferPointer();
+   const VectorPixelType * const buff_end = ptr + field->GetBufferedRegion().GetNumberOfPixels();
+   while ( ptr != buff_end )
+   {
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         *(outptrs[d])++ = (*ptr)[d];
+      }
+      ++ptr;
+   }
+}
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef __mex_options_h
+#define __mex_options_h
+
+// Helpers to read the optional trailing options struct of the MEX functions,
+// e.g. invcondemonsforces(..., reg_weight, struct('sdm_mode','warp')).
+// Missing fields fall back to the given default, strings are lowercased.
+
+#include <mex.h>
+
+#include <cctype>
+#include <string>
+
+#include "mex_itkimage.h"
+
+// The options struct if the last input is one, NULL otherwise
+inline const mxArray * mexGetOptions(int nrhs, const mxArray *prhs[])
+{
+   if ( nrhs > 0 && mxIsStruct(prhs[nrhs-1]) )
+   {
+      return prhs[nrhs-1];
+   }
+   return NULL;
+}
+
+// Number of inputs without the options struct
+inline int mexGetNumberOfArguments(int nrhs, const mxArray *prhs[])
+{
+   return mexGetOptions(nrhs, prhs) ? nrhs-1 : nrhs;
+}
+
+inline const mxArray * mexGetOptionField(const mxArray * opts, const char * name)
+{
+   if ( !opts || mxGetNumberOfElements(opts) < 1 )
+   {
+      return NULL;
+   }
+   return mxGetField(opts, 0, name);
+}
+
+inline double mexGetScalarOption(const mxArray * opts, const char * name, double defaultValue)
+{
+   const mxArray * field = mexGetOptionField(opts, name);
+   if ( !field || mxIsEmpty(field) )
+   {
+      return defaultValue;
+   }
+   if ( !mxIsNumeric(field) && !mxIsLogical(field) )
+   {
+      mexErrMsgTxt((std::string("Option ") + name + " must be numeric.").c_str());
+   }
+   return mxGetScalar(field);
+}
+
+inline std::string mexGetStringOption(const mxArray * opts, const char * name, const std::string & defaultValue)
+{
+   const mxArray * field = mexGetOptionField(opts, name);
+   if ( !field || mxIsEmpty(field) )
+   {
+      return defaultValue;
+   }
+   if ( !mxIsChar(field) )
+   {
+      mexErrMsgTxt((std::string("Option ") + name + " must be a string.").c_str());
+   }
+   char * buffer = mxArrayToString(field);
+   std::string value(buffer);
+   mxFree(buffer);
+   for (std::string::size_type i=0; i<value.size(); i++)
+   {
+      value[i] = static_cast<char>( std::tolower(static_cast<unsigned char>(value[i])) );
+   }
+   return value;
+}
+
+// Thread count from the num_threads option, 0 (the default) lets ITK choose
+inline unsigned int mexGetNumberOfThreads(const mxArray * opts)
+{
+   const double numThreads = mexGetScalarOption(opts, "num_threads", 0.0);
+   if ( numThreads < 0 )
+   {
+      mexErrMsgTxt("Option num_threads must be non-negative.");
+   }
+   return static_cast<unsigned int>( numThreads );
+}
+
+// Image given as a single or double array of the image dimension, NULL if
+// the option is missing. A single array is wrapped, not copied, so the
+// options must outlive the image.
+template <class TImage>
+typename TImage::Pointer mexGetImageOption(const mxArray * opts, const char * name)
+{
+   const mxArray * field = mexGetOptionField(opts, name);
+   if ( !field || mxIsEmpty(field) )
+   {
+      return NULL;
+   }
+   if ( mxIsComplex(field) || mxGetNumberOfDimensions(field) != TImage::ImageDimension )
+   {
+      mexErrMsgTxt((std::string("Option ") + name + " must be a noncomplex array of the image dimension.").c_str());
+   }
+   switch ( mxGetClassID(field) )
+   {
+      case mxSINGLE_CLASS:
+         return mexImportImage<TImage, float>( field );
+      case mxDOUBLE_CLASS:
+         return mexImportImage<TImage, double>( field );
+      default:
+         mexErrMsgTxt((std::string("Option ") + name + " must be single or double.").c_str());
+   }
+   return NULL;
+}
+
+// Options shared by the demons force functions:
+//   sdm_mode  'recompute' (default) recomputes the SDMs of the warped label
+//             images at every call, 'warp' resamples the SDMs of the
+//             unwarped label images instead
+//   sdm_band  band width in voxels of the label SDMs, distances beyond it
+//             are clamped, the SDMs within it are unchanged (default 0:
+//             whole image)
+//   sdm_frame margin around the bounding box of the labels when there is
+//             no band (default 5)
+//   sdm_fixed_reference, sdm_moving_reference
+//             full-resolution label images the fixed and moving images
+//             were decimated from: their SDMs are computed at full
+//             resolution and Gaussian-smoothed down to the level, needs
+//             sdm_mode 'warp' (default: none, the SDMs of the level's own
+//             label images)
+//   sdm_pyramid_sigma
+//             standard deviation of that Gaussian, in voxels of the finer
+//             level (default 1)
+//   vectorize use the SIMD row kernel when available (default 1), the
+//             result is the same without it
+template <class TDemonsFunction>
+void mexSetForceOptions(TDemonsFunction * drfp, const mxArray * opts)
+{
+   const double sdmBand = mexGetScalarOption(opts, "sdm_band", 0.0);
+   const double sdmFrame = mexGetScalarOption(opts, "sdm_frame", 5.0);
+   if ( sdmBand < 0 || sdmFrame < 0 )
+   {
+      mexErrMsgTxt("Options sdm_band and sdm_frame must be non-negative.");
+   }
+   drfp->SetSDMBandWidth( sdmBand );
+   drfp->SetSDMFrameWidth( static_cast<unsigned int>( sdmFrame ) );
+
+   const double sdmPyramidSigma = mexGetScalarOption(opts, "sdm_pyramid_sigma", 1.0);
+   if ( sdmPyramidSigma < 0 )
+   {
+      mexErrMsgTxt("Option sdm_pyramid_sigma must be non-negative.");
+   }
+   drfp->SetSDMPyramidSigma( sdmPyramidSigma );
+   drfp->SetFixedSDMReferenceImage(
+      mexGetImageOption<typename TDemonsFunction::FixedImageType>(opts, "sdm_fixed_reference") );
+   drfp->SetMovingSDMReferenceImage(
+      mexGetImageOption<typename TDemonsFunction::MovingImageType>(opts, "sdm_moving_reference") );
+
+   drfp->SetUseVectorizedUpdate( mexGetScalarOption(opts, "vectorize", 1.0) != 0 );
+
+   const std::string sdmMode = mexGetStringOption(opts, "sdm_mode", "recompute");
+   if ( sdmMode == "recompute" )
+   {
+      drfp->SetSDMMode( TDemonsFunction::RecomputeSDM );
+   }
+   else if ( sdmMode == "warp" )
+   {
+      drfp->SetSDMMode( TDemonsFunction::WarpSDM );
+   }
+   else
+   {
+      mexErrMsgTxt("Option sdm_mode must be 'recompute' or 'warp'.");
+   }
+   if ( drfp->GetFixedSDMReferenceImage() || drfp->GetMovingSDMReferenceImage() )
+   {
+      if ( !drfp->GetFixedSDMReferenceImage() || !drfp->GetMovingSDMReferenceImage() )
+      {
+         mexErrMsgTxt("Options sdm_fixed_reference and sdm_moving_reference must be given together.");
+      }
+      if ( sdmMode != "warp" )
+      {
+         mexErrMsgTxt("Options sdm_fixed_reference and sdm_moving_reference need sdm_mode 'warp'.");
+      }
+   }
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef __mex_profiler_h
+#define __mex_profiler_h
+
+// Profiling of the MEX functions, see itk::RegistrationProfiler. It is on
+// when the caller asks for the profile output, or with the options
+//   profile      nonzero to profile without the output (default 0)
+//   profile_log  file to which each call appends its profile as one JSON
+//                line: {"function":..,"phases":{name:{"seconds":..,
+//                "calls":..}},"counters":{name:value}}
+// The profile output is a struct with the fields phases (seconds per
+// phase), calls (calls per phase) and counters.
+
+#include "itkRegistrationProfiler.h"
+
+#include <cstdio>
+#include <string>
+
+#include <mex.h>
+
+#include "mex_options.h"
+
+// A new profiler if profiling is on, NULL otherwise
+inline itk::RegistrationProfiler::Pointer mexCreateProfiler(const mxArray * opts, bool outputRequested)
+{
+   if ( outputRequested || mexGetScalarOption(opts, "profile", 0.0) != 0
+        || !mexGetStringOption(opts, "profile_log", "").empty() )
+   {
+      return itk::RegistrationProfiler::New();
+   }
+   return NULL;
+}
+
+// Times the consecutive phases of a MEX function: Lap records the time
+// since the previous lap (or the construction) under the given phase
+class mexPhaseTimer
+{
+public:
+   mexPhaseTimer(itk::RegistrationProfiler * profiler)
+      : m_Profiler(profiler), m_Start(0.0)
+   {
+      if ( m_Profiler )
+      {
+         m_Start = itk::RegistrationProfiler::GetTime();
+      }
+   }
+
+   void Lap(const char * phase)
+   {
+      if ( m_Profiler )
+      {
+         const double now = itk::RegistrationProfiler::GetTime();
+         m_Profiler->AddTime(phase, now - m_Start);
+         m_Start = now;
+      }
+   }
+
+private:
+   itk::RegistrationProfiler *  m_Profiler;
+   double                       m_Start;
+};
+
+inline mxArray * mexCreateProfileStruct(const itk::RegistrationProfiler * profiler)
+{
+   typedef itk::RegistrationProfiler::PhaseMapType    PhaseMapType;
+   typedef itk::RegistrationProfiler::CounterMapType  CounterMapType;
+
+   mxArray * phases = mxCreateStructMatrix(1, 1, 0, NULL);
+   mxArray * calls = mxCreateStructMatrix(1, 1, 0, NULL);
+   mxArray * counters = mxCreateStructMatrix(1, 1, 0, NULL);
+   const PhaseMapType & phaseMap = profiler->GetPhases();
+   for (PhaseMapType::const_iterator it=phaseMap.begin(); it!=phaseMap.end(); ++it)
+   {
+      mxSetFieldByNumber(phases, 0, mxAddField(phases, it->first.c_str()),
+         mxCreateDoubleScalar(it->second.m_Seconds));
+      mxSetFieldByNumber(calls, 0, mxAddField(calls, it->first.c_str()),
+         mxCreateDoubleScalar(static_cast<double>(it->second.m_Calls)));
+   }
+   const CounterMapType & counterMap = profiler->GetCounters();
+   for (CounterMapType::const_iterator it=counterMap.begin(); it!=counterMap.end(); ++it)
+   {
+      mxSetFieldByNumber(counters, 0, mxAddField(counters, it->first.c_str()),
+         mxCreateDoubleScalar(it->second));
+   }
+
+   const char * fieldnames[] = { "phases", "calls", "counters" };
+   mxArray * profile = mxCreateStructMatrix(1, 1, 3, fieldnames);
+   mxSetFieldByNumber(profile, 0, 0, phases);
+   mxSetFieldByNumber(profile, 0, 1, calls);
+   mxSetFieldByNumber(profile, 0, 2, counters);
+   return profile;
+}
+
+// Append the profile to the profile_log file, if any
+inline void mexWriteProfileLog(const itk::RegistrationProfiler * profiler,
+                               const mxArray * opts, const char * function)
+{
+   typedef itk::RegistrationProfiler::PhaseMapType    PhaseMapType;
+   typedef itk::RegistrationProfiler::CounterMapType  CounterMapType;
+
+   const mxArray * field = mexGetOptionField(opts, "profile_log");
+   if ( !profiler || !field || mxIsEmpty(field) )
+   {
+      return;
+   }
+   if ( !mxIsChar(field) )
+   {
+      mexErrMsgTxt("Option profile_log must be a string.");
+   }
+   // the file name is kept as given, mexGetStringOption lowercases
+   char * filename = mxArrayToString(field);
+   FILE * log = std::fopen(filename, "a");
+   mxFree(filename);
+   if ( !log )
+   {
+      mexWarnMsgTxt("Could not open the profile_log file, profile not written.");
+      return;
+   }
+
+   std::fprintf(log, "{\"function\":\"%s\",\"phases\":{", function);
+   const PhaseMapType & phaseMap = profiler->GetPhases();
+   for (PhaseMapType::const_iterator it=phaseMap.begin(); it!=phaseMap.end(); ++it)
+   {
+      std::fprintf(log, "%s\"%s\":{\"seconds\":%.9g,\"calls\":%lu}",
+         it==phaseMap.begin() ? "" : ",", it->first.c_str(),
+         it->second.m_Seconds, it->second.m_Calls);
+   }
+   std::fprintf(log, "},\"counters\":{");
+   const CounterMapType & counterMap = profiler->GetCounters();
+   for (CounterMapType::const_iterator it=counterMap.begin(); it!=counterMap.end(); ++it)
+   {
+      std::fprintf(log, "%s\"%s\":%.17g",
+         it==counterMap.begin() ? "" : ",", it->first.c_str(), it->second);
+   }
+   std::fprintf(log, "}}\n");
+   std::fclose(log);
+}
+
+#endif
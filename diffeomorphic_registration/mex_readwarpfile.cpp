@@ -1,98 +1,284 @@
-//#include "fastcopy.h"
 #include "itkImageFileReader.h"
-#include "itkCommand.h"
+#include "itkImageIOFactory.h"
 #include "itkImage.h"
+#include "itkWarpFieldFile.h"
 
-#include <itkWarpImageFilter.h>
-
-//#include <boost/timer.hpp>
+#include <algorithm>
+#include <string>
 
 #include <mex.h>
 
-template <class MatlabPixelType, unsigned int Dimension>
-void readwarpfile(int nlhs,
-               mxArray *plhs[],
-               int nrhs,
-               const mxArray *prhs[])
+#include "mex_options.h"
+
+// [vx, vy, (vz)] = readwarpfile(filename, (template), (options))
+//   displacement field saved by writewarpfile. The outputs have the class
+//   of the template array, if given (its size must be that of the field),
+//   or of the class option.
+// info = readwarpfile(filename, 'info')
+//   struct with the size, spacing, origin and direction of the field, read
+//   from the header only.
+//
+// A .bflwarp file is mapped into memory, and only the blocks holding the
+// slices asked for are read (and inflated and checked, in parallel):
+// MATLAB arrays cannot wrap the mapping, but the copy into the outputs
+// is the only pass over the values. Other files are read by ITK.
+//
+// Options:
+//   class        'single' (default) or 'double'
+//   slices       [first last], 1-based range of slices along the last axis
+//                to read (default: all)
+//   verify       check the checksums of the blocks read (default 1)
+//   num_threads  threads reading the blocks (default: ITK default)
+
+// Slices [first, last) along the last axis from the slices option
+template <unsigned int Dimension, class TSize>
+void mexGetSliceRange(const mxArray * opts, const TSize & size, unsigned long & first, unsigned long & last)
 {
-   typedef int PixelType;
-   typedef itk::Image< PixelType, Dimension >           ImageType;
- //  mexPrintf("the dimentsion is ", Dimension);   
- //  typedef                                           PixelType;
-   typedef itk::Vector<PixelType, Dimension>  VectorPixelType;
-   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
+   first = 0;
+   last = size[Dimension-1];
+   const mxArray * slices = mexGetOptionField(opts, "slices");
+   if ( !slices || mxIsEmpty(slices) )
+   {
+      return;
+   }
+   if ( !mxIsDouble(slices) || mxIsComplex(slices) || mxGetNumberOfElements(slices) != 2 )
+   {
+      mexErrMsgTxt("Option slices must be [first last].");
+   }
+   const double * range = mxGetPr(slices);
+   if ( range[0] < 1 || range[1] < range[0] || range[1] > last
+        || range[0] != static_cast<double>( static_cast<unsigned long>( range[0] ) )
+        || range[1] != static_cast<double>( static_cast<unsigned long>( range[1] ) ) )
+   {
+      mexErrMsgTxt("Option slices must be integers within the field.");
+   }
+   first = static_cast<unsigned long>( range[0] ) - 1;
+   last = static_cast<unsigned long>( range[1] );
+}
 
-   typedef itk::WarpImageFilter
-      <ImageType, ImageType, DeformationFieldType>      WarperType;
-   mexPrintf("input number is: %d", nrhs);
-   mexPrintf("output parameternumber is: %d", nlhs);
- // mexPrintf("the dimentsion is :%d", Dimension); 
-   //boost::timer timer;
-   typename DeformationFieldType::SizeType       size;
-   typename DeformationFieldType::IndexType      start;
-   unsigned int numPix(1u);
-   char * inputDfFilename; 
+// New MATLAB arrays of the slices [first, last) of a field of the given
+// size, one per component
+template <unsigned int Dimension, class TSize>
+void mexCreateFieldArrays(const TSize & size, unsigned long first, unsigned long last,
+                          mxClassID classID, mxArray * plhs[])
+{
    mwSize matlabdims[Dimension];
-
-// here, we should read image parameter
    for (unsigned int d=0; d<Dimension; d++)
    {
-      matlabdims[d]= mxGetDimensions(prhs[1])[d];
-      size[d] = matlabdims[d];
-      start[d] = 0;
-      numPix *= size[d];
-
-//    inptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[d]));
-   }
-   inputDfFilename = mxArrayToString(prhs[0]);
-   mexPrintf("output file name is %s", inputDfFilename);
-   typename itk::ImageFileReader<DeformationFieldType>::Pointer df_reader = itk::ImageFileReader<DeformationFieldType>::New();
-   df_reader->SetFileName(inputDfFilename);
-   df_reader->Update();
-
-   // Allocate images and deformation field
-   typename ImageType::Pointer image
-      = ImageType::New();
-   typename DeformationFieldType::Pointer field = DeformationFieldType::New();
-//  typename DeformationFieldType::Pointer field = 0; 
-   typename DeformationFieldType::SpacingType spacing;
-   spacing.Fill( 1.0 );
-   
-   typename DeformationFieldType::PointType origin;
-   origin.Fill( 0.0 );
-   
-   typename DeformationFieldType::RegionType     region;
-   field = df_reader->GetOutput();
-
-
-   region = field->GetLargestPossibleRegion();
-
-// initialize output point
-   const mxClassID classID = mxGetClassID(prhs[1]);
-   MatlabPixelType * fieldoutptrs[Dimension];
+      matlabdims[d] = size[d];
+   }
+   matlabdims[Dimension-1] = last - first;
    for (unsigned int d=0; d<Dimension; d++)
    {
-      plhs[d] = mxCreateNumericArray(
-         Dimension, matlabdims, classID, mxREAL);
+      plhs[d] = mxCreateNumericArray( Dimension, matlabdims, classID, mxREAL );
+   }
+}
 
-      fieldoutptrs[d] = static_cast<MatlabPixelType *>(mxGetData(plhs[d]));
+// Struct of the geometry of a field
+template <unsigned int Dimension, class TSize, class TSpacing, class TPoint, class TDirection>
+mxArray * mexCreateFieldInfo(const TSize & size, const TSpacing & spacing, const TPoint & origin,
+                             const TDirection & direction, const char * format)
+{
+   const char * fieldnames[] = { "size", "spacing", "origin", "direction", "format" };
+   mxArray * info = mxCreateStructMatrix( 1, 1, 5, fieldnames );
+
+   mxArray * sizeArray = mxCreateDoubleMatrix( 1, Dimension, mxREAL );
+   mxArray * spacingArray = mxCreateDoubleMatrix( 1, Dimension, mxREAL );
+   mxArray * originArray = mxCreateDoubleMatrix( 1, Dimension, mxREAL );
+   mxArray * directionArray = mxCreateDoubleMatrix( Dimension, Dimension, mxREAL );
+   for (unsigned int i=0; i<Dimension; i++)
+   {
+      mxGetPr(sizeArray)[i] = size[i];
+      mxGetPr(spacingArray)[i] = spacing[i];
+      mxGetPr(originArray)[i] = origin[i];
+      for (unsigned int j=0; j<Dimension; j++)
+      {
+         mxGetPr(directionArray)[i + Dimension*j] = direction[i][j];
+      }
    }
+   mxSetField( info, 0, "size", sizeArray );
+   mxSetField( info, 0, "spacing", spacingArray );
+   mxSetField( info, 0, "origin", originArray );
+   mxSetField( info, 0, "direction", directionArray );
+   mxSetField( info, 0, "format", mxCreateString(format) );
+   return info;
+}
 
+template <class MatlabPixelType, unsigned int Dimension>
+void readnativefield(mxArray *plhs[],
+                     const std::string & filename,
+                     bool infoRequested,
+                     mxClassID classID,
+                     const mxArray * templateArray,
+                     const mxArray * opts)
+{
+   typedef itk::WarpFieldFile<Dimension>                WarpFieldFileType;
+
+   typename WarpFieldFileType::Pointer file = WarpFieldFileType::New();
+   file->SetFileName( filename );
+   file->SetVerifyChecksums( mexGetScalarOption(opts, "verify", 1.0) != 0 );
+   file->SetNumberOfThreads( mexGetNumberOfThreads(opts) );
+   try
+   {
+      file->Open();
+   }
+   catch( itk::ExceptionObject & err )
+   {
+      mexErrMsgTxt( err.GetDescription() );
+   }
+
+   const typename WarpFieldFileType::SizeType & size = file->GetSize();
+   if ( infoRequested )
+   {
+      plhs[0] = mexCreateFieldInfo<Dimension>( size, file->GetSpacing(), file->GetOrigin(),
+                                               file->GetDirection(), "bflwarp" );
+      return;
+   }
+   if ( templateArray )
+   {
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         if ( mxGetDimensions(templateArray)[d] != size[d] )
+         {
+            mexErrMsgTxt("The template must have the size of the field.");
+         }
+      }
+   }
+
+   unsigned long first;
+   unsigned long last;
+   mexGetSliceRange<Dimension>( opts, size, first, last );
+   const unsigned long slicePixels = file->GetNumberOfPixels() / std::max( 1ul, static_cast<unsigned long>( size[Dimension-1] ) );
+
+   mexCreateFieldArrays<Dimension>( size, first, last, classID, plhs );
+   MatlabPixelType * outputs[Dimension];
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      outputs[d] = static_cast<MatlabPixelType *>(mxGetData(plhs[d]));
+   }
+
+   try
+   {
+      file->ReadComponents( first * slicePixels, ( last - first ) * slicePixels, outputs );
+   }
+   catch( itk::ExceptionObject & err )
+   {
+      mexErrMsgTxt( err.GetDescription() );
+   }
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+void readitkfield(mxArray *plhs[],
+                  const std::string & filename,
+                  bool infoRequested,
+                  mxClassID classID,
+                  const mxArray * templateArray,
+                  const mxArray * opts)
+{
+   typedef float                                        VectorComponentType;
+   typedef itk::Vector<VectorComponentType, Dimension>  VectorPixelType;
+   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
 
-// read field
-   VectorPixelType * fieldptr = field->GetBufferPointer();
-   const VectorPixelType * const buff_end = fieldptr + numPix;
- 
+   typename itk::ImageFileReader<DeformationFieldType>::Pointer reader = itk::ImageFileReader<DeformationFieldType>::New();
+   reader->SetFileName( filename.c_str() );
+   try
+   {
+      if ( infoRequested )
+      {
+         reader->UpdateOutputInformation();
+      }
+      else
+      {
+         reader->Update();
+      }
+   }
+   catch( itk::ExceptionObject & err )
+   {
+      mexErrMsgTxt( err.GetDescription() );
+   }
 
-     while ( fieldptr != buff_end )
+   const DeformationFieldType * field = reader->GetOutput();
+   const typename DeformationFieldType::SizeType size = field->GetLargestPossibleRegion().GetSize();
+   if ( infoRequested )
+   {
+      plhs[0] = mexCreateFieldInfo<Dimension>( size, field->GetSpacing(), field->GetOrigin(),
+                                               field->GetDirection(), "itk" );
+      return;
+   }
+   if ( templateArray )
    {
       for (unsigned int d=0; d<Dimension; d++)
       {
-         *(fieldoutptrs[d])++ = (*fieldptr)[d];
+         if ( mxGetDimensions(templateArray)[d] != size[d] )
+         {
+            mexErrMsgTxt("The template must have the size of the field.");
+         }
       }
-      ++fieldptr;
    }
 
+   unsigned long first;
+   unsigned long last;
+   mexGetSliceRange<Dimension>( opts, size, first, last );
+   const unsigned long slicePixels = field->GetLargestPossibleRegion().GetNumberOfPixels()
+      / std::max( 1ul, static_cast<unsigned long>( size[Dimension-1] ) );
+
+   // Split the slices into the components
+   mexCreateFieldArrays<Dimension>( size, first, last, classID, plhs );
+   const VectorPixelType * fieldptr = field->GetBufferPointer() + first * slicePixels;
+   const unsigned long numPix = ( last - first ) * slicePixels;
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      MatlabPixelType * outptr = static_cast<MatlabPixelType *>(mxGetData(plhs[d]));
+      for (unsigned long i=0; i<numPix; i++)
+      {
+         outptr[i] = fieldptr[i][d];
+      }
+   }
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+void readwarpfile(mxArray *plhs[],
+                  const std::string & filename,
+                  bool infoRequested,
+                  mxClassID classID,
+                  const mxArray * templateArray,
+                  const mxArray * opts)
+{
+   if ( itk::WarpFieldFile<Dimension>::HasWarpFieldExtension( filename ) )
+   {
+      readnativefield<MatlabPixelType, Dimension>( plhs, filename, infoRequested, classID, templateArray, opts );
+   }
+   else
+   {
+      readitkfield<MatlabPixelType, Dimension>( plhs, filename, infoRequested, classID, templateArray, opts );
+   }
+}
+
+// Dimension of the field of a file, from its header
+unsigned int readDimension(const std::string & filename)
+{
+   try
+   {
+      if ( itk::WarpFieldFile<3>::HasWarpFieldExtension( filename ) )
+      {
+         return itk::WarpFieldFile<3>::ReadDimension( filename );
+      }
+
+      itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO(
+         filename.c_str(), itk::ImageIOFactory::ReadMode );
+      if ( !io )
+      {
+         mexErrMsgTxt(("Cannot read " + filename + ".").c_str());
+      }
+      io->SetFileName( filename.c_str() );
+      io->ReadImageInformation();
+      return io->GetNumberOfDimensions();
+   }
+   catch( itk::ExceptionObject & err )
+   {
+      mexErrMsgTxt( err.GetDescription() );
+   }
+   return 0;
 }
 
 
@@ -101,42 +287,53 @@ void mexFunction(int nlhs,
                  int nrhs,
                  const mxArray *prhs[])
 {
+   /* The options struct may be omitted. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+
    /* Check for proper number of arguments. */
-   if (nrhs!=2)
+   if ( nargs < 1 || nargs > 2 || !mxIsChar(prhs[0]) )
    {
-      mexErrMsgTxt("2 input required.");
+      mexErrMsgTxt("Usage: [vx, vy, (vz)] = readwarpfile(filename, (template), (options)) or info = readwarpfile(filename, 'info')");
    }
+   char * buffer = mxArrayToString(prhs[0]);
+   const std::string filename(buffer);
+   mxFree(buffer);
 
-   const int dim=nlhs;
-
-   const mxClassID classID = mxGetClassID(prhs[1]);
-
-   /* The inputs must be noncomplex double matrices.*/
-
-   for (int n=1; n<nrhs-1; n++)
+   bool infoRequested = false;
+   const mxArray * templateArray = NULL;
+   mxClassID classID = mexGetStringOption(opts, "class", "single") == "double" ? mxDOUBLE_CLASS : mxSINGLE_CLASS;
+   if ( nargs == 2 )
    {
-      if ( mxGetClassID(prhs[n])!=classID || mxIsComplex(prhs[n]) )
+      if ( mxIsChar(prhs[1]) )
       {
-         mexErrMsgTxt("Input must be a noncomplex floating point.");
+         buffer = mxArrayToString(prhs[1]);
+         infoRequested = ( std::string(buffer) == "info" );
+         mxFree(buffer);
+         if ( !infoRequested )
+         {
+            mexErrMsgTxt("The second input must be a template array or 'info'.");
+         }
       }
-
-//      if ( mxGetNumberOfDimensions(prhs[n]) != dim )
-    //  {
-  //       mexErrMsgTxt("The dimension of the  must agree with the number of inputs.");
-    //  }
-
-      for (int dd=0; dd<dim; dd++)
+      else
       {
-         if ( mxGetDimensions(prhs[n])[dd] != mxGetDimensions(prhs[0])[dd] )
+         templateArray = prhs[1];
+         classID = mxGetClassID(templateArray);
+         if ( classID != mxSINGLE_CLASS && classID != mxDOUBLE_CLASS )
          {
-            mexErrMsgTxt("Inputs must have the same size.");
+            mexErrMsgTxt("Pixel type unsupported.");
          }
       }
    }
 
-   if (nlhs != 3)
+   const unsigned int dim = readDimension( filename );
+   if ( infoRequested ? nlhs > 1 : nlhs != static_cast<int>(dim) )
+   {
+      mexErrMsgTxt("Number of outputs must agree with the dimension of the field.");
+   }
+   if ( templateArray && mxGetNumberOfDimensions(templateArray) != dim )
    {
-      mexErrMsgTxt("Number of outputs must be 3.");
+      mexErrMsgTxt("The template must have the dimension of the field.");
    }
 
    switch ( dim )
@@ -144,28 +341,21 @@ void mexFunction(int nlhs,
    case 2:
       switch ( classID )
       {
-         case mxSINGLE_CLASS:    
-            readwarpfile<float,2>(nlhs, plhs, nrhs, prhs);
-            break;
-         case mxDOUBLE_CLASS:
-            readwarpfile<double,2>(nlhs, plhs, nrhs, prhs);
+         case mxSINGLE_CLASS:
+            readwarpfile<float,2>(plhs, filename, infoRequested, classID, templateArray, opts);
             break;
          default:
-            mexErrMsgTxt("Pixel type unsupported.");
+            readwarpfile<double,2>(plhs, filename, infoRequested, classID, templateArray, opts);
       }
       break;
    case 3:
       switch ( classID )
       {
-      //   std:cout<<"classID: "<<classID<<std::endl;
-         case mxSINGLE_CLASS:    
-            readwarpfile<float,3>(nlhs, plhs, nrhs, prhs);
-            break;
-         case mxDOUBLE_CLASS:
-            readwarpfile<double,3>(nlhs, plhs, nrhs, prhs);
+         case mxSINGLE_CLASS:
+            readwarpfile<float,3>(plhs, filename, infoRequested, classID, templateArray, opts);
             break;
          default:
-            mexErrMsgTxt("Pixel type unsupported.");
+            readwarpfile<double,3>(plhs, filename, infoRequested, classID, templateArray, opts);
       }
       break;
    default:
@@ -174,5 +364,3 @@ void mexFunction(int nlhs,
 
    return;
 }
-
-
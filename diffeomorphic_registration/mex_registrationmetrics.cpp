@@ -0,0 +1,167 @@
+#include "itkRegistrationMetricsCalculator.h"
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// stats = registrationmetrics(fix_im, mov_im, def_x, def_y, def_z, invdef_x, invdef_y, invdef_z, options)
+//
+// The statistics make_update in invconstdemonsreg3d_aux.m computes with
+// warplabelimage, deffieldharmonicenergy and deffieldjacobiandeterminant,
+// in one threaded pass (see itk::RegistrationMetricsCalculator): a struct
+// with the fields MSE, backMSE, harmoEner, backharmoEner, negJacRatio and
+// backnegJacRatio, as returned by demonsiteration. Without the inverse
+// field only MSE, harmoEner and negJacRatio are returned. options may hold
+// num_threads.
+template <class MatlabPixelType, unsigned int Dimension>
+void registrationmetrics(int nlhs,
+                         mxArray *plhs[],
+                         int nrhs,
+                         const mxArray *prhs[])
+{
+   typedef float PixelType;
+   typedef itk::Image< PixelType, Dimension >           ImageType;
+
+   typedef float                                        VectorComponentType;
+   typedef itk::Vector<VectorComponentType, Dimension>  VectorPixelType;
+   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
+
+   typedef itk::RegistrationMetricsCalculator
+      <ImageType,DeformationFieldType>                  MetricsCalculatorType;
+
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+   const bool inverse = ( mexGetNumberOfArguments(nrhs, prhs) == 2+2*static_cast<int>(Dimension) );
+
+   // The images wrap the MATLAB buffers when they are single, the fields
+   // are interleaved
+   typename ImageType::Pointer fixedimage =
+      mexImportImage<ImageType, MatlabPixelType>( prhs[0] );
+   typename ImageType::Pointer movingimage =
+      mexImportImage<ImageType, MatlabPixelType>( prhs[1] );
+   typename DeformationFieldType::Pointer field =
+      mexImportField<DeformationFieldType, MatlabPixelType>( prhs+2 );
+   typename DeformationFieldType::Pointer inversefield;
+   if ( inverse )
+   {
+      inversefield = mexImportField<DeformationFieldType, MatlabPixelType>( prhs+2+Dimension );
+   }
+
+   typename MetricsCalculatorType::Pointer calculator = MetricsCalculatorType::New();
+   calculator->SetFixedImage( fixedimage );
+   calculator->SetMovingImage( movingimage );
+   calculator->SetDeformationField( field );
+   calculator->SetInverseDeformationField( inversefield );
+   calculator->SetNumberOfThreads( mexGetNumberOfThreads( opts ) );
+   calculator->Compute();
+
+   if ( inverse )
+   {
+      const char * fieldnames[] = { "MSE", "backMSE", "harmoEner",
+         "backharmoEner", "negJacRatio", "backnegJacRatio" };
+      const double values[] = { calculator->GetMSE(), calculator->GetBackMSE(),
+         calculator->GetHarmonicEnergy(), calculator->GetBackHarmonicEnergy(),
+         calculator->GetNegativeJacobianRatio(), calculator->GetBackNegativeJacobianRatio() };
+
+      plhs[0] = mxCreateStructMatrix(1, 1, 6, fieldnames);
+      for (int n=0; n<6; n++)
+      {
+         mxSetFieldByNumber(plhs[0], 0, n, mxCreateDoubleScalar(values[n]));
+      }
+   }
+   else
+   {
+      const char * fieldnames[] = { "MSE", "harmoEner", "negJacRatio" };
+      const double values[] = { calculator->GetMSE(),
+         calculator->GetHarmonicEnergy(), calculator->GetNegativeJacobianRatio() };
+
+      plhs[0] = mxCreateStructMatrix(1, 1, 3, fieldnames);
+      for (int n=0; n<3; n++)
+      {
+         mxSetFieldByNumber(plhs[0], 0, n, mxCreateDoubleScalar(values[n]));
+      }
+   }
+}
+
+
+void mexFunction(int nlhs,
+                 mxArray *plhs[],
+                 int nrhs,
+                 const mxArray *prhs[])
+{
+   /* Check for proper number of arguments. An options struct may follow. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   if (nargs<1 or (mxGetNumberOfDimensions(prhs[0])!=2 and mxGetNumberOfDimensions(prhs[0])!=3))
+   {
+      mexErrMsgTxt("2D or 3D images required.");
+   }
+
+   const int dim=mxGetNumberOfDimensions(prhs[0]);
+   if (nargs!=2+dim and nargs!=2+2*dim)
+   {
+      mexErrMsgTxt("The images and one or two fields required, optionally followed by an options struct.");
+   }
+
+   const mxClassID classID = mxGetClassID(prhs[0]);
+
+   /* The inputs must be noncomplex floating point matrices.*/
+   for (int n=0; n<nargs; n++)
+   {
+      if ( mxGetClassID(prhs[n])!=classID || mxIsComplex(prhs[n]) )
+      {
+         mexErrMsgTxt("Input must be a noncomplex floating point.");
+      }
+
+      if ( mxGetNumberOfDimensions(prhs[n]) != dim )
+      {
+         mexErrMsgTxt("The inputs must all have the same dimension.");
+      }
+
+      for (int dd=0; dd<dim; dd++)
+      {
+         if ( mxGetDimensions(prhs[n])[dd] != mxGetDimensions(prhs[0])[dd] )
+         {
+            mexErrMsgTxt("Inputs must have the same size.");
+         }
+      }
+   }
+
+   if (nlhs > 1)
+   {
+      mexErrMsgTxt("One output at most.");
+   }
+
+   switch ( dim )
+   {
+   case 2:
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            registrationmetrics<float,2>(nlhs, plhs, nrhs, prhs);
+            break;
+         case mxDOUBLE_CLASS:
+            registrationmetrics<double,2>(nlhs, plhs, nrhs, prhs);
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+      break;
+   case 3:
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            registrationmetrics<float,3>(nlhs, plhs, nrhs, prhs);
+            break;
+         case mxDOUBLE_CLASS:
+            registrationmetrics<double,3>(nlhs, plhs, nrhs, prhs);
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+      break;
+   default:
+      mexErrMsgTxt("Dimension unsupported.");
+   }
+
+   return;
+}
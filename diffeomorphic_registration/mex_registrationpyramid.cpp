@@ -0,0 +1,277 @@
+#include "itkRegistrationPyramid.h"
+
+#include <string>
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// levels = registrationpyramid('image', image, numlevels, (options))
+//   cell array of the numlevels levels of the image, the image itself
+//   first, each half the size of the previous one (rounded down).
+// [ux,uy,(uz)] = registrationpyramid('downsample_field', vx, vy, (vz), (options))
+//   field on the next coarser level, decimated and halved.
+// [ux,uy,(uz)] = registrationpyramid('upsample_field', vx, vy, (vz), size, (options))
+//   field interpolated trilinearly on the finer level of the given size,
+//   and doubled, as the upscale of BFL_pairwise_reg3D.
+//
+// See itk::RegistrationPyramid. Images and fields are resampled in the
+// class of the inputs, single or double, and the outputs have that class.
+//
+// Options:
+//   mode             'label' keeps every other voxel (default), 'smooth'
+//                    smooths by a Gaussian first, for intensities and
+//                    signed distance maps only: label images must keep
+//                    'label' (BFL_pairwise_reg3D smooths their SDMs through
+//                    the sdm_pyramid option instead)
+//   smoothing_sigma  standard deviation of the Gaussian, in voxels of the
+//                    finer level (default 1)
+//   num_threads      threads used (default: ITK default)
+
+template <class PixelType, unsigned int Dimension>
+struct RegistrationPyramidTypes
+{
+   typedef itk::Image<PixelType, Dimension>             ImageType;
+   typedef itk::Vector<PixelType, Dimension>            VectorPixelType;
+   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
+   typedef itk::RegistrationPyramid<ImageType, DeformationFieldType> PyramidType;
+};
+
+template <class PixelType, unsigned int Dimension>
+typename RegistrationPyramidTypes<PixelType, Dimension>::PyramidType::Pointer
+CreateRegistrationPyramid(const mxArray * opts)
+{
+   typedef typename RegistrationPyramidTypes<PixelType, Dimension>::PyramidType PyramidType;
+
+   const double sigma = mexGetScalarOption(opts, "smoothing_sigma", 1.0);
+   if ( sigma < 0 )
+   {
+      mexErrMsgTxt("Option smoothing_sigma must be non-negative.");
+   }
+
+   typename PyramidType::Pointer pyramid = PyramidType::New();
+   pyramid->SetSmoothingSigma( sigma );
+   pyramid->SetNumberOfThreads( mexGetNumberOfThreads( opts ) );
+   return pyramid;
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+void imagepyramid(mxArray *plhs[],
+                  const mxArray * image,
+                  unsigned int numberOfLevels,
+                  const mxArray * opts)
+{
+   typedef typename RegistrationPyramidTypes<MatlabPixelType, Dimension>::ImageType   ImageType;
+   typedef typename RegistrationPyramidTypes<MatlabPixelType, Dimension>::PyramidType PyramidType;
+
+   const std::string mode = mexGetStringOption(opts, "mode", "label");
+   if ( mode != "label" && mode != "smooth" )
+   {
+      mexErrMsgTxt("Option mode must be 'label' or 'smooth'.");
+   }
+
+   typename PyramidType::Pointer pyramid = CreateRegistrationPyramid<MatlabPixelType, Dimension>( opts );
+
+   // The image wraps the MATLAB buffer
+   typename ImageType::Pointer input = mexImportImage<ImageType, MatlabPixelType>( image );
+
+   plhs[0] = mxCreateCellMatrix( numberOfLevels, 1 );
+   mxSetCell( plhs[0], 0, mxDuplicateArray(image) );
+
+   typename ImageType::ConstPointer level = input.GetPointer();
+   for (unsigned int l=1; l<numberOfLevels; l++)
+   {
+      typename ImageType::Pointer coarser = pyramid->DownsampleImage( level,
+         mode == "smooth" ? PyramidType::SmoothMode : PyramidType::LabelMode );
+      mxSetCell( plhs[0], l, mexExportImage<MatlabPixelType>( coarser.GetPointer(), mxGetClassID(image) ) );
+      level = coarser.GetPointer();
+   }
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+void fieldpyramid(mxArray *plhs[],
+                  const mxArray * const fieldArrays[],
+                  const mxArray * size,
+                  const mxArray * opts)
+{
+   typedef typename RegistrationPyramidTypes<MatlabPixelType, Dimension>::DeformationFieldType DeformationFieldType;
+   typedef typename RegistrationPyramidTypes<MatlabPixelType, Dimension>::PyramidType          PyramidType;
+
+   typename PyramidType::Pointer pyramid = CreateRegistrationPyramid<MatlabPixelType, Dimension>( opts );
+
+   // Interleave the field components
+   typename DeformationFieldType::Pointer field =
+      mexImportField<DeformationFieldType, MatlabPixelType>( fieldArrays );
+
+   typename DeformationFieldType::Pointer output;
+   if ( size )
+   {
+      typename PyramidType::SizeType outputSize;
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         const double length = mxGetPr(size)[d];
+         if ( length < 1 || length != static_cast<double>( static_cast<unsigned long>( length ) ) )
+         {
+            mexErrMsgTxt("The size must be positive integers.");
+         }
+         outputSize[d] = static_cast<unsigned long>( length );
+      }
+      output = pyramid->UpsampleField( field, outputSize );
+   }
+   else
+   {
+      output = pyramid->DownsampleField( field );
+   }
+
+   // Allocate outputs and copy the result
+   mexExportField<MatlabPixelType>( output.GetPointer(), mxGetClassID(fieldArrays[0]), plhs );
+}
+
+// The inputs must be noncomplex floating point arrays of dim dimensions
+// and of the same size
+void checkInputs(const mxArray * const inputs[], int numberOfInputs, int dim)
+{
+   const mxClassID classID = mxGetClassID(inputs[0]);
+   if ( classID != mxSINGLE_CLASS && classID != mxDOUBLE_CLASS )
+   {
+      mexErrMsgTxt("Pixel type unsupported.");
+   }
+   if ( dim != 2 && dim != 3 )
+   {
+      mexErrMsgTxt("Dimension unsupported.");
+   }
+   for (int n=0; n<numberOfInputs; n++)
+   {
+      if ( mxGetClassID(inputs[n])!=classID || mxIsComplex(inputs[n]) )
+      {
+         mexErrMsgTxt("Input must be a noncomplex floating point.");
+      }
+
+      if ( mxGetNumberOfDimensions(inputs[n]) != dim )
+      {
+         mexErrMsgTxt("The dimension of the inputs must agree with the number of inputs.");
+      }
+
+      for (int dd=0; dd<dim; dd++)
+      {
+         if ( mxGetDimensions(inputs[n])[dd] != mxGetDimensions(inputs[0])[dd] )
+         {
+            mexErrMsgTxt("Inputs must have the same size.");
+         }
+      }
+   }
+}
+
+
+void mexFunction(int nlhs,
+                 mxArray *plhs[],
+                 int nrhs,
+                 const mxArray *prhs[])
+{
+   if ( nrhs < 1 || !mxIsChar(prhs[0]) )
+   {
+      mexErrMsgTxt("The first input must be a command: 'image', 'downsample_field' or 'upsample_field'.");
+   }
+   char * buffer = mxArrayToString(prhs[0]);
+   const std::string command(buffer);
+   mxFree(buffer);
+
+   /* The options struct may be omitted. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+
+   if ( command == "image" )
+   {
+      if ( nargs != 3 || nlhs > 1 )
+      {
+         mexErrMsgTxt("Usage: levels = registrationpyramid('image', image, numlevels, (options))");
+      }
+      const int dim = mxGetNumberOfDimensions(prhs[1]);
+      checkInputs( prhs+1, 1, dim );
+
+      const double numberOfLevels = mxGetScalar(prhs[2]);
+      if ( numberOfLevels < 1 || numberOfLevels != static_cast<double>( static_cast<unsigned int>( numberOfLevels ) ) )
+      {
+         mexErrMsgTxt("The number of levels must be a positive integer.");
+      }
+      const unsigned int levels = static_cast<unsigned int>( numberOfLevels );
+
+      if ( mxGetClassID(prhs[1]) == mxSINGLE_CLASS )
+      {
+         if ( dim == 2 )
+         {
+            imagepyramid<float,2>( plhs, prhs[1], levels, opts );
+         }
+         else
+         {
+            imagepyramid<float,3>( plhs, prhs[1], levels, opts );
+         }
+      }
+      else
+      {
+         if ( dim == 2 )
+         {
+            imagepyramid<double,2>( plhs, prhs[1], levels, opts );
+         }
+         else
+         {
+            imagepyramid<double,3>( plhs, prhs[1], levels, opts );
+         }
+      }
+   }
+   else if ( command == "downsample_field" || command == "upsample_field" )
+   {
+      const bool upsample = ( command == "upsample_field" );
+      const int dim = upsample ? nargs-2 : nargs-1;
+      if ( dim != 2 && dim != 3 )
+      {
+         mexErrMsgTxt(upsample ? "Usage: [ux,uy,(uz)] = registrationpyramid('upsample_field', vx, vy, (vz), size, (options))"
+                               : "Usage: [ux,uy,(uz)] = registrationpyramid('downsample_field', vx, vy, (vz), (options))");
+      }
+      if ( nlhs != dim )
+      {
+         mexErrMsgTxt("Number of outputs must agree with the dimension of the field.");
+      }
+      checkInputs( prhs+1, dim, dim );
+
+      const mxArray * size = NULL;
+      if ( upsample )
+      {
+         size = prhs[dim+1];
+         if ( !mxIsDouble(size) || mxIsComplex(size) || mxGetNumberOfElements(size) != static_cast<size_t>(dim) )
+         {
+            mexErrMsgTxt("The size must be a real double vector with one element per dimension.");
+         }
+      }
+
+      if ( mxGetClassID(prhs[1]) == mxSINGLE_CLASS )
+      {
+         if ( dim == 2 )
+         {
+            fieldpyramid<float,2>( plhs, prhs+1, size, opts );
+         }
+         else
+         {
+            fieldpyramid<float,3>( plhs, prhs+1, size, opts );
+         }
+      }
+      else
+      {
+         if ( dim == 2 )
+         {
+            fieldpyramid<double,2>( plhs, prhs+1, size, opts );
+         }
+         else
+         {
+            fieldpyramid<double,3>( plhs, prhs+1, size, opts );
+         }
+      }
+   }
+   else
+   {
+      mexErrMsgTxt(("Unknown command " + command + ".").c_str());
+   }
+
+   return;
+}
@@ -0,0 +1,98 @@
+#ifndef __mex_tiledwarp_h
+#define __mex_tiledwarp_h
+
+// Warping of an image by slabs of slices along its last axis (z in 3-D),
+// for the memory_budget option of warpimage and warplabelimage.
+//
+// Each slab of the output is computed from the slab of the deformation
+// field and from the slices of the image its displacements reach, plus one
+// on each side, so that no interpolation and no inside test sees the cut:
+// the output is the same as warping the whole image at once. The slabs are
+// sized so that the interleaved field, the output and the image slices of
+// a slab fit in the budget; a slab whose displacements reach far along z
+// may hold more image slices.
+
+#include <algorithm>
+#include <cmath>
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// Memory budget in bytes of the memory_budget option, in megabytes; 0 (the
+// default) warps the whole image at once
+inline double mexGetMemoryBudget(const mxArray * opts)
+{
+   const double budget = mexGetScalarOption(opts, "memory_budget", 0.0);
+   if ( budget < 0 )
+   {
+      mexErrMsgTxt("Option memory_budget must be non-negative.");
+   }
+   return budget * 1024.0 * 1024.0;
+}
+
+// Warp the MATLAB image by the MATLAB field into output, a MATLAB array of
+// the size of the image. warper has its interpolator, edge padding and
+// output geometry set.
+template <class MatlabPixelType, class TWarper>
+void mexTiledWarp(TWarper * warper, const mxArray * image, const mxArray * const fieldArrays[],
+                  double budget, mxArray * output)
+{
+   typedef typename TWarper::InputImageType       ImageType;
+   typedef typename TWarper::OutputImageType      OutputImageType;
+   typedef typename TWarper::DeformationFieldType DeformationFieldType;
+   typedef typename DeformationFieldType::PixelType VectorPixelType;
+   const unsigned int Dimension = ImageType::ImageDimension;
+   const unsigned int axis = Dimension-1;
+
+   const size_t numberOfSlices = mxGetDimensions(image)[axis];
+   const size_t numPix = mxGetNumberOfElements(image);
+   if ( numPix == 0 )
+   {
+      return;
+   }
+   const size_t slicePixels = numPix / numberOfSlices;
+
+   const double sliceBytes = static_cast<double>( slicePixels ) *
+      ( sizeof(VectorPixelType) + sizeof(typename OutputImageType::PixelType) + sizeof(typename ImageType::PixelType) );
+   const size_t slabSlices = std::max( 1.0, std::floor( budget / sliceBytes ) );
+
+   const MatlabPixelType * displacement = static_cast<const MatlabPixelType *>( mxGetData(fieldArrays[axis]) );
+   MatlabPixelType * outptr = static_cast<MatlabPixelType *>( mxGetData(output) );
+
+   for (size_t first=0; first<numberOfSlices; first+=slabSlices)
+   {
+      const size_t count = std::min( slabSlices, numberOfSlices - first );
+
+      // slices of the image reached from the slab, as the warper computes
+      // the locations
+      double lowest = static_cast<double>( numberOfSlices );
+      double highest = -1.0;
+      for (size_t n=0; n<count*slicePixels; n++)
+      {
+         const double location = static_cast<double>( first + n/slicePixels )
+            + static_cast<double>( static_cast<float>( displacement[first*slicePixels + n] ) );
+         lowest = std::min( lowest, location );
+         highest = std::max( highest, location );
+      }
+      const double last = static_cast<double>( numberOfSlices - 1 );
+      const size_t inputFirst = static_cast<size_t>( std::max( 0.0, std::min( last, std::floor( lowest ) - 1.0 ) ) );
+      const size_t inputLast = static_cast<size_t>( std::max( static_cast<double>( inputFirst ),
+         std::min( last, std::ceil( highest ) + 1.0 ) ) );
+
+      typename ImageType::Pointer inputSlab =
+         mexImportImageSlab<ImageType, MatlabPixelType>( image, inputFirst, inputLast - inputFirst + 1 );
+      typename DeformationFieldType::Pointer fieldSlab =
+         mexImportFieldSlab<DeformationFieldType, MatlabPixelType>( fieldArrays, first, count );
+
+      warper->SetInput( inputSlab );
+      warper->SetDeformationField( fieldSlab );
+      warper->UpdateLargestPossibleRegion();
+
+      const typename OutputImageType::PixelType * ptr = warper->GetOutput()->GetBufferPointer();
+      std::copy( ptr, ptr + count*slicePixels, outptr + first*slicePixels );
+   }
+}
+
+#endif
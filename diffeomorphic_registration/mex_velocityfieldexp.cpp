@@ -1,11 +1,57 @@
-#include "itkExponentialDeformationFieldImageFilter.h"
+#include "itkJointFieldExponentiator.h"
 
-//#include <boost/timer.hpp>
+#include <algorithm>
 
 #include <dlfcn.h>
 
 #include <mex.h>
 
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// [dx,dy,(dz)] = velocityfieldexp(vx,vy,(vz),(opts)) computes exp(v);
+// with twice as many outputs, [dx,dy,(dz),ix,iy,(iz)], exp(-v) too, sharing
+// the number of squarings and the sweeps over the field.
+//
+// Incremental form, when v is a previous velocity field plus an update u:
+//   [d..., (i...), (info)] = velocityfieldexp(v..., u..., dprev..., (iprev...), (opts))
+// composes exp(v-u) = dprev (and exp(-(v-u)) = iprev, needed for the
+// inverse) with exp(u), which takes few squarings when u is small, see
+// itk::JointFieldExponentiator. It is exact to first order only: the
+// caller recomputes from v (the plain form) from time to time.
+//
+// With the jacobian option, the Jacobian determinants of exp(v) (and
+// exp(-v)) follow the fields, computed in the same threads as
+// deffieldjacobiandeterminant does: [d..., (i...), jac, (invjac), (info)].
+//
+// The optional last output info has the fields incremental and iterations
+// (squarings done), and with the check_drift option the maximum and mean
+// norm of the difference to a full computation from v: max_error,
+// mean_error (and inv_max_error, inv_mean_error for exp(-v)).
+//
+// Options:
+//   num_threads  threads used (default: ITK default)
+//   check_drift  nonzero to compare with a full computation (default 0)
+//   jacobian     nonzero to output the Jacobian determinants (default 0)
+
+// Which of the optional outputs nlhs stands for, false if none matches
+bool velocityfieldexpOutputs(int nlhs, int dim, bool jacobian, bool & inverse, bool & info)
+{
+   for (int inv=0; inv<2; inv++)
+   {
+      for (int inf=0; inf<2; inf++)
+      {
+         if ( nlhs == (1+inv)*dim + (jacobian ? 1+inv : 0) + inf )
+         {
+            inverse = ( inv == 1 );
+            info = ( inf == 1 );
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
 template <class MatlabPixelType, unsigned int Dimension>
 void velocityfieldexp(int nlhs,
                  mxArray *plhs[],
@@ -15,109 +61,122 @@ void velocityfieldexp(int nlhs,
    typedef float                                        VectorComponentType;
    typedef itk::Vector<VectorComponentType, Dimension>  VectorPixelType;
    typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
-   typedef itk::ExponentialDeformationFieldImageFilter
-      <DeformationFieldType, DeformationFieldType>      FieldExponentiatorType;
+   typedef itk::JointFieldExponentiator
+      <DeformationFieldType>                            FieldExponentiatorType;
 
-   //boost::timer timer;
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   const bool incremental = ( nargs >= 3*static_cast<int>(Dimension) );
+   const bool jacobian = ( mexGetScalarOption(opts, "jacobian", 0.0) != 0 );
+   bool computeInverse = false;
+   bool infoRequested = false;
+   velocityfieldexpOutputs(nlhs, Dimension, jacobian, computeInverse, infoRequested);
 
-   // Allocate deformation field
-   typename DeformationFieldType::Pointer field =
-      DeformationFieldType::New();
-   
-   typename DeformationFieldType::SpacingType spacing;
-   spacing.Fill( 1.0 );
-   
-   typename DeformationFieldType::PointType origin;
-   origin.Fill( 0.0 );
-   
-   typename DeformationFieldType::RegionType     region;
-   typename DeformationFieldType::SizeType       size;
-   typename DeformationFieldType::IndexType      start;
-
-   unsigned int numPix(1u);
-   const MatlabPixelType * inptrs[Dimension];
-   mwSize matlabdims[Dimension];
-   for (unsigned int d=0; d<Dimension; d++)
+   if ( incremental && computeInverse && nargs != 4*static_cast<int>(Dimension) )
    {
-      matlabdims[d]= mxGetDimensions(prhs[0])[d];
-      size[d] = matlabdims[d];
-      start[d] = 0;
-      numPix *= size[d];
-
-      inptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[d]));
+      mexErrMsgTxt("The incremental exp(-v) needs the previous inverse field.");
    }
-   
-   region.SetSize( size );
-   region.SetIndex( start );
-   
-   field->SetOrigin( origin );
-   field->SetSpacing( spacing );
-   field->SetRegions( region );
-   field->Allocate();
 
-   //mexPrintf("done field->Allocate(); %f sec\n", timer.elapsed());
-   //timer.restart();
+   // Interleave the field components
+   typename DeformationFieldType::Pointer field =
+      mexImportField<DeformationFieldType, MatlabPixelType>( prhs );
 
-   VectorPixelType * ptr = field->GetBufferPointer();
-   const VectorPixelType * const buff_end = ptr + numPix;
-   
-   while ( ptr != buff_end )
+   // Compute exponential, and the inverse one if asked for
+   typename FieldExponentiatorType::Pointer exponentiator =
+      FieldExponentiatorType::New();
+
+   exponentiator->SetVelocityField( field );
+   exponentiator->SetComputeInverse( computeInverse );
+   exponentiator->SetComputeJacobianDeterminant( jacobian );
+   exponentiator->SetNumberOfThreads( mexGetNumberOfThreads( opts ) );
+   if ( incremental )
    {
-      for (unsigned int d=0; d<Dimension; d++)
+      typename DeformationFieldType::Pointer update =
+         mexImportField<DeformationFieldType, MatlabPixelType>( prhs+Dimension );
+      typename DeformationFieldType::Pointer previous =
+         mexImportField<DeformationFieldType, MatlabPixelType>( prhs+2*Dimension );
+      typename DeformationFieldType::Pointer previousInverse;
+      if ( computeInverse )
       {
-         (*ptr)[d] = *(inptrs[d])++;
+         previousInverse = mexImportField<DeformationFieldType, MatlabPixelType>( prhs+3*Dimension );
       }
-      ++ptr;
+      exponentiator->SetUpdateField( update );
+      exponentiator->SetRecomputeInterval( 0 );
+      exponentiator->SetPreviousDeformationFields( previous, previousInverse );
    }
+   exponentiator->Compute();
 
-   //mexPrintf("done inputs copy %f sec\n", timer.elapsed());
-   //timer.restart();
-   
-   // Compute exponential
-   typename FieldExponentiatorType::Pointer exponentiator =
-      FieldExponentiatorType::New();
-
-   exponentiator->SetInput( field );
-   exponentiator->AutomaticNumberOfIterationsOn();
-   // Just set a high value so that automatic number of step
-   // is not thresholded
-   exponentiator->SetMaximumNumberOfIterations( 2000u );
-
-   exponentiator->UpdateLargestPossibleRegion();
-
-   //mexPrintf("done exponentiator->UpdateLargestPossibleRegion(); %f sec\n", timer.elapsed());
-   //timer.restart();
+   // Free the copies no longer needed before the outputs are allocated:
+   // the workspaces, and the velocity field unless it is compared with
+   // below
+   const bool checkDrift = infoRequested && mexGetScalarOption(opts, "check_drift", 0.0) != 0;
+   exponentiator->ReleaseWorkspace();
+   if ( !checkDrift )
+   {
+      exponentiator->SetVelocityField( NULL );
+      exponentiator->SetUpdateField( NULL );
+      field = NULL;
+   }
 
-   // Allocate outputs
+   // Allocate outputs and copy the result
    const mxClassID classID = mxGetClassID(prhs[0]);
-   MatlabPixelType * outptrs[Dimension];
-   for (unsigned int d=0; d<Dimension; d++)
+   mexExportField<MatlabPixelType>( exponentiator->GetDeformationField(), classID, plhs );
+   if ( computeInverse )
    {
-      plhs[d] = mxCreateNumericArray(
-         Dimension, matlabdims, classID, mxREAL);
+      mexExportField<MatlabPixelType>( exponentiator->GetInverseDeformationField(), classID, plhs+Dimension );
+   }
+   if ( jacobian )
+   {
+      const int first = computeInverse ? 2*Dimension : Dimension;
+      plhs[first] = mexExportImage<MatlabPixelType>( exponentiator->GetJacobianDeterminant(), classID );
+      if ( computeInverse )
+      {
+         plhs[first+1] = mexExportImage<MatlabPixelType>( exponentiator->GetInverseJacobianDeterminant(), classID );
+      }
+   }
 
-      outptrs[d] = static_cast<MatlabPixelType *>(mxGetData(plhs[d]));
+   if ( !infoRequested )
+   {
+      return;
    }
 
-   //mexPrintf("done allocate outputs %f sec\n", timer.elapsed());
-   //timer.restart();
-   
+   const char * fieldnames[] = { "incremental", "iterations",
+                                 "max_error", "mean_error", "inv_max_error", "inv_mean_error" };
+   const int numberOfFields = checkDrift ? (computeInverse ? 6 : 4) : 2;
+   mxArray * info = mxCreateStructMatrix(1, 1, numberOfFields, fieldnames);
+   mxSetFieldByNumber(info, 0, 0, mxCreateLogicalScalar(exponentiator->GetIncremental()));
+   mxSetFieldByNumber(info, 0, 1, mxCreateDoubleScalar(exponentiator->GetNumberOfIterations()));
 
-   // copy result to outputs
-   const VectorPixelType * ptr2 =
-      exponentiator->GetOutput()->GetBufferPointer();
-   const VectorPixelType * const buff_end2 = ptr2 + numPix;
-   
-   while ( ptr2 != buff_end2 )
+   if ( numberOfFields > 2 )
    {
-      for (unsigned int d=0; d<Dimension; d++)
+      // full computation from v
+      typename FieldExponentiatorType::Pointer reference =
+         FieldExponentiatorType::New();
+      reference->SetVelocityField( field );
+      reference->SetComputeInverse( computeInverse );
+      reference->SetNumberOfThreads( mexGetNumberOfThreads( opts ) );
+      reference->Compute();
+
+      const unsigned long numPix = field->GetBufferedRegion().GetNumberOfPixels();
+      for (int f=0; f<(computeInverse ? 2 : 1); f++)
       {
-         *(outptrs[d])++ = (*ptr2)[d];
+         const VectorPixelType * approx = ( f==0 ? exponentiator->GetDeformationField()
+            : exponentiator->GetInverseDeformationField() )->GetBufferPointer();
+         const VectorPixelType * exact = ( f==0 ? reference->GetDeformationField()
+            : reference->GetInverseDeformationField() )->GetBufferPointer();
+         double maxError = 0.0;
+         double sumError = 0.0;
+         for (unsigned long n=0; n<numPix; n++)
+         {
+            const double error = ( approx[n] - exact[n] ).GetNorm();
+            maxError = std::max( maxError, error );
+            sumError += error;
+         }
+         mxSetFieldByNumber(info, 0, 2+2*f, mxCreateDoubleScalar(maxError));
+         mxSetFieldByNumber(info, 0, 3+2*f, mxCreateDoubleScalar(numPix>0 ? sumError/numPix : 0.0));
       }
-      ++ptr2;
    }
-
-   //mexPrintf("done outputs copy %f sec\n", timer.elapsed());
+   plhs[nlhs-1] = info;
 }
 
 
@@ -140,20 +199,27 @@ void mexFunction(int nlhs,
    dlopen("libProcessing.so", RTLD_LAZY|RTLD_GLOBAL);
    dlopen("libRobustEstimation.so", RTLD_LAZY|RTLD_GLOBAL);
    
-   /* Check for proper number of arguments. */
-   if (nrhs<2 or nrhs>3)
+   /* Check for proper number of arguments: the velocity field, in the
+      incremental form followed by the update and the previous fields. An
+      options struct may follow. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   if (nargs<2 or mxGetNumberOfDimensions(prhs[0])<2 or mxGetNumberOfDimensions(prhs[0])>3)
    {
-      mexErrMsgTxt("Two or three inputs required.");
+      mexErrMsgTxt("Two or three inputs required, optionally followed by an options struct.");
    }
 
-   const int dim=nrhs;
+   const int dim=mxGetNumberOfDimensions(prhs[0]);
+   if (nargs!=dim and nargs!=3*dim and nargs!=4*dim)
+   {
+      mexErrMsgTxt("The number of inputs must be the dimension, or 3 or 4 times it for the incremental form.");
+   }
    
    const mxClassID classID = mxGetClassID(prhs[0]);
     
    
 
    /* The inputs must be noncomplex flaoting point matrices.*/
-   for (int d=0; d<dim; d++)
+   for (int d=0; d<nargs; d++)
    {
       if ( mxGetClassID(prhs[d])!=classID || mxIsComplex(prhs[d]) )
       {
@@ -162,7 +228,7 @@ void mexFunction(int nlhs,
 
       if ( mxGetNumberOfDimensions(prhs[d]) != dim )
       {
-         mexErrMsgTxt("The dimension of the inputs must match the number of inputs.");
+         mexErrMsgTxt("The inputs must all have the same dimension.");
       }
 
       for (int dd=0; dd<dim; dd++)
@@ -174,9 +240,11 @@ void mexFunction(int nlhs,
       }
    }
 
-   if (nlhs != nrhs)
+   bool inverse, info;
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+   if ( !velocityfieldexpOutputs(nlhs, dim, mexGetScalarOption(opts, "jacobian", 0.0) != 0, inverse, info) )
    {
-      mexErrMsgTxt("Number of outputs must match number of inputs.");
+      mexErrMsgTxt("Number of outputs must be the dimension, or twice it for the inverse, followed by the Jacobian determinants with the jacobian option, and optionally info.");
    }
 
    switch ( dim )
@@ -0,0 +1,819 @@
+#include "itkJointFieldExponentiator.h"
+#include "itkRegistrationPyramid.h"
+
+#include <itkNearestNeighborInterpolateImageFunction.h>
+#include <itkWarpImageFilter.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// h = velocitytransform('create', vx, vy, (vz), (options))
+// h = velocitytransform('create', t)
+// t = velocitytransform('pack', h)
+// [vx,vy,(vz)] = velocitytransform('velocity', h, (options))
+// [dx,dy,(dz)] = velocitytransform('displacement', h, (options))
+// jac = velocitytransform('jacobian', h, (options))
+// warped = velocitytransform('warp', h, image, (options))
+// used = velocitytransform('budget', (megabytes))
+// velocitytransform('destroy', h)
+//
+// A velocity transform holds a stationary velocity field v (log_def_x/y/z)
+// and hands out exp(v), exp(-v) and their Jacobian determinants, computed
+// as velocityfieldexp does on first use and memoized for the next ones, so
+// that a subject warped several times (images, labels, Jacobians) is
+// exponentiated once.
+//
+// 'pack' returns what to save (in a .mat file) instead of the displacement:
+// a struct with the velocity as stored (x, y, (z), single), the size of
+// the field, storage_levels, the class of the outputs and metadata;
+// 'create' with that struct gives the transform back. Since v is smooth it
+// may be stored on a coarser grid: with storage_levels n, it is decimated
+// n times as the registration pyramid does (see registrationpyramid), 8^n
+// times smaller in 3-D, and upsampled trilinearly to the full size before
+// each exponentiation. 'velocity' returns v on the full grid, as it is
+// exponentiated: the consumers of a saved transform that need v itself
+// (to resume a registration, to average the velocities of a group) get it
+// from there. Decimating that v again gives the stored one back, so a
+// transform may be unpacked, changed and packed again without the
+// interpolation error piling up.
+//
+// The memoized fields of all the open transforms share a memory budget,
+// Inf by default; the least recently used ones are freed to stay within
+// it, and results larger than the budget are not kept. exp(v) and exp(-v)
+// are computed together, sharing the squarings, when both fit. 'budget'
+// sets the budget, in megabytes (0 keeps nothing), and returns the
+// megabytes held.
+//
+// The outputs have the class of the velocity given to 'create', single or
+// double; the computations are done in single precision.
+//
+// Options of 'create':
+//   storage_levels  times the stored velocity is decimated (default 0)
+//   metadata        any MATLAB value kept with the transform and packed
+//                   with it (subject, template, geometry...)
+// Options of 'velocity':
+//   num_threads     threads used (default: ITK default)
+// Options of 'displacement', 'jacobian' and 'warp':
+//   inverse         nonzero for exp(-v) (default 0)
+//   num_threads     threads used (default: ITK default)
+// Options of 'warp':
+//   interpolation   'linear' (default) as warpimage, or 'nearest' as
+//                   warplabelimage; NaN outside the image
+//
+// The MEX file stays locked while transforms are open. Transforms not
+// destroyed are freed when MATLAB exits.
+
+// Bytes of the memoized results of all the transforms, and their budget
+static double cacheBudget = std::numeric_limits<double>::infinity();
+static double cacheUsed = 0.0;
+static unsigned long cacheClock = 0ul;
+
+// Free the least recently used results until bytes more fit in the budget
+static void MakeRoom(double bytes);
+
+
+class VelocityTransformBase
+{
+public:
+   virtual ~VelocityTransformBase() {}
+
+   virtual void Pack(mxArray *plhs[]) const = 0;
+   virtual void Velocity(mxArray *plhs[], const mxArray * opts) const = 0;
+   virtual void Displacement(mxArray *plhs[], const mxArray * opts) = 0;
+   virtual void Jacobian(mxArray *plhs[], const mxArray * opts) = 0;
+   virtual void Warp(mxArray *plhs[], const mxArray * image, const mxArray * opts) = 0;
+   virtual unsigned int GetDimension() const = 0;
+
+   // Last use of the least recently used memoized result, false if none
+   virtual bool GetLeastRecentlyUsed(unsigned long & lastUse) const = 0;
+   virtual void FreeLeastRecentlyUsed() = 0;
+};
+
+
+template <unsigned int Dimension>
+class VelocityTransform : public VelocityTransformBase
+{
+public:
+   typedef itk::Image<float, Dimension>                 ImageType;
+   typedef typename ImageType::Pointer                  ImagePointer;
+   typedef typename ImageType::SizeType                 SizeType;
+   typedef itk::Vector<float, Dimension>                VectorPixelType;
+   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
+   typedef typename DeformationFieldType::Pointer       DeformationFieldPointer;
+   typedef itk::JointFieldExponentiator
+      <DeformationFieldType>                            FieldExponentiatorType;
+   typedef itk::RegistrationPyramid
+      <ImageType, DeformationFieldType>                 PyramidType;
+
+   // The memoized results, forward ones (exp(v)) at even indices
+   enum { ForwardField, InverseField, ForwardJacobian, InverseJacobian, NumberOfResults };
+
+   // Takes the velocity as stored, storageLevels times coarser than size,
+   // and metadata, a persistent array or NULL
+   VelocityTransform(DeformationFieldType * velocity, const SizeType & size, unsigned int storageLevels,
+                     mxClassID classID, mxArray * metadata)
+      : m_Velocity( velocity ), m_Size( size ), m_StorageLevels( storageLevels ),
+        m_ClassID( classID ), m_Metadata( metadata )
+   {
+      for (unsigned int r=0; r<NumberOfResults; r++)
+      {
+         m_LastUse[r] = 0;
+         m_Bytes[r] = 0.0;
+      }
+   }
+
+   virtual ~VelocityTransform()
+   {
+      for (unsigned int r=0; r<NumberOfResults; r++)
+      {
+         Free( r );
+      }
+      if ( m_Metadata )
+      {
+         mxDestroyArray( m_Metadata );
+      }
+   }
+
+   virtual unsigned int GetDimension() const
+   {
+      return Dimension;
+   }
+
+   virtual void Pack(mxArray *plhs[]) const
+   {
+      const char * fieldnames2D[] = { "x", "y", "size", "storage_levels", "class", "metadata" };
+      const char * fieldnames3D[] = { "x", "y", "z", "size", "storage_levels", "class", "metadata" };
+      plhs[0] = mxCreateStructMatrix( 1, 1, Dimension + 4, ( Dimension == 2 ) ? fieldnames2D : fieldnames3D );
+
+      mxArray * components[Dimension];
+      mexExportField<float>( m_Velocity.GetPointer(), mxSINGLE_CLASS, components );
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         mxSetFieldByNumber( plhs[0], 0, d, components[d] );
+      }
+
+      mxArray * size = mxCreateDoubleMatrix( 1, Dimension, mxREAL );
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         mxGetPr(size)[d] = m_Size[d];
+      }
+      mxSetField( plhs[0], 0, "size", size );
+      mxSetField( plhs[0], 0, "storage_levels", mxCreateDoubleScalar( m_StorageLevels ) );
+      mxSetField( plhs[0], 0, "class", mxCreateString( m_ClassID == mxSINGLE_CLASS ? "single" : "double" ) );
+      mxSetField( plhs[0], 0, "metadata", m_Metadata ? mxDuplicateArray( m_Metadata ) : mxCreateDoubleMatrix( 0, 0, mxREAL ) );
+   }
+
+   virtual void Velocity(mxArray *plhs[], const mxArray * opts) const
+   {
+      DeformationFieldPointer velocity = GetFullVelocity( false, mexGetNumberOfThreads( opts ) );
+      if ( m_ClassID == mxSINGLE_CLASS )
+      {
+         mexExportField<float>( velocity.GetPointer(), m_ClassID, plhs );
+      }
+      else
+      {
+         mexExportField<double>( velocity.GetPointer(), m_ClassID, plhs );
+      }
+   }
+
+   virtual void Displacement(mxArray *plhs[], const mxArray * opts)
+   {
+      const bool inverse = ( mexGetScalarOption(opts, "inverse", 0.0) != 0 );
+      DeformationFieldPointer field;
+      ImagePointer determinant;
+      Evaluate( inverse, false, mexGetNumberOfThreads( opts ), field, determinant );
+
+      if ( m_ClassID == mxSINGLE_CLASS )
+      {
+         mexExportField<float>( field.GetPointer(), m_ClassID, plhs );
+      }
+      else
+      {
+         mexExportField<double>( field.GetPointer(), m_ClassID, plhs );
+      }
+   }
+
+   virtual void Jacobian(mxArray *plhs[], const mxArray * opts)
+   {
+      const bool inverse = ( mexGetScalarOption(opts, "inverse", 0.0) != 0 );
+      DeformationFieldPointer field;
+      ImagePointer determinant;
+      Evaluate( inverse, true, mexGetNumberOfThreads( opts ), field, determinant );
+
+      if ( m_ClassID == mxSINGLE_CLASS )
+      {
+         plhs[0] = mexExportImage<float>( determinant.GetPointer(), m_ClassID );
+      }
+      else
+      {
+         plhs[0] = mexExportImage<double>( determinant.GetPointer(), m_ClassID );
+      }
+   }
+
+   virtual void Warp(mxArray *plhs[], const mxArray * image, const mxArray * opts)
+   {
+      const mxClassID classID = mxGetClassID(image);
+      if ( ( classID != mxSINGLE_CLASS && classID != mxDOUBLE_CLASS ) || mxIsComplex(image) )
+      {
+         mexErrMsgTxt("The image must be a noncomplex floating point.");
+      }
+      if ( mxGetNumberOfDimensions(image) != Dimension )
+      {
+         mexErrMsgTxt("The image must have the dimension of the transform.");
+      }
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         if ( mxGetDimensions(image)[d] != m_Size[d] )
+         {
+            mexErrMsgTxt("The image must have the size of the transform.");
+         }
+      }
+
+      const std::string interpolation = mexGetStringOption(opts, "interpolation", "linear");
+      if ( interpolation != "linear" && interpolation != "nearest" )
+      {
+         mexErrMsgTxt("Option interpolation must be 'linear' or 'nearest'.");
+      }
+
+      const bool inverse = ( mexGetScalarOption(opts, "inverse", 0.0) != 0 );
+      DeformationFieldPointer field;
+      ImagePointer determinant;
+      Evaluate( inverse, false, mexGetNumberOfThreads( opts ), field, determinant );
+
+      if ( classID == mxSINGLE_CLASS )
+      {
+         plhs[0] = WarpImage<float>( image, field, interpolation == "nearest" );
+      }
+      else
+      {
+         plhs[0] = WarpImage<double>( image, field, interpolation == "nearest" );
+      }
+   }
+
+   virtual bool GetLeastRecentlyUsed(unsigned long & lastUse) const
+   {
+      bool found = false;
+      for (unsigned int r=0; r<NumberOfResults; r++)
+      {
+         if ( IsMemoized( r ) && ( !found || m_LastUse[r] < lastUse ) )
+         {
+            lastUse = m_LastUse[r];
+            found = true;
+         }
+      }
+      return found;
+   }
+
+   virtual void FreeLeastRecentlyUsed()
+   {
+      unsigned long lastUse = 0;
+      if ( !GetLeastRecentlyUsed( lastUse ) )
+      {
+         return;
+      }
+      for (unsigned int r=0; r<NumberOfResults; r++)
+      {
+         if ( IsMemoized( r ) && m_LastUse[r] == lastUse )
+         {
+            Free( r );
+            return;
+         }
+      }
+   }
+
+private:
+   bool IsMemoized(unsigned int r) const
+   {
+      return ( r < ForwardJacobian ) ? m_Fields[r].IsNotNull() : m_Jacobians[r-ForwardJacobian].IsNotNull();
+   }
+
+   void Free(unsigned int r)
+   {
+      if ( r < ForwardJacobian )
+      {
+         m_Fields[r] = NULL;
+      }
+      else
+      {
+         m_Jacobians[r-ForwardJacobian] = NULL;
+      }
+      cacheUsed -= m_Bytes[r];
+      m_Bytes[r] = 0.0;
+   }
+
+   // Keep a result if it fits in the budget, as the most recently used
+   void Memoize(unsigned int r, DeformationFieldType * field, ImageType * determinant, double bytes)
+   {
+      Free( r );
+      if ( bytes > cacheBudget )
+      {
+         return;
+      }
+      MakeRoom( bytes );
+      if ( r < ForwardJacobian )
+      {
+         m_Fields[r] = field;
+      }
+      else
+      {
+         m_Jacobians[r-ForwardJacobian] = determinant;
+      }
+      m_Bytes[r] = bytes;
+      m_LastUse[r] = ++cacheClock;
+      cacheUsed += bytes;
+   }
+
+   // The velocity on the full grid, negated for exp(-v) alone
+   DeformationFieldPointer GetFullVelocity(bool negate, unsigned int numberOfThreads) const
+   {
+      DeformationFieldPointer velocity = m_Velocity;
+      if ( m_StorageLevels > 0 )
+      {
+         std::vector<SizeType> sizes( m_StorageLevels, m_Size );
+         for (unsigned int l=1; l<m_StorageLevels; l++)
+         {
+            sizes[l] = PyramidType::GetDownsampledSize( sizes[l-1] );
+         }
+         typename PyramidType::Pointer pyramid = PyramidType::New();
+         pyramid->SetNumberOfThreads( numberOfThreads );
+         for (unsigned int l=m_StorageLevels; l>0; l--)
+         {
+            velocity = pyramid->UpsampleField( velocity, sizes[l-1] );
+         }
+      }
+      if ( negate )
+      {
+         if ( velocity == m_Velocity )
+         {
+            velocity = DeformationFieldType::New();
+            velocity->CopyInformation( m_Velocity );
+            velocity->SetRegions( m_Velocity->GetLargestPossibleRegion() );
+            velocity->Allocate();
+            std::copy( m_Velocity->GetBufferPointer(),
+                       m_Velocity->GetBufferPointer() + m_Velocity->GetBufferedRegion().GetNumberOfPixels(),
+                       velocity->GetBufferPointer() );
+         }
+         VectorPixelType * ptr = velocity->GetBufferPointer();
+         const VectorPixelType * const buff_end = ptr + velocity->GetBufferedRegion().GetNumberOfPixels();
+         for ( ; ptr != buff_end; ++ptr )
+         {
+            *ptr = -(*ptr);
+         }
+      }
+      return velocity;
+   }
+
+   // exp(v) or exp(-v), and its Jacobian determinant with jacobian, from
+   // the memoized results or computed and memoized
+   void Evaluate(bool inverse, bool jacobian, unsigned int numberOfThreads,
+                 DeformationFieldPointer & field, ImagePointer & determinant)
+   {
+      const unsigned int f = inverse ? InverseField : ForwardField;
+      const unsigned int j = inverse ? InverseJacobian : ForwardJacobian;
+      if ( IsMemoized( f ) && ( !jacobian || IsMemoized( j ) ) )
+      {
+         field = m_Fields[f];
+         m_LastUse[f] = ++cacheClock;
+         if ( jacobian )
+         {
+            determinant = m_Jacobians[j-ForwardJacobian];
+            m_LastUse[j] = ++cacheClock;
+         }
+         return;
+      }
+
+      double numPix = 1.0;
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         numPix *= m_Size[d];
+      }
+      const double fieldBytes = numPix * sizeof(VectorPixelType);
+      const double jacobianBytes = jacobian ? numPix * sizeof(float) : 0.0;
+
+      // exp(v) and exp(-v) share the squarings: both are computed when the
+      // other one is missing and both fit in the budget
+      const bool both = !IsMemoized( InverseField - f ) && 2.0 * ( fieldBytes + jacobianBytes ) <= cacheBudget;
+
+      typename FieldExponentiatorType::Pointer exponentiator = FieldExponentiatorType::New();
+      exponentiator->SetVelocityField( GetFullVelocity( inverse && !both, numberOfThreads ) );
+      exponentiator->SetComputeInverse( both );
+      exponentiator->SetComputeJacobianDeterminant( jacobian );
+      exponentiator->SetNumberOfThreads( numberOfThreads );
+      exponentiator->Compute();
+      exponentiator->ReleaseWorkspace();
+      exponentiator->SetVelocityField( NULL );
+
+      if ( both )
+      {
+         // the other direction first, as the less recently used
+         const bool other = !inverse;
+         Memoize( InverseField - f, other ? exponentiator->GetInverseDeformationField()
+                                          : exponentiator->GetDeformationField(), NULL, fieldBytes );
+         if ( jacobian )
+         {
+            Memoize( InverseJacobian + ForwardJacobian - j, NULL,
+                     other ? exponentiator->GetInverseJacobianDeterminant()
+                           : exponentiator->GetJacobianDeterminant(), jacobianBytes );
+         }
+         field = inverse ? exponentiator->GetInverseDeformationField() : exponentiator->GetDeformationField();
+         if ( jacobian )
+         {
+            determinant = inverse ? exponentiator->GetInverseJacobianDeterminant()
+                                  : exponentiator->GetJacobianDeterminant();
+         }
+      }
+      else
+      {
+         field = exponentiator->GetDeformationField();
+         if ( jacobian )
+         {
+            determinant = exponentiator->GetJacobianDeterminant();
+         }
+      }
+
+      Memoize( f, field, NULL, fieldBytes );
+      if ( jacobian )
+      {
+         Memoize( j, NULL, determinant, jacobianBytes );
+      }
+   }
+
+   template <class MatlabPixelType>
+   mxArray * WarpImage(const mxArray * image, DeformationFieldType * field, bool nearest) const
+   {
+      typedef itk::WarpImageFilter
+         <ImageType, ImageType, DeformationFieldType>   WarperType;
+      typedef itk::NearestNeighborInterpolateImageFunction
+         <ImageType, double>                            NearestInterpolatorType;
+
+      // The image wraps the MATLAB buffer when it is single
+      ImagePointer input = mexImportImage<ImageType, MatlabPixelType>( image );
+
+      typename WarperType::Pointer warper = WarperType::New();
+      warper->SetInput( input );
+      warper->SetOutputSpacing( input->GetSpacing() );
+      warper->SetOutputOrigin( input->GetOrigin() );
+      warper->SetDeformationField( field );
+      if ( nearest )
+      {
+         warper->SetInterpolator( NearestInterpolatorType::New() );
+      }
+      warper->SetEdgePaddingValue( std::numeric_limits<float>::quiet_NaN() );
+      warper->UpdateLargestPossibleRegion();
+
+      return mexExportImage<MatlabPixelType>( warper->GetOutput(), mxGetClassID(image) );
+   }
+
+   DeformationFieldPointer       m_Velocity;
+   SizeType                      m_Size;
+   unsigned int                  m_StorageLevels;
+   mxClassID                     m_ClassID;
+   mxArray *                     m_Metadata;
+
+   DeformationFieldPointer       m_Fields[2];
+   ImagePointer                  m_Jacobians[2];
+   unsigned long                 m_LastUse[NumberOfResults];
+   double                        m_Bytes[NumberOfResults];
+};
+
+
+// Transform of the given velocity components, decimated storageLevels
+// times
+template <class MatlabPixelType, unsigned int Dimension>
+VelocityTransformBase * ImportVelocityTransform(const mxArray * const fields[], unsigned int storageLevels,
+                                                mxClassID classID, const mxArray * metadata,
+                                                const typename VelocityTransform<Dimension>::SizeType * size)
+{
+   typedef VelocityTransform<Dimension>                  TransformType;
+   typedef typename TransformType::DeformationFieldType  DeformationFieldType;
+   typedef typename TransformType::PyramidType           PyramidType;
+
+   typename DeformationFieldType::Pointer velocity =
+      mexImportField<DeformationFieldType, MatlabPixelType>( fields );
+
+   // A packed velocity is stored already, a new one is decimated here
+   typename TransformType::SizeType fullSize = velocity->GetLargestPossibleRegion().GetSize();
+   if ( size )
+   {
+      fullSize = *size;
+      typename TransformType::SizeType storedSize = fullSize;
+      for (unsigned int l=0; l<storageLevels; l++)
+      {
+         storedSize = PyramidType::GetDownsampledSize( storedSize );
+      }
+      if ( storedSize != velocity->GetLargestPossibleRegion().GetSize() )
+      {
+         mexErrMsgTxt("The packed velocity does not match its size and storage_levels.");
+      }
+   }
+   else
+   {
+      typename PyramidType::Pointer pyramid = PyramidType::New();
+      for (unsigned int l=0; l<storageLevels; l++)
+      {
+         velocity = pyramid->DownsampleField( velocity );
+      }
+   }
+
+   mxArray * kept = NULL;
+   if ( metadata && !mxIsEmpty(metadata) )
+   {
+      kept = mxDuplicateArray( metadata );
+      mexMakeArrayPersistent( kept );
+   }
+   return new TransformType( velocity, fullSize, storageLevels, classID, kept );
+}
+
+// The velocity components must be noncomplex floating point arrays of dim
+// dimensions and of the same size
+void checkVelocity(const mxArray * const inputs[], int dim)
+{
+   if ( dim != 2 && dim != 3 )
+   {
+      mexErrMsgTxt("Dimension unsupported.");
+   }
+   if ( !inputs[0] )
+   {
+      mexErrMsgTxt("The velocity components are missing.");
+   }
+   const mxClassID classID = mxGetClassID(inputs[0]);
+   if ( classID != mxSINGLE_CLASS && classID != mxDOUBLE_CLASS )
+   {
+      mexErrMsgTxt("Pixel type unsupported.");
+   }
+   for (int n=0; n<dim; n++)
+   {
+      if ( !inputs[n] || mxGetClassID(inputs[n])!=classID || mxIsComplex(inputs[n]) )
+      {
+         mexErrMsgTxt("Input must be a noncomplex floating point.");
+      }
+
+      if ( mxGetNumberOfDimensions(inputs[n]) != dim )
+      {
+         mexErrMsgTxt("The dimension of the field must agree with the number of inputs.");
+      }
+
+      for (int dd=0; dd<dim; dd++)
+      {
+         if ( mxGetDimensions(inputs[n])[dd] != mxGetDimensions(inputs[0])[dd] )
+         {
+            mexErrMsgTxt("Inputs must have the same size.");
+         }
+      }
+   }
+}
+
+template <unsigned int Dimension>
+VelocityTransformBase * CreateVelocityTransform(const mxArray * const fields[], unsigned int storageLevels,
+                                                mxClassID classID, const mxArray * metadata,
+                                                const double * size)
+{
+   typename VelocityTransform<Dimension>::SizeType fullSize;
+   for (unsigned int d=0; size && d<Dimension; d++)
+   {
+      if ( size[d] < 1 || size[d] != static_cast<double>( static_cast<unsigned long>( size[d] ) ) )
+      {
+         mexErrMsgTxt("The size must be positive integers.");
+      }
+      fullSize[d] = static_cast<unsigned long>( size[d] );
+   }
+   if ( mxGetClassID(fields[0]) == mxSINGLE_CLASS )
+   {
+      return ImportVelocityTransform<float, Dimension>( fields, storageLevels, classID, metadata, size ? &fullSize : NULL );
+   }
+   return ImportVelocityTransform<double, Dimension>( fields, storageLevels, classID, metadata, size ? &fullSize : NULL );
+}
+
+unsigned int getStorageLevels(double storageLevels)
+{
+   if ( storageLevels < 0 || storageLevels > 16
+        || storageLevels != static_cast<double>( static_cast<unsigned int>( storageLevels ) ) )
+   {
+      mexErrMsgTxt("The storage levels must be an integer between 0 and 16.");
+   }
+   return static_cast<unsigned int>( storageLevels );
+}
+
+
+// Open transforms by handle
+typedef std::map<unsigned int, VelocityTransformBase *> TransformTable;
+static TransformTable transforms;
+static unsigned int nextHandle = 1u;
+
+static void MakeRoom(double bytes)
+{
+   while ( cacheUsed + bytes > cacheBudget )
+   {
+      VelocityTransformBase * oldest = NULL;
+      unsigned long oldestUse = 0;
+      for (TransformTable::iterator it=transforms.begin(); it!=transforms.end(); ++it)
+      {
+         unsigned long lastUse;
+         if ( it->second->GetLeastRecentlyUsed( lastUse ) && ( !oldest || lastUse < oldestUse ) )
+         {
+            oldest = it->second;
+            oldestUse = lastUse;
+         }
+      }
+      if ( !oldest )
+      {
+         return;
+      }
+      oldest->FreeLeastRecentlyUsed();
+   }
+}
+
+static void DestroyAllTransforms()
+{
+   for (TransformTable::iterator it=transforms.begin(); it!=transforms.end(); ++it)
+   {
+      delete it->second;
+   }
+   transforms.clear();
+}
+
+static TransformTable::iterator GetTransform(const mxArray * handle)
+{
+   if ( !mxIsNumeric(handle) || mxGetNumberOfElements(handle) != 1 )
+   {
+      mexErrMsgTxt("The transform handle must be a scalar.");
+   }
+   TransformTable::iterator it = transforms.find( static_cast<unsigned int>( mxGetScalar(handle) ) );
+   if ( it == transforms.end() )
+   {
+      mexErrMsgTxt("Invalid or destroyed transform handle.");
+   }
+   return it;
+}
+
+
+void mexFunction(int nlhs,
+                 mxArray *plhs[],
+                 int nrhs,
+                 const mxArray *prhs[])
+{
+   if ( nrhs < 1 || !mxIsChar(prhs[0]) )
+   {
+      mexErrMsgTxt("The first input must be a command: 'create', 'pack', 'velocity', 'displacement', 'jacobian', 'warp', 'budget' or 'destroy'.");
+   }
+   char * buffer = mxArrayToString(prhs[0]);
+   const std::string command(buffer);
+   mxFree(buffer);
+
+   /* The options struct may be omitted. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+
+   if ( command == "create" )
+   {
+      VelocityTransformBase * transform = NULL;
+      if ( nargs == 1 && opts && nlhs <= 1 )
+      {
+         // packed transform, given as the last (struct) input
+         const mxArray * packed = opts;
+         const mxArray * size = mxGetField(packed, 0, "size");
+         const mxArray * levels = mxGetField(packed, 0, "storage_levels");
+         if ( !size || !mxIsDouble(size) || !levels || !mxIsNumeric(levels) )
+         {
+            mexErrMsgTxt("The packed transform must have the fields of velocitytransform('pack', h).");
+         }
+         const int dim = static_cast<int>( mxGetNumberOfElements(size) );
+         const mxArray * fields[] = { mxGetField(packed, 0, "x"), mxGetField(packed, 0, "y"),
+                                      dim == 3 ? mxGetField(packed, 0, "z") : NULL };
+         checkVelocity( fields, dim );
+
+         const unsigned int storageLevels = getStorageLevels( mxGetScalar(levels) );
+         const mxClassID classID = ( mexGetStringOption(packed, "class", "single") == "double" ) ? mxDOUBLE_CLASS : mxSINGLE_CLASS;
+         const mxArray * metadata = mxGetField(packed, 0, "metadata");
+         if ( dim == 2 )
+         {
+            transform = CreateVelocityTransform<2>( fields, storageLevels, classID, metadata, mxGetPr(size) );
+         }
+         else
+         {
+            transform = CreateVelocityTransform<3>( fields, storageLevels, classID, metadata, mxGetPr(size) );
+         }
+      }
+      else
+      {
+         const int dim = nargs-1;
+         if ( (dim != 2 && dim != 3) || nlhs > 1 )
+         {
+            mexErrMsgTxt("Usage: h = velocitytransform('create', vx, vy, (vz), (options)) or h = velocitytransform('create', t)");
+         }
+         checkVelocity( prhs+1, dim );
+
+         const unsigned int storageLevels = getStorageLevels( mexGetScalarOption(opts, "storage_levels", 0.0) );
+         const mxArray * metadata = mexGetOptionField(opts, "metadata");
+         if ( dim == 2 )
+         {
+            transform = CreateVelocityTransform<2>( prhs+1, storageLevels, mxGetClassID(prhs[1]), metadata, NULL );
+         }
+         else
+         {
+            transform = CreateVelocityTransform<3>( prhs+1, storageLevels, mxGetClassID(prhs[1]), metadata, NULL );
+         }
+      }
+
+      if ( transforms.empty() )
+      {
+         mexAtExit( DestroyAllTransforms );
+      }
+      transforms[nextHandle] = transform;
+      mexLock();
+
+      plhs[0] = mxCreateDoubleScalar( nextHandle++ );
+   }
+   else if ( command == "pack" )
+   {
+      if ( nrhs != 2 || nlhs > 1 )
+      {
+         mexErrMsgTxt("Usage: t = velocitytransform('pack', h)");
+      }
+      GetTransform(prhs[1])->second->Pack( plhs );
+   }
+   else if ( command == "velocity" )
+   {
+      if ( nargs != 2 )
+      {
+         mexErrMsgTxt("Usage: [vx,vy,(vz)] = velocitytransform('velocity', h, (options))");
+      }
+      const VelocityTransformBase * transform = GetTransform(prhs[1])->second;
+      if ( nlhs != static_cast<int>( transform->GetDimension() ) )
+      {
+         mexErrMsgTxt("Number of outputs must agree with the dimension of the field.");
+      }
+      transform->Velocity( plhs, opts );
+   }
+   else if ( command == "displacement" )
+   {
+      if ( nargs != 2 )
+      {
+         mexErrMsgTxt("Usage: [dx,dy,(dz)] = velocitytransform('displacement', h, (options))");
+      }
+      VelocityTransformBase * transform = GetTransform(prhs[1])->second;
+      if ( nlhs != static_cast<int>( transform->GetDimension() ) )
+      {
+         mexErrMsgTxt("Number of outputs must agree with the dimension of the field.");
+      }
+      transform->Displacement( plhs, opts );
+   }
+   else if ( command == "jacobian" )
+   {
+      if ( nargs != 2 || nlhs > 1 )
+      {
+         mexErrMsgTxt("Usage: jac = velocitytransform('jacobian', h, (options))");
+      }
+      GetTransform(prhs[1])->second->Jacobian( plhs, opts );
+   }
+   else if ( command == "warp" )
+   {
+      if ( nargs != 3 || nlhs > 1 )
+      {
+         mexErrMsgTxt("Usage: warped = velocitytransform('warp', h, image, (options))");
+      }
+      GetTransform(prhs[1])->second->Warp( plhs, prhs[2], opts );
+   }
+   else if ( command == "budget" )
+   {
+      if ( nrhs > 2 || nlhs > 1 )
+      {
+         mexErrMsgTxt("Usage: used = velocitytransform('budget', (megabytes))");
+      }
+      if ( nrhs == 2 )
+      {
+         if ( !mxIsNumeric(prhs[1]) || mxGetNumberOfElements(prhs[1]) != 1 || mxGetScalar(prhs[1]) < 0 )
+         {
+            mexErrMsgTxt("The budget must be a non-negative scalar.");
+         }
+         cacheBudget = mxGetScalar(prhs[1]) * 1024.0 * 1024.0;
+         MakeRoom( 0.0 );
+      }
+      plhs[0] = mxCreateDoubleScalar( cacheUsed / ( 1024.0 * 1024.0 ) );
+   }
+   else if ( command == "destroy" )
+   {
+      if ( nrhs != 2 || nlhs > 0 )
+      {
+         mexErrMsgTxt("Usage: velocitytransform('destroy', h)");
+      }
+      TransformTable::iterator it = GetTransform(prhs[1]);
+      delete it->second;
+      transforms.erase( it );
+      mexUnlock();
+   }
+   else
+   {
+      mexErrMsgTxt(("Unknown command " + command + ".").c_str());
+   }
+
+   return;
+}
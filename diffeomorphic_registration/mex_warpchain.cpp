@@ -0,0 +1,589 @@
+#include "itkJointFieldExponentiator.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// warped = warpchain(image, chain, (options))
+//
+// Warps an image through a chain of transforms without composing them into
+// a field or resampling the image in between: the location of each output
+// voxel x in the image is T_n(...T_2(T_1(x))), where chain = {T_1, ..., T_n}
+// is a cell array of structs of one of the types
+//
+//   struct('type','affine', 'matrix',M, ('center',c))
+//       x -> M(1:d,1:d)*(x-c) + M(1:d,d+1) + c, in MATLAB voxel coordinates,
+//       as the matrices of AffineParams2Mat_aux. c defaults to half the
+//       output size, as in AffineMat2VelocityField3D_aux.
+//   struct('type','displacement', 'x',dx, 'y',dy, ('z',dz))
+//       x -> x + d(x), as warpimage; d is interpolated linearly between its
+//       voxels and is zero outside of them.
+//   struct('type','velocity', 'x',vx, 'y',vy, ('z',vz), ('inverse',1))
+//       the displacement exp(v), or exp(-v) with inverse, computed once as
+//       velocityfieldexp does.
+//
+// so that warpchain(im, {struct('type','velocity', ...)}) is
+// warpimage(im, velocityfieldexp(v)) and a chain of displacements d1, d2
+// warps as warpimage with the field d1 composed with d2, without the
+// blurring of warping twice. The fields may be single or double, and each
+// lives on its own grid, of voxel coordinates shared with the image.
+//
+// The image, single or double, is interpolated once at the end, in float,
+// NaN outside of it. The output has the class of the image.
+//
+// Options:
+//   size           size of the output (default: size of the first field of
+//                  the chain, else of the image)
+//   interpolation  'linear' (default), or 'nearest' as warplabelimage
+//   num_threads    threads used (default: ITK default)
+
+template <unsigned int Dimension>
+class TransformChain
+{
+public:
+   typedef float                                        VectorComponentType;
+   typedef itk::Vector<VectorComponentType, Dimension>  VectorPixelType;
+   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
+   typedef itk::JointFieldExponentiator
+      <DeformationFieldType>                            FieldExponentiatorType;
+
+   // x -> m_Matrix x + m_Offset, or x -> x + m_Field(x), in 0-based
+   // voxel coordinates
+   struct Element
+   {
+      bool      m_IsAffine;
+      double    m_Matrix[Dimension][Dimension];
+      double    m_Offset[Dimension];
+      typename DeformationFieldType::Pointer m_Field;
+      const VectorPixelType * m_Buffer;
+      long      m_Size[Dimension];
+      long      m_Stride[Dimension];
+   };
+
+   void AddAffine(const mxArray * element, const long outputSize[])
+   {
+      const mxArray * matrix = mxGetField(element, 0, "matrix");
+      if ( !matrix || !mxIsDouble(matrix) || mxIsComplex(matrix) || mxGetM(matrix) < Dimension
+           || mxGetM(matrix) > Dimension+1 || mxGetN(matrix) != Dimension+1 )
+      {
+         mexErrMsgTxt("The matrix of an affine transform must be a (d or d+1) by d+1 double matrix.");
+      }
+      const double * m = mxGetPr(matrix);
+      const size_t rows = mxGetM(matrix);
+
+      double center[Dimension];
+      const mxArray * centerArray = mxGetField(element, 0, "center");
+      if ( centerArray && !mxIsEmpty(centerArray) )
+      {
+         if ( !mxIsDouble(centerArray) || mxGetNumberOfElements(centerArray) != Dimension )
+         {
+            mexErrMsgTxt("The center of an affine transform must be a vector of d doubles.");
+         }
+         std::copy( mxGetPr(centerArray), mxGetPr(centerArray)+Dimension, center );
+      }
+      else
+      {
+         for (unsigned int i=0; i<Dimension; i++)
+         {
+            center[i] = 0.5 * static_cast<double>( outputSize[i] );
+         }
+      }
+
+      // x0 + 1 = M (x0 + 1 - c) + t + c for the 0-based coordinates x0
+      Element e;
+      e.m_IsAffine = true;
+      for (unsigned int i=0; i<Dimension; i++)
+      {
+         e.m_Offset[i] = m[i + rows*Dimension] + center[i] - 1.0;
+         for (unsigned int j=0; j<Dimension; j++)
+         {
+            e.m_Matrix[i][j] = m[i + rows*j];
+            e.m_Offset[i] += m[i + rows*j] * ( 1.0 - center[j] );
+         }
+      }
+      m_Elements.push_back( e );
+   }
+
+   void AddField(const mxArray * element, bool velocity, unsigned int numberOfThreads)
+   {
+      static const char * componentNames[] = { "x", "y", "z" };
+      const mxArray * components[Dimension];
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         components[d] = mxGetField(element, 0, componentNames[d]);
+         if ( !components[d] || mxIsComplex(components[d])
+              || mxGetNumberOfDimensions(components[d]) != Dimension
+              || mxGetClassID(components[d]) != mxGetClassID(components[0]) )
+         {
+            mexErrMsgTxt("The components of a field must be noncomplex arrays of the dimension of the image and of the same class.");
+         }
+         for (unsigned int dd=0; dd<Dimension; dd++)
+         {
+            if ( mxGetDimensions(components[d])[dd] != mxGetDimensions(components[0])[dd] )
+            {
+               mexErrMsgTxt("The components of a field must have the same size.");
+            }
+         }
+      }
+
+      typename DeformationFieldType::Pointer field;
+      switch ( mxGetClassID(components[0]) )
+      {
+         case mxSINGLE_CLASS:
+            field = mexImportField<DeformationFieldType, float>( components );
+            break;
+         case mxDOUBLE_CLASS:
+            field = mexImportField<DeformationFieldType, double>( components );
+            break;
+         default:
+            mexErrMsgTxt("The fields must be single or double.");
+      }
+
+      if ( velocity )
+      {
+         const mxArray * inverse = mxGetField(element, 0, "inverse");
+         if ( inverse && !mxIsEmpty(inverse) && mxGetScalar(inverse) != 0 )
+         {
+            VectorPixelType * ptr = field->GetBufferPointer();
+            const VectorPixelType * const buff_end = ptr + field->GetBufferedRegion().GetNumberOfPixels();
+            for ( ; ptr != buff_end; ++ptr )
+            {
+               *ptr = -(*ptr);
+            }
+         }
+         typename FieldExponentiatorType::Pointer exponentiator =
+            FieldExponentiatorType::New();
+         exponentiator->SetVelocityField( field );
+         exponentiator->SetComputeInverse( false );
+         exponentiator->SetNumberOfThreads( numberOfThreads );
+         exponentiator->Compute();
+         field = exponentiator->GetDeformationField();
+      }
+
+      Element e;
+      e.m_IsAffine = false;
+      e.m_Field = field;
+      e.m_Buffer = field->GetBufferPointer();
+      long stride = 1;
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         e.m_Size[d] = static_cast<long>( field->GetBufferedRegion().GetSize()[d] );
+         e.m_Stride[d] = stride;
+         stride *= e.m_Size[d];
+      }
+      m_Elements.push_back( e );
+   }
+
+   // Size of the first field, false if none
+   bool GetFirstFieldSize(long size[]) const
+   {
+      for (size_t n=0; n<m_Elements.size(); n++)
+      {
+         if ( !m_Elements[n].m_IsAffine )
+         {
+            std::copy( m_Elements[n].m_Size, m_Elements[n].m_Size+Dimension, size );
+            return true;
+         }
+      }
+      return false;
+   }
+
+   // Location in the image of the point p of the output
+   void Map(double p[]) const
+   {
+      for (size_t n=0; n<m_Elements.size(); n++)
+      {
+         const Element & e = m_Elements[n];
+         if ( e.m_IsAffine )
+         {
+            double q[Dimension];
+            for (unsigned int i=0; i<Dimension; i++)
+            {
+               q[i] = e.m_Offset[i];
+               for (unsigned int j=0; j<Dimension; j++)
+               {
+                  q[i] += e.m_Matrix[i][j] * p[j];
+               }
+            }
+            std::copy( q, q+Dimension, p );
+            continue;
+         }
+
+         // linear interpolation of the field, zero outside
+         long base[Dimension];
+         double distance[Dimension];
+         bool inside = true;
+         for (unsigned int i=0; i<Dimension && inside; i++)
+         {
+            inside = ( p[i] >= -0.5 && p[i] < static_cast<double>( e.m_Size[i] ) - 0.5 );
+            base[i] = static_cast<long>( std::floor( p[i] ) );
+            distance[i] = p[i] - static_cast<double>( base[i] );
+         }
+         if ( !inside )
+         {
+            continue;
+         }
+
+         double displacement[Dimension];
+         std::fill( displacement, displacement+Dimension, 0.0 );
+         for (unsigned int counter=0; counter<(1u << Dimension); counter++)
+         {
+            double overlap = 1.0;
+            long neighborOffset = 0;
+            for (unsigned int i=0; i<Dimension; i++)
+            {
+               long neighbor;
+               if ( counter & ( 1u << i ) )
+               {
+                  neighbor = std::min( base[i] + 1, e.m_Size[i] - 1 );
+                  overlap *= distance[i];
+               }
+               else
+               {
+                  neighbor = std::max( base[i], 0L );
+                  overlap *= 1.0 - distance[i];
+               }
+               neighborOffset += neighbor * e.m_Stride[i];
+            }
+            if ( overlap )
+            {
+               const VectorPixelType & value = e.m_Buffer[neighborOffset];
+               for (unsigned int k=0; k<Dimension; k++)
+               {
+                  displacement[k] += overlap * static_cast<double>( value[k] );
+               }
+            }
+         }
+         for (unsigned int i=0; i<Dimension; i++)
+         {
+            p[i] += displacement[i];
+         }
+      }
+   }
+
+private:
+   std::vector<Element>   m_Elements;
+};
+
+
+template <class MatlabPixelType, unsigned int Dimension>
+struct WarpChainData
+{
+   const TransformChain<Dimension> * m_Chain;
+   const MatlabPixelType * m_Input;
+   MatlabPixelType *       m_Output;
+   long            m_InputSize[Dimension];
+   long            m_InputStride[Dimension];
+   long            m_OutputSize[Dimension];
+   size_t          m_NumberOfRows;
+   size_t          m_RowsPerThread;
+   bool            m_Nearest;
+};
+
+template <class MatlabPixelType, unsigned int Dimension>
+ITK_THREAD_RETURN_TYPE WarpChainThreaderCallback(void * arg)
+{
+   typedef WarpChainData<MatlabPixelType, Dimension> DataType;
+   const unsigned int numberOfNeighbors = 1u << Dimension;
+
+   itk::MultiThreader::ThreadInfoStruct * info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+   const DataType & data = *static_cast<const DataType *>( info->UserData );
+
+   const size_t firstRow = info->ThreadID * data.m_RowsPerThread;
+   const size_t endRow = std::min( firstRow + data.m_RowsPerThread, data.m_NumberOfRows );
+   const long rowLength = data.m_OutputSize[0];
+   const MatlabPixelType padding = static_cast<MatlabPixelType>( std::numeric_limits<float>::quiet_NaN() );
+
+   for (size_t row=firstRow; row<endRow; row++)
+   {
+      MatlabPixelType * output = data.m_Output + row * rowLength;
+
+      long index[Dimension];
+      size_t coordinates = row;
+      index[0] = 0;
+      for (unsigned int d=1; d<Dimension; d++)
+      {
+         index[d] = static_cast<long>( coordinates % data.m_OutputSize[d] );
+         coordinates /= data.m_OutputSize[d];
+      }
+
+      for (long x=0; x<rowLength; x++)
+      {
+         index[0] = x;
+         double p[Dimension];
+         for (unsigned int i=0; i<Dimension; i++)
+         {
+            p[i] = static_cast<double>( index[i] );
+         }
+         data.m_Chain->Map( p );
+
+         // inside if within half a voxel of the image
+         long base[Dimension];
+         double distance[Dimension];
+         bool inside = true;
+         for (unsigned int i=0; i<Dimension && inside; i++)
+         {
+            inside = ( p[i] >= -0.5 && p[i] < static_cast<double>( data.m_InputSize[i] ) - 0.5 );
+            base[i] = static_cast<long>( std::floor( p[i] ) );
+            distance[i] = p[i] - static_cast<double>( base[i] );
+         }
+         if ( !inside )
+         {
+            output[x] = padding;
+            continue;
+         }
+
+         if ( data.m_Nearest )
+         {
+            long offset = 0;
+            for (unsigned int i=0; i<Dimension; i++)
+            {
+               const long nearest = std::min( static_cast<long>( std::floor( p[i] + 0.5 ) ), data.m_InputSize[i] - 1 );
+               offset += std::max( nearest, 0L ) * data.m_InputStride[i];
+            }
+            output[x] = static_cast<MatlabPixelType>( static_cast<float>( data.m_Input[offset] ) );
+            continue;
+         }
+
+         double value = 0.0;
+         for (unsigned int counter=0; counter<numberOfNeighbors; counter++)
+         {
+            double overlap = 1.0;
+            long neighborOffset = 0;
+            for (unsigned int i=0; i<Dimension; i++)
+            {
+               long neighbor;
+               if ( counter & ( 1u << i ) )
+               {
+                  neighbor = std::min( base[i] + 1, data.m_InputSize[i] - 1 );
+                  overlap *= distance[i];
+               }
+               else
+               {
+                  neighbor = std::max( base[i], 0L );
+                  overlap *= 1.0 - distance[i];
+               }
+               neighborOffset += neighbor * data.m_InputStride[i];
+            }
+            if ( overlap )
+            {
+               value += overlap * static_cast<double>( static_cast<float>( data.m_Input[neighborOffset] ) );
+            }
+         }
+         output[x] = static_cast<MatlabPixelType>( static_cast<float>( value ) );
+      }
+   }
+
+   return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+void warpchain(int nlhs,
+               mxArray *plhs[],
+               int nrhs,
+               const mxArray *prhs[])
+{
+   typedef WarpChainData<MatlabPixelType, Dimension> DataType;
+
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+   const unsigned int numberOfThreads = mexGetNumberOfThreads( opts );
+
+   DataType data;
+   data.m_Input = static_cast<const MatlabPixelType *>( mxGetData(prhs[0]) );
+   long stride = 1;
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      data.m_InputSize[d] = static_cast<long>( mxGetDimensions(prhs[0])[d] );
+      data.m_InputStride[d] = stride;
+      stride *= data.m_InputSize[d];
+   }
+
+   // The output size, needed by the default centers of the affine
+   // transforms, is that of the first field unless given
+   const mxArray * chainArray = prhs[1];
+   const size_t numberOfElements = mxGetNumberOfElements(chainArray);
+   std::copy( data.m_InputSize, data.m_InputSize+Dimension, data.m_OutputSize );
+   for (size_t n=0; n<numberOfElements; n++)
+   {
+      const mxArray * element = mxGetCell(chainArray, n);
+      const std::string type = mexGetStringOption(element, "type", "");
+      if ( type == "displacement" || type == "velocity" )
+      {
+         const mxArray * component = mxGetField(element, 0, "x");
+         if ( component && mxGetNumberOfDimensions(component) == Dimension )
+         {
+            for (unsigned int d=0; d<Dimension; d++)
+            {
+               data.m_OutputSize[d] = static_cast<long>( mxGetDimensions(component)[d] );
+            }
+         }
+         break;
+      }
+   }
+   const mxArray * sizeArray = mexGetOptionField(opts, "size");
+   if ( sizeArray && !mxIsEmpty(sizeArray) )
+   {
+      if ( !mxIsDouble(sizeArray) || mxGetNumberOfElements(sizeArray) != Dimension )
+      {
+         mexErrMsgTxt("Option size must be a vector of d doubles.");
+      }
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         if ( mxGetPr(sizeArray)[d] < 1 )
+         {
+            mexErrMsgTxt("Option size must be positive.");
+         }
+         data.m_OutputSize[d] = static_cast<long>( mxGetPr(sizeArray)[d] );
+      }
+   }
+
+   TransformChain<Dimension> chain;
+   for (size_t n=0; n<numberOfElements; n++)
+   {
+      const mxArray * element = mxGetCell(chainArray, n);
+      const std::string type = mexGetStringOption(element, "type", "");
+      if ( type == "affine" )
+      {
+         chain.AddAffine( element, data.m_OutputSize );
+      }
+      else if ( type == "displacement" || type == "velocity" )
+      {
+         chain.AddField( element, type == "velocity", numberOfThreads );
+      }
+      else
+      {
+         mexErrMsgTxt("The type of a transform must be 'affine', 'displacement' or 'velocity'.");
+      }
+   }
+   data.m_Chain = &chain;
+
+   const std::string interpolation = mexGetStringOption(opts, "interpolation", "linear");
+   if ( interpolation != "linear" && interpolation != "nearest" )
+   {
+      mexErrMsgTxt("Option interpolation must be 'linear' or 'nearest'.");
+   }
+   data.m_Nearest = ( interpolation == "nearest" );
+
+   // Allocate output
+   mwSize matlabdims[Dimension];
+   size_t numPix = 1;
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      matlabdims[d] = data.m_OutputSize[d];
+      numPix *= data.m_OutputSize[d];
+   }
+   plhs[0] = mxCreateNumericArray( Dimension, matlabdims, mxGetClassID(prhs[0]), mxREAL );
+   data.m_Output = static_cast<MatlabPixelType *>( mxGetData(plhs[0]) );
+   data.m_NumberOfRows = numPix / data.m_OutputSize[0];
+
+   unsigned int threads = numberOfThreads;
+   if ( threads == 0 )
+   {
+      threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+   }
+   threads = std::max( 1u, std::min( threads, static_cast<unsigned int>(
+      itk::MultiThreader::GetGlobalMaximumNumberOfThreads() ) ) );
+   data.m_RowsPerThread = ( data.m_NumberOfRows + threads - 1 ) / threads;
+
+   // Warp the image
+   if ( threads == 1 || data.m_NumberOfRows <= 1 )
+   {
+      data.m_RowsPerThread = data.m_NumberOfRows;
+      itk::MultiThreader::ThreadInfoStruct info;
+      info.ThreadID = 0;
+      info.UserData = &data;
+      WarpChainThreaderCallback<MatlabPixelType, Dimension>( &info );
+   }
+   else
+   {
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      threader->SetNumberOfThreads( threads );
+      threader->SetSingleMethod( WarpChainThreaderCallback<MatlabPixelType, Dimension>, &data );
+      threader->SingleMethodExecute();
+   }
+}
+
+
+void mexFunction(int nlhs,
+                 mxArray *plhs[],
+                 int nrhs,
+                 const mxArray *prhs[])
+{
+   /* Check for proper number of arguments: the image and the chain. An
+      options struct may follow. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   if ( nargs != 2 )
+   {
+      mexErrMsgTxt("Two inputs required, optionally followed by an options struct.");
+   }
+
+   const mxClassID classID = mxGetClassID(prhs[0]);
+   if ( mxIsComplex(prhs[0]) )
+   {
+      mexErrMsgTxt("Input must be a noncomplex floating point.");
+   }
+
+   if ( !mxIsCell(prhs[1]) )
+   {
+      mexErrMsgTxt("The chain must be a cell array of structs.");
+   }
+   for (size_t n=0; n<mxGetNumberOfElements(prhs[1]); n++)
+   {
+      const mxArray * element = mxGetCell(prhs[1], n);
+      if ( !element || !mxIsStruct(element) || mxGetNumberOfElements(element) != 1 )
+      {
+         mexErrMsgTxt("The chain must be a cell array of structs.");
+      }
+   }
+
+   if (nlhs != 1)
+   {
+      mexErrMsgTxt("Number of outputs must be one.");
+   }
+
+   const int dim = mxGetNumberOfDimensions(prhs[0]);
+   switch ( dim )
+   {
+   case 2:
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            warpchain<float,2>(nlhs, plhs, nrhs, prhs);
+            break;
+         case mxDOUBLE_CLASS:
+            warpchain<double,2>(nlhs, plhs, nrhs, prhs);
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+      break;
+   case 3:
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            warpchain<float,3>(nlhs, plhs, nrhs, prhs);
+            break;
+         case mxDOUBLE_CLASS:
+            warpchain<double,3>(nlhs, plhs, nrhs, prhs);
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+      break;
+   default:
+      mexErrMsgTxt("Dimension unsupported.");
+   }
+
+   return;
+}
+
+
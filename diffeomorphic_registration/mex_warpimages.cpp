@@ -0,0 +1,376 @@
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// warped = warpimages(images, dx, dy, (dz), (options))
+//
+// Warps several images through the same deformation field, as many calls
+// to warpimage would: linear interpolation, NaN for the voxels mapped
+// outside the image. images is either an array whose last dimension runs
+// over the images (e.g. x*y*z*n for 3-D fields) or a cell array of images
+// of the size of the field; warped has the same form.
+//
+// The field is read in place. For each row along x, the interpolation
+// cell and weights of every voxel are computed once, then applied to all
+// the images, so that the cost of the field is paid once whatever the
+// number of images. The rows are shared between threads (option
+// num_threads).
+
+template <class MatlabPixelType, unsigned int Dimension>
+struct WarpImagesData
+{
+   const mexPlanarField<MatlabPixelType, Dimension> * m_Field;
+   std::vector<const MatlabPixelType *>  m_Inputs;
+   std::vector<MatlabPixelType *>        m_Outputs;
+   long            m_Size[Dimension];
+   long            m_Stride[Dimension];
+   size_t          m_NumberOfRows;
+   size_t          m_RowsPerThread;
+};
+
+template <class MatlabPixelType, unsigned int Dimension>
+ITK_THREAD_RETURN_TYPE WarpImagesThreaderCallback(void * arg)
+{
+   typedef WarpImagesData<MatlabPixelType, Dimension> DataType;
+   const unsigned int numberOfNeighbors = 1u << Dimension;
+
+   itk::MultiThreader::ThreadInfoStruct * info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+   const DataType & data = *static_cast<const DataType *>( info->UserData );
+
+   const size_t firstRow = info->ThreadID * data.m_RowsPerThread;
+   const size_t endRow = std::min( firstRow + data.m_RowsPerThread, data.m_NumberOfRows );
+   const long rowLength = data.m_Size[0];
+   const size_t numberOfImages = data.m_Inputs.size();
+
+   // Interpolation cell of the voxels of the current row: the offsets of
+   // its corners and their weights, no corners if mapped outside
+   std::vector<long> offsets( rowLength * numberOfNeighbors );
+   std::vector<double> weights( rowLength * numberOfNeighbors );
+   std::vector<bool> inside( rowLength );
+
+   const float padding = std::numeric_limits<float>::quiet_NaN();
+
+   for (size_t row=firstRow; row<endRow; row++)
+   {
+      const long rowStart = static_cast<long>(row) * rowLength;
+
+      long index[Dimension];
+      size_t coordinates = row;
+      index[0] = 0;
+      for (unsigned int d=1; d<Dimension; d++)
+      {
+         index[d] = static_cast<long>( coordinates % data.m_Size[d] );
+         coordinates /= data.m_Size[d];
+      }
+
+      for (long x=0; x<rowLength; x++)
+      {
+         index[0] = x;
+
+         // continuous index of the displaced voxel, inside if within half
+         // a voxel of the image
+         long base[Dimension];
+         double distance[Dimension];
+         bool in = true;
+         for (unsigned int i=0; i<Dimension && in; i++)
+         {
+            const double cindex = static_cast<double>( index[i] )
+               + static_cast<double>( static_cast<float>( data.m_Field->Get(rowStart+x, i) ) );
+            in = ( cindex >= -0.5 && cindex < static_cast<double>( data.m_Size[i] ) - 0.5 );
+            base[i] = static_cast<long>( std::floor( cindex ) );
+            distance[i] = cindex - static_cast<double>( base[i] );
+         }
+         inside[x] = in;
+         if ( !in )
+         {
+            continue;
+         }
+
+         long * cellOffsets = &offsets[x*numberOfNeighbors];
+         double * cellWeights = &weights[x*numberOfNeighbors];
+         for (unsigned int counter=0; counter<numberOfNeighbors; counter++)
+         {
+            double overlap = 1.0;
+            long neighborOffset = 0;
+            unsigned int upper = counter;
+            for (unsigned int i=0; i<Dimension; i++)
+            {
+               long neighbor;
+               if ( upper & 1 )
+               {
+                  neighbor = std::min( base[i] + 1, data.m_Size[i] - 1 );
+                  overlap *= distance[i];
+               }
+               else
+               {
+                  neighbor = std::max( base[i], 0L );
+                  overlap *= 1.0 - distance[i];
+               }
+               neighborOffset += neighbor * data.m_Stride[i];
+               upper >>= 1;
+            }
+            cellOffsets[counter] = neighborOffset;
+            cellWeights[counter] = overlap;
+         }
+      }
+
+      // the same cells for all the images, interpolated in float as the
+      // images of warpimage
+      for (size_t n=0; n<numberOfImages; n++)
+      {
+         const MatlabPixelType * input = data.m_Inputs[n];
+         MatlabPixelType * output = data.m_Outputs[n] + rowStart;
+         for (long x=0; x<rowLength; x++)
+         {
+            if ( !inside[x] )
+            {
+               output[x] = static_cast<MatlabPixelType>( padding );
+               continue;
+            }
+            const long * cellOffsets = &offsets[x*numberOfNeighbors];
+            const double * cellWeights = &weights[x*numberOfNeighbors];
+            double value = 0.0;
+            for (unsigned int counter=0; counter<numberOfNeighbors; counter++)
+            {
+               if ( cellWeights[counter] )
+               {
+                  value += cellWeights[counter] * static_cast<double>(
+                     static_cast<float>( input[cellOffsets[counter]] ) );
+               }
+            }
+            output[x] = static_cast<MatlabPixelType>( static_cast<float>( value ) );
+         }
+      }
+   }
+
+   return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+void warpimages(int nlhs,
+                mxArray *plhs[],
+                int nrhs,
+                const mxArray *prhs[])
+{
+   typedef WarpImagesData<MatlabPixelType, Dimension> DataType;
+
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+   const mxClassID classID = mxGetClassID(prhs[1]);
+
+   // The field is read in place
+   const mexPlanarField<MatlabPixelType, Dimension> field( prhs + 1 );
+   const size_t numPix = field.GetNumberOfPixels();
+
+   DataType data;
+   data.m_Field = &field;
+   long stride = 1;
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      data.m_Size[d] = static_cast<long>( mxGetDimensions(prhs[1])[d] );
+      data.m_Stride[d] = stride;
+      stride *= data.m_Size[d];
+   }
+   data.m_NumberOfRows = data.m_Size[0] ? numPix / data.m_Size[0] : 0;
+
+   // Inputs and outputs, in the form of the images
+   if ( mxIsCell(prhs[0]) )
+   {
+      const size_t numberOfImages = mxGetNumberOfElements(prhs[0]);
+      plhs[0] = mxCreateCellArray( mxGetNumberOfDimensions(prhs[0]), mxGetDimensions(prhs[0]) );
+      for (size_t n=0; n<numberOfImages; n++)
+      {
+         const mxArray * image = mxGetCell(prhs[0], n);
+         mxArray * warped = mxCreateNumericArray( Dimension, mxGetDimensions(prhs[1]), classID, mxREAL );
+         mxSetCell( plhs[0], n, warped );
+         data.m_Inputs.push_back( static_cast<const MatlabPixelType *>( mxGetData(image) ) );
+         data.m_Outputs.push_back( static_cast<MatlabPixelType *>( mxGetData(warped) ) );
+      }
+   }
+   else
+   {
+      const size_t numberOfImages = numPix ? mxGetNumberOfElements(prhs[0]) / numPix : 0;
+      plhs[0] = mxCreateNumericArray( mxGetNumberOfDimensions(prhs[0]), mxGetDimensions(prhs[0]), classID, mxREAL );
+      const MatlabPixelType * input = static_cast<const MatlabPixelType *>( mxGetData(prhs[0]) );
+      MatlabPixelType * output = static_cast<MatlabPixelType *>( mxGetData(plhs[0]) );
+      for (size_t n=0; n<numberOfImages; n++)
+      {
+         data.m_Inputs.push_back( input + n*numPix );
+         data.m_Outputs.push_back( output + n*numPix );
+      }
+   }
+
+   if ( data.m_Inputs.empty() || data.m_NumberOfRows == 0 )
+   {
+      return;
+   }
+
+   unsigned int numberOfThreads = mexGetNumberOfThreads( opts );
+   if ( numberOfThreads == 0 )
+   {
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+   }
+   numberOfThreads = std::max( 1u, std::min( numberOfThreads, static_cast<unsigned int>(
+      itk::MultiThreader::GetGlobalMaximumNumberOfThreads() ) ) );
+   data.m_RowsPerThread = ( data.m_NumberOfRows + numberOfThreads - 1 ) / numberOfThreads;
+
+   // Warp the images
+   if ( numberOfThreads == 1 || data.m_NumberOfRows <= 1 )
+   {
+      data.m_RowsPerThread = data.m_NumberOfRows;
+      itk::MultiThreader::ThreadInfoStruct info;
+      info.ThreadID = 0;
+      info.UserData = &data;
+      WarpImagesThreaderCallback<MatlabPixelType, Dimension>( &info );
+   }
+   else
+   {
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      threader->SetNumberOfThreads( numberOfThreads );
+      threader->SetSingleMethod( WarpImagesThreaderCallback<MatlabPixelType, Dimension>, &data );
+      threader->SingleMethodExecute();
+   }
+}
+
+
+// Whether the images of prhs[0] match the field: a cell array of arrays of
+// the size of the field, or an array of its size followed by the number of
+// images
+bool warpimagesCheckImages(const mxArray * images, const mxArray * field, int dim, mxClassID classID)
+{
+   const mwSize * fieldSize = mxGetDimensions(field);
+
+   if ( mxIsCell(images) )
+   {
+      for (size_t n=0; n<mxGetNumberOfElements(images); n++)
+      {
+         const mxArray * image = mxGetCell(images, n);
+         if ( !image || mxGetClassID(image)!=classID || mxIsComplex(image)
+              || mxGetNumberOfDimensions(image) != dim )
+         {
+            return false;
+         }
+         for (int dd=0; dd<dim; dd++)
+         {
+            if ( mxGetDimensions(image)[dd] != fieldSize[dd] )
+            {
+               return false;
+            }
+         }
+      }
+      return true;
+   }
+
+   if ( mxGetClassID(images)!=classID || mxIsComplex(images) )
+   {
+      return false;
+   }
+   // MATLAB drops the trailing singleton dimension of a single image
+   const int imageDim = mxGetNumberOfDimensions(images);
+   if ( imageDim != dim && imageDim != dim+1 )
+   {
+      return false;
+   }
+   for (int dd=0; dd<dim; dd++)
+   {
+      if ( mxGetDimensions(images)[dd] != fieldSize[dd] )
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+void mexFunction(int nlhs,
+                 mxArray *plhs[],
+                 int nrhs,
+                 const mxArray *prhs[])
+{
+   /* Check for proper number of arguments. An options struct may follow. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   if (nargs!=3 and nargs!=4)
+   {
+      mexErrMsgTxt("3 or 4 inputs required, optionally followed by an options struct.");
+   }
+
+   const int dim=nargs-1;
+
+   const mxClassID classID = mxGetClassID(prhs[1]);
+
+   /* The field components must be noncomplex floating point matrices.*/
+   for (int n=1; n<nargs; n++)
+   {
+      if ( mxGetClassID(prhs[n])!=classID || mxIsComplex(prhs[n]) )
+      {
+         mexErrMsgTxt("Input must be a noncomplex floating point.");
+      }
+
+      if ( mxGetNumberOfDimensions(prhs[n]) != dim )
+      {
+         mexErrMsgTxt("The dimension of the field must agree with the number of inputs.");
+      }
+
+      for (int dd=0; dd<dim; dd++)
+      {
+         if ( mxGetDimensions(prhs[n])[dd] != mxGetDimensions(prhs[1])[dd] )
+         {
+            mexErrMsgTxt("Inputs must have the same size.");
+         }
+      }
+   }
+
+   if ( !warpimagesCheckImages(prhs[0], prhs[1], dim, classID) )
+   {
+      mexErrMsgTxt("The images must be an array of the size of the field followed by the number of images, or a cell array of arrays of the size of the field, of the class of the field.");
+   }
+
+   if (nlhs != 1)
+   {
+      mexErrMsgTxt("Number of outputs must be one.");
+   }
+
+   switch ( dim )
+   {
+   case 2:
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            warpimages<float,2>(nlhs, plhs, nrhs, prhs);
+            break;
+         case mxDOUBLE_CLASS:
+            warpimages<double,2>(nlhs, plhs, nrhs, prhs);
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+      break;
+   case 3:
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            warpimages<float,3>(nlhs, plhs, nrhs, prhs);
+            break;
+         case mxDOUBLE_CLASS:
+            warpimages<double,3>(nlhs, plhs, nrhs, prhs);
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+      break;
+   default:
+      mexErrMsgTxt("Dimension unsupported.");
+   }
+
+   return;
+}
+
+
@@ -7,6 +7,18 @@
 
 #include <mex.h>
 
+#include "mex_itkimage.h"
+#include "mex_options.h"
+#include "mex_tiledwarp.h"
+
+// warped = warplabelimage(image, dx, dy, (dz), (options))
+//
+// Nearest neighbour interpolation, NaN outside the image.
+//
+// Options:
+//   memory_budget  megabytes held at once by warping slabs of slices along
+//                  the last axis, same result (default 0: whole image)
+
 template <class MatlabPixelType, unsigned int Dimension>
 void warplabelimage(int nlhs,
                mxArray *plhs[],
@@ -28,70 +40,39 @@ void warplabelimage(int nlhs,
    //boost::timer timer;
 
 
-   // Allocate images and deformation field
-   typename ImageType::Pointer image
-      = ImageType::New();
-   typename DeformationFieldType::Pointer field
-      = DeformationFieldType::New();
-   
-   typename DeformationFieldType::SpacingType spacing;
-   spacing.Fill( 1.0 );
-   
-   typename DeformationFieldType::PointType origin;
-   origin.Fill( 0.0 );
-   
-   typename DeformationFieldType::RegionType     region;
-   typename DeformationFieldType::SizeType       size;
-   typename DeformationFieldType::IndexType      start;
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
 
-   typename InterpolatorType::Pointer interp = InterpolatorType::New();
-      
-   unsigned int numPix(1u);
-   const MatlabPixelType * iminptr =  static_cast<const MatlabPixelType *>(mxGetData(prhs[0]));
-   const MatlabPixelType * fieldinptrs[Dimension];
-   mwSize matlabdims[Dimension];
-   for (unsigned int d=0; d<Dimension; d++)
+   // With a memory budget, warp by slabs of slices (see mex_tiledwarp.h)
+   const double budget = mexGetMemoryBudget( opts );
+   if ( budget > 0 )
    {
-      matlabdims[d]= mxGetDimensions(prhs[0])[d];
-      size[d] = matlabdims[d];
-      start[d] = 0;
-      numPix *= size[d];
+      typename ImageType::SpacingType spacing;
+      typename ImageType::PointType   origin;
+      spacing.Fill( 1.0 );
+      origin.Fill( 0.0 );
+
+      typename WarperType::Pointer warper = WarperType::New();
+      warper->SetInterpolator( InterpolatorType::New() );
+      warper->SetOutputSpacing( spacing );
+      warper->SetOutputOrigin( origin );
+      if ( std::numeric_limits<PixelType>::has_quiet_NaN )
+      {
+         warper->SetEdgePaddingValue( std::numeric_limits<PixelType>::quiet_NaN() );
+      }
 
-      fieldinptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[1+d]));
+      plhs[0] = mxCreateNumericArray( Dimension, mxGetDimensions(prhs[0]), mxGetClassID(prhs[0]), mxREAL );
+      mexTiledWarp<MatlabPixelType>( warper.GetPointer(), prhs[0], prhs + 1, budget, plhs[0] );
+      return;
    }
-   
-   region.SetSize( size );
-   region.SetIndex( start );
-
-   image->SetOrigin( origin );
-   image->SetSpacing( spacing );
-   image->SetRegions( region );
-   image->Allocate();
-   
-   field->SetOrigin( origin );
-   field->SetSpacing( spacing );
-   field->SetRegions( region );
-   field->Allocate();
-
 
-   //mexPrintf("done Allocate(); %f sec\n", timer.elapsed());
-   //timer.restart();
+   // The image wraps the MATLAB buffer when it is single, the deformation
+   // field is interleaved
+   typename ImageType::Pointer image =
+      mexImportImage<ImageType, MatlabPixelType>( prhs[0] );
+   typename DeformationFieldType::Pointer field =
+      mexImportField<DeformationFieldType, MatlabPixelType>( prhs + 1 );
 
-   
-   PixelType * imptr = image->GetBufferPointer();
-   const PixelType * const buff_end = imptr + numPix;
-   VectorPixelType * fieldptr = field->GetBufferPointer();
-   
-   while ( imptr != buff_end )
-   {
-      *imptr++ = *iminptr++;
-         
-      for (unsigned int d=0; d<Dimension; d++)
-      {
-         (*fieldptr)[d] = *(fieldinptrs[d])++;
-      }
-      ++fieldptr;
-   }
+   typename InterpolatorType::Pointer interp = InterpolatorType::New();
 
    //mz::writeRaw<ImageType>(fixedimage,"fixedimage.mha");
    //mz::writeRaw<ImageType>(movingimage,"movingimage.mha");
@@ -103,8 +84,8 @@ void warplabelimage(int nlhs,
    typename WarperType::Pointer warper = WarperType::New();
    warper->SetInterpolator( interp );
    warper->SetInput( image );
-   warper->SetOutputSpacing( spacing );
-   warper->SetOutputOrigin( origin );
+   warper->SetOutputSpacing( image->GetSpacing() );
+   warper->SetOutputOrigin( image->GetOrigin() );
    warper->SetDeformationField( field );
    if ( std::numeric_limits<PixelType>::has_quiet_NaN )
    {
@@ -117,20 +98,8 @@ void warplabelimage(int nlhs,
    //timer.restart();
 
 
-   // Allocate output
-   const mxClassID classID = mxGetClassID(prhs[0]);
-   plhs[0] = mxCreateNumericArray(
-      Dimension, matlabdims, classID, mxREAL);
-   MatlabPixelType * outptr = static_cast<MatlabPixelType *>(mxGetData(plhs[0]));
-   
-   //mexPrintf("done allocate output %f sec\n", timer.elapsed());
-   //timer.restart();
-   
-
-   // put result into output
-   const PixelType * warpptr = warper->GetOutput()->GetBufferPointer();
-   //mz::copy(warpptr, warpptr + numPix, outptr);
-   std::copy(warpptr, warpptr + numPix, outptr);
+   // Allocate output and copy the result
+   plhs[0] = mexExportImage<MatlabPixelType>( warper->GetOutput(), mxGetClassID(prhs[0]) );
 
    //mexPrintf("done outputs copy %f sec\n", timer.elapsed());
 }
@@ -141,18 +110,19 @@ void mexFunction(int nlhs,
                  int nrhs,
                  const mxArray *prhs[])
 {
-   /* Check for proper number of arguments. */
-   if (nrhs!=3 and nrhs!=4)
+   /* Check for proper number of arguments. An options struct may follow. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   if (nargs!=3 and nargs!=4)
    {
-      mexErrMsgTxt("3 or 4 inputs required.");
+      mexErrMsgTxt("3 or 4 inputs required, optionally followed by an options struct.");
    }
 
-   const int dim=nrhs-1;
+   const int dim=nargs-1;
 
    const mxClassID classID = mxGetClassID(prhs[0]);
 
    /* The inputs must be noncomplex double matrices.*/
-   for (int n=0; n<nrhs; n++)
+   for (int n=0; n<nargs; n++)
    {
       if ( mxGetClassID(prhs[n])!=classID || mxIsComplex(prhs[n]) )
       {
@@ -0,0 +1,349 @@
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// [labels, (toplabels, topprobs)] = warplabels(labelimage, dx, dy, (dz), (options))
+//
+// Warps a label image through a deformation field. The trilinear weights
+// of the corners of the interpolation cell of each voxel are added up per
+// label, and labels is the label of largest weight: a vote among the
+// neighbours instead of the single nearest one of warplabelimage, which
+// aliases thin structures. Ties go to the smallest label.
+//
+// toplabels and topprobs, of the size of the image followed by k (option
+// top_k, default 2), list the k labels of largest weight at each voxel and
+// their weights, which add up to one over all the labels, in decreasing
+// order. Voxels with fewer than k labels around them are padded with a NaN
+// label and a zero weight. Voxels mapped more than half a voxel outside
+// the image get a NaN label and no weights, as in warplabelimage.
+//
+// The field is read in place. The weights are gathered in a map of at
+// most 2^dim entries on the stack. The rows along x are shared between
+// threads (option num_threads).
+
+template <class MatlabPixelType, unsigned int Dimension>
+struct WarpLabelsData
+{
+   const mexPlanarField<MatlabPixelType, Dimension> * m_Field;
+   const MatlabPixelType * m_Input;
+   MatlabPixelType *       m_Labels;
+   MatlabPixelType *       m_TopLabels;
+   MatlabPixelType *       m_TopProbabilities;
+   unsigned int    m_TopK;
+   long            m_Size[Dimension];
+   long            m_Stride[Dimension];
+   size_t          m_NumberOfPixels;
+   size_t          m_NumberOfRows;
+   size_t          m_RowsPerThread;
+};
+
+template <class MatlabPixelType, unsigned int Dimension>
+ITK_THREAD_RETURN_TYPE WarpLabelsThreaderCallback(void * arg)
+{
+   typedef WarpLabelsData<MatlabPixelType, Dimension> DataType;
+   const unsigned int numberOfNeighbors = 1u << Dimension;
+
+   itk::MultiThreader::ThreadInfoStruct * info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+   const DataType & data = *static_cast<const DataType *>( info->UserData );
+
+   const size_t firstRow = info->ThreadID * data.m_RowsPerThread;
+   const size_t endRow = std::min( firstRow + data.m_RowsPerThread, data.m_NumberOfRows );
+   const long rowLength = data.m_Size[0];
+
+   const MatlabPixelType padding = static_cast<MatlabPixelType>( std::numeric_limits<float>::quiet_NaN() );
+
+   for (size_t row=firstRow; row<endRow; row++)
+   {
+      const long rowStart = static_cast<long>(row) * rowLength;
+
+      long index[Dimension];
+      size_t coordinates = row;
+      index[0] = 0;
+      for (unsigned int d=1; d<Dimension; d++)
+      {
+         index[d] = static_cast<long>( coordinates % data.m_Size[d] );
+         coordinates /= data.m_Size[d];
+      }
+
+      for (long x=0; x<rowLength; x++)
+      {
+         const long offset = rowStart + x;
+         index[0] = x;
+
+         // continuous index of the displaced voxel, inside if within half
+         // a voxel of the image
+         long base[Dimension];
+         double distance[Dimension];
+         bool inside = true;
+         for (unsigned int i=0; i<Dimension && inside; i++)
+         {
+            const double cindex = static_cast<double>( index[i] )
+               + static_cast<double>( static_cast<float>( data.m_Field->Get(offset, i) ) );
+            inside = ( cindex >= -0.5 && cindex < static_cast<double>( data.m_Size[i] ) - 0.5 );
+            base[i] = static_cast<long>( std::floor( cindex ) );
+            distance[i] = cindex - static_cast<double>( base[i] );
+         }
+
+         // weight of each distinct label of the cell
+         float labels[numberOfNeighbors];
+         double weights[numberOfNeighbors];
+         unsigned int numberOfLabels = 0;
+         for (unsigned int counter=0; inside && counter<numberOfNeighbors; counter++)
+         {
+            double overlap = 1.0;
+            long neighborOffset = 0;
+            unsigned int upper = counter;
+            for (unsigned int i=0; i<Dimension; i++)
+            {
+               long neighbor;
+               if ( upper & 1 )
+               {
+                  neighbor = std::min( base[i] + 1, data.m_Size[i] - 1 );
+                  overlap *= distance[i];
+               }
+               else
+               {
+                  neighbor = std::max( base[i], 0L );
+                  overlap *= 1.0 - distance[i];
+               }
+               neighborOffset += neighbor * data.m_Stride[i];
+               upper >>= 1;
+            }
+            if ( !overlap )
+            {
+               continue;
+            }
+
+            const float label = static_cast<float>( data.m_Input[neighborOffset] );
+            unsigned int l = 0;
+            while ( l < numberOfLabels && labels[l] != label )
+            {
+               l++;
+            }
+            if ( l == numberOfLabels )
+            {
+               labels[l] = label;
+               weights[l] = 0.0;
+               numberOfLabels++;
+            }
+            weights[l] += overlap;
+         }
+
+         // sort by decreasing weight, then increasing label; a handful of
+         // entries at most
+         for (unsigned int l=1; l<numberOfLabels; l++)
+         {
+            const float label = labels[l];
+            const double weight = weights[l];
+            unsigned int m = l;
+            while ( m > 0 && ( weights[m-1] < weight
+                               || ( weights[m-1] == weight && labels[m-1] > label ) ) )
+            {
+               labels[m] = labels[m-1];
+               weights[m] = weights[m-1];
+               m--;
+            }
+            labels[m] = label;
+            weights[m] = weight;
+         }
+
+         data.m_Labels[offset] = numberOfLabels ? static_cast<MatlabPixelType>( labels[0] ) : padding;
+
+         if ( data.m_TopLabels )
+         {
+            for (unsigned int k=0; k<data.m_TopK; k++)
+            {
+               const size_t topOffset = offset + k * data.m_NumberOfPixels;
+               if ( k < numberOfLabels )
+               {
+                  data.m_TopLabels[topOffset] = static_cast<MatlabPixelType>( labels[k] );
+                  data.m_TopProbabilities[topOffset] = static_cast<MatlabPixelType>( weights[k] );
+               }
+               else
+               {
+                  data.m_TopLabels[topOffset] = padding;
+                  data.m_TopProbabilities[topOffset] = 0;
+               }
+            }
+         }
+      }
+   }
+
+   return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+void warplabels(int nlhs,
+                mxArray *plhs[],
+                int nrhs,
+                const mxArray *prhs[])
+{
+   typedef WarpLabelsData<MatlabPixelType, Dimension> DataType;
+
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+   const mxClassID classID = mxGetClassID(prhs[0]);
+
+   // The image and the field are read in place
+   const mexPlanarField<MatlabPixelType, Dimension> field( prhs + 1 );
+
+   DataType data;
+   data.m_Field = &field;
+   data.m_Input = static_cast<const MatlabPixelType *>( mxGetData(prhs[0]) );
+   data.m_NumberOfPixels = field.GetNumberOfPixels();
+   long stride = 1;
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      data.m_Size[d] = static_cast<long>( mxGetDimensions(prhs[0])[d] );
+      data.m_Stride[d] = stride;
+      stride *= data.m_Size[d];
+   }
+   data.m_NumberOfRows = data.m_Size[0] ? data.m_NumberOfPixels / data.m_Size[0] : 0;
+
+   // Allocate outputs
+   plhs[0] = mxCreateNumericArray( Dimension, mxGetDimensions(prhs[0]), classID, mxREAL );
+   data.m_Labels = static_cast<MatlabPixelType *>( mxGetData(plhs[0]) );
+   data.m_TopLabels = NULL;
+   data.m_TopProbabilities = NULL;
+   data.m_TopK = 0;
+   if ( nlhs == 3 )
+   {
+      const double topK = mexGetScalarOption(opts, "top_k", 2.0);
+      if ( topK < 1 || topK > ( 1u << Dimension ) )
+      {
+         mexErrMsgTxt("Option top_k must be between 1 and 2^dim.");
+      }
+      data.m_TopK = static_cast<unsigned int>( topK );
+
+      mwSize dims[Dimension+1];
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         dims[d] = mxGetDimensions(prhs[0])[d];
+      }
+      dims[Dimension] = data.m_TopK;
+      plhs[1] = mxCreateNumericArray( Dimension+1, dims, classID, mxREAL );
+      plhs[2] = mxCreateNumericArray( Dimension+1, dims, classID, mxREAL );
+      data.m_TopLabels = static_cast<MatlabPixelType *>( mxGetData(plhs[1]) );
+      data.m_TopProbabilities = static_cast<MatlabPixelType *>( mxGetData(plhs[2]) );
+   }
+
+   if ( data.m_NumberOfRows == 0 )
+   {
+      return;
+   }
+
+   unsigned int numberOfThreads = mexGetNumberOfThreads( opts );
+   if ( numberOfThreads == 0 )
+   {
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+   }
+   numberOfThreads = std::max( 1u, std::min( numberOfThreads, static_cast<unsigned int>(
+      itk::MultiThreader::GetGlobalMaximumNumberOfThreads() ) ) );
+   data.m_RowsPerThread = ( data.m_NumberOfRows + numberOfThreads - 1 ) / numberOfThreads;
+
+   // Warp the labels
+   if ( numberOfThreads == 1 || data.m_NumberOfRows <= 1 )
+   {
+      data.m_RowsPerThread = data.m_NumberOfRows;
+      itk::MultiThreader::ThreadInfoStruct info;
+      info.ThreadID = 0;
+      info.UserData = &data;
+      WarpLabelsThreaderCallback<MatlabPixelType, Dimension>( &info );
+   }
+   else
+   {
+      itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+      threader->SetNumberOfThreads( numberOfThreads );
+      threader->SetSingleMethod( WarpLabelsThreaderCallback<MatlabPixelType, Dimension>, &data );
+      threader->SingleMethodExecute();
+   }
+}
+
+
+void mexFunction(int nlhs,
+                 mxArray *plhs[],
+                 int nrhs,
+                 const mxArray *prhs[])
+{
+   /* Check for proper number of arguments. An options struct may follow. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   if (nargs!=3 and nargs!=4)
+   {
+      mexErrMsgTxt("3 or 4 inputs required, optionally followed by an options struct.");
+   }
+
+   const int dim=nargs-1;
+
+   const mxClassID classID = mxGetClassID(prhs[0]);
+
+   /* The inputs must be noncomplex floating point matrices.*/
+   for (int n=0; n<nargs; n++)
+   {
+      if ( mxGetClassID(prhs[n])!=classID || mxIsComplex(prhs[n]) )
+      {
+         mexErrMsgTxt("Input must be a noncomplex floating point.");
+      }
+
+      if ( mxGetNumberOfDimensions(prhs[n]) != dim )
+      {
+         mexErrMsgTxt("The dimension of the inputs must agree with the number of inputs.");
+      }
+
+      for (int dd=0; dd<dim; dd++)
+      {
+         if ( mxGetDimensions(prhs[n])[dd] != mxGetDimensions(prhs[0])[dd] )
+         {
+            mexErrMsgTxt("Inputs must have the same size.");
+         }
+      }
+   }
+
+   if (nlhs != 1 and nlhs != 3)
+   {
+      mexErrMsgTxt("Number of outputs must be one, or three for the top labels and their weights.");
+   }
+
+   switch ( dim )
+   {
+   case 2:
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            warplabels<float,2>(nlhs, plhs, nrhs, prhs);
+            break;
+         case mxDOUBLE_CLASS:
+            warplabels<double,2>(nlhs, plhs, nrhs, prhs);
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+      break;
+   case 3:
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            warplabels<float,3>(nlhs, plhs, nrhs, prhs);
+            break;
+         case mxDOUBLE_CLASS:
+            warplabels<double,3>(nlhs, plhs, nrhs, prhs);
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+      break;
+   default:
+      mexErrMsgTxt("Dimension unsupported.");
+   }
+
+   return;
+}
+
+
@@ -0,0 +1,596 @@
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <mex.h>
+
+#include "mex_itkimage.h"
+#include "mex_options.h"
+
+// h = warpplan('create', dx, dy, (dz), (options))
+// warped = warpplan('apply', h, images, (options))
+// warpplan('destroy', h)
+//
+// A warp plan keeps what warpimage recomputes from the deformation field
+// at every call: for each voxel, whether it is mapped inside the image
+// (within half a voxel of it), the offset of its interpolation cell and
+// its position in the cell along each axis, from which the trilinear
+// weights of the corners follow. 'apply' then warps any number of images
+// of the size of the field by streaming through the plan, without reading
+// the field again.
+//
+// images is an image, an array whose last dimension runs over the images,
+// or a cell array of images, single or double; warped has the same form
+// and class. As warpimage, the interpolation is done in float and the
+// voxels mapped outside are NaN.
+//
+// Options of 'create':
+//   num_threads  threads used (default: ITK default)
+//   weight_bits  32 (default) stores the positions in float, 16 as 16 bit
+//                fixed point, the weights then being exact to 2^-16. A
+//                voxel takes a 4 byte cell offset, a flag byte and one
+//                position per axis: 17 bytes in 3-D with 32 bits, 11
+//                (about a third less) with 16
+// Options of 'apply':
+//   num_threads    threads used (default: ITK default)
+//   interpolation  'linear' (default), or 'nearest' as warplabelimage
+//
+// The MEX file stays locked while plans are open. Plans not destroyed are
+// freed when MATLAB exits.
+
+// Position of a voxel in its cell along one axis, in [0, 1)
+template <class TFraction>
+struct WarpPlanFraction;
+
+template <>
+struct WarpPlanFraction<float>
+{
+   static float Encode(double fraction) { return static_cast<float>( fraction ); }
+   static double Decode(float fraction) { return fraction; }
+   static bool IsUpper(float fraction) { return fraction >= 0.5f; }
+};
+
+template <>
+struct WarpPlanFraction<unsigned short>
+{
+   static unsigned short Encode(double fraction)
+   {
+      return static_cast<unsigned short>( std::min( std::floor( fraction * 65536.0 ), 65535.0 ) );
+   }
+   static double Decode(unsigned short fraction) { return fraction * ( 1.0 / 65536.0 ); }
+   static bool IsUpper(unsigned short fraction) { return fraction >= 32768; }
+};
+
+
+// Class of the images to warp: that of the first one of a cell array,
+// which must hold at least one image
+inline mxClassID GetImagesClassID(const mxArray * images)
+{
+   if ( !mxIsCell(images) )
+   {
+      return mxGetClassID(images);
+   }
+   const mxArray * first = mxGetNumberOfElements(images) > 0 ? mxGetCell(images, 0) : NULL;
+   if ( !first )
+   {
+      mexErrMsgTxt("The images must be noncomplex arrays of the size of the plan and of the same class.");
+   }
+   return mxGetClassID(first);
+}
+
+
+class WarpPlanBase
+{
+public:
+   virtual ~WarpPlanBase() {}
+
+   virtual void Apply(mxArray *plhs[], const mxArray * images, const mxArray * opts) const = 0;
+   virtual unsigned int GetDimension() const = 0;
+};
+
+
+template <unsigned int Dimension, class TFraction>
+class WarpPlan : public WarpPlanBase
+{
+public:
+   typedef WarpPlanFraction<TFraction> FractionTraits;
+
+   // Flags of a voxel: bit d if the cell extends along axis d (not
+   // clamped at the border), InsideFlag if mapped inside the image
+   enum { InsideFlag = 0x80 };
+
+   // Voxels handled together, for all the images in turn
+   enum { BlockSize = 4096 };
+
+   // The last argument only gives the class of the field
+   template <class MatlabPixelType>
+   WarpPlan(const mxArray * const fields[], unsigned int numberOfThreads, const MatlabPixelType *)
+   {
+      const mexPlanarField<MatlabPixelType, Dimension> field( fields );
+      m_NumberOfPixels = field.GetNumberOfPixels();
+      long stride = 1;
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         m_Size[d] = static_cast<long>( mxGetDimensions(fields[0])[d] );
+         m_Stride[d] = stride;
+         stride *= m_Size[d];
+      }
+      m_Base.resize( m_NumberOfPixels );
+      m_Flags.resize( m_NumberOfPixels );
+      m_Fractions.resize( m_NumberOfPixels * Dimension );
+
+      BuildData<MatlabPixelType> data;
+      data.m_Plan = this;
+      data.m_Field = &field;
+      Execute( BuildThreaderCallback<MatlabPixelType>, &data, numberOfThreads );
+   }
+
+   virtual unsigned int GetDimension() const
+   {
+      return Dimension;
+   }
+
+   virtual void Apply(mxArray *plhs[], const mxArray * images, const mxArray * opts) const
+   {
+      const mxClassID classID = GetImagesClassID(images);
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            ApplyTo<float>( plhs, images, opts );
+            break;
+         case mxDOUBLE_CLASS:
+            ApplyTo<double>( plhs, images, opts );
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+   }
+
+private:
+   template <class MatlabPixelType>
+   struct BuildData
+   {
+      WarpPlan * m_Plan;
+      const mexPlanarField<MatlabPixelType, Dimension> * m_Field;
+      size_t     m_PixelsPerThread;
+   };
+
+   template <class MatlabPixelType>
+   struct ApplyData
+   {
+      const WarpPlan * m_Plan;
+      std::vector<const MatlabPixelType *>  m_Inputs;
+      std::vector<MatlabPixelType *>        m_Outputs;
+      bool       m_Nearest;
+      size_t     m_PixelsPerThread;
+   };
+
+   // Run callback on numberOfThreads contiguous ranges of voxels
+   template <class TData>
+   void Execute(ITK_THREAD_RETURN_TYPE (*callback)(void *), TData * data, unsigned int numberOfThreads) const
+   {
+      if ( numberOfThreads == 0 )
+      {
+         numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+      numberOfThreads = std::max( 1u, std::min( numberOfThreads, static_cast<unsigned int>(
+         itk::MultiThreader::GetGlobalMaximumNumberOfThreads() ) ) );
+
+      if ( numberOfThreads == 1 || m_NumberOfPixels <= BlockSize )
+      {
+         data->m_PixelsPerThread = m_NumberOfPixels;
+         itk::MultiThreader::ThreadInfoStruct info;
+         info.ThreadID = 0;
+         info.UserData = data;
+         callback( &info );
+      }
+      else
+      {
+         data->m_PixelsPerThread = ( m_NumberOfPixels + numberOfThreads - 1 ) / numberOfThreads;
+         itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+         threader->SetNumberOfThreads( numberOfThreads );
+         threader->SetSingleMethod( callback, data );
+         threader->SingleMethodExecute();
+      }
+   }
+
+   template <class MatlabPixelType>
+   static ITK_THREAD_RETURN_TYPE BuildThreaderCallback(void * arg)
+   {
+      itk::MultiThreader::ThreadInfoStruct * info =
+         static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+      const BuildData<MatlabPixelType> & data =
+         *static_cast<const BuildData<MatlabPixelType> *>( info->UserData );
+      WarpPlan & plan = *data.m_Plan;
+
+      const size_t first = std::min( info->ThreadID * data.m_PixelsPerThread, plan.m_NumberOfPixels );
+      const size_t end = std::min( first + data.m_PixelsPerThread, plan.m_NumberOfPixels );
+
+      long index[Dimension];
+      size_t coordinates = first;
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         index[d] = static_cast<long>( coordinates % static_cast<size_t>( plan.m_Size[d] ) );
+         coordinates /= static_cast<size_t>( plan.m_Size[d] );
+      }
+
+      for (size_t n=first; n<end; n++)
+      {
+         // continuous index of the displaced voxel
+         long base = 0;
+         unsigned char flags = InsideFlag;
+         for (unsigned int i=0; i<Dimension; i++)
+         {
+            const double cindex = static_cast<double>( index[i] )
+               + static_cast<double>( static_cast<float>( data.m_Field->Get(n, i) ) );
+            if ( !( cindex >= -0.5 && cindex < static_cast<double>( plan.m_Size[i] ) - 0.5 ) )
+            {
+               flags = 0;
+               break;
+            }
+            const long lower = static_cast<long>( std::floor( cindex ) );
+            const double fraction = cindex - static_cast<double>( lower );
+            // the corners beyond the border are clamped to it
+            base += std::max( lower, 0L ) * plan.m_Stride[i];
+            if ( lower >= 0 && lower+1 < plan.m_Size[i] )
+            {
+               flags |= static_cast<unsigned char>( 1u << i );
+            }
+            plan.m_Fractions[n*Dimension+i] = FractionTraits::Encode( fraction );
+         }
+         plan.m_Base[n] = static_cast<unsigned int>( base );
+         plan.m_Flags[n] = flags;
+
+         // next voxel
+         for (unsigned int d=0; d<Dimension; d++)
+         {
+            if ( ++index[d] < plan.m_Size[d] )
+            {
+               break;
+            }
+            index[d] = 0;
+         }
+      }
+
+      return ITK_THREAD_RETURN_VALUE;
+   }
+
+   template <class MatlabPixelType>
+   static ITK_THREAD_RETURN_TYPE ApplyThreaderCallback(void * arg)
+   {
+      const unsigned int numberOfNeighbors = 1u << Dimension;
+
+      itk::MultiThreader::ThreadInfoStruct * info =
+         static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+      const ApplyData<MatlabPixelType> & data =
+         *static_cast<const ApplyData<MatlabPixelType> *>( info->UserData );
+      const WarpPlan & plan = *data.m_Plan;
+
+      const size_t first = std::min( info->ThreadID * data.m_PixelsPerThread, plan.m_NumberOfPixels );
+      const size_t end = std::min( first + data.m_PixelsPerThread, plan.m_NumberOfPixels );
+      const MatlabPixelType padding = static_cast<MatlabPixelType>( std::numeric_limits<float>::quiet_NaN() );
+
+      // a block of the plan stays in cache while it is applied to all the
+      // images
+      for (size_t blockStart=first; blockStart<end; blockStart+=BlockSize)
+      {
+         const size_t blockEnd = std::min( blockStart + static_cast<size_t>(BlockSize), end );
+
+         for (size_t i=0; i<data.m_Inputs.size(); i++)
+         {
+            const MatlabPixelType * input = data.m_Inputs[i];
+            MatlabPixelType * output = data.m_Outputs[i];
+
+            for (size_t n=blockStart; n<blockEnd; n++)
+            {
+               const unsigned char flags = plan.m_Flags[n];
+               if ( !( flags & InsideFlag ) )
+               {
+                  output[n] = padding;
+                  continue;
+               }
+               const TFraction * fractions = &plan.m_Fractions[n*Dimension];
+               const MatlabPixelType * cell = input + plan.m_Base[n];
+
+               if ( data.m_Nearest )
+               {
+                  long offset = 0;
+                  for (unsigned int d=0; d<Dimension; d++)
+                  {
+                     if ( ( flags & ( 1u << d ) ) && FractionTraits::IsUpper( fractions[d] ) )
+                     {
+                        offset += plan.m_Stride[d];
+                     }
+                  }
+                  output[n] = static_cast<MatlabPixelType>( static_cast<float>( cell[offset] ) );
+                  continue;
+               }
+
+               double distance[Dimension];
+               for (unsigned int d=0; d<Dimension; d++)
+               {
+                  distance[d] = FractionTraits::Decode( fractions[d] );
+               }
+
+               double value = 0.0;
+               for (unsigned int counter=0; counter<numberOfNeighbors; counter++)
+               {
+                  double overlap = 1.0;
+                  long offset = 0;
+                  for (unsigned int d=0; d<Dimension; d++)
+                  {
+                     if ( counter & ( 1u << d ) )
+                     {
+                        overlap *= distance[d];
+                        if ( flags & ( 1u << d ) )
+                        {
+                           offset += plan.m_Stride[d];
+                        }
+                     }
+                     else
+                     {
+                        overlap *= 1.0 - distance[d];
+                     }
+                  }
+                  if ( overlap )
+                  {
+                     value += overlap * static_cast<double>( static_cast<float>( cell[offset] ) );
+                  }
+               }
+               output[n] = static_cast<MatlabPixelType>( static_cast<float>( value ) );
+            }
+         }
+      }
+
+      return ITK_THREAD_RETURN_VALUE;
+   }
+
+   // Whether image has the size of the plan, or of the plan followed by
+   // the number of images
+   bool HasSize(const mxArray * image, bool stack) const
+   {
+      const mwSize numberOfDimensions = mxGetNumberOfDimensions(image);
+      if ( numberOfDimensions != Dimension && !( stack && numberOfDimensions == Dimension+1 ) )
+      {
+         return false;
+      }
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         if ( static_cast<long>( mxGetDimensions(image)[d] ) != m_Size[d] )
+         {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   template <class MatlabPixelType>
+   void ApplyTo(mxArray *plhs[], const mxArray * images, const mxArray * opts) const
+   {
+      const mxClassID classID = GetImagesClassID(images);
+
+      ApplyData<MatlabPixelType> data;
+      data.m_Plan = this;
+
+      const std::string interpolation = mexGetStringOption(opts, "interpolation", "linear");
+      if ( interpolation != "linear" && interpolation != "nearest" )
+      {
+         mexErrMsgTxt("Option interpolation must be 'linear' or 'nearest'.");
+      }
+      data.m_Nearest = ( interpolation == "nearest" );
+
+      // Inputs and outputs, in the form of the images
+      if ( mxIsCell(images) )
+      {
+         for (size_t n=0; n<mxGetNumberOfElements(images); n++)
+         {
+            const mxArray * image = mxGetCell(images, n);
+            if ( !image || mxGetClassID(image)!=classID || mxIsComplex(image) || !HasSize(image, false) )
+            {
+               mexErrMsgTxt("The images must be noncomplex arrays of the size of the plan and of the same class.");
+            }
+         }
+         plhs[0] = mxCreateCellArray( mxGetNumberOfDimensions(images), mxGetDimensions(images) );
+         for (size_t n=0; n<mxGetNumberOfElements(images); n++)
+         {
+            const mxArray * image = mxGetCell(images, n);
+            mxArray * warped = mxCreateNumericArray( Dimension, mxGetDimensions(image), classID, mxREAL );
+            mxSetCell( plhs[0], n, warped );
+            data.m_Inputs.push_back( static_cast<const MatlabPixelType *>( mxGetData(image) ) );
+            data.m_Outputs.push_back( static_cast<MatlabPixelType *>( mxGetData(warped) ) );
+         }
+      }
+      else
+      {
+         if ( mxIsComplex(images) || !HasSize(images, true) )
+         {
+            mexErrMsgTxt("The images must be a noncomplex array of the size of the plan, optionally followed by the number of images.");
+         }
+         const size_t numberOfImages = m_NumberOfPixels ? mxGetNumberOfElements(images) / m_NumberOfPixels : 0;
+         plhs[0] = mxCreateNumericArray( mxGetNumberOfDimensions(images), mxGetDimensions(images), classID, mxREAL );
+         const MatlabPixelType * input = static_cast<const MatlabPixelType *>( mxGetData(images) );
+         MatlabPixelType * output = static_cast<MatlabPixelType *>( mxGetData(plhs[0]) );
+         for (size_t n=0; n<numberOfImages; n++)
+         {
+            data.m_Inputs.push_back( input + n*m_NumberOfPixels );
+            data.m_Outputs.push_back( output + n*m_NumberOfPixels );
+         }
+      }
+
+      if ( data.m_Inputs.empty() || m_NumberOfPixels == 0 )
+      {
+         return;
+      }
+
+      Execute( ApplyThreaderCallback<MatlabPixelType>, &data, mexGetNumberOfThreads( opts ) );
+   }
+
+   long                          m_Size[Dimension];
+   long                          m_Stride[Dimension];
+   size_t                        m_NumberOfPixels;
+   std::vector<unsigned int>     m_Base;
+   std::vector<unsigned char>    m_Flags;
+   std::vector<TFraction>        m_Fractions;
+};
+
+
+template <unsigned int Dimension, class MatlabPixelType>
+WarpPlanBase * CreateWarpPlan(const mxArray * const fields[], const mxArray * opts)
+{
+   const double weightBits = mexGetScalarOption(opts, "weight_bits", 32.0);
+   const unsigned int numberOfThreads = mexGetNumberOfThreads( opts );
+   if ( weightBits == 32 )
+   {
+      return new WarpPlan<Dimension, float>( fields, numberOfThreads, static_cast<const MatlabPixelType *>(NULL) );
+   }
+   if ( weightBits == 16 )
+   {
+      return new WarpPlan<Dimension, unsigned short>( fields, numberOfThreads, static_cast<const MatlabPixelType *>(NULL) );
+   }
+   mexErrMsgTxt("Option weight_bits must be 32 or 16.");
+   return NULL;
+}
+
+
+// Open plans by handle
+typedef std::map<unsigned int, WarpPlanBase *> PlanTable;
+static PlanTable plans;
+static unsigned int nextHandle = 1u;
+
+static void DestroyAllPlans()
+{
+   for (PlanTable::iterator it=plans.begin(); it!=plans.end(); ++it)
+   {
+      delete it->second;
+   }
+   plans.clear();
+}
+
+static PlanTable::iterator GetPlan(const mxArray * handle)
+{
+   if ( !mxIsNumeric(handle) || mxGetNumberOfElements(handle) != 1 )
+   {
+      mexErrMsgTxt("The plan handle must be a scalar.");
+   }
+   PlanTable::iterator it = plans.find( static_cast<unsigned int>( mxGetScalar(handle) ) );
+   if ( it == plans.end() )
+   {
+      mexErrMsgTxt("Invalid or destroyed plan handle.");
+   }
+   return it;
+}
+
+
+void mexFunction(int nlhs,
+                 mxArray *plhs[],
+                 int nrhs,
+                 const mxArray *prhs[])
+{
+   if ( nrhs < 1 || !mxIsChar(prhs[0]) )
+   {
+      mexErrMsgTxt("The first input must be a command: 'create', 'apply' or 'destroy'.");
+   }
+   char * buffer = mxArrayToString(prhs[0]);
+   const std::string command(buffer);
+   mxFree(buffer);
+
+   if ( command == "create" )
+   {
+      /* The options struct may be omitted. */
+      const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+      if ( (nargs != 3 && nargs != 4) || nlhs > 1 )
+      {
+         mexErrMsgTxt("Usage: h = warpplan('create', dx, dy, (dz), (options))");
+      }
+      const int dim = nargs-1;
+      const mxClassID classID = mxGetClassID(prhs[1]);
+
+      /* The field components must be noncomplex floating point matrices.*/
+      for (int n=1; n<nargs; n++)
+      {
+         if ( mxGetClassID(prhs[n])!=classID || mxIsComplex(prhs[n]) )
+         {
+            mexErrMsgTxt("Input must be a noncomplex floating point.");
+         }
+
+         if ( mxGetNumberOfDimensions(prhs[n]) != dim )
+         {
+            mexErrMsgTxt("The dimension of the field must agree with the number of inputs.");
+         }
+
+         for (int dd=0; dd<dim; dd++)
+         {
+            if ( mxGetDimensions(prhs[n])[dd] != mxGetDimensions(prhs[1])[dd] )
+            {
+               mexErrMsgTxt("Inputs must have the same size.");
+            }
+         }
+      }
+
+      if ( mxGetNumberOfElements(prhs[1]) > std::numeric_limits<unsigned int>::max() )
+      {
+         mexErrMsgTxt("The field is too large for a plan.");
+      }
+
+      const mxArray * opts = mexGetOptions(nrhs, prhs);
+      WarpPlanBase * plan = NULL;
+      switch ( classID )
+      {
+         case mxSINGLE_CLASS:
+            plan = ( dim == 2 ) ? CreateWarpPlan<2,float>( prhs+1, opts ) : CreateWarpPlan<3,float>( prhs+1, opts );
+            break;
+         case mxDOUBLE_CLASS:
+            plan = ( dim == 2 ) ? CreateWarpPlan<2,double>( prhs+1, opts ) : CreateWarpPlan<3,double>( prhs+1, opts );
+            break;
+         default:
+            mexErrMsgTxt("Pixel type unsupported.");
+      }
+
+      if ( plans.empty() )
+      {
+         mexAtExit( DestroyAllPlans );
+      }
+      plans[nextHandle] = plan;
+      mexLock();
+
+      plhs[0] = mxCreateDoubleScalar( nextHandle++ );
+   }
+   else if ( command == "apply" )
+   {
+      const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+      if ( nargs != 3 || nlhs > 1 )
+      {
+         mexErrMsgTxt("Usage: warped = warpplan('apply', h, images, (options))");
+      }
+      if ( mxIsCell(prhs[2]) && mxGetNumberOfElements(prhs[2]) == 0 )
+      {
+         plhs[0] = mxCreateCellArray( mxGetNumberOfDimensions(prhs[2]), mxGetDimensions(prhs[2]) );
+         return;
+      }
+      GetPlan(prhs[1])->second->Apply( plhs, prhs[2], mexGetOptions(nrhs, prhs) );
+   }
+   else if ( command == "destroy" )
+   {
+      if ( nrhs != 2 || nlhs > 0 )
+      {
+         mexErrMsgTxt("Usage: warpplan('destroy', h)");
+      }
+      PlanTable::iterator it = GetPlan(prhs[1]);
+      delete it->second;
+      plans.erase( it );
+      mexUnlock();
+   }
+   else
+   {
+      mexErrMsgTxt(("Unknown command " + command + ".").c_str());
+   }
+
+   return;
+}
+
+
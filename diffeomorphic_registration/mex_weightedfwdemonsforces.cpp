@@ -1,9 +1,14 @@
 #include "itkESMInvConDemonsRegistrationFunction.h"
+#include "itkDemonsUpdateCalculator.h"
 
 #include <itkNeighborhoodAlgorithm.h>
 
 #include <mex.h>
 
+#include "mex_itkimage.h"
+#include "mex_options.h"
+#include "mex_profiler.h"
+
 template <class MatlabPixelType, unsigned int Dimension>
 void invcondemonsforces(int nlhs,
                  mxArray *plhs[],
@@ -21,153 +26,36 @@ void invcondemonsforces(int nlhs,
       <ImageType,ImageType,DeformationFieldType>        DemonsRegistrationFunctionType;
 
    
-   //boost::timer timer;
-
-
-   // Allocate images and deformation field
-   typename ImageType::Pointer fixedimage
-      = ImageType::New();
-   typename ImageType::Pointer movingimage
-      = ImageType::New();
-   typename ImageType::Pointer fw_weightimage
-      = ImageType::New();  
-   typename DeformationFieldType::Pointer field
-      = DeformationFieldType::New();
-   
-   typename ImageType::Pointer jacobianimage
-      = ImageType::New();  
-      
-      
-   typename DeformationFieldType::Pointer inv_field
-      = DeformationFieldType::New();
-      
-   typename DeformationFieldType::Pointer update
-      = DeformationFieldType::New();
-   
-   typename DeformationFieldType::SpacingType spacing;
-   spacing.Fill( 1.0 );
-   
-   typename DeformationFieldType::PointType origin;
-   origin.Fill( 0.0 );
-   
-   typename DeformationFieldType::RegionType     region;
-   typename DeformationFieldType::SizeType       size;
-   typename DeformationFieldType::IndexType      start;
-
-   unsigned int numPix(1u);
-   const MatlabPixelType * fixinptr =  static_cast<const MatlabPixelType *>(mxGetData(prhs[0]));
-   const MatlabPixelType * movinptr =  static_cast<const MatlabPixelType *>(mxGetData(prhs[1]));
-   const MatlabPixelType * fieldinptrs[Dimension];
-   const MatlabPixelType * inv_fieldinptrs[Dimension];
-   
-   
-   mwSize matlabdims[Dimension];
-   for (unsigned int d=0; d<Dimension; d++)
-   {
-      matlabdims[d]= mxGetDimensions(prhs[0])[d];
-      size[d] = matlabdims[d];
-      start[d] = 0;
-      numPix *= size[d];
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+   itk::RegistrationProfiler::Pointer profiler =
+      mexCreateProfiler( opts, nlhs > static_cast<int>(Dimension) );
+   mexPhaseTimer timer( profiler );
+
 
-      fieldinptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[2+d]));
-      inv_fieldinptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[2+Dimension+d]));
-   }
-   
-   const MatlabPixelType * jacobianptr = static_cast<const MatlabPixelType *> (mxGetData(prhs[2*Dimension + 2]));
-   const MatlabPixelType * fw_weightptr = static_cast<const MatlabPixelType *> (mxGetData(prhs[2*Dimension + 3]));
-   
    const double RegWeight = static_cast<double>( mxGetPr(prhs[2*Dimension+4])[0] );
-   
+
    const unsigned int UseJacFlag = 1;
-   
+
    //std::cout << "RegWeight : " << RegWeight << std::endl;
-   
-   region.SetSize( size );
-   region.SetIndex( start );
-
-   fixedimage->SetOrigin( origin );
-   fixedimage->SetSpacing( spacing );
-   fixedimage->SetRegions( region );
-   fixedimage->Allocate();
-
-   movingimage->SetOrigin( origin );
-   movingimage->SetSpacing( spacing );
-   movingimage->SetRegions( region );
-   movingimage->Allocate();
-   
-   fw_weightimage->SetOrigin( origin );
-   fw_weightimage->SetSpacing( spacing );
-   fw_weightimage->SetRegions( region );
-   fw_weightimage->Allocate();
-   
-   
-   field->SetOrigin( origin );
-   field->SetSpacing( spacing );
-   field->SetRegions( region );
-   field->Allocate();
-   
-   inv_field->SetOrigin( origin );
-   inv_field->SetSpacing( spacing );
-   inv_field->SetRegions( region );
-   inv_field->Allocate();
-
-   update->SetOrigin( origin );
-   update->SetSpacing( spacing );
-   update->SetRegions( region );
-   update->Allocate();
-   if (UseJacFlag > 0)
-   {
-        jacobianimage->SetOrigin( origin );
-        jacobianimage->SetSpacing( spacing );
-        jacobianimage->SetRegions( region );
-        jacobianimage->Allocate();
-   }
-   
 
-   //mexPrintf("done Allocate(); %f sec\n", timer.elapsed());
-   //timer.restart();
-
-   
-   PixelType * fixptr = fixedimage->GetBufferPointer();
-   const PixelType * const fixbuff_end = fixptr + numPix;
-   PixelType * movptr = movingimage->GetBufferPointer();
-   PixelType * fwweightptr = NULL;
-   PixelType * jacptr = NULL;
-   if (UseJacFlag > 0)
-   {
-       jacptr = jacobianimage->GetBufferPointer();
-   }
-   
-   
-   
-   fwweightptr = fw_weightimage->GetBufferPointer();
-   
-   VectorPixelType * fieldptr = field->GetBufferPointer();
-   VectorPixelType * inv_fieldptr = inv_field->GetBufferPointer();
-   
-   while ( fixptr != fixbuff_end )
-   {
-      *fixptr++ = *fixinptr++;
-      *movptr++ = *movinptr++;
-      *fwweightptr++ = *fw_weightptr++; 
-      
-      for (unsigned int d=0; d<Dimension; d++)
-      {
-         (*fieldptr)[d] = *(fieldinptrs[d])++;
-      }
-      if (UseJacFlag > 0)
-      {
-        *jacptr++ = *jacobianptr++; 
-      }
-      
-      ++fieldptr;
-      
-      for (unsigned int d=0; d<Dimension; d++)
-      {
-         (*inv_fieldptr)[d] = *(inv_fieldinptrs[d])++;
-      }
-      ++inv_fieldptr;
-   }
+   // Scalar images wrap the MATLAB buffers when they are single, the
+   // deformation fields are interleaved
+   typename ImageType::Pointer fixedimage =
+      mexImportImage<ImageType, MatlabPixelType>( prhs[0] );
+   typename ImageType::Pointer movingimage =
+      mexImportImage<ImageType, MatlabPixelType>( prhs[1] );
+   typename ImageType::Pointer jacobianimage =
+      mexImportImage<ImageType, MatlabPixelType>( prhs[2*Dimension+2] );
+   typename ImageType::Pointer fw_weightimage =
+      mexImportImage<ImageType, MatlabPixelType>( prhs[2*Dimension+3] );
+   typename DeformationFieldType::Pointer field =
+      mexImportField<DeformationFieldType, MatlabPixelType>( prhs + 2 );
+   typename DeformationFieldType::Pointer inv_field =
+      mexImportField<DeformationFieldType, MatlabPixelType>( prhs + 2 + Dimension );
+   typename DeformationFieldType::Pointer update =
+      mexAllocateImage<DeformationFieldType>( prhs[0] );
+
+   timer.Lap("import");
 
    // Create demons function
    typename DemonsRegistrationFunctionType::Pointer drfp
@@ -185,6 +73,18 @@ void invcondemonsforces(int nlhs,
    drfp->SetMovingImage( movingimage );
    
    drfp->SetRegWeight(RegWeight);
+
+   // The SDMs of the unwarped label images are kept between calls, so
+   // they are computed once per pyramid level ("clear mex" drops them)
+   static typename DemonsRegistrationFunctionType::SDMCachePointer sdmCache;
+   if ( !sdmCache )
+   {
+      sdmCache = DemonsRegistrationFunctionType::SDMCacheType::New();
+   }
+   drfp->SetSDMCache( sdmCache );
+
+   mexSetForceOptions( drfp.GetPointer(), opts );
+   drfp->SetProfiler( profiler );
    
    drfp->SetUseFwWeight(true);
    drfp->SetFwWeightImage(fw_weightimage);
@@ -200,105 +100,37 @@ void invcondemonsforces(int nlhs,
    }
    
    drfp->InitializeIteration();
-
-   //mexPrintf("done demons function init %f sec\n", timer.elapsed());
-   //timer.restart();
-
-   const itk::Size<Dimension> radius = drfp->GetRadius();
-
-   // Break the input into a series of regions.  The first region is free
-   // of boundary conditions, the rest with boundary conditions.  We operate
-   // on the output region because input has been copied to output.
-   typedef itk::NeighborhoodAlgorithm::ImageBoundaryFacesCalculator
-      <DeformationFieldType> FaceCalculatorType;
-   typedef typename FaceCalculatorType::FaceListType FaceListType;
-   typedef typename DemonsRegistrationFunctionType::NeighborhoodType
-      NeighborhoodIteratorType;
-   typedef itk::ImageRegionIterator<DeformationFieldType> UpdateIteratorType;
-
-   FaceCalculatorType faceCalculator;
-   
-   FaceListType faceList = faceCalculator(field, region, radius);
-   typename FaceListType::iterator fIt = faceList.begin();
-   
-   // Ask the function object for a pointer to a data structure it
-   // will use to manage any global values it needs.  We'll pass this
-   // back to the function object at each calculation and then
-   // again so that the function object can use it to determine a
-   // time step for this iteration.
-   void * globalData = drfp->GetGlobalDataPointer();
-   
-   // Process the non-boundary region.
-   NeighborhoodIteratorType nD(radius, field, *fIt);
-   UpdateIteratorType       nU(update,  *fIt);
-   nD.GoToBegin();
-   while( !nD.IsAtEnd() )
-   {
-      nU.Value() = drfp->ComputeUpdate(nD, globalData);
-      ++nD;
-      ++nU;
-   }
-
-   // Process each of the boundary faces.
-   
-   NeighborhoodIteratorType bD;
-   UpdateIteratorType   bU;
-   for (++fIt; fIt != faceList.end(); ++fIt)
+   timer.Lap("force_init");
+
+   // Evaluate the force over the field, the interior and boundary faces
+   // of each slab on its own thread. Every thread keeps its own metric
+   // accumulator, they are reduced in a fixed order afterwards.
+   typedef itk::DemonsUpdateCalculator
+      <DemonsRegistrationFunctionType,DeformationFieldType> UpdateCalculatorType;
+
+   typename UpdateCalculatorType::Pointer updateCalculator
+      = UpdateCalculatorType::New();
+   updateCalculator->SetDemonsFunction( drfp );
+   updateCalculator->SetDeformationField( field );
+   updateCalculator->SetUpdateField( update );
+   updateCalculator->SetNumberOfThreads( mexGetNumberOfThreads( opts ) );
+   updateCalculator->Compute();
+   timer.Lap("force");
+
+   // Allocate outputs and copy the result
+   mexExportField<MatlabPixelType>( update.GetPointer(), mxGetClassID(prhs[0]), plhs );
+   timer.Lap("export");
+
+   if ( profiler )
    {
-      bD = NeighborhoodIteratorType(radius, field, *fIt);
-      bU = UpdateIteratorType(update, *fIt);
-      
-      bD.GoToBegin();
-      bU.GoToBegin();
-      while ( !bD.IsAtEnd() )
+      profiler->AddCount( "voxels", update->GetBufferedRegion().GetNumberOfPixels() );
+      profiler->AddCount( "voxels_processed", drfp->GetNumberOfPixelsProcessed() );
+      mexWriteProfileLog( profiler, opts, "weightedfwdemonsforces" );
+      if (nlhs > static_cast<int>(Dimension))
       {
-         bU.Value() = drfp->ComputeUpdate(bD, globalData);
-         ++bD;
-         ++bU;
+         plhs[Dimension] = mexCreateProfileStruct( profiler );
       }
    }
-
-   // Ask the finite difference function to compute the time step for
-   // this iteration.  We give it the global data pointer to use, then
-   // ask it to free the global data memory.
-   //timeStep = df->ComputeGlobalTimeStep(globalData);
-   drfp->ReleaseGlobalDataPointer(globalData);
-
-
-   //mexPrintf("done actual computations %f sec\n", timer.elapsed());
-   //timer.restart();
-
-
-   // Allocate outputs
-   const mxClassID classID = mxGetClassID(prhs[0]);
-   MatlabPixelType * outptrs[Dimension];
-   for (unsigned int d=0; d<Dimension; d++)
-   {
-      plhs[d] = mxCreateNumericArray(
-         Dimension, matlabdims, classID, mxREAL);
-
-      outptrs[d] = static_cast<MatlabPixelType *>(mxGetData(plhs[d]));
-   }
-
-   
-   //mexPrintf("done allocate outputs %f sec\n", timer.elapsed());
-   //timer.restart();
-   
-
-   // put result into outputs
-   const VectorPixelType * upptr = update->GetBufferPointer();
-   const VectorPixelType * const upbuff_end = upptr + numPix;
-   
-   while ( upptr != upbuff_end )
-   {
-      for (unsigned int d=0; d<Dimension; d++)
-      {
-         *(outptrs[d])++ = (*upptr)[d];
-      }
-      ++upptr;
-   }
-
-   //mexPrintf("done outputs copy %f sec\n", timer.elapsed());
 }
 
 
@@ -307,13 +139,14 @@ void mexFunction(int nlhs,
                  int nrhs,
                  const mxArray *prhs[])
 {
-   /* Check for proper number of arguments. */
-   if (nrhs!=9 and nrhs!=11)
+   /* Check for proper number of arguments. An options struct may follow. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   if (nargs!=9 and nargs!=11)
    {
-      mexErrMsgTxt("9 or 11 inputs required.");
+      mexErrMsgTxt("9 or 11 inputs required, optionally followed by an options struct.");
    }
 
-   const int dim=(nrhs-4)/2;
+   const int dim=(nargs-4)/2;
    //mexPrintf("Dimension of images: %i\n",dim);
    const mxClassID classID = mxGetClassID(prhs[0]);
 
@@ -401,9 +234,9 @@ void mexFunction(int nlhs,
        
    }
    
-   if (nlhs != dim)
+   if (nlhs != dim and nlhs != dim+1)
    {
-      mexErrMsgTxt("Number of outputs must agree with the number of inputs.");
+      mexErrMsgTxt("Number of outputs must agree with the number of inputs, optionally followed by the profile.");
    }
 
    switch ( dim )
@@ -1,136 +1,217 @@
-//#include "fastcopy.h"
 #include "itkImageFileWriter.h"
-#include "itkCommand.h"
 #include "itkImage.h"
+#include "itkWarpFieldFile.h"
 
-#include <itkWarpImageFilter.h>
-
-//#include <boost/timer.hpp>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include <mex.h>
 
+#include "mex_options.h"
+
+// writewarpfile(vx, vy, (vz), filename, (options))
+//
+// Saves a displacement field in float32, without loss below the single
+// precision. A filename ending in .bflwarp gets the native container of
+// itk::WarpFieldFile (planar components in page-aligned blocks, header and
+// checksums), which readwarpfile reads back through a memory mapping. Any
+// other extension is written by ITK as a vector image (.mha, .nii.gz...).
+//
+// Options:
+//   compress    compress the field (default 0 for .bflwarp, where blocks
+//               are deflated one by one in parallel; 1 otherwise, with
+//               the compression of the ITK format)
+//   block_size  kilobytes per block of a component in a .bflwarp file, a
+//               multiple of 4 (default 1024)
+//   spacing     spacing stored in the file (default ones)
+//   origin      origin stored in the file (default zeros)
+//   direction   direction matrix stored in the file (default identity)
+//   num_threads threads compressing the blocks (default: ITK default)
+
+// Real vector or matrix option of numberOfValues values, into values
+inline bool mexGetVectorOption(const mxArray * opts, const char * name, unsigned int numberOfValues, double * values)
+{
+   const mxArray * field = mexGetOptionField(opts, name);
+   if ( !field || mxIsEmpty(field) )
+   {
+      return false;
+   }
+   if ( !mxIsDouble(field) || mxIsComplex(field) || mxGetNumberOfElements(field) != numberOfValues )
+   {
+      mexErrMsgTxt((std::string("Option ") + name + " has the wrong size or class.").c_str());
+   }
+   std::copy( mxGetPr(field), mxGetPr(field) + numberOfValues, values );
+   return true;
+}
+
+// Geometry of the field from the options, the direction matrix being
+// column major as in MATLAB
+template <unsigned int Dimension, class TSpacing, class TPoint, class TDirection>
+void mexGetGeometryOptions(const mxArray * opts, TSpacing & spacing, TPoint & origin,
+                           TDirection & direction)
+{
+   double values[Dimension*Dimension];
+   spacing.Fill( 1.0 );
+   origin.Fill( 0.0 );
+   direction.SetIdentity();
+   if ( mexGetVectorOption(opts, "spacing", Dimension, values) )
+   {
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         spacing[d] = values[d];
+      }
+   }
+   if ( mexGetVectorOption(opts, "origin", Dimension, values) )
+   {
+      for (unsigned int d=0; d<Dimension; d++)
+      {
+         origin[d] = values[d];
+      }
+   }
+   if ( mexGetVectorOption(opts, "direction", Dimension*Dimension, values) )
+   {
+      for (unsigned int i=0; i<Dimension; i++)
+      {
+         for (unsigned int j=0; j<Dimension; j++)
+         {
+            direction[i][j] = values[i + Dimension*j];
+         }
+      }
+   }
+}
+
 template <class MatlabPixelType, unsigned int Dimension>
-void writewarpfile(int nlhs,
-               mxArray *plhs[],
-               int nrhs,
-               const mxArray *prhs[])
+void writenativefield(const mxArray * const fieldArrays[],
+                      const std::string & filename,
+                      const mxArray * opts)
 {
-   typedef int PixelType;
-   typedef itk::Image< PixelType, Dimension >           ImageType;
- //  mexPrintf("the dimentsion is ", Dimension);   
- //  typedef                                           PixelType;
-   typedef itk::Vector<PixelType, Dimension>  VectorPixelType;
-   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
+   typedef itk::WarpFieldFile<Dimension>                WarpFieldFileType;
 
-   typedef itk::WarpImageFilter
-      <ImageType, ImageType, DeformationFieldType>      WarperType;
+   typename WarpFieldFileType::Pointer file = WarpFieldFileType::New();
 
- // mexPrintf("the dimentsion is :%d", Dimension); 
-   //boost::timer timer;
+   typename WarpFieldFileType::SizeType size;
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      size[d] = mxGetDimensions(fieldArrays[0])[d];
+   }
+   typename WarpFieldFileType::SpacingType   spacing;
+   typename WarpFieldFileType::PointType     origin;
+   typename WarpFieldFileType::DirectionType direction;
+   mexGetGeometryOptions<Dimension>( opts, spacing, origin, direction );
 
+   const double blockSize = mexGetScalarOption(opts, "block_size", 1024.0);
+   if ( blockSize < 4 || blockSize != 4 * static_cast<double>( static_cast<unsigned long>( blockSize / 4 ) ) )
+   {
+      mexErrMsgTxt("Option block_size must be a positive multiple of 4.");
+   }
 
-   // Allocate images and deformation fieldnnnn
-   typename ImageType::Pointer image
-      = ImageType::New();
-   typename DeformationFieldType::Pointer field = DeformationFieldType::New();
-//  typename DeformationFieldType::Pointer field = 0; 
-   typename DeformationFieldType::SpacingType spacing;
-   spacing.Fill( 1.0 );
-   
-   typename DeformationFieldType::PointType origin;
-   origin.Fill( 0.0 );
-   
-   typename DeformationFieldType::RegionType     region;
-   typename DeformationFieldType::SizeType       size;
-   typename DeformationFieldType::IndexType      start;
+   file->SetFileName( filename );
+   file->SetSize( size );
+   file->SetSpacing( spacing );
+   file->SetOrigin( origin );
+   file->SetDirection( direction );
+   file->SetBlockSize( static_cast<unsigned long>( blockSize ) * 1024 );
+   file->SetCompression( mexGetScalarOption(opts, "compress", 0.0) != 0 ?
+                         WarpFieldFileType::BlockCompression : WarpFieldFileType::NoCompression );
+   file->SetNumberOfThreads( mexGetNumberOfThreads(opts) );
 
-   unsigned int numPix(1u);
-  const MatlabPixelType * iminptr =  static_cast<const MatlabPixelType *>(mxGetData(prhs[0]));
-   const MatlabPixelType * fieldinptrs[Dimension];
-   mwSize matlabdims[Dimension];
+   // single arrays are written from the MATLAB buffers, others converted
+   const size_t numPix = mxGetNumberOfElements(fieldArrays[0]);
+   std::vector<float> converted[Dimension];
+   const float * components[Dimension];
    for (unsigned int d=0; d<Dimension; d++)
    {
-      matlabdims[d]= mxGetDimensions(prhs[0])[d];
-      size[d] = matlabdims[d];
-      start[d] = 0;
-      numPix *= size[d];
-      
-      fieldinptrs[d] = static_cast<const MatlabPixelType *>(mxGetData(prhs[d]));
-   //   mexPrintf("the dimentsion is :%d", d);
+      const MatlabPixelType * inptr = static_cast<const MatlabPixelType *>(mxGetData(fieldArrays[d]));
+      if ( mxGetClassID(fieldArrays[d]) == mxSINGLE_CLASS )
+      {
+         components[d] = reinterpret_cast<const float *>( inptr );
+      }
+      else
+      {
+         converted[d].assign( inptr, inptr + numPix );
+         components[d] = numPix ? &converted[d][0] : NULL;
+      }
+   }
+
+   try
+   {
+      file->Write( components );
+   }
+   catch( itk::ExceptionObject & err )
+   {
+      mexErrMsgTxt( err.GetDescription() );
+   }
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+void writeitkfield(const mxArray * const fieldArrays[],
+                   const std::string & filename,
+                   const mxArray * opts)
+{
+   typedef float                                        VectorComponentType;
+   typedef itk::Vector<VectorComponentType, Dimension>  VectorPixelType;
+   typedef itk::Image<VectorPixelType, Dimension>       DeformationFieldType;
 
+   typename DeformationFieldType::RegionType     region;
+   typename DeformationFieldType::SizeType       size;
+   for (unsigned int d=0; d<Dimension; d++)
+   {
+      size[d] = mxGetDimensions(fieldArrays[0])[d];
    }
-//   mexPrintf("er of pixel is:  %d \n", numPix);
    region.SetSize( size );
-   region.SetIndex( start );
 
-   image->SetOrigin( origin );
-   image->SetSpacing( spacing );
-   image->SetRegions( region );
-   image->Allocate();
-   
-   field->SetOrigin( origin );
-   field->SetSpacing( spacing );
+   typename DeformationFieldType::SpacingType    spacing;
+   typename DeformationFieldType::PointType      origin;
+   typename DeformationFieldType::DirectionType  direction;
+   mexGetGeometryOptions<Dimension>( opts, spacing, origin, direction );
+
+   typename DeformationFieldType::Pointer field = DeformationFieldType::New();
    field->SetRegions( region );
+   field->SetSpacing( spacing );
+   field->SetOrigin( origin );
+   field->SetDirection( direction );
    field->Allocate();
 
-   //mexPrintf("done Allocate(); %f sec\n", timer.elapsed());
-   //timer.restart();
-
-   
-   PixelType * imptr = image->GetBufferPointer();
-//   const PixelType * const buff_begin = imptr;
-   const PixelType * const buff_end = imptr + numPix;
+   // Interleave the field components
+   const size_t numPix = mxGetNumberOfElements(fieldArrays[0]);
    VectorPixelType * fieldptr = field->GetBufferPointer();
-   
-     while ( imptr != buff_end )
+   for (unsigned int d=0; d<Dimension; d++)
    {
-      *imptr++ = *iminptr++;
-
-      for (unsigned int d=0; d<Dimension; d++)
-      {
-         (*fieldptr)[d] = *(fieldinptrs[d])++;
-      } 
-      ++fieldptr;
-   }
-   // here the deformation field is not like logdomain deformation field. why?
-   //mz::writeRaw<ImageType>(fixedimage,"fixedimage.mha");
-   //mz::writeRaw<ImageType>(movingimage,"movingimage.mha");
-   //mexPrintf("done inputs copy %f sec\n", timer.elapsed());
-   //timer.restart();
-    char * outputDfFilename;
-  
-    outputDfFilename = mxArrayToString(prhs[3]); 
-    mexPrintf("the output file name is: %s", outputDfFilename);
-   //write image
-   //
-   //typename itk::ImageFileWriter<ImageType>::Pointer writer = itk::ImageFileWriter<ImageType>::New();
-    //writer->SetFileName(outputDfFilename);
-      //           writer->SetInput(image);
-        //        std::cout<<"outputfile name: "<<outputDfFilename<<std::endl;
-          //       writer->SetUseCompression(true);
-      //           writer->Update();
-  
-   //write deformation field 
-     
-                typename itk::ImageFileWriter<DeformationFieldType>::Pointer df_writer = itk::ImageFileWriter<DeformationFieldType>::New();
-                df_writer->SetFileName(outputDfFilename);
-                df_writer->SetInput(field);
-            
-                df_writer->SetUseCompression(true);
-           //     df_writer->UpdateLargestPossibleRegion();
-               df_writer->Update();
-/*               try
-              {
-                 df_writer->Update();
-                        }
-    catch( itk::ExceptionObject& err )
+      const MatlabPixelType * inptr = static_cast<const MatlabPixelType *>(mxGetData(fieldArrays[d]));
+      for (size_t i=0; i<numPix; i++)
       {
-      std::cout << "Unexpected error." << std::endl;
-      std::cout << err << std::endl;
-      exit( EXIT_FAILURE );
+         fieldptr[i][d] = static_cast<VectorComponentType>( inptr[i] );
       }
-*/
-                mxFree(outputDfFilename);
+   }
+
+   typename itk::ImageFileWriter<DeformationFieldType>::Pointer writer = itk::ImageFileWriter<DeformationFieldType>::New();
+   writer->SetFileName( filename.c_str() );
+   writer->SetInput( field );
+   writer->SetUseCompression( mexGetScalarOption(opts, "compress", 1.0) != 0 );
+   try
+   {
+      writer->Update();
+   }
+   catch( itk::ExceptionObject & err )
+   {
+      mexErrMsgTxt( err.GetDescription() );
+   }
+}
+
+template <class MatlabPixelType, unsigned int Dimension>
+void writewarpfile(const mxArray * const fieldArrays[],
+                   const std::string & filename,
+                   const mxArray * opts)
+{
+   if ( itk::WarpFieldFile<Dimension>::HasWarpFieldExtension( filename ) )
+   {
+      writenativefield<MatlabPixelType, Dimension>( fieldArrays, filename, opts );
+   }
+   else
+   {
+      writeitkfield<MatlabPixelType, Dimension>( fieldArrays, filename, opts );
+   }
 }
 
 
@@ -139,19 +220,31 @@ void mexFunction(int nlhs,
                  int nrhs,
                  const mxArray *prhs[])
 {
+   /* The options struct may be omitted. */
+   const int nargs = mexGetNumberOfArguments(nrhs, prhs);
+   const mxArray * opts = mexGetOptions(nrhs, prhs);
+
    /* Check for proper number of arguments. */
-   if (nrhs!=4 and nrhs!=3)
+   if ( nargs!=4 && nargs!=3 )
    {
-      mexErrMsgTxt("4 or 3 inputs required.");
+      mexErrMsgTxt("Usage: writewarpfile(vx, vy, (vz), filename, (options))");
    }
 
-   const int dim=nrhs-1;
+   const int dim=nargs-1;
+
+   if ( !mxIsChar(prhs[dim]) )
+   {
+      mexErrMsgTxt("The file name must be a string.");
+   }
+   char * buffer = mxArrayToString(prhs[dim]);
+   const std::string filename(buffer);
+   mxFree(buffer);
 
    const mxClassID classID = mxGetClassID(prhs[0]);
 
-   /* The inputs must be noncomplex double matrices.*/
+   /* The inputs must be noncomplex floating point matrices.*/
 
-   for (int n=0; n<nrhs-1; n++)
+   for (int n=0; n<dim; n++)
    {
       if ( mxGetClassID(prhs[n])!=classID || mxIsComplex(prhs[n]) )
       {
@@ -160,7 +253,7 @@ void mexFunction(int nlhs,
 
       if ( mxGetNumberOfDimensions(prhs[n]) != dim )
       {
-         mexErrMsgTxt("The dimension of the  must agree with the number of inputs.");
+         mexErrMsgTxt("The dimension of the field must agree with the number of inputs.");
       }
 
       for (int dd=0; dd<dim; dd++)
@@ -182,11 +275,11 @@ void mexFunction(int nlhs,
    case 2:
       switch ( classID )
       {
-         case mxSINGLE_CLASS:    
-            writewarpfile<float,2>(nlhs, plhs, nrhs, prhs);
+         case mxSINGLE_CLASS:
+            writewarpfile<float,2>(prhs, filename, opts);
             break;
          case mxDOUBLE_CLASS:
-            writewarpfile<double,2>(nlhs, plhs, nrhs, prhs);
+            writewarpfile<double,2>(prhs, filename, opts);
             break;
          default:
             mexErrMsgTxt("Pixel type unsupported.");
@@ -195,11 +288,11 @@ void mexFunction(int nlhs,
    case 3:
       switch ( classID )
       {
-         case mxSINGLE_CLASS:    
-            writewarpfile<float,3>(nlhs, plhs, nrhs, prhs);
+         case mxSINGLE_CLASS:
+            writewarpfile<float,3>(prhs, filename, opts);
             break;
          case mxDOUBLE_CLASS:
-            writewarpfile<double,3>(nlhs, plhs, nrhs, prhs);
+            writewarpfile<double,3>(prhs, filename, opts);
             break;
          default:
             mexErrMsgTxt("Pixel type unsupported.");
@@ -211,5 +304,3 @@ void mexFunction(int nlhs,
 
    return;
 }
-
-
@@ -1,4 +1,4 @@
-function renormalize_warps(SBJ_CELL, Output_dir, CurTemplateWarpName)
+function renormalize_warps(SBJ_CELL, Output_dir, CurTemplateWarpName, storage_levels)
 
 %%% THIS IS AN AUXILARY FUNCTION AND IS NOT MEANT TO BE CALLED DIRECTLY.
 %%% THE FUNCTION TO BE CALLED IS: BFL_groupwise_reg3D
@@ -42,15 +42,19 @@ function renormalize_warps(SBJ_CELL, Output_dir, CurTemplateWarpName)
 
 
 
+if (nargin < 4)
+    storage_levels = 0;
+end
+
 NumSbj = length(SBJ_CELL);
-load([Output_dir '/' SBJ_CELL{1,1} '.' CurTemplateWarpName '.mat']);
+log_def_x = load_warp_aux([Output_dir '/' SBJ_CELL{1,1} '.' CurTemplateWarpName '.mat']);
 
 avg_log_def_x = zeros(size(log_def_x), 'single');
 avg_log_def_y = avg_log_def_x;
 avg_log_def_z = avg_log_def_x;
 
 for i = 1:NumSbj
-    load([Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat']);
+    [log_def_x, log_def_y, log_def_z] = load_warp_aux([Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat']);
     
     avg_log_def_x = log_def_x + avg_log_def_x;
     avg_log_def_y = log_def_y + avg_log_def_y;
@@ -62,11 +66,14 @@ avg_log_def_x = avg_log_def_x/NumSbj;
 avg_log_def_y = avg_log_def_y/NumSbj;
 avg_log_def_z = avg_log_def_z/NumSbj;
 
+% with storage_levels, the velocities are upsampled as they are
+% exponentiated and decimated again when saved: only the average changes
+% their stored values
 for i = 1:NumSbj
-    load([Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat']);
+    warp_file = [Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat'];
+    [log_def_x, log_def_y, log_def_z] = load_warp_aux(warp_file);
     log_def_x = log_def_x - avg_log_def_x;
     log_def_y = log_def_y - avg_log_def_y;
     log_def_z = log_def_z - avg_log_def_z;
-    save([Output_dir '/' SBJ_CELL{1,i} '.' CurTemplateWarpName '.mat'], ...
-            'log_def_x', 'log_def_y', 'log_def_z');
+    save_warp_aux(warp_file, log_def_x, log_def_y, log_def_z, storage_levels);
 end
\ No newline at end of file
@@ -0,0 +1,58 @@
+function save_warp_aux(warp_file, log_def_x, log_def_y, log_def_z, storage_levels)
+
+% Saves the velocity field of a subject as the packed velocitytransform,
+% decimated storage_levels times (see velocitytransform), or as
+% log_def_x/y/z when velocitytransform is not compiled.
+
+%%% THIS IS AN AUXILARY FUNCTION AND IS NOT MEANT TO BE CALLED DIRECTLY.
+%%% THE FUNCTION TO BE CALLED IS: BFL_groupwise_reg3D
+
+%=========================================================================
+%  Brain Fuse Lab 
+%  Copyright (c) 2010-2011 Mert R. Sabuncu
+%  A.A. Martinos Center for Biomedical Imaging, 
+%  Mass. General Hospital, Harvard Medical School
+%  CSAIL, Mass. Institute of Technology 
+%  All rights reserved.
+%
+%Redistribution and use in source and binary forms, with or without
+%modification, are permitted provided that the following conditions are met:
+%
+%    * Redistributions of source code must retain the above copyright notice,
+%      this list of conditions and the following disclaimer.
+%
+%    * Redistributions in binary form must reproduce the above copyright notice,
+%      this list of conditions and the following disclaimer in the documentation
+%      and/or other materials provided with the distribution.
+%
+%    * Neither the names of the copyright holders nor the names of future
+%      contributors may be used to endorse or promote products derived from this
+%      software without specific prior written permission.
+%
+%THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+%ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+%WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+%DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+%ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+%(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+%LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+%ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+%SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.    
+%
+%=========================================================================
+
+
+if (nargin < 5)
+    storage_levels = 0;
+end
+
+if (exist('velocitytransform', 'file') == 3)
+    h = velocitytransform('create', log_def_x, log_def_y, log_def_z, ...
+        struct('storage_levels', storage_levels));
+    transform = velocitytransform('pack', h);
+    velocitytransform('destroy', h);
+    save(warp_file, 'transform');
+else
+    save(warp_file, 'log_def_x', 'log_def_y', 'log_def_z');
+end
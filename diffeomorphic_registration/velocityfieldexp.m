@@ -1,4 +1,12 @@
 % VELOCITYFIELDEXP - Compute the exponential of a velocity field
 %
 % Usage: varargout=velocityfieldexp(varargin)
+%   [dx,dy,dz] = velocityfieldexp(vx,vy,vz) computes exp(v)
+%   [dx,dy,dz,ix,iy,iz] = velocityfieldexp(vx,vy,vz) computes exp(v) and
+%   exp(-v) together. A last options struct may give num_threads.
+%   [d..., i..., info] = velocityfieldexp(v..., u..., dprev..., iprev..., opts)
+%   increments exp(v-u), exp(u-v) by the update u instead of recomputing;
+%   with opts.check_drift, info gives the error to a full computation.
+%   With opts.jacobian, the Jacobian determinants follow the fields:
+%   [dx,dy,dz,ix,iy,iz,jac,invjac] = velocityfieldexp(vx,vy,vz,opts)
 % Needs a mex file
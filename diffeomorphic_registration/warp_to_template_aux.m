@@ -0,0 +1,59 @@
+function warped = warp_to_template_aux(warp_file, vol)
+
+% Subject image vol warped by exp(-v) onto the template, v being the
+% velocity field saved in warp_file (by save_warp_aux, or as log_def_x/y/z
+% by an older version). NaN outside the image.
+
+%%% THIS IS AN AUXILARY FUNCTION AND IS NOT MEANT TO BE CALLED DIRECTLY.
+%%% THE FUNCTION TO BE CALLED IS: BFL_groupwise_reg3D
+
+%=========================================================================
+%  Brain Fuse Lab 
+%  Copyright (c) 2010-2011 Mert R. Sabuncu
+%  A.A. Martinos Center for Biomedical Imaging, 
+%  Mass. General Hospital, Harvard Medical School
+%  CSAIL, Mass. Institute of Technology 
+%  All rights reserved.
+%
+%Redistribution and use in source and binary forms, with or without
+%modification, are permitted provided that the following conditions are met:
+%
+%    * Redistributions of source code must retain the above copyright notice,
+%      this list of conditions and the following disclaimer.
+%
+%    * Redistributions in binary form must reproduce the above copyright notice,
+%      this list of conditions and the following disclaimer in the documentation
+%      and/or other materials provided with the distribution.
+%
+%    * Neither the names of the copyright holders nor the names of future
+%      contributors may be used to endorse or promote products derived from this
+%      software without specific prior written permission.
+%
+%THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+%ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+%WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+%DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+%ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+%(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+%LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+%ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+%SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.    
+%
+%=========================================================================
+
+
+warp = load(warp_file);
+if (isfield(warp, 'transform'))
+    % exp(-v) is computed from the stored velocity and not copied back to MATLAB
+    h = velocitytransform('create', warp.transform);
+    warped = velocitytransform('warp', h, single(vol), struct('inverse', 1));
+    velocitytransform('destroy', h);
+elseif (exist('warpchain', 'file') == 3)
+    % exp(-v) is not copied back to MATLAB
+    warped = warpchain(single(vol), {struct('type', 'velocity', ...
+        'x', warp.log_def_x, 'y', warp.log_def_y, 'z', warp.log_def_z, 'inverse', 1)});
+else
+    [def_x, def_y, def_z] = velocityfieldexp(-warp.log_def_x, -warp.log_def_y, -warp.log_def_z);
+    warped = warpimage(single(vol), single(def_x), single(def_y), single(def_z));
+end
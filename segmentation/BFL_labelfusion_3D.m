@@ -24,6 +24,14 @@ function BFL_labelfusion_3D(SBJ_CELL, DATA_DIR, Output_dir, options)
 %   fusion. (See [1], where this parameter is referred to as rho) (default:
 %   1)
 %   background_label = <int> the index of the background label (default: 0)
+%   * label_top_k: when nonzero, the training labels are warped with
+%   warplabels instead of the distance transforms: the label probabilities
+%   of a training subject are the trilinear weights of its label_top_k
+%   most likely labels at each voxel, and dt_weight is not used. Much less
+%   memory traffic than one distance transform per label. (default: 0)
+%   * label_chunk: number of distance transforms warped at once (by
+%   warpplan, or warpimages if it is not compiled). Only label_chunk of
+%   them are held next to the label probabilities at a time. (default: 8)
 
 %   (These are for registration options)
 %   *num_multires = <scalar, integer> num of levels in multi-resolution pyramid
@@ -134,6 +142,14 @@ if (~isfield(options,'outfile_postfix'))
     options.outfile_postfix = '';
 end
 
+if (~isfield(options,'label_top_k'))
+    options.label_top_k = 0;
+end
+
+if (~isfield(options,'label_chunk'))
+    options.label_chunk = 8;
+end
+
 
 NumTrainingSubjects = length(options.TRAINING_IMAGE_CELL);
 
@@ -189,23 +205,63 @@ for s = 1:NumTestSubjects
         dt_bk = zeros(size(vol1.vol), 'single');
         curlabelprob = zeros([size(vol1.vol), numLabels], 'single');
     
-        for l = 1:numLabels
-            cur_label = labels(l);
-            if (cur_label ~= options.background_label)
+        if (options.label_top_k > 0)
+            % sparse label probabilities from the weights of the warped
+            % labels, renormalized over the kept ones
+            [~, toplabels, topprobs] = warplabels(single(seg2.vol), single(def_x), single(def_y), single(def_z), ...
+                struct('top_k', options.label_top_k));
+            for l = 1:numLabels
+                curlabelprob(:,:,:, l) = sum(topprobs.*(toplabels == labels(l)), 4);
+            end
+            curlabelprob = curlabelprob./repmat(max(sum(topprobs, 4), eps('single')), [1 1 1 numLabels]);
+            clear toplabels topprobs
+        elseif (exist('warpplan', 'file') == 3 || exist('warpimages', 'file') == 3)
+            % the distance transforms of label_chunk labels at a time warped
+            % in one pass over the deformation, straight into curlabelprob.
+            % A warp plan reads the field once for all the chunks.
+            fg = find(labels ~= options.background_label);
+            use_plan = (exist('warpplan', 'file') == 3);
+            if (use_plan)
+                plan = warpplan('create', single(def_x), single(def_y), single(def_z));
+            end
+            for first = 1:options.label_chunk:length(fg)
+                chunk = fg(first:min(first + options.label_chunk - 1, length(fg)));
+                dts = zeros([size(seg2.vol), length(chunk)], 'single');
+                for l = 1:length(chunk)
+                    dts(:,:,:, l) = fast_compute_distance_transform(seg2.vol, labels(chunk(l)));
+                end
+                if (use_plan)
+                    curlabelprob(:,:,:, chunk) = warpplan('apply', plan, dts).*options.dt_weight;
+                else
+                    curlabelprob(:,:,:, chunk) = warpimages(dts, single(def_x), single(def_y), single(def_z)).*options.dt_weight;
+                end
+            end
+            if (use_plan)
+                warpplan('destroy', plan);
+            end
+            curlabelprob(:,:,:, labels == options.background_label) = (dt_bk.*options.dt_weight);
+            clear dts
+        else
+            for l = 1:numLabels
+                cur_label = labels(l);
+                if (cur_label ~= options.background_label)
 
-                dt = fast_compute_distance_transform(seg2.vol, cur_label);
+                    dt = fast_compute_distance_transform(seg2.vol, cur_label);
                 
-                dt = warpimage(single(dt), single(def_x), single(def_y),single(def_z));
+                    dt = warpimage(single(dt), single(def_x), single(def_y),single(def_z));
                 
-                curlabelprob(:,:,:, l) = (dt.*options.dt_weight);
-            else
-                curlabelprob(:,:,:, l) = (dt_bk.*options.dt_weight);
-            end
+                    curlabelprob(:,:,:, l) = (dt.*options.dt_weight);
+                else
+                    curlabelprob(:,:,:, l) = (dt_bk.*options.dt_weight);
+                end
             
+            end
+        end
+        if (options.label_top_k == 0)
+            curlabelprob = curlabelprob - repmat(max(curlabelprob, [], 4), [1 1 1 numLabels]);
+            curlabelprob = exp(curlabelprob);
+            curlabelprob = curlabelprob./repmat(sum(curlabelprob, 4), [1 1 1 numLabels]);
         end
-        curlabelprob = curlabelprob - repmat(max(curlabelprob, [], 4), [1 1 1 numLabels]);
-        curlabelprob = exp(curlabelprob);
-        curlabelprob = curlabelprob./repmat(sum(curlabelprob, 4), [1 1 1 numLabels]);
         labelprob = labelprob + repmat(mri_weight, [1 1 1 numLabels]).*curlabelprob;
 
     end